@@ -90,6 +90,10 @@ marla_WriteResult marla_writeChunk(marla_Server* server, marla_Ring* input, marl
     //marla_logMessagef(server, "output->read_index=%d output->write_index=%d\n", output->read_index, output->write_index);
     if(slotLen <= 5) {
         marla_Ring_putbackWrite(output, slotLen);
+        if(output->mirrored) {
+            // The slot was already all of the free space.
+            return marla_WriteResult_DOWNSTREAM_CHOKED;
+        }
         //fprintf(stderr, "presimplifying. output->read_index=%d output->write_index=%d\n", output->read_index, output->write_index);
         marla_Ring_simplify(output);
         //fprintf(stderr, "postsimplifying. output->read_index=%d output->write_index=%d\n", output->read_index, output->write_index);
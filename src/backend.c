@@ -50,6 +50,38 @@ static int writeSource(marla_Connection* cxn, void* source, size_t len)
     return nwritten;
 }
 
+static int readvSource(marla_Connection* cxn, struct iovec* iov, int iovcnt)
+{
+    marla_BackendSource* cxnSource = cxn->source;
+    int nread = readv(cxnSource->fd, iov, iovcnt);
+    if(nread <= 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            cxn->wantsRead = 1;
+        }
+        else {
+            cxn->shouldDestroy = 1;
+        }
+        return -1;
+    }
+    return nread;
+}
+
+static int writevSource(marla_Connection* cxn, struct iovec* iov, int iovcnt)
+{
+    marla_BackendSource* cxnSource = cxn->source;
+    int nwritten = writev(cxnSource->fd, iov, iovcnt);
+    if(nwritten <= 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            cxn->wantsWrite = 1;
+        }
+        else {
+            cxn->shouldDestroy = 1;
+        }
+        return -1;
+    }
+    return nwritten;
+}
+
 static void acceptSource(marla_Connection* cxn)
 {
     // Accepted and secured.
@@ -70,13 +102,15 @@ static void destroySource(marla_Connection* cxn)
     cxn->source = 0;
     cxn->readSource = 0;
     cxn->writeSource = 0;
+    cxn->readvSource = 0;
+    cxn->writevSource = 0;
     cxn->acceptSource = 0;
     cxn->shutdownSource = 0;
     cxn->destroySource = 0;
     cxn->describeSource = 0;
 }
 
-int marla_BackendResponder_NEXT_ID = 0;
+atomic_int marla_BackendResponder_NEXT_ID = 0;
 
 struct marla_BackendResponder* marla_BackendResponder_new(size_t bufSize, marla_Request* req)
 {
@@ -85,7 +119,7 @@ struct marla_BackendResponder* marla_BackendResponder_new(size_t bufSize, marla_
         abort();
     }
     marla_BackendResponder* resp = malloc(sizeof *resp);
-    resp->id = ++marla_BackendResponder_NEXT_ID;
+    resp->id = atomic_fetch_add(&marla_BackendResponder_NEXT_ID, 1) + 1;
     //fprintf(stderr, "Creating backend responder %d\n", resp->id);
     resp->backendRequestBody = marla_Ring_new(bufSize);
     resp->backendResponse = marla_Ring_new(bufSize);
@@ -113,9 +147,15 @@ marla_BackendSource* marla_Backend_init(marla_Connection* cxn, int fd)
 {
     marla_BackendSource* source = malloc(sizeof *source);
     cxn->is_backend = 1;
+    // The connection's buffers were sized for a client.
+    size_t initialSize = cxn->server->bufferPolicy[marla_BUFFER_BACKEND].initialSize;
+    marla_Connection_resizeRing(cxn, &cxn->input, initialSize);
+    marla_Connection_resizeRing(cxn, &cxn->output, initialSize);
     cxn->source = source;
     cxn->readSource = readSource;
     cxn->writeSource = writeSource;
+    cxn->readvSource = readvSource;
+    cxn->writevSource = writevSource;
     cxn->acceptSource = acceptSource;
     cxn->shutdownSource = shutdownSource;
     cxn->destroySource = destroySource;
@@ -147,7 +187,9 @@ marla_Connection* marla_Backend_connect(marla_Server* server)
     memset(&event, 0, sizeof(struct epoll_event));
     event.data.ptr = backend;
     event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT | EPOLLET;
-    s = epoll_ctl(server->efd, EPOLL_CTL_ADD, backendfd, &event);
+    // Backends are polled by the worker that owns their client.
+    int efd = backend->worker ? backend->worker->efd : server->efd;
+    s = epoll_ctl(efd, EPOLL_CTL_ADD, backendfd, &event);
     if(s == -1) {
         marla_logMessage(server, "Failed to add backend server to epoll queue.");
         marla_Connection_destroy(backend);
@@ -270,25 +312,9 @@ marla_WriteResult marla_backendWrite(marla_Connection* cxn)
                 marla_Request_unref(req);
                 goto exit_downstream_choked;
             }
-            int nflushed;
-            marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
-            switch(wr) {
-            case marla_WriteResult_CLOSED:
-                marla_Connection_putbackWrite(cxn, nw);
-                marla_Request_unref(req);
-                marla_logMessagef(server, "Backend connection has closed while sending request line.");
-                goto exit_closed;
-            case marla_WriteResult_UPSTREAM_CHOKED:
-                marla_logMessagef(server, "Wrote backend request line.");
-                req->writeStage = marla_BACKEND_REQUEST_WRITING_HEADERS;
-                break;
-            case marla_WriteResult_DOWNSTREAM_CHOKED:
-                marla_Connection_putbackWrite(cxn, nw);
-                marla_Request_unref(req);
-                goto exit_downstream_choked;
-            default:
-                marla_die(server, "Unhandled flush result");
-            }
+            // Flushed with the headers once the event loop is done.
+            marla_logMessagef(server, "Wrote backend request line.");
+            req->writeStage = marla_BACKEND_REQUEST_WRITING_HEADERS;
         }
         if(req->writeStage == marla_BACKEND_REQUEST_WRITING_HEADERS) {
             // Write headers.
@@ -442,7 +468,13 @@ static marla_WriteResult marla_processBackendResponseLine(marla_Request* req)
     marla_Server* server = cxn->server;
     char out[marla_BUFSIZE];
     memset(out, 0, sizeof out);
-    int nr = marla_Connection_read(cxn, (unsigned char*)out, MAX_RESPONSE_LINE_LENGTH);
+
+    // Only copy out the line once all of it has arrived.
+    int lineEnd = marla_Ring_find(cxn->input, "\n", MAX_RESPONSE_LINE_LENGTH);
+    if(lineEnd < 0 && marla_Ring_size(cxn->input) < MAX_RESPONSE_LINE_LENGTH) {
+        return marla_WriteResult_UPSTREAM_CHOKED;
+    }
+    int nr = marla_Connection_read(cxn, (unsigned char*)out, lineEnd < 0 ? MAX_RESPONSE_LINE_LENGTH : lineEnd + 1);
     if(nr == 0) {
         return marla_WriteResult_CLOSED;
     }
@@ -569,7 +601,12 @@ static marla_WriteResult marla_processBackendResponseFields(marla_Request* req)
 
     while(req->readStage == marla_BACKEND_REQUEST_READING_HEADERS) {
         //marla_logMessagecf(cxn->server, "HTTP Headers", "Reading headers");
-        int nr = marla_Connection_read(cxn, (unsigned char*)out, MAX_FIELD_NAME_LENGTH + MAX_FIELD_VALUE_LENGTH);
+        int lineEnd = marla_Ring_find(cxn->input, "\n", MAX_FIELD_NAME_LENGTH + MAX_FIELD_VALUE_LENGTH);
+        if(lineEnd < 0 && marla_Ring_size(cxn->input) < MAX_FIELD_NAME_LENGTH + MAX_FIELD_VALUE_LENGTH) {
+            // Incomplete line.
+            return marla_WriteResult_UPSTREAM_CHOKED;
+        }
+        int nr = marla_Connection_read(cxn, (unsigned char*)out, lineEnd < 0 ? MAX_FIELD_NAME_LENGTH + MAX_FIELD_VALUE_LENGTH : lineEnd + 1);
         if(nr <= 0) {
             marla_logMessagef(server, "Nothing to read.");
             return marla_WriteResult_KILLED;
@@ -704,59 +741,58 @@ static marla_WriteResult marla_processBackendResponseFields(marla_Request* req)
             marla_logMessagecf(cxn->server, "HTTP Headers", "%s", responseHeaderKey);
         }
         // Process HTTP header (i.e. responseHeaderKey and responseHeaderValue)
-        if(responseHeaderKey[0] == 'C') {
-            if(!strcmp(responseHeaderKey, "Content-Length")) {
-                char* endptr;
-                long contentLen = strtol(responseHeaderValue, &endptr, 10);
-                if(endptr == responseHeaderValue) {
-                    marla_killRequest(req, 400, "Content-Length is malformed");
-                    return marla_WriteResult_KILLED;
+        req->headerField = marla_lookupField(responseHeaderKey, strlen(responseHeaderKey));
+        switch(req->headerField) {
+        case marla_FIELD_CONTENT_LENGTH: {
+            char* endptr;
+            long contentLen = strtol(responseHeaderValue, &endptr, 10);
+            if(endptr == responseHeaderValue) {
+                marla_killRequest(req, 400, "Content-Length is malformed");
+                return marla_WriteResult_KILLED;
+            }
+            if(req->responseLen != marla_MESSAGE_LENGTH_UNKNOWN) {
+                marla_killRequest(req, 400, "Content-Length specified twice.");
+                return marla_WriteResult_KILLED;
+            }
+            req->responseLen = contentLen;
+            break;
+        }
+        case marla_FIELD_CONNECTION: {
+            char* sp;
+            char* fieldToken = strtok_r(responseHeaderValue, ",", &sp);
+            int hasMultiple = 1;
+            if(!fieldToken) {
+                fieldToken = responseHeaderValue;
+                hasMultiple = 0;
+            }
+            while(fieldToken) {
+                while(fieldToken[0] == ' ') {
+                    ++fieldToken;
                 }
-                if(req->responseLen != marla_MESSAGE_LENGTH_UNKNOWN) {
-                    marla_killRequest(req, 400, "Content-Length specified twice.");
-                    return marla_WriteResult_KILLED;
+                if(!strcasecmp(fieldToken, "close")) {
+                    marla_logMessage(server, "Backend request will close once done.");
+                    if(req->responseLen == marla_MESSAGE_LENGTH_UNKNOWN) {
+                        req->responseLen = marla_MESSAGE_USES_CLOSE;
+                    }
+                    req->close_after_done = 1;
                 }
-                req->responseLen = contentLen;
-            }
-            else if(!strcmp(responseHeaderKey, "Connection")) {
-                char* sp;
-                char* fieldToken = strtok_r(responseHeaderValue, ",", &sp);
-                int hasMultiple = 1;
-                if(!fieldToken) {
-                    fieldToken = responseHeaderValue;
-                    hasMultiple = 0;
+                else if(!strcasecmp(fieldToken, "Upgrade")) {
+                    req->expect_upgrade = 1;
                 }
-                while(fieldToken) {
-                    while(fieldToken[0] == ' ') {
-                        ++fieldToken;
-                    }
-                    if(!strcasecmp(fieldToken, "close")) {
-                        marla_logMessage(server, "Backend request will close once done.");
-                        if(req->responseLen == marla_MESSAGE_LENGTH_UNKNOWN) {
-                            req->responseLen = marla_MESSAGE_USES_CLOSE;
-                        }
-                        req->close_after_done = 1;
-                    }
-                    else if(!strcasecmp(fieldToken, "Upgrade")) {
-                        req->expect_upgrade = 1;
-                    }
-                    else if(strcasecmp(fieldToken, "keep-alive")) {
-                        marla_killRequest(req, 400, "Connection is not understood, so no valid request.\n");
-                        return marla_WriteResult_KILLED;
-                    }
-                    if(hasMultiple) {
-                        fieldToken = strtok_r(0, ",", &sp);
-                    }
+                else if(strcasecmp(fieldToken, "keep-alive")) {
+                    marla_killRequest(req, 400, "Connection is not understood, so no valid request.\n");
+                    return marla_WriteResult_KILLED;
+                }
+                if(hasMultiple) {
+                    fieldToken = strtok_r(0, ",", &sp);
                 }
             }
-            else if(!strcmp(responseHeaderKey, "Content-Type")) {
-                strncpy(req->contentType, responseHeaderValue, MAX_FIELD_VALUE_LENGTH);
-            }
-            else if(req->handler) {
-                req->handler(req, marla_BACKEND_EVENT_HEADER, responseHeader, responseHeaderValue - responseHeaderKey);
-            }
+            break;
         }
-        else if(!strcmp(responseHeaderKey, "Transfer-Encoding")) {
+        case marla_FIELD_CONTENT_TYPE:
+            strncpy(req->contentType, responseHeaderValue, MAX_FIELD_VALUE_LENGTH);
+            break;
+        case marla_FIELD_TRANSFER_ENCODING:
             if(req->responseLen != marla_MESSAGE_LENGTH_UNKNOWN) {
                 marla_killRequest(req, 400, "Content-Length/Transfer-Encoding header value was set twice, so no valid request.\n");
                 return marla_WriteResult_KILLED;
@@ -765,15 +801,18 @@ static marla_WriteResult marla_processBackendResponseFields(marla_Request* req)
             if(!strcasecmp(responseHeaderValue, "chunked")) {
                 req->responseLen = marla_MESSAGE_IS_CHUNKED;
             }
-        }
-        else if(!strcmp(responseHeaderKey, "Location")) {
+            break;
+        case marla_FIELD_LOCATION:
             strncpy(req->redirectLocation, responseHeaderValue, sizeof(req->redirectLocation));
-        }
-        else if(!strcmp(responseHeaderKey, "Set-Cookie")) {
+            break;
+        case marla_FIELD_SET_COOKIE:
             strncpy(req->setCookieHeader, responseHeaderValue, sizeof(req->setCookieHeader));
-        }
-        else if(req->handler) {
-            req->handler(req, marla_BACKEND_EVENT_HEADER, responseHeader, responseHeaderValue - responseHeaderKey);
+            break;
+        default:
+            if(req->handler) {
+                req->handler(req, marla_BACKEND_EVENT_HEADER, responseHeader, responseHeaderValue - responseHeaderKey);
+            }
+            break;
         }
     }
 
@@ -0,0 +1,47 @@
+#!/bin/bash
+# Compares the round-trip latency of the default blocking event loop against
+# the busy-polling one, for keep-alive GET requests and for WebSocket echoes.
+# The module must echo WebSocket messages back unchanged, as mod_echo.so
+# does; `make bench-latency` builds it and uses it by default.
+#
+# Usage: bench-latency.sh [host:]port modulepath?modulefunc [path] [count] [busypoll-usec] [echo-bytes] [marla flags...]
+
+if test $# -lt 2; then
+    echo "Usage: $0 [host:]port modulepath?modulefunc [path] [count] [busypoll-usec] [echo-bytes] [marla flags...]" >&2
+    exit 1
+fi
+
+dir=`dirname $0`
+address=$1
+port=${address##*:}
+module=$2
+path=${3:-/}
+count=${4:-10000}
+busypoll=${5:-50}
+echobytes=${6:-32}
+shift 6 2>/dev/null || shift $#
+
+run() {
+    name=$1
+    shift
+    $dir/../marla $address $((port + 1)) $((port + 2)) -nossl -nocurses "$@" $module >/dev/null 2>&1 &
+    pid=$!
+    for i in `seq 50`; do
+        if (exec 3<>/dev/tcp/localhost/$port) 2>/dev/null; then
+            break
+        fi
+        sleep 0.1
+    done
+    $dir/bench_latency localhost $port $path $count ${name}_get && echo "," &&
+        $dir/bench_latency localhost $port $path $count ${name}_echo $echobytes
+    rv=$?
+    kill -INT $pid
+    wait $pid
+    return $rv
+}
+
+echo "["
+run blocking "$@" || exit
+echo ","
+run busypoll -busypoll $busypoll "$@" || exit
+echo "]"
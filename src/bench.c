@@ -0,0 +1,586 @@
+#include "marla.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Micro-benchmarks for the ring, chunk, and parsing hot paths. Results are
+// written to stdout as JSON so runs from different builds can be compared.
+
+#define BENCH_MIN_SECONDS 0.2
+
+struct bench_state {
+marla_Server* server;
+marla_Ring* ring;
+marla_Ring* output;
+unsigned char* buf;
+size_t len;
+};
+
+static int first_result = 1;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs op until BENCH_MIN_SECONDS have passed, doubling the batch size each
+// round, then reports the rate of the last round.
+static void bench(const char* name, size_t bytesPerOp, int(*op)(struct bench_state*), struct bench_state* state)
+{
+    size_t iterations = 1;
+    double elapsed = 0;
+    for(;;) {
+        double start = now();
+        for(size_t i = 0; i < iterations; ++i) {
+            if(op(state)) {
+                fprintf(stdout, "%s\n", first_result ? "" : ",");
+                fprintf(stdout, "    {\"name\": \"%s\", \"error\": \"operation failed\"}", name);
+                first_result = 0;
+                return;
+            }
+        }
+        elapsed = now() - start;
+        if(elapsed >= BENCH_MIN_SECONDS) {
+            break;
+        }
+        iterations <<= 1;
+    }
+
+    double nsPerOp = elapsed * 1e9 / iterations;
+    fprintf(stdout, "%s\n", first_result ? "" : ",");
+    fprintf(stdout, "    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.2f, \"bytes_per_sec\": %.0f}",
+        name, iterations, nsPerOp, bytesPerOp ? bytesPerOp * iterations / elapsed : 0);
+    first_result = 0;
+}
+
+static int ring_writeRead(struct bench_state* state)
+{
+    if(marla_Ring_write(state->ring, state->buf, state->len) != state->len) {
+        return 1;
+    }
+    return marla_Ring_read(state->ring, state->buf, state->len) != state->len;
+}
+
+static int ring_slots(struct bench_state* state)
+{
+    void* slot;
+    size_t slotLen;
+    size_t total = 0;
+    while(total < state->len) {
+        marla_Ring_writeSlot(state->ring, &slot, &slotLen);
+        if(slotLen > state->len - total) {
+            marla_Ring_putbackWrite(state->ring, slotLen - (state->len - total));
+            slotLen = state->len - total;
+        }
+        memcpy(slot, state->buf + total, slotLen);
+        total += slotLen;
+    }
+    while(total > 0) {
+        marla_Ring_readSlot(state->ring, &slot, &slotLen);
+        if(slotLen == 0) {
+            return 1;
+        }
+        memcpy(state->buf, slot, slotLen);
+        total -= slotLen;
+    }
+    return 0;
+}
+
+static int ring_simplify(struct bench_state* state)
+{
+    // Leave the contents wrapped so simplify must move both parts.
+    marla_Ring* ring = state->ring;
+    ring->read_index = ring->capacity - state->len / 2;
+    ring->write_index = ring->read_index + state->len;
+    marla_Ring_simplify(ring);
+    return ring->read_index != 0;
+}
+
+static int ring_find(struct bench_state* state)
+{
+    marla_Ring* ring = state->ring;
+    ring->read_index = ring->capacity - state->len / 2;
+    ring->write_index = ring->read_index + state->len;
+    return marla_Ring_find(ring, "\r\n", state->len) != state->len - 1;
+}
+
+static int measureChunk(struct bench_state* state)
+{
+    size_t prefix_len;
+    size_t availUsed;
+    for(size_t slotLen = 16; slotLen <= state->len; slotLen <<= 1) {
+        marla_measureChunk(slotLen, state->len, &prefix_len, &availUsed);
+        if(availUsed == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int writeChunk(struct bench_state* state)
+{
+    marla_Ring_write(state->ring, state->buf, state->len);
+    while(!marla_Ring_isEmpty(state->ring)) {
+        switch(marla_writeChunk(state->server, state->ring, state->output)) {
+        case marla_WriteResult_CONTINUE:
+        case marla_WriteResult_UPSTREAM_CHOKED:
+            break;
+        case marla_WriteResult_DOWNSTREAM_CHOKED:
+            marla_Ring_clear(state->output);
+            break;
+        default:
+            return 1;
+        }
+    }
+    marla_Ring_clear(state->output);
+    return 0;
+}
+
+static void parseHandler(marla_Request* req, marla_ClientEvent ev, void* in, int len)
+{
+    marla_WriteEvent* we;
+    switch(ev) {
+    case marla_EVENT_ACCEPTING_REQUEST:
+        *(int*)in = 1;
+        break;
+    case marla_EVENT_REQUEST_BODY:
+        we = in;
+        if(we->length == 0) {
+            req->readStage = marla_CLIENT_REQUEST_DONE_READING;
+        }
+        break;
+    case marla_EVENT_MUST_WRITE:
+        req->writeStage = marla_CLIENT_REQUEST_AFTER_RESPONSE;
+        break;
+    default:
+        return;
+    }
+}
+
+static void parseRouter(marla_Request* req, void* hd)
+{
+    req->handler = parseHandler;
+}
+
+static int parseRequest(struct bench_state* state)
+{
+    marla_Connection* cxn = marla_Connection_new(state->server);
+    marla_Duplex_init(cxn, marla_BUFSIZE, marla_BUFSIZE);
+    marla_writeDuplex(cxn, state->buf, state->len);
+    marla_clientRead(cxn);
+    int rv = cxn->requests_in_process > 0;
+    marla_Connection_destroy(cxn);
+    return rv;
+}
+
+static int scanHeaders(struct bench_state* state)
+{
+    marla_HeaderScan scan;
+    marla_scanHeaders(&scan, state->buf, state->len, marla_MAX_FIELD_LINE_LENGTH);
+    return scan.status != marla_HEADERS_DONE;
+}
+
+#define SEGMENT_BODY_SIZE 16384
+#define SEGMENT_RESPONSES 200
+
+static size_t response_written;
+
+// Writes a response the way handlers do: headers, then the body in slices,
+// asking for a flush after each one.
+static void segmentHandler(marla_Request* req, marla_ClientEvent ev, void* in, int len)
+{
+    marla_WriteEvent* we;
+    char buf[marla_BUFSIZE];
+    switch(ev) {
+    case marla_EVENT_ACCEPTING_REQUEST:
+        *(int*)in = 1;
+        break;
+    case marla_EVENT_REQUEST_BODY:
+        we = in;
+        if(we->length == 0) {
+            req->readStage = marla_CLIENT_REQUEST_DONE_READING;
+        }
+        break;
+    case marla_EVENT_MUST_WRITE:
+        we = in;
+        if(response_written == 0) {
+            len = snprintf(buf, sizeof buf, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", SEGMENT_BODY_SIZE);
+            marla_Connection_write(req->cxn, buf, len);
+        }
+        if(response_written == SEGMENT_BODY_SIZE) {
+            req->writeStage = marla_CLIENT_REQUEST_AFTER_RESPONSE;
+            break;
+        }
+        memset(buf, 'a', sizeof buf);
+        len = marla_Connection_write(req->cxn, buf, SEGMENT_BODY_SIZE - response_written < sizeof buf ? SEGMENT_BODY_SIZE - response_written : sizeof buf);
+        if(len > 0) {
+            response_written += len;
+        }
+        we->status = marla_WriteResult_DOWNSTREAM_CHOKED;
+        break;
+    default:
+        return;
+    }
+}
+
+static void segmentRouter(marla_Request* req, void* hd)
+{
+    req->handler = segmentHandler;
+}
+
+// Serves responses over a loopback TCP connection, and reports the data
+// segments the server sent for each.
+static void benchSegments(const char* name, int useCork)
+{
+    marla_Server server;
+    marla_Server_init(&server);
+    marla_Server_addHook(&server, marla_ServerHook_ROUTE, segmentRouter, 0);
+    strcpy(server.serverport, "8080");
+    server.use_cork = useCork;
+
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int cfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(lfd < 0 || cfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(lfd, 1) != 0 ||
+        getsockname(lfd, (struct sockaddr*)&addr, &addrLen) != 0 || connect(cfd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+        fprintf(stdout, "%s\n", first_result ? "" : ",");
+        fprintf(stdout, "    {\"name\": \"%s\", \"error\": \"loopback connection failed\"}", name);
+        first_result = 0;
+        return;
+    }
+    int sfd = accept(lfd, 0, 0);
+    close(lfd);
+    fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL, 0) | O_NONBLOCK);
+
+    marla_Connection* cxn = marla_Connection_new(&server);
+    marla_cleartext_init(cxn, sfd);
+
+    const char* request = "GET / HTTP/1.1\r\nHost: localhost:8080\r\n\r\n";
+    char buf[65536];
+    struct tcp_info info;
+    socklen_t infoLen = sizeof info;
+    getsockopt(sfd, IPPROTO_TCP, TCP_INFO, &info, &infoLen);
+    unsigned int segments = info.tcpi_data_segs_out;
+    size_t responseLen = 0;
+    int responses = 0;
+    for(; responses < SEGMENT_RESPONSES; ++responses) {
+        response_written = 0;
+        if(write(cfd, request, strlen(request)) < 0) {
+            break;
+        }
+        marla_clientRead(cxn);
+        marla_clientWrite(cxn);
+        // As at the end of an event loop pass.
+        marla_Connection_flush(cxn, 0);
+        size_t received = 0;
+        while(received == 0 || received < responseLen) {
+            int nread = read(cfd, buf, sizeof buf);
+            if(nread <= 0) {
+                break;
+            }
+            received += nread;
+            if(responseLen == 0) {
+                char* body = strstr(buf, "\r\n\r\n");
+                responseLen = body ? body + 4 - buf + SEGMENT_BODY_SIZE : 0;
+            }
+        }
+    }
+    infoLen = sizeof info;
+    getsockopt(sfd, IPPROTO_TCP, TCP_INFO, &info, &infoLen);
+    segments = info.tcpi_data_segs_out - segments;
+
+    fprintf(stdout, "%s\n", first_result ? "" : ",");
+    fprintf(stdout, "    {\"name\": \"%s\", \"responses\": %d, \"segments_per_response\": %.2f}",
+        name, responses, responses ? (double)segments / responses : 0);
+    first_result = 0;
+
+    marla_Connection_destroy(cxn);
+    close(cfd);
+    marla_Server_free(&server);
+}
+
+#define ZEROCOPY_BYTES (1L << 30)
+#define ZEROCOPY_BUFSIZE 262144
+#define ZEROCOPY_BUFFERS 4
+
+static void releaseBuffer(void* data)
+{
+    *(int*)data = 0;
+}
+
+// Connects to the sink at host:port, or else to a child process that reads
+// and discards over loopback. Loopback always copies, so a remote sink is
+// needed to see what zero-copy sends save.
+static int openSink(const char* sink, pid_t* child)
+{
+    *child = 0;
+    if(sink) {
+        char host[256];
+        snprintf(host, sizeof host, "%s", sink);
+        char* port = strrchr(host, ':');
+        if(!port) {
+            return -1;
+        }
+        *port++ = 0;
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* result;
+        if(getaddrinfo(host, port, &hints, &result) != 0) {
+            return -1;
+        }
+        int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if(fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        return fd;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(lfd, 1) != 0 ||
+        getsockname(lfd, (struct sockaddr*)&addr, &addrLen) != 0) {
+        return -1;
+    }
+    *child = fork();
+    if(*child == 0) {
+        int fd = accept(lfd, 0, 0);
+        char buf[65536];
+        while(read(fd, buf, sizeof buf) > 0);
+        _exit(0);
+    }
+    close(lfd);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Flushes the connection, then waits for it to become writable or for the
+// kernel to complete zero-copy sends.
+static void waitForSink(marla_Connection* cxn, int fd)
+{
+    if(marla_Connection_flush(cxn, 0) == marla_WriteResult_UPSTREAM_CHOKED && !cxn->first_zeroCopy) {
+        return;
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = marla_Connection_hasOutput(cxn) ? POLLOUT : 0;
+    pfd.revents = 0;
+    poll(&pfd, 1, 100);
+    marla_Connection_completeZeroCopy(cxn);
+}
+
+// Sends ZEROCOPY_BYTES through a connection, either copied through its output
+// ring or queued to be sent from the buffers themselves, and reports the CPU
+// time this process spent per gigabyte.
+static void benchZeroCopy(const char* name, int useZeroCopy, const char* sink)
+{
+    marla_Server server;
+    marla_Server_init(&server);
+    server.zeroCopyThreshold = useZeroCopy ? 1 : 0;
+
+    pid_t child;
+    int fd = openSink(sink, &child);
+    if(fd < 0) {
+        fprintf(stdout, "%s\n", first_result ? "" : ",");
+        fprintf(stdout, "    {\"name\": \"%s\", \"error\": \"sink connection failed\"}", name);
+        first_result = 0;
+        marla_Server_free(&server);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    marla_Connection* cxn = marla_Connection_new(&server);
+    marla_cleartext_init(cxn, fd);
+
+    unsigned char* bufs = malloc(ZEROCOPY_BUFFERS * ZEROCOPY_BUFSIZE);
+    memset(bufs, 'a', ZEROCOPY_BUFFERS * ZEROCOPY_BUFSIZE);
+    int busy[ZEROCOPY_BUFFERS];
+    memset(busy, 0, sizeof busy);
+
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    double start = now();
+    size_t sent = 0;
+    long zeroCopySends = 0;
+    for(int i = 0; sent < ZEROCOPY_BYTES && !cxn->shouldDestroy; i = (i + 1) % ZEROCOPY_BUFFERS) {
+        unsigned char* buf = bufs + i * ZEROCOPY_BUFSIZE;
+        while(busy[i] && !cxn->shouldDestroy) {
+            // Still pinned by an earlier send.
+            waitForSink(cxn, fd);
+        }
+        busy[i] = 1;
+        if(marla_Connection_writeZeroCopy(cxn, buf, ZEROCOPY_BUFSIZE, releaseBuffer, busy + i) == 0) {
+            ++zeroCopySends;
+            marla_Connection_flush(cxn, 0);
+        }
+        else {
+            busy[i] = 0;
+            for(size_t pos = 0; pos < ZEROCOPY_BUFSIZE && !cxn->shouldDestroy;) {
+                int nwritten = marla_Connection_write(cxn, buf + pos, ZEROCOPY_BUFSIZE - pos);
+                if(nwritten > 0) {
+                    pos += nwritten;
+                }
+                else {
+                    waitForSink(cxn, fd);
+                }
+            }
+        }
+        sent += ZEROCOPY_BUFSIZE;
+    }
+    while((marla_Connection_hasOutput(cxn) || cxn->first_zeroCopy) && !cxn->shouldDestroy) {
+        waitForSink(cxn, fd);
+    }
+    double elapsed = now() - start;
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    double cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) +
+        ((after.ru_utime.tv_usec - before.ru_utime.tv_usec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec)) / 1e6;
+
+    fprintf(stdout, "%s\n", first_result ? "" : ",");
+    if(cxn->shouldDestroy) {
+        fprintf(stdout, "    {\"name\": \"%s\", \"error\": \"send failed\"}", name);
+    }
+    else {
+        fprintf(stdout, "    {\"name\": \"%s\", \"bytes\": %ld, \"zero_copy_sends\": %ld, \"kernel_copied\": %s, \"cpu_sec_per_gb\": %.4f, \"bytes_per_sec\": %.0f}",
+            name, sent, zeroCopySends, cxn->zeroCopy < 0 ? "true" : "false", cpu * 1e9 / sent, sent / elapsed);
+    }
+    first_result = 0;
+
+    marla_Connection_destroy(cxn);
+    if(child > 0) {
+        waitpid(child, 0, 0);
+    }
+    free(bufs);
+    marla_Server_free(&server);
+}
+
+int main(int argc, char** argv)
+{
+    apr_initialize();
+
+    // Connections log their destruction to stderr.
+    if(!freopen("/dev/null", "w", stderr)) {
+        perror("freopen");
+        return 1;
+    }
+
+    marla_Server server;
+    marla_Server_init(&server);
+    marla_Server_addHook(&server, marla_ServerHook_ROUTE, parseRouter, 0);
+    strcpy(server.serverport, "8080");
+
+    struct bench_state state;
+    state.server = &server;
+    state.buf = malloc(65536);
+    memset(state.buf, 'a', 65536);
+
+    fprintf(stdout, "{\n  \"benchmarks\": [");
+
+    size_t sizes[] = {16, 256, 4096};
+    char name[128];
+    for(int i = 0; i < sizeof(sizes)/sizeof(*sizes); ++i) {
+        state.ring = marla_Ring_new(2 * 4096);
+        state.len = sizes[i];
+        snprintf(name, sizeof name, "ring_write_read_%ld", state.len);
+        bench(name, 2 * state.len, ring_writeRead, &state);
+        snprintf(name, sizeof name, "ring_slots_%ld", state.len);
+        bench(name, 2 * state.len, ring_slots, &state);
+        snprintf(name, sizeof name, "ring_simplify_%ld", state.len);
+        bench(name, state.len, ring_simplify, &state);
+        memset(state.ring->buf, 'a', state.ring->capacity);
+        state.ring->buf[(state.ring->capacity - state.len / 2 + state.len - 1) & (state.ring->capacity - 1)] = '\n';
+        snprintf(name, sizeof name, "ring_find_%ld", state.len);
+        bench(name, state.len, ring_find, &state);
+        marla_Ring_free(state.ring);
+    }
+
+    state.len = marla_BUFSIZE;
+    bench("measure_chunk", 0, measureChunk, &state);
+
+    state.ring = marla_Ring_new(65536);
+    state.output = marla_Ring_new(marla_BUFSIZE);
+    state.len = 16384;
+    bench("write_chunk_16384", state.len, writeChunk, &state);
+    marla_Ring_free(state.ring);
+    marla_Ring_free(state.output);
+
+    const char* requests[][2] = {
+        {"parse_request_minimal", "GET / HTTP/1.1\r\nHost: localhost:8080\r\n\r\n"},
+        {"parse_request_browser", "GET /index.html?q=search HTTP/1.1\r\n"
+            "Host: localhost:8080\r\n"
+            "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+            "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+            "Accept-Language: en-US,en;q=0.5\r\n"
+            "Accept-Encoding: gzip, deflate\r\n"
+            "Connection: keep-alive\r\n"
+            "Upgrade-Insecure-Requests: 1\r\n"
+            "\r\n"},
+        {"parse_request_browser_cookies", "GET /assets/app.js?v=3 HTTP/1.1\r\n"
+            "Host: www.example.com\r\n"
+            "Connection: keep-alive\r\n"
+            "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+            "sec-ch-ua-mobile: ?0\r\n"
+            "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+            "sec-ch-ua-platform: \"Windows\"\r\n"
+            "Accept: */*\r\n"
+            "Sec-Fetch-Site: same-origin\r\n"
+            "Sec-Fetch-Mode: no-cors\r\n"
+            "Sec-Fetch-Dest: script\r\n"
+            "Referer: https://www.example.com/products/widgets?page=2&sort=price\r\n"
+            "Accept-Encoding: gzip, deflate, br\r\n"
+            "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+            "Cookie: session=6f1c0a9e2b7d4c3f8a5e1d0b9c8f7a6e; _ga=GA1.2.1234567890.1697040000; _gid=GA1.2.987654321.1697040000; theme=dark; consent=analytics%3Dtrue%26ads%3Dfalse\r\n"
+            "\r\n"}
+    };
+    for(int i = 0; i < sizeof(requests)/sizeof(*requests); ++i) {
+        state.len = strlen(requests[i][1]);
+        memcpy(state.buf, requests[i][1], state.len);
+        bench(requests[i][0], state.len, parseRequest, &state);
+    }
+
+    // Scan the header blocks alone, past their request lines.
+    for(int i = 0; i < sizeof(requests)/sizeof(*requests); ++i) {
+        const char* headers = strstr(requests[i][1], "\r\n") + 2;
+        state.len = strlen(headers);
+        memcpy(state.buf, headers, state.len);
+        snprintf(name, sizeof name, "scan_headers_%s", requests[i][0] + strlen("parse_request_"));
+        bench(name, state.len, scanHeaders, &state);
+    }
+
+    benchSegments("segments_per_response_corked", 1);
+    benchSegments("segments_per_response_uncorked", 0);
+
+    // A host:port given here receives the zero-copy benchmarks' data.
+    const char* sink = argc > 1 ? argv[1] : 0;
+    benchZeroCopy("send_gb_copied", 0, sink);
+    benchZeroCopy("send_gb_zero_copy", 1, sink);
+
+    fprintf(stdout, "\n  ]\n}\n");
+
+    free(state.buf);
+    marla_Server_free(&server);
+    apr_terminate();
+    return 0;
+}
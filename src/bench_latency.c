@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Measures round trips against a running server, one at a time over a
+// single connection, so each round trip includes the server's wakeup. Each
+// round trip is a keep-alive GET, or a WebSocket message that the server's
+// module echoes back. Results are written to stdout as JSON, like bench.
+
+#define BENCH_WARMUP 100
+#define BENCH_MAX_ECHO 125
+
+static char response[65536];
+static size_t responseLen = 0;
+
+static long now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int connect_to(const char* host, const char* port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result;
+    if(getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for(struct addrinfo* rp = result; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if(fd == -1) {
+            continue;
+        }
+        if(connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if(fd >= 0) {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+    }
+    return fd;
+}
+
+static int fill(int fd)
+{
+    if(responseLen == sizeof response) {
+        return -1;
+    }
+    for(;;) {
+        ssize_t nread = read(fd, response + responseLen, sizeof response - responseLen);
+        if(nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if(nread <= 0) {
+            return -1;
+        }
+        responseLen += nread;
+        return 0;
+    }
+}
+
+static void consume(size_t len)
+{
+    memmove(response, response + len, responseLen - len);
+    responseLen -= len;
+}
+
+// Reads one response, whose body is either sized by Content-Length or
+// chunked, leaving anything after it for the next.
+static int read_response(int fd)
+{
+    char* end;
+    for(;;) {
+        end = memmem(response, responseLen, "\r\n\r\n", 4);
+        if(end) {
+            break;
+        }
+        if(fill(fd) != 0) {
+            return -1;
+        }
+    }
+    size_t headerLen = end + 4 - response;
+    long contentLength = -1;
+    int chunked = 0;
+    for(char* line = memmem(response, headerLen, "\r\n", 2); line && line < end; line = memmem(line + 2, end + 2 - (line + 2), "\r\n", 2)) {
+        if(!strncasecmp(line + 2, "Content-Length:", 15)) {
+            contentLength = atol(line + 17);
+        }
+        else if(!strncasecmp(line + 2, "Transfer-Encoding:", 18) && memmem(line, end - line, "chunked", 7)) {
+            chunked = 1;
+        }
+    }
+    consume(headerLen);
+    if(!chunked) {
+        if(contentLength < 0) {
+            fprintf(stderr, "Responses must give a Content-Length or be chunked.\n");
+            return -1;
+        }
+        while(responseLen < contentLength) {
+            if(fill(fd) != 0) {
+                return -1;
+            }
+        }
+        consume(contentLength);
+        return 0;
+    }
+    for(;;) {
+        char* lineEnd;
+        while(!(lineEnd = memmem(response, responseLen, "\r\n", 2))) {
+            if(fill(fd) != 0) {
+                return -1;
+            }
+        }
+        size_t chunkSize = strtoul(response, 0, 16);
+        size_t needed = lineEnd + 2 - response + chunkSize + 2;
+        while(responseLen < needed) {
+            if(fill(fd) != 0) {
+                return -1;
+            }
+        }
+        consume(needed);
+        if(chunkSize == 0) {
+            return 0;
+        }
+    }
+}
+
+// Upgrades the connection to a WebSocket, leaving it ready for messages.
+static int upgrade(int fd, const char* host, const char* port, const char* path)
+{
+    char request[1024];
+    int requestLen = snprintf(request, sizeof request, "GET %s HTTP/1.1\r\nHost: %s:%s\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n", path, host, port);
+    if(write(fd, request, requestLen) != requestLen) {
+        return -1;
+    }
+    char* end;
+    while(!(end = memmem(response, responseLen, "\r\n\r\n", 4))) {
+        if(fill(fd) != 0) {
+            return -1;
+        }
+    }
+    if(strncmp(response, "HTTP/1.1 101", 12)) {
+        fprintf(stderr, "The server must accept the WebSocket upgrade.\n");
+        return -1;
+    }
+    consume(end + 4 - response);
+    return 0;
+}
+
+// Sends a masked binary message, and reads back its echo.
+static int echo(int fd, const unsigned char* message, int len)
+{
+    static const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    unsigned char frame[6 + BENCH_MAX_ECHO];
+    frame[0] = 0x82;
+    frame[1] = 0x80 | len;
+    memcpy(frame + 2, mask, 4);
+    for(int i = 0; i < len; ++i) {
+        frame[6 + i] = message[i] ^ mask[i % 4];
+    }
+    if(write(fd, frame, 6 + len) != 6 + len) {
+        return -1;
+    }
+    while(responseLen < 2 + len) {
+        if(fill(fd) != 0) {
+            return -1;
+        }
+    }
+    if((unsigned char)response[0] != 0x82 || response[1] != len || memcmp(response + 2, message, len)) {
+        fprintf(stderr, "The server must echo each message unchanged.\n");
+        return -1;
+    }
+    consume(2 + len);
+    return 0;
+}
+
+static int compare_longs(const void* a, const void* b)
+{
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 3) {
+        fprintf(stderr, "Usage: %s host port [path] [count] [name] [echo-bytes]\n", argv[0]);
+        return 1;
+    }
+    const char* host = argv[1];
+    const char* port = argv[2];
+    const char* path = argc > 3 ? argv[3] : "/";
+    int count = argc > 4 ? atoi(argv[4]) : 10000;
+    const char* name = argc > 5 ? argv[5] : "round_trip";
+    int echoBytes = argc > 6 ? atoi(argv[6]) : 0;
+    if(count < 1) {
+        fprintf(stderr, "The count must be a positive number of requests.\n");
+        return 1;
+    }
+    if(echoBytes < 0 || echoBytes > BENCH_MAX_ECHO) {
+        fprintf(stderr, "Echoed messages must be at most %d bytes.\n", BENCH_MAX_ECHO);
+        return 1;
+    }
+
+    int fd = connect_to(host, port);
+    if(fd < 0) {
+        fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+        return 1;
+    }
+
+    if(echoBytes > 0 && upgrade(fd, host, port, path) != 0) {
+        fprintf(stderr, "Failed to open a WebSocket at %s\n", path);
+        return 1;
+    }
+    unsigned char message[BENCH_MAX_ECHO];
+    memset(message, 'm', sizeof message);
+
+    char request[1024];
+    int requestLen = snprintf(request, sizeof request, "GET %s HTTP/1.1\r\nHost: %s:%s\r\n\r\n", path, host, port);
+    long* samples = malloc(sizeof(long) * count);
+    for(int i = -BENCH_WARMUP; i < count; ++i) {
+        long start = now_usec();
+        if(echoBytes > 0 ? echo(fd, message, echoBytes) != 0 : (write(fd, request, requestLen) != requestLen || read_response(fd) != 0)) {
+            fprintf(stderr, "Round trip %d failed.\n", i + BENCH_WARMUP);
+            return 1;
+        }
+        if(i >= 0) {
+            samples[i] = now_usec() - start;
+        }
+    }
+    close(fd);
+
+    qsort(samples, count, sizeof(long), compare_longs);
+    fprintf(stdout, "    {\"name\": \"%s\", \"round_trips\": %d, \"p50_us\": %ld, \"p99_us\": %ld, \"max_us\": %ld}\n",
+        name, count, samples[count / 2], samples[(count * 99) / 100], samples[count - 1]);
+    free(samples);
+    return 0;
+}
@@ -4,6 +4,10 @@
 #include <errno.h>
 #include <sys/socket.h>
 
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
 static int describeSource(marla_Connection* cxn, char* sink, size_t len)
 {
     marla_ClearTextSource* cxnSource = cxn->source;
@@ -48,6 +52,64 @@ static int writeSource(marla_Connection* cxn, void* source, size_t len)
     return nwritten;
 }
 
+static int readvSource(marla_Connection* cxn, struct iovec* iov, int iovcnt)
+{
+    marla_ClearTextSource* cxnSource = cxn->source;
+    int nread = readv(cxnSource->fd, iov, iovcnt);
+    if(nread <= 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            cxn->wantsRead = 1;
+        }
+        else {
+            cxn->shouldDestroy = 1;
+        }
+        return -1;
+    }
+    return nread;
+}
+
+static int writevSource(marla_Connection* cxn, struct iovec* iov, int iovcnt)
+{
+    marla_ClearTextSource* cxnSource = cxn->source;
+    int nwritten = writev(cxnSource->fd, iov, iovcnt);
+    if(nwritten <= 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            cxn->wantsWrite = 1;
+        }
+        else {
+            cxn->shouldDestroy = 1;
+        }
+        return -1;
+    }
+    return nwritten;
+}
+
+// Sends without copying; the pages of source stay in use until the kernel
+// posts a completion to the socket's error queue.
+static int sendZeroCopySource(marla_Connection* cxn, const void* source, size_t len)
+{
+    marla_ClearTextSource* cxnSource = cxn->source;
+    int nwritten = send(cxnSource->fd, source, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if(nwritten <= 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            // ENOBUFS means too many sends await completion; their notices
+            // will wake the connection.
+            cxn->wantsWrite = 1;
+        }
+        else {
+            cxn->shouldDestroy = 1;
+        }
+        return -1;
+    }
+    return nwritten;
+}
+
+static int socketSource(marla_Connection* cxn)
+{
+    marla_ClearTextSource* cxnSource = cxn->source;
+    return cxnSource->fd;
+}
+
 static void acceptSource(marla_Connection* cxn)
 {
     // Accepted and secured.
@@ -59,7 +121,7 @@ static int shutdownSource(marla_Connection* cxn)
     marla_logMessage(cxn->server, "Shutting down cleartext source.");
     marla_ClearTextSource* cxnSource = cxn->source;
 
-    while(!marla_Ring_isEmpty(cxn->output)) {
+    while(marla_Connection_hasOutput(cxn)) {
         int nflushed;
         switch(marla_Connection_flush(cxn, &nflushed)) {
         case marla_WriteResult_CLOSED:
@@ -71,6 +133,12 @@ static int shutdownSource(marla_Connection* cxn)
             continue;
         }
     }
+    marla_Connection_completeZeroCopy(cxn);
+    if(cxn->first_zeroCopy) {
+        // Wait until the kernel is done with zero-copied buffers, whose
+        // contents may still be queued after the shutdown.
+        return -1;
+    }
     int rv = shutdown(cxnSource->fd, SHUT_RDWR);
     marla_logMessagef(cxn->server, "shutdown() returned %d", rv);
     return 1;
@@ -80,20 +148,39 @@ static void destroySource(marla_Connection* cxn)
 {
     marla_logMessage(cxn->server, "Destroying cleartext source.");
     marla_ClearTextSource* cxnSource = cxn->source;
-    close(cxnSource->fd);
+    if(cxnSource->fd >= 0) {
+        close(cxnSource->fd);
+    }
     free(cxn->source);
 }
 
+// Detaches the connection's socket, so that destroying the connection leaves
+// it open. Returns the socket, or -1 if the connection is not cleartext.
+int marla_cleartext_release(marla_Connection* cxn)
+{
+    if(cxn->destroySource != destroySource) {
+        return -1;
+    }
+    marla_ClearTextSource* cxnSource = cxn->source;
+    int fd = cxnSource->fd;
+    cxnSource->fd = -1;
+    return fd;
+}
+
 int marla_cleartext_init(marla_Connection* cxn, int fd)
 {
     marla_ClearTextSource* source = malloc(sizeof *source);
     cxn->source = source;
     cxn->readSource = readSource;
     cxn->writeSource = writeSource;
+    cxn->readvSource = readvSource;
+    cxn->writevSource = writevSource;
     cxn->acceptSource = acceptSource;
     cxn->shutdownSource = shutdownSource;
     cxn->destroySource = destroySource;
     cxn->describeSource = describeSource;
+    cxn->socketSource = socketSource;
+    cxn->sendZeroCopySource = sendZeroCopySource;
     source->fd = fd;
     return 0;
 }
@@ -8,90 +8,98 @@ marla_WriteResult marla_processClientFields(marla_Request* req)
 {
     marla_Connection* cxn = req->cxn;
     marla_Server* server = cxn->server;
+    marla_Ring* input = cxn->input;
+
+    // Header lines are found a block at a time, and handled one at a time.
+    marla_HeaderScan scan;
+    scan.numLines = 0;
+    scan.status = marla_HEADERS_PARTIAL;
+    int handled = 0;
+    size_t consumed = 0;
+    const unsigned char* data = 0;
+    unsigned char wrapped[marla_MAX_FIELD_LINE_LENGTH];
     while(req->readStage == marla_CLIENT_REQUEST_READING_FIELD) {
-        char fieldLine[MAX_FIELD_NAME_LENGTH + 2 + MAX_FIELD_VALUE_LENGTH + 2];
-        memset(fieldLine, 0, sizeof(fieldLine));
-        int nread = marla_Connection_read(cxn, (unsigned char*)fieldLine, sizeof(fieldLine));
-        if(nread <= 0) {
-            // Error.
-            return marla_WriteResult_UPSTREAM_CHOKED;
-        }
-
-        // Validate.
-        int foundNewline = 0;
-        int foundSeparator = 0;
-        int toleratingSpaces = 0;
-        char* fieldValue = 0;
-        for(int i = 0; i < nread; ++i) {
-            if(fieldLine[i] == '\n') {
-                fieldLine[i] = 0;
-                foundNewline = 1;
-                marla_Connection_putbackRead(cxn, nread - i - 1);
-                break;
-            }
-            if(fieldLine[i] == '\r') {
-                if(i >= nread - 1) {
-                    marla_Connection_putbackRead(cxn, nread);
-                    return marla_WriteResult_UPSTREAM_CHOKED;
-                }
-                if(fieldLine[i + 1] != '\n') {
-                    marla_killRequest(req, 400, "Header line is not terminated properly, so no valid request.");
-                    return marla_WriteResult_KILLED;
+        char fieldLine[marla_MAX_FIELD_LINE_LENGTH];
+        if(handled == scan.numLines && (scan.status == marla_HEADERS_PARTIAL || scan.status == marla_HEADERS_FULL)) {
+            void* slot;
+            size_t slotLen;
+            marla_Ring_readSlot(input, &slot, &slotLen);
+            marla_Ring_putbackRead(input, slotLen);
+            data = slot;
+            marla_scanHeaders(&scan, data, slotLen, sizeof(fieldLine));
+            if(scan.status == marla_HEADERS_PARTIAL && scan.numLines == 0 && slotLen < marla_Ring_size(input)) {
+                // The line wraps around the end of the ring.
+                data = wrapped;
+                marla_scanHeaders(&scan, data, marla_Ring_peek(input, wrapped, sizeof(wrapped)), sizeof(fieldLine));
+            }
+            handled = 0;
+            consumed = 0;
+        }
+        if(handled == scan.numLines) {
+            switch(scan.status) {
+            case marla_HEADERS_BAD_NAME:
+                switch(data[scan.errorAt]) {
+                case '<': case '>': case '#': case '%': case '"':
+                    marla_killRequest(req, 400, "Client request header contains delimiters, so no valid request.");
+                    break;
+                case '{': case '}': case '|': case '\\': case '^': case '[': case ']': case '`':
+                    marla_killRequest(req, 400, "Client request header contains unwise characters, so no valid request.");
+                    break;
+                default:
+                    if(data[scan.errorAt] < 0x20 || data[scan.errorAt] >= 0x7f) {
+                        marla_killRequest(req, 400, "Client request header contains control characters, so no valid request.");
+                    }
+                    else {
+                        marla_killRequest(req, 400, "Client request header contains non alphanumeric characters, so no valid request.");
+                    }
                 }
-                fieldLine[i] = 0;
-                foundNewline = 1;
-                marla_Connection_putbackRead(cxn, nread - i - 2);
-                break;
-            }
-            char c = fieldLine[i];
-            if((c <= 0x1f && c != '\t') || c == 0x7f) {
+                return marla_WriteResult_KILLED;
+            case marla_HEADERS_BAD_VALUE:
                 marla_killRequest(req, 400, "Client request header contains control characters, so no valid request.");
                 return marla_WriteResult_KILLED;
-            }
-            if(!foundSeparator && (c == '<' || c == '>' || c == '#' || c == '%' || c == '"')) {
-                marla_killRequest(req, 400, "Client request header contains delimiters, so no valid request.");
+            case marla_HEADERS_BAD_EOL:
+                marla_killRequest(req, 400, "Header line is not terminated properly, so no valid request.");
                 return marla_WriteResult_KILLED;
-            }
-            if(!foundSeparator && (c == '{' || c == '}' || c == '|' || c == '\\' || c == '^' || c == '[' || c == ']' || c == '`')) {
-                marla_killRequest(req, 400, "Client request header contains unwise characters, so no valid request.");
+            case marla_HEADERS_TOO_LONG:
+                marla_killRequest(req, 400, "Header line is too long, so no valid request.");
                 return marla_WriteResult_KILLED;
-            }
-            if(!foundSeparator && !isalnum(c) && c != '-' && c != '\t') {
-                if(c == ':' && i > 0 && i < nread - 1) {
-                    foundSeparator = i;
-                    fieldLine[i] = 0;
-                    toleratingSpaces = 1;
-                    continue;
-                }
-                marla_killRequest(req, 400, "Client request header contains non alphanumeric characters, so no valid request.");
-                return marla_WriteResult_KILLED;
-            }
-            if(foundSeparator && toleratingSpaces) {
-                if(c == ' ') {
-                    continue;
-                }
-                toleratingSpaces = 0;
-                fieldValue = fieldLine + i;
+            case marla_HEADERS_PARTIAL:
+                return marla_WriteResult_UPSTREAM_CHOKED;
+            default:
+                break;
             }
         }
 
-        // Validate.
-        if(!foundNewline && nread == sizeof(fieldLine)) {
-            marla_killRequest(req, 400, "Request version is too long, so no valid request.");
-            return marla_WriteResult_KILLED;
+        char* fieldValue = 0;
+        if(handled < scan.numLines) {
+            // Copy out the line, splitting the name from the value.
+            marla_HeaderLine* line = scan.lines + handled++;
+            size_t lineLen = line->end - line->start;
+            memcpy(fieldLine, data + line->start, lineLen);
+            fieldLine[lineLen] = 0;
+            fieldLine[line->colon - line->start] = 0;
+            if(line->value < line->end) {
+                fieldValue = fieldLine + (line->value - line->start);
+                req->headerField = marla_lookupField(fieldLine, line->colon - line->start);
+            }
+            marla_Ring_skip(input, line->next - consumed);
+            consumed = line->next;
         }
-        if(!foundNewline) {
-            // Incomplete;
-            marla_Connection_putbackRead(cxn, nread);
-            return marla_WriteResult_UPSTREAM_CHOKED;
+        else {
+            // Empty line.
+            fieldLine[0] = 0;
+            marla_Ring_skip(input, scan.next - consumed);
+            consumed = scan.next;
         }
-        if(foundSeparator && fieldValue) {
+
+        if(fieldValue) {
             // Header found.
             char* fieldName = fieldLine;
             //fprintf(stderr, "HEADER: %s = %s\n", fieldName, fieldValue);
             marla_logMessagecf(req->cxn->server, "HTTP Headers", "%s = %s", fieldName, fieldValue);
 
-            if(!strcasecmp(fieldName, "Content-Length")) {
+            switch(req->headerField) {
+            case marla_FIELD_CONTENT_LENGTH: {
                 if(req->requestLen != marla_MESSAGE_LENGTH_UNKNOWN) {
                     marla_killRequest(req, 400, "Content-Length/Transfer-Encoding header value was set twice, so no valid request.");
                     return marla_WriteResult_KILLED;
@@ -106,15 +114,16 @@ marla_WriteResult marla_processClientFields(marla_Request* req)
                 if(req->handler) {
                     req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
                 }
+                break;
             }
-            else if(!strcasecmp(fieldName, "Host")) {
+            case marla_FIELD_HOST:
                 memset(req->host, 0, sizeof(req->host));
                 strncpy(req->host, fieldValue, sizeof(req->host) - 1);
                 if(req->handler) {
                     req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
                 }
-            }
-            else if(!strcasecmp(fieldName, "Transfer-Encoding")) {
+                break;
+            case marla_FIELD_TRANSFER_ENCODING:
                 if(req->requestLen != marla_MESSAGE_LENGTH_UNKNOWN) {
                     marla_killRequest(req, 400, "Content-Length/Transfer-Encoding header value was set twice, so no valid request.");
                     return marla_WriteResult_KILLED;
@@ -123,8 +132,8 @@ marla_WriteResult marla_processClientFields(marla_Request* req)
                 if(!strcasecmp(fieldValue, "chunked")) {
                     req->requestLen = marla_MESSAGE_IS_CHUNKED;
                 }
-            }
-            else if(!strcasecmp(fieldName, "Connection")) {
+                break;
+            case marla_FIELD_CONNECTION: {
                 char* sp;
                 char* fieldToken = strtok_r(fieldValue, ",", &sp);
                 int hasMultiple = 1;
@@ -160,94 +169,67 @@ marla_WriteResult marla_processClientFields(marla_Request* req)
                         fieldToken = strtok_r(0, ",", &sp);
                     }
                 }
+                break;
             }
-            else if(!strcmp(fieldName, "Trailer")) {
-
-            }
-            else if(!strcmp(fieldName, "TE")) {
-
-            }
-            else if(!strcmp(fieldName, "Range")) {
-
-            }
-            else if(!strcmp(fieldName, "If-Unmodified-Since")) {
-
-            }
-            else if(!strcmp(fieldName, "If-Range")) {
-
-            }
-            else if(!strcmp(fieldName, "If-None-Match")) {
-
-            }
-            else if(!strcmp(fieldName, "If-Modified-Since")) {
-
-            }
-            else if(!strcmp(fieldName, "If-Match")) {
-
-            }
-            else if(!strcmp(fieldName, "Expect")) {
+            case marla_FIELD_TRAILER:
+            case marla_FIELD_TE:
+            case marla_FIELD_RANGE:
+            case marla_FIELD_IF_UNMODIFIED_SINCE:
+            case marla_FIELD_IF_RANGE:
+            case marla_FIELD_IF_NONE_MATCH:
+            case marla_FIELD_IF_MODIFIED_SINCE:
+            case marla_FIELD_IF_MATCH:
+                break;
+            case marla_FIELD_EXPECT:
                 if(!strcmp(fieldValue, "100-continue")) {
                     req->expect_continue = 1;
                 }
                 else if(req->handler) {
                     req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
                 }
-            }
-            else if(!strcmp(fieldName, "Cookie")) {
+                break;
+            case marla_FIELD_COOKIE:
                 strncpy(req->cookieHeader, fieldValue, MAX_FIELD_VALUE_LENGTH);
                 if(req->handler) {
                     req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
                 }
-            }
-            else if(!strcmp(fieldName, "Content-Type")) {
+                break;
+            case marla_FIELD_CONTENT_TYPE:
                 strncpy(req->contentType, fieldValue, MAX_FIELD_VALUE_LENGTH);
                 if(req->handler) {
                     req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
                 }
-            }
-            else if(!strcmp(fieldName, "Accept-Language")) {
-                if(req->handler) {
-                    req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
-                }
-            }
-            else if(!strcmp(fieldName, "Accept-Encoding")) {
-                if(req->handler) {
-                    req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
-                }
-
-            }
-            else if(!strcmp(fieldName, "Accept-Charset")) {
-                if(req->handler) {
-                    req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
-                }
-            }
-            else if(!strcmp(fieldName, "Sec-WebSocket-Key")) {
+                break;
+            case marla_FIELD_SEC_WEBSOCKET_KEY:
                 strncpy(req->websocket_nonce, fieldValue, MAX_WEBSOCKET_NONCE_LENGTH);
-            }
-            else if(!strcmp(fieldName, "Sec-WebSocket-Version")) {
+                break;
+            case marla_FIELD_SEC_WEBSOCKET_VERSION:
                 if(!strcmp(fieldValue, "13")) {
                     req->websocket_version = 13;
                 }
                 else {
                     marla_killRequest(req, 400, "Unexpected WebSocket version");
                 }
-            }
-            else if(!strcmp(fieldName, "Accept")) {
+                break;
+            case marla_FIELD_ACCEPT:
                 strncpy(req->acceptHeader, fieldValue, MAX_FIELD_VALUE_LENGTH);
                 if(req->handler) {
                     req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
                 }
-            }
-            else if(!strcmp(fieldName, "Upgrade")) {
+                break;
+            case marla_FIELD_UPGRADE:
                 if(!strcmp(fieldValue, "websocket")) {
                     req->expect_websocket = 1;
                 }
                 else if(req->handler) {
                     req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
                 }
-            }
-            else if(req->handler) {
-                req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
+                break;
+            default:
+                if(req->handler) {
+                    req->handler(req, marla_EVENT_HEADER, fieldName, fieldValue - fieldName);
+                }
+                break;
             }
 
             continue;
@@ -834,18 +816,18 @@ static marla_WriteResult marla_processStatusLine(marla_Request* req)
 
     if(req->readStage == marla_CLIENT_REQUEST_READING_METHOD) {
         memset(req->method, 0, sizeof(req->method));
-        int nread = marla_Connection_read(cxn, (unsigned char*)req->method, MAX_METHOD_LENGTH + 1);
+        int methodEnd = marla_Ring_find(cxn->input, " ", MAX_METHOD_LENGTH + 1);
+        if(methodEnd < 0 && marla_Ring_size(cxn->input) < MAX_METHOD_LENGTH + 1) {
+            // Incomplete.
+            return marla_WriteResult_UPSTREAM_CHOKED;
+        }
+        int nread = marla_Connection_read(cxn, (unsigned char*)req->method, methodEnd < 0 ? MAX_METHOD_LENGTH + 1 : methodEnd + 1);
         if(nread < 0) {
             return marla_WriteResult_UPSTREAM_CHOKED;
         }
         if(nread == 0) {
             return marla_WriteResult_CLOSED;
         }
-        if(nread < MIN_METHOD_LENGTH + 1) {
-            // Incomplete.
-            marla_Connection_putbackRead(cxn, nread);
-            return marla_WriteResult_UPSTREAM_CHOKED;
-        }
 
         // Validate the given method.
         int foundSpace = 0;
@@ -887,33 +869,16 @@ static marla_WriteResult marla_processStatusLine(marla_Request* req)
         memset(req->method + strlen(req->method), 0, sizeof(req->method) - strlen(req->method));
         req->readStage = marla_CLIENT_REQUEST_PAST_METHOD;
 
-        if(!strcmp(req->method, "GET")) {
-
-        }
-        else if(!strcmp(req->method, "HEAD")) {
-
-        }
-        else if(!strcmp(req->method, "POST")) {
-
-        }
-        else if(!strcmp(req->method, "PUT")) {
-
-        }
-        else if(!strcmp(req->method, "DELETE")) {
-
-        }
-        else if(!strcmp(req->method, "CONNECT")) {
-
-        }
-        else if(!strcmp(req->method, "OPTIONS")) {
-
-        }
-        else if(!strcmp(req->method, "TRACE")) {
-            // A client MUST NOT send a message body in a TRACE request.
-        }
-        else {
+        req->methodId = marla_lookupMethod(req->method, strlen(req->method));
+        switch(req->methodId) {
+        case marla_METHOD_UNKNOWN:
             marla_killRequest(req, 400, "Request method '%s' is unknown, so no valid request.", req->method);
             return marla_WriteResult_KILLED;
+        case marla_METHOD_TRACE:
+            // A client MUST NOT send a message body in a TRACE request.
+            break;
+        default:
+            break;
         }
 
         marla_logMessagef(req->cxn->server, "Found method: %s", req->method);
@@ -939,18 +904,18 @@ static marla_WriteResult marla_processStatusLine(marla_Request* req)
 
     if(req->readStage == marla_CLIENT_REQUEST_READING_REQUEST_TARGET) {
         memset(req->uri, 0, sizeof(req->uri));
-        int nread = marla_Connection_read(cxn, (unsigned char*)req->uri, MAX_URI_LENGTH + 1);
+        int uriEnd = marla_Ring_find(cxn->input, " ", MAX_URI_LENGTH + 1);
+        if(uriEnd < 0 && marla_Ring_size(cxn->input) < MAX_URI_LENGTH + 1) {
+            // Incomplete read.
+            return marla_WriteResult_UPSTREAM_CHOKED;
+        }
+        int nread = marla_Connection_read(cxn, (unsigned char*)req->uri, uriEnd < 0 ? MAX_URI_LENGTH + 1 : uriEnd + 1);
         if(nread < 0) {
             return marla_WriteResult_UPSTREAM_CHOKED;
         }
         if(nread == 0) {
             return marla_WriteResult_CLOSED;
         }
-        if(nread < 2) {
-            // Incomplete read.
-            marla_Connection_putbackRead(cxn, nread);
-            return marla_WriteResult_UPSTREAM_CHOKED;
-        }
 
         // Validate the given method.
         int foundSpace = 0;
@@ -1243,12 +1208,14 @@ marla_WriteResult marla_clientRead(marla_Connection* cxn)
             }
         }
         else {
-            for(; cxn->requests_in_process > 0 && req->cxn->stage != marla_CLIENT_COMPLETE && req->writeStage != marla_CLIENT_REQUEST_DONE_WRITING;) {
+            for(int loop = 1; loop && cxn->requests_in_process > 0 && req->cxn->stage != marla_CLIENT_COMPLETE && req->writeStage != marla_CLIENT_REQUEST_DONE_WRITING;) {
                 wr = marla_clientWrite(req->cxn);
                 switch(wr) {
                 case marla_WriteResult_CONTINUE:
                     continue;
                 case marla_WriteResult_UPSTREAM_CHOKED:
+                    // The handler is waiting, possibly on a task.
+                    loop = 0;
                     break;
                 case marla_WriteResult_DOWNSTREAM_CHOKED:
                 case marla_WriteResult_TIMEOUT:
@@ -1337,8 +1304,9 @@ marla_WriteResult marla_clientWrite(marla_Connection* cxn)
 
     marla_Ring* output = cxn->output;
 
-    // Write current output.
-    while(marla_Ring_size(output) > 0) {
+    // Write current output once there is no room to add to it. Otherwise it
+    // is flushed when the event loop is done with the connection.
+    while(marla_Ring_size(output) > marla_Ring_capacity(output) - 4) {
         int nflushed;
         marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
         switch(wr) {
@@ -1449,6 +1417,10 @@ marla_WriteResult marla_clientWrite(marla_Connection* cxn)
         req->readStage = marla_CLIENT_REQUEST_WEBSOCKET;
         req->writeStage = marla_CLIENT_REQUEST_WRITING_WEBSOCKET_RESPONSE;
 
+        // WebSocket frames are small and interactive, so send them at once.
+        marla_Connection_uncork(cxn);
+        marla_Connection_setNoDelay(cxn);
+
         marla_logMessage(server, "Going websocket");
         for(int loop = 1; loop;) {
             switch(marla_clientRead(cxn)) {
@@ -1481,6 +1453,10 @@ marla_WriteResult marla_clientWrite(marla_Connection* cxn)
     marla_WriteEvent result;
     marla_WriteEvent_init(&result, marla_WriteResult_CONTINUE);
 
+    if(req->writeStage == marla_CLIENT_REQUEST_WRITING_RESPONSE) {
+        // Send the response in full segments.
+        marla_Connection_cork(cxn);
+    }
     for(; req->cxn->stage != marla_CLIENT_COMPLETE && req->writeStage == marla_CLIENT_REQUEST_WRITING_RESPONSE; ) {
         switch(result.status) {
         case marla_WriteResult_UPSTREAM_CHOKED:
@@ -1536,6 +1512,7 @@ marla_WriteResult marla_clientWrite(marla_Connection* cxn)
     }
 
     if(req->writeStage == marla_CLIENT_REQUEST_AFTER_RESPONSE) {
+        marla_Connection_uncork(cxn);
         if(req->expect_trailer) {
             req->writeStage = marla_CLIENT_REQUEST_WRITING_TRAILERS;
 
@@ -1551,8 +1528,12 @@ marla_WriteResult marla_clientWrite(marla_Connection* cxn)
 
     if(req->writeStage == marla_CLIENT_REQUEST_DONE_WRITING) {
         //fprintf(stderr, "Done writing!\n");
-        // Write current output.
-        while(marla_Ring_size(cxn->output) > 0) {
+        // Write current output before closing. Otherwise, let the next
+        // response share its flush.
+        if(marla_Connection_hasOutput(cxn)) {
+            marla_Connection_markDirty(cxn);
+        }
+        while(req->close_after_done && marla_Connection_hasOutput(cxn)) {
             int nflushed;
             marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
             switch(wr) {
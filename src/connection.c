@@ -1,4 +1,18 @@
 #include "marla.h"
+#include <netdb.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <sys/un.h>
+#include <stddef.h>
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
 
 const char* marla_nameConnectionStage(enum marla_ConnectionStage stage)
 {
@@ -15,7 +29,30 @@ const char* marla_nameConnectionStage(enum marla_ConnectionStage stage)
     return "?";
 }
 
-static int next_connection_id = 1;
+const char* marla_nameBufferKind(enum marla_BufferKind kind)
+{
+    switch(kind) {
+    case marla_BUFFER_CLIENT:
+        return "CLIENT";
+    case marla_BUFFER_BACKEND:
+        return "BACKEND";
+    case marla_BUFFER_WEBSOCKET:
+        return "WEBSOCKET";
+    case marla_BUFFER_KIND_MAX:
+        break;
+    }
+    return "?";
+}
+
+static atomic_int next_connection_id = 1;
+
+static marla_Pool* connectionPool(marla_Connection* cxn)
+{
+    if(cxn->worker) {
+        return &cxn->worker->objectPool;
+    }
+    return &cxn->server->objectPool;
+}
 
 marla_Connection* marla_Connection_new(struct marla_Server* server)
 {
@@ -23,18 +60,24 @@ marla_Connection* marla_Connection_new(struct marla_Server* server)
         fprintf(stderr, "A connection must be provided a server when constructed.\n");
         abort();
     }
-    marla_Connection* cxn = (marla_Connection*)malloc(sizeof(*cxn));
+    // Connections created on a worker's thread belong to that worker.
+    marla_Worker* worker = marla_Worker_current();
+    marla_Pool* pool = worker ? &worker->objectPool : &server->objectPool;
+    marla_Connection* cxn = marla_Pool_takeConnection(pool);
     if(!cxn) {
         return 0;
     }
 
-    cxn->id = ++next_connection_id;
+    cxn->id = atomic_fetch_add(&next_connection_id, 1) + 1;
 
     cxn->server = server;
+    cxn->worker = worker;
+    cxn->peerAddressLen = 0;
     cxn->prev_connection = 0;
     cxn->next_connection = 0;
-    cxn->lastProcessTime.tv_sec = 0;
-    cxn->lastProcessTime.tv_nsec = 0;
+    cxn->prev_ready = 0;
+    cxn->next_ready = 0;
+    cxn->readyEvents = 0;
     cxn->backendPeer = 0;
 
     // Initialize flags.
@@ -50,47 +93,370 @@ marla_Connection* marla_Connection_new(struct marla_Server* server)
     cxn->describeSource = 0;
     cxn->readSource = 0;
     cxn->writeSource = 0;
+    cxn->readvSource = 0;
+    cxn->writevSource = 0;
     cxn->acceptSource = 0;
     cxn->shutdownSource = 0;
     cxn->destroySource = 0;
-
-    // Initialize the buffer.
-    cxn->input = marla_Ring_new(marla_BUFSIZE);
-    cxn->output = marla_Ring_new(marla_BUFSIZE);
+    cxn->socketSource = 0;
+    cxn->sendZeroCopySource = 0;
+    cxn->corked = 0;
+    cxn->zeroCopy = 0;
+    cxn->first_zeroCopy = 0;
+    cxn->last_zeroCopy = 0;
+    cxn->unsent_zeroCopy = 0;
+    cxn->zeroCopySends = 0;
+    cxn->zeroCopyCompleted = 0;
 
     cxn->stage = marla_CLIENT_ACCEPTED;
     cxn->requests_in_process = 0;
     cxn->latest_request = 0;
     cxn->current_request = 0;
 
-    if(cxn->server) {
-        if(!cxn->server->last_connection) {
-            cxn->server->first_connection = cxn;
-            cxn->server->last_connection = cxn;
+    // Initialize the buffer.
+    size_t bufSize = server->bufferPolicy[marla_Connection_bufferKind(cxn)].initialSize;
+    if(server->use_mirrored_rings) {
+        cxn->input = marla_Ring_newMirrored(bufSize);
+        cxn->output = marla_Ring_newMirrored(bufSize);
+    }
+    else {
+        cxn->input = marla_Pool_takeRing(pool, bufSize);
+        cxn->output = marla_Pool_takeRing(pool, bufSize);
+    }
+    cxn->inputChokes = 0;
+    cxn->outputChokes = 0;
+
+    marla_Connection** first = worker ? &worker->first_connection : &server->first_connection;
+    marla_Connection** last = worker ? &worker->last_connection : &server->last_connection;
+    if(!*last) {
+        *first = cxn;
+        *last = cxn;
+    }
+    else {
+        (*last)->next_connection = cxn;
+        cxn->prev_connection = *last;
+        *last = cxn;
+    }
+
+    // Check on the connection from its event loop's timer wheel.
+    marla_TimerWheel* timers = marla_Connection_timers(cxn);
+    marla_Timer_init(&cxn->timer, marla_Connection_idle, cxn);
+    cxn->lastActivity = marla_TimerWheel_tick(timers);
+    cxn->headerStart = -1;
+    marla_TimerWheel_schedule(timers, &cxn->timer, marla_IDLE_INTERVAL_MS);
+
+    return cxn;
+}
+
+marla_TimerWheel* marla_Connection_timers(marla_Connection* cxn)
+{
+    return cxn->worker ? &cxn->worker->timers : &cxn->server->timers;
+}
+
+// Adds the connection to its event loop's ready list, or adds the given
+// events to those it will be processed with if it is already there.
+static void queueReady(marla_Connection* cxn, int events)
+{
+    if(cxn->readyEvents) {
+        cxn->readyEvents |= events;
+        return;
+    }
+    marla_Connection** first = cxn->worker ? &cxn->worker->first_ready : &cxn->server->first_ready;
+    marla_Connection** last = cxn->worker ? &cxn->worker->last_ready : &cxn->server->last_ready;
+    int* numReady = cxn->worker ? &cxn->worker->numReady : &cxn->server->numReady;
+    cxn->readyEvents = events;
+    cxn->next_ready = 0;
+    cxn->prev_ready = *last;
+    if(*last) {
+        (*last)->next_ready = cxn;
+    }
+    else {
+        *first = cxn;
+    }
+    *last = cxn;
+    ++*numReady;
+}
+
+// Queues the connection to be processed again once the loop's current
+// events are done.
+void marla_Connection_markReady(marla_Connection* cxn)
+{
+    queueReady(cxn, EPOLLIN | EPOLLOUT);
+}
+
+// Queues the connection's output to be flushed once the loop's current
+// events are done, so that writes made in the meantime share a flush.
+void marla_Connection_markDirty(marla_Connection* cxn)
+{
+    queueReady(cxn, EPOLLOUT);
+}
+
+void marla_Connection_unmarkReady(marla_Connection* cxn)
+{
+    if(!cxn->readyEvents) {
+        return;
+    }
+    marla_Connection** first = cxn->worker ? &cxn->worker->first_ready : &cxn->server->first_ready;
+    marla_Connection** last = cxn->worker ? &cxn->worker->last_ready : &cxn->server->last_ready;
+    int* numReady = cxn->worker ? &cxn->worker->numReady : &cxn->server->numReady;
+    if(cxn->prev_ready) {
+        cxn->prev_ready->next_ready = cxn->next_ready;
+    }
+    else {
+        *first = cxn->next_ready;
+    }
+    if(cxn->next_ready) {
+        cxn->next_ready->prev_ready = cxn->prev_ready;
+    }
+    else {
+        *last = cxn->prev_ready;
+    }
+    cxn->prev_ready = 0;
+    cxn->next_ready = 0;
+    cxn->readyEvents = 0;
+    --*numReady;
+}
+
+// Returns whether the connection has buffered data that it could process
+// without waiting on its source.
+int marla_Connection_hasPendingWork(marla_Connection* cxn)
+{
+    if(cxn->shouldDestroy || cxn->stage == marla_CLIENT_ACCEPTED) {
+        return 0;
+    }
+    if(cxn->stage == marla_CLIENT_COMPLETE) {
+        return marla_Connection_hasOutput(cxn) && !cxn->wantsWrite;
+    }
+    return !marla_Ring_isEmpty(cxn->input) || (marla_Connection_hasOutput(cxn) && !cxn->wantsWrite);
+}
+
+// Returns whether the connection has output left to flush, either in its
+// output ring or queued to be sent without copying.
+int marla_Connection_hasOutput(marla_Connection* cxn)
+{
+    return !marla_Ring_isEmpty(cxn->output) || cxn->unsent_zeroCopy != 0;
+}
+
+static int setSocketOption(marla_Connection* cxn, int level, int option, int value)
+{
+    int fd = cxn->socketSource ? cxn->socketSource(cxn) : -1;
+    if(fd < 0) {
+        return -1;
+    }
+    return setsockopt(fd, level, option, &value, sizeof value);
+}
+
+// Holds back partial segments while a response is being written.
+void marla_Connection_cork(marla_Connection* cxn)
+{
+    if(cxn->corked) {
+        cxn->corked = 1;
+        return;
+    }
+    if(cxn->server->use_cork && 0 == setSocketOption(cxn, IPPROTO_TCP, TCP_CORK, 1)) {
+        cxn->corked = 1;
+    }
+}
+
+// Sends the corked response once its output has been flushed.
+void marla_Connection_uncork(marla_Connection* cxn)
+{
+    if(!cxn->corked) {
+        return;
+    }
+    if(marla_Connection_hasOutput(cxn)) {
+        cxn->corked = 2;
+        return;
+    }
+    setSocketOption(cxn, IPPROTO_TCP, TCP_CORK, 0);
+    cxn->corked = 0;
+}
+
+int marla_Connection_setNoDelay(marla_Connection* cxn)
+{
+    return setSocketOption(cxn, IPPROTO_TCP, TCP_NODELAY, 1);
+}
+
+// Has reads of the socket poll the device for up to the given number of
+// microseconds before waiting for an interrupt, and lets a busy-polling
+// epoll_wait take over that polling while the event loop spins.
+int marla_Connection_setBusyPoll(marla_Connection* cxn, int usec)
+{
+    if(setSocketOption(cxn, SOL_SOCKET, SO_BUSY_POLL, usec) != 0) {
+        return -1;
+    }
+    return setSocketOption(cxn, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1);
+}
+
+// Queues the buffer to be sent from where it lies once the output written
+// before it has been flushed, instead of copying it into the output ring. The
+// buffer must not change until release is called with releaseData, which
+// happens once the kernel reports it is done sending the buffer, or the
+// connection is destroyed. Returns 0 if the buffer was queued, or -1 if the
+// caller should write it itself: zero-copy sends are disabled, the buffer is
+// smaller than the server's zeroCopyThreshold, or the connection's source
+// cannot send without copying.
+int marla_Connection_writeZeroCopy(marla_Connection* cxn, const void* data, size_t length, void(*release)(void*), void* releaseData)
+{
+    size_t threshold = cxn->server->zeroCopyThreshold;
+    if(threshold == 0 || length < threshold || !cxn->sendZeroCopySource || cxn->zeroCopy < 0) {
+        return -1;
+    }
+    if(cxn->zeroCopy == 0) {
+        if(setSocketOption(cxn, SOL_SOCKET, SO_ZEROCOPY, 1) != 0) {
+            cxn->zeroCopy = -1;
+            return -1;
         }
-        else {
-            cxn->server->last_connection->next_connection = cxn;
-            cxn->prev_connection = cxn->server->last_connection;
-            cxn->server->last_connection = cxn;
+        cxn->zeroCopy = 1;
+    }
+    marla_ZeroCopy* zc = malloc(sizeof *zc);
+    if(!zc) {
+        return -1;
+    }
+    zc->data = data;
+    zc->length = length;
+    zc->sent = 0;
+    zc->lastSend = 0;
+    zc->release = release;
+    zc->releaseData = releaseData;
+    zc->next = 0;
+
+    // Count only the output written since the last queued buffer.
+    zc->precedingBytes = marla_Ring_size(cxn->output);
+    for(marla_ZeroCopy* unsent = cxn->unsent_zeroCopy; unsent; unsent = unsent->next) {
+        zc->precedingBytes -= unsent->precedingBytes;
+    }
+
+    if(cxn->last_zeroCopy) {
+        cxn->last_zeroCopy->next = zc;
+    }
+    else {
+        cxn->first_zeroCopy = zc;
+    }
+    cxn->last_zeroCopy = zc;
+    if(!cxn->unsent_zeroCopy) {
+        cxn->unsent_zeroCopy = zc;
+    }
+    marla_Connection_markDirty(cxn);
+    return 0;
+}
+
+static void releaseZeroCopy(marla_Connection* cxn)
+{
+    marla_ZeroCopy* zc = cxn->first_zeroCopy;
+    cxn->first_zeroCopy = zc->next;
+    if(!cxn->first_zeroCopy) {
+        cxn->last_zeroCopy = 0;
+    }
+    if(cxn->unsent_zeroCopy == zc) {
+        cxn->unsent_zeroCopy = zc->next;
+    }
+    if(zc->release) {
+        zc->release(zc->releaseData);
+    }
+    free(zc);
+}
+
+// Reads the kernel's notices of completed zero-copy sends from the socket's
+// error queue, where they raise EPOLLERR, and releases the buffers whose
+// sends have all completed. Returns the number of notices read.
+int marla_Connection_completeZeroCopy(marla_Connection* cxn)
+{
+    int fd = cxn->socketSource ? cxn->socketSource(cxn) : -1;
+    int count = 0;
+    while(fd >= 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
         }
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if(err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // TCP completes sends in order, so the notice covers all sends
+            // up to its last.
+            if((int)(err->ee_data + 1 - cxn->zeroCopyCompleted) > 0) {
+                cxn->zeroCopyCompleted = err->ee_data + 1;
+            }
+            if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // The kernel had to copy anyway, so stop pinning buffers.
+                cxn->zeroCopy = -1;
+            }
+            ++count;
+        }
+    }
+    while(cxn->first_zeroCopy && cxn->first_zeroCopy != cxn->unsent_zeroCopy && (int)(cxn->zeroCopyCompleted - cxn->first_zeroCopy->lastSend) > 0) {
+        releaseZeroCopy(cxn);
     }
+    return count;
+}
 
-    return cxn;
+// Counts a connection that used up its processing budget, and queues it to
+// be processed again once its event loop has polled its other sockets.
+void marla_Connection_exhaustBudget(marla_Connection* cxn)
+{
+    if(cxn->worker) {
+        ++cxn->worker->budgetExhausted;
+    }
+    else {
+        ++cxn->server->budgetExhausted;
+    }
+    marla_Connection_markReady(cxn);
+}
+
+// Records activity on the connection, and makes sure its timer runs soon
+// enough to service any request that has arrived.
+void marla_Connection_touch(marla_Connection* cxn)
+{
+    marla_TimerWheel* timers = marla_Connection_timers(cxn);
+    cxn->lastActivity = timers->now;
+    if(!marla_Timer_isActive(&cxn->timer) || cxn->timer.deadline - timers->now > marla_IDLE_INTERVAL_MS / marla_TIMER_TICK_MS) {
+        marla_TimerWheel_schedule(timers, &cxn->timer, marla_IDLE_INTERVAL_MS);
+    }
 }
 
 int marla_Connection_refill(marla_Connection* cxn, size_t* total)
 {
     marla_Ring* input = cxn->input;
     for(; !cxn->wantsRead;) {
-        void* ringBuf;
         size_t slotLen;
-        marla_Ring_writeSlot(input, &ringBuf, &slotLen);
-        if(slotLen == 0) {
-            marla_logMessagecf(cxn->server, "I/O", "Connection %d's input buffer is full.", cxn->id);
-            break;
+        int nread;
+        if(cxn->readvSource) {
+            // Fill both halves of the ring in one call.
+            struct iovec iov[2];
+            int iovcnt = marla_Ring_writeIov(input, iov);
+            slotLen = marla_Ring_iovLen(iov, iovcnt);
+            if(slotLen == 0) {
+                marla_logMessagecf(cxn->server, "I/O", "Connection %d's input buffer is full.", cxn->id);
+                if(marla_Connection_growInput(cxn)) {
+                    input = cxn->input;
+                    continue;
+                }
+                break;
+            }
+            nread = cxn->readvSource(cxn, iov, iovcnt);
+        }
+        else {
+            void* ringBuf;
+            marla_Ring_writeSlot(input, &ringBuf, &slotLen);
+            if(slotLen == 0) {
+                marla_logMessagecf(cxn->server, "I/O", "Connection %d's input buffer is full.", cxn->id);
+                if(marla_Connection_growInput(cxn)) {
+                    input = cxn->input;
+                    continue;
+                }
+                break;
+            }
+            nread = cxn->readSource(cxn, ringBuf, slotLen);
         }
-
-        int nread = cxn->readSource(cxn, ringBuf, slotLen);
         marla_logMessagecf(cxn->server, "I/O", "Read %d bytes from source into input slot of size %d.", nread, slotLen);
         if(nread <= 0) {
             marla_Ring_putbackWrite(input, slotLen);
@@ -141,12 +507,125 @@ void marla_Connection_putbackWrite(marla_Connection* cxn, size_t amount)
 
 int marla_Connection_write(marla_Connection* cxn, const void* source, size_t requested)
 {
-    if(marla_Ring_isFull(cxn->output)) {
+    if(marla_Ring_isFull(cxn->output) && !marla_Connection_growOutput(cxn)) {
         return -1;
     }
+    marla_Connection_markDirty(cxn);
     return marla_Ring_write(cxn->output, source, requested);
 }
 
+enum marla_BufferKind marla_Connection_bufferKind(marla_Connection* cxn)
+{
+    if(cxn->is_backend) {
+        return marla_BUFFER_BACKEND;
+    }
+    if(cxn->current_request && cxn->current_request->readStage == marla_CLIENT_REQUEST_WEBSOCKET) {
+        return marla_BUFFER_WEBSOCKET;
+    }
+    return marla_BUFFER_CLIENT;
+}
+
+int marla_Connection_resizeRing(marla_Connection* cxn, marla_Ring** ringp, size_t capacity)
+{
+    marla_Ring* ring = *ringp;
+    size_t size = marla_Ring_size(ring);
+    if(capacity == ring->capacity || capacity < size) {
+        return 0;
+    }
+
+    marla_Ring* resized;
+    if(ring->mirrored) {
+        resized = marla_Ring_newMirrored(capacity);
+    }
+    else if(capacity > cxn->server->bufferPolicy[marla_Connection_bufferKind(cxn)].initialSize) {
+        // Grown rings are not pooled, so shrinking gives their memory back
+        // instead of leaving it on the pool's freelists.
+        resized = marla_Ring_new(capacity);
+    }
+    else {
+        resized = marla_Pool_takeRing(connectionPool(cxn), capacity);
+    }
+    if(resized->capacity == ring->capacity) {
+        // Mirrored rings round up to the page size.
+        marla_Pool_releaseRing(connectionPool(cxn), resized);
+        return 0;
+    }
+    resized->write_index = marla_Ring_read(ring, (unsigned char*)resized->buf, size);
+    marla_Pool_releaseRing(connectionPool(cxn), ring);
+    *ringp = resized;
+    return 1;
+}
+
+static int growRing(marla_Connection* cxn, marla_Ring** ringp, int* chokes)
+{
+    struct marla_BufferPolicy* policy = cxn->server->bufferPolicy + marla_Connection_bufferKind(cxn);
+    if(++*chokes < policy->growAfter || (*ringp)->capacity >= policy->maxSize) {
+        return 0;
+    }
+    *chokes = 0;
+    size_t capacity = (*ringp)->capacity;
+    if(!marla_Connection_resizeRing(cxn, ringp, capacity << 1)) {
+        return 0;
+    }
+    marla_logMessagecf(cxn->server, "I/O", "Connection %d's %s buffer grew from %ld to %ld bytes.", cxn->id, *ringp == cxn->input ? "input" : "output", capacity, (*ringp)->capacity);
+    return 1;
+}
+
+int marla_Connection_growInput(marla_Connection* cxn)
+{
+    return growRing(cxn, &cxn->input, &cxn->inputChokes);
+}
+
+int marla_Connection_growOutput(marla_Connection* cxn)
+{
+    return growRing(cxn, &cxn->output, &cxn->outputChokes);
+}
+
+void marla_Connection_shrink(marla_Connection* cxn)
+{
+    cxn->inputChokes = 0;
+    cxn->outputChokes = 0;
+    if(cxn->requests_in_process > 0) {
+        return;
+    }
+    size_t initialSize = cxn->server->bufferPolicy[marla_Connection_bufferKind(cxn)].initialSize;
+    if(cxn->input->capacity > initialSize && marla_Ring_isEmpty(cxn->input)) {
+        marla_Connection_resizeRing(cxn, &cxn->input, initialSize);
+    }
+    if(cxn->output->capacity > initialSize && marla_Ring_isEmpty(cxn->output)) {
+        marla_Connection_resizeRing(cxn, &cxn->output, initialSize);
+    }
+}
+
+// Formats the connection's peer address as host:port. The address is kept
+// raw when accepted, so this is only paid for when it's shown.
+int marla_Connection_describePeer(marla_Connection* cxn, char* sink, size_t len)
+{
+    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    if(cxn->peerAddressLen == 0) {
+        snprintf(sink, len, "%s", "");
+        return -1;
+    }
+    if(cxn->peerAddress.ss_family == AF_UNIX) {
+        // Clients of a Unix socket are usually unnamed.
+        struct sockaddr_un* local = (struct sockaddr_un*)&cxn->peerAddress;
+        snprintf(sink, len, "unix:%s", cxn->peerAddressLen > offsetof(struct sockaddr_un, sun_path) ? local->sun_path : "");
+        return 0;
+    }
+    int s = getnameinfo((struct sockaddr*)&cxn->peerAddress, cxn->peerAddressLen, hbuf, sizeof hbuf, sbuf, sizeof sbuf, NI_NUMERICHOST | NI_NUMERICSERV);
+    if(s != 0) {
+        snprintf(sink, len, "%s", "");
+        return -1;
+    }
+    if(cxn->peerAddress.ss_family == AF_INET6) {
+        snprintf(sink, len, "[%s]:%s", hbuf, sbuf);
+    }
+    else {
+        snprintf(sink, len, "%s:%s", hbuf, sbuf);
+    }
+    return 0;
+}
+
 marla_WriteResult marla_Connection_flush(marla_Connection* cxn, int* outnflushed)
 {
     void* buf;
@@ -155,17 +634,68 @@ marla_WriteResult marla_Connection_flush(marla_Connection* cxn, int* outnflushed
     int nflushed = 0;
     marla_WriteResult wr;
     for(;;) {
-        marla_Ring_readSlot(cxn->output, &buf, &len);
-        if(len == 0) {
-            wr = marla_WriteResult_UPSTREAM_CHOKED;
-            break;
+        int true_flushed;
+        marla_ZeroCopy* zc = cxn->unsent_zeroCopy;
+        if(zc && zc->precedingBytes == 0) {
+            // The output before the queued buffer is flushed, so send it.
+            true_flushed = cxn->sendZeroCopySource(cxn, zc->data + zc->sent, zc->length - zc->sent);
+            if(true_flushed <= 0) {
+                wr = marla_WriteResult_DOWNSTREAM_CHOKED;
+                break;
+            }
+            zc->lastSend = cxn->zeroCopySends++;
+            zc->sent += true_flushed;
+            nflushed += true_flushed;
+            if(zc->sent < zc->length) {
+                wr = marla_WriteResult_DOWNSTREAM_CHOKED;
+                break;
+            }
+            cxn->unsent_zeroCopy = zc->next;
+            continue;
+        }
+        if(cxn->writevSource) {
+            // Drain both halves of the ring in one call.
+            struct iovec iov[2];
+            int iovcnt = marla_Ring_readIov(cxn->output, iov);
+            len = marla_Ring_iovLen(iov, iovcnt);
+            if(len == 0) {
+                wr = marla_WriteResult_UPSTREAM_CHOKED;
+                break;
+            }
+            if(zc && len > zc->precedingBytes) {
+                // Stop at the queued buffer.
+                marla_Ring_putbackRead(cxn->output, len - zc->precedingBytes);
+                len = zc->precedingBytes;
+                if(iov[0].iov_len >= len) {
+                    iov[0].iov_len = len;
+                    iovcnt = 1;
+                }
+                else {
+                    iov[1].iov_len = len - iov[0].iov_len;
+                }
+            }
+            true_flushed = cxn->writevSource(cxn, iov, iovcnt);
+        }
+        else {
+            marla_Ring_readSlot(cxn->output, &buf, &len);
+            if(len == 0) {
+                wr = marla_WriteResult_UPSTREAM_CHOKED;
+                break;
+            }
+            if(zc && len > zc->precedingBytes) {
+                marla_Ring_putbackRead(cxn->output, len - zc->precedingBytes);
+                len = zc->precedingBytes;
+            }
+            true_flushed = cxn->writeSource(cxn, buf, len);
         }
-        int true_flushed = cxn->writeSource(cxn, buf, len);
         if(true_flushed <= 0) {
             marla_Ring_putbackRead(cxn->output, len);
             wr = marla_WriteResult_DOWNSTREAM_CHOKED;
             break;
         }
+        if(zc) {
+            zc->precedingBytes -= true_flushed;
+        }
         nflushed += true_flushed;
         marla_logMessagecf(cxn->server, "I/O", "%d bytes flushed to source on connection %d.", true_flushed, cxn->id);
         //printf("%d bytes flushed to source on connection %d. Size=%d\n", true_flushed, cxn->id, marla_Ring_size(cxn->output));
@@ -184,6 +714,14 @@ marla_WriteResult marla_Connection_flush(marla_Connection* cxn, int* outnflushed
     if(cxn->shouldDestroy) {
         return marla_WriteResult_CLOSED;
     }
+    if(cxn->corked == 2 && wr == marla_WriteResult_UPSTREAM_CHOKED) {
+        // The finished response has been written, so send what is left of it.
+        marla_Connection_uncork(cxn);
+    }
+    if(cxn->readyEvents == EPOLLOUT && (wr == marla_WriteResult_UPSTREAM_CHOKED || cxn->wantsWrite)) {
+        // Nothing is left to flush until the source is writable again.
+        marla_Connection_unmarkReady(cxn);
+    }
     return wr;
 }
 
@@ -192,10 +730,19 @@ void marla_Connection_destroy(marla_Connection* cxn)
     marla_logMessagef(cxn->server, "Destroying connection %d", cxn->id);
     fprintf(stderr, "Destroying %s connection %d\n", cxn->is_backend ? "backend" : "client", cxn->id);
 
+    marla_TimerWheel_cancel(&cxn->timer);
+    marla_Connection_unmarkReady(cxn);
+
     // Force reads and writes to fail.
     cxn->in_write = 1;
     cxn->in_read = 1;
 
+    // Graceful shutdowns wait for zero-copy sends to complete, so buffers are
+    // only still queued here when the connection is being aborted.
+    while(cxn->first_zeroCopy) {
+        releaseZeroCopy(cxn);
+    }
+
     if(cxn->destroySource) {
         cxn->destroySource(cxn);
         cxn->destroySource = 0;
@@ -221,6 +768,8 @@ void marla_Connection_destroy(marla_Connection* cxn)
         cxn->backendPeer = 0;
     }
 
+    marla_Connection** first = cxn->worker ? &cxn->worker->first_connection : &cxn->server->first_connection;
+    marla_Connection** last = cxn->worker ? &cxn->worker->last_connection : &cxn->server->last_connection;
     if(cxn->prev_connection && cxn->next_connection) {
         cxn->next_connection->prev_connection = cxn->prev_connection;
         cxn->prev_connection->next_connection = cxn->next_connection;
@@ -228,32 +777,32 @@ void marla_Connection_destroy(marla_Connection* cxn)
         cxn->prev_connection = 0;
     }
     else if(cxn->prev_connection) {
-        if(cxn->server && cxn->server->last_connection == cxn) {
-            cxn->server->last_connection = cxn->prev_connection;
+        if(*last == cxn) {
+            *last = cxn->prev_connection;
         }
         cxn->prev_connection->next_connection = 0;
         cxn->next_connection = 0;
         cxn->prev_connection = 0;
     }
     else if(cxn->next_connection) {
-        if(cxn->server && cxn->server->first_connection == cxn) {
-            cxn->server->first_connection = cxn->next_connection;
+        if(*first == cxn) {
+            *first = cxn->next_connection;
         }
         cxn->next_connection->prev_connection = 0;
         cxn->next_connection = 0;
         cxn->prev_connection = 0;
     }
     else {
-        if(cxn->server && cxn->server->first_connection == cxn) {
-            cxn->server->first_connection = cxn->next_connection;
+        if(*first == cxn) {
+            *first = cxn->next_connection;
         }
-        if(cxn->server && cxn->server->last_connection == cxn) {
-            cxn->server->last_connection = cxn->prev_connection;
+        if(*last == cxn) {
+            *last = cxn->prev_connection;
         }
     }
 
-    marla_Ring_free(cxn->input);
-    marla_Ring_free(cxn->output);
-
-    free(cxn);
+    marla_Pool* pool = connectionPool(cxn);
+    marla_Pool_releaseRing(pool, cxn->input);
+    marla_Pool_releaseRing(pool, cxn->output);
+    marla_Pool_releaseConnection(pool, cxn);
 }
@@ -24,6 +24,38 @@ static int writeDuplexSource(struct marla_Connection* cxn, void* writeSource, si
     return rv;
 }
 
+static int readvDuplexSource(struct marla_Connection* cxn, struct iovec* iov, int iovcnt)
+{
+    int total = 0;
+    for(int i = 0; i < iovcnt; ++i) {
+        int rv = readDuplexSource(cxn, iov[i].iov_base, iov[i].iov_len);
+        if(rv <= 0) {
+            break;
+        }
+        total += rv;
+        if(rv < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total > 0 ? total : -1;
+}
+
+static int writevDuplexSource(struct marla_Connection* cxn, struct iovec* iov, int iovcnt)
+{
+    int total = 0;
+    for(int i = 0; i < iovcnt; ++i) {
+        int rv = writeDuplexSource(cxn, iov[i].iov_base, iov[i].iov_len);
+        if(rv <= 0) {
+            break;
+        }
+        total += rv;
+        if(rv < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total > 0 ? total : -1;
+}
+
 static void acceptDuplexSource(marla_Connection* cxn)
 {
     // Accepted and secured.
@@ -112,6 +144,8 @@ void marla_Duplex_init(marla_Connection* cxn, size_t input_size, size_t output_s
     cxn->source = source;
     cxn->readSource = readDuplexSource;
     cxn->writeSource = writeDuplexSource;
+    cxn->readvSource = readvDuplexSource;
+    cxn->writevSource = writevDuplexSource;
     cxn->acceptSource = acceptDuplexSource;
     cxn->shutdownSource = shutdownDuplexSource;
     cxn->destroySource = destroyDuplexSource;
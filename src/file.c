@@ -23,6 +23,82 @@ void marla_FileResponder_free(marla_FileResponder* resp)
     free(resp);
 }
 
+// Keeps a version of a file entry's data while zero-copy sends of it are in
+// flight, so that reloading the entry does not free the pages being sent.
+struct marla_FilePin {
+marla_Server* server;
+unsigned char* data;
+int shared;
+int refs;
+int retired;
+};
+
+static void freePinnedData(struct marla_FilePin* pin)
+{
+    if(pin->data && !pin->shared) {
+        free(pin->data);
+    }
+    free(pin);
+}
+
+static void unpinData(void* data)
+{
+    struct marla_FilePin* pin = data;
+    marla_Server* server = pin->server;
+    pthread_mutex_lock(&server->fileCache_mutex);
+    if(--pin->refs == 0 && pin->retired) {
+        freePinnedData(pin);
+    }
+    pthread_mutex_unlock(&server->fileCache_mutex);
+}
+
+// Releases the entry's data before it is replaced, unless it is pinned, in
+// which case the last zero-copy send to finish frees it. The file cache's
+// lock must be held.
+static void releaseData(marla_FileEntry* fileEntry)
+{
+    struct marla_FilePin* pin = fileEntry->pin;
+    fileEntry->pin = 0;
+    if(pin && pin->refs > 0) {
+        pin->retired = 1;
+    }
+    else {
+        free(pin);
+        if(fileEntry->data && !fileEntry->shared) {
+            free(fileEntry->data);
+        }
+    }
+    fileEntry->data = 0;
+}
+
+// Queues the rest of the entry's data to be sent without copying, if the
+// connection allows it. Returns 0 if the data was queued.
+static int writeZeroCopy(marla_FileResponder* resp, marla_Connection* cxn)
+{
+    marla_FileEntry* fe = resp->entry;
+    marla_Server* server = fe->server;
+    pthread_mutex_lock(&server->fileCache_mutex);
+    if(!fe->pin) {
+        fe->pin = malloc(sizeof *fe->pin);
+        fe->pin->server = server;
+        fe->pin->data = fe->data;
+        fe->pin->shared = fe->shared;
+        fe->pin->refs = 0;
+        fe->pin->retired = 0;
+    }
+    struct marla_FilePin* pin = fe->pin;
+    ++pin->refs;
+    int rv = marla_Connection_writeZeroCopy(cxn, fe->data + resp->pos, fe->length - resp->pos, unpinData, pin);
+    if(rv != 0) {
+        --pin->refs;
+    }
+    else {
+        resp->pos = fe->length;
+    }
+    pthread_mutex_unlock(&server->fileCache_mutex);
+    return rv;
+}
+
 static void invokeServerUpdater(marla_FileEntry* fe)
 {
     if(fe->server->fileUpdated) {
@@ -33,6 +109,7 @@ static void invokeServerUpdater(marla_FileEntry* fe)
 marla_FileEntry* marla_Server_getFile(marla_Server* server, const char* pathname, const char* watchpath)
 {
     // Get the entry.
+    pthread_mutex_lock(&server->fileCache_mutex);
     marla_FileEntry* fe = apr_hash_get(server->fileCache, pathname, APR_HASH_KEY_STRING);
     if(!fe) {
         // Create a file entry.
@@ -45,11 +122,44 @@ marla_FileEntry* marla_Server_getFile(marla_Server* server, const char* pathname
     }
 
     fe->callback = invokeServerUpdater;
+    pthread_mutex_unlock(&server->fileCache_mutex);
 
     // Return the entry.
     return fe;
 }
 
+// Reads the open file's data, from the server's shared file store if it
+// has one with room.
+static void readData(marla_FileEntry* fileEntry, struct stat* sb)
+{
+    fileEntry->length = sb->st_size;
+    fileEntry->data = 0;
+    fileEntry->shared = 0;
+    if(fileEntry->length == 0) {
+        return;
+    }
+    if(fileEntry->server->fileStore) {
+        fileEntry->data = marla_FileStore_load(fileEntry->server->fileStore, fileEntry->fd, sb);
+        if(fileEntry->data) {
+            fileEntry->shared = 1;
+            return;
+        }
+    }
+    fileEntry->data = malloc(sb->st_size + 1);
+    fileEntry->data[sb->st_size] = 0;
+    size_t remaining = sb->st_size;
+    size_t index = 0;
+    while(remaining > 0) {
+        int nread = read(fileEntry->fd, fileEntry->data + index, remaining);
+        if(nread <= 0) {
+            perror("read");
+            abort();
+        }
+        remaining -= nread;
+        index += nread;
+    }
+}
+
 marla_FileEntry* marla_FileEntry_new(marla_Server* server, const char* pathname, const char* watchpath)
 {
     struct stat sb;
@@ -62,6 +172,7 @@ marla_FileEntry* marla_FileEntry_new(marla_Server* server, const char* pathname,
     fileEntry->type = "application/octet-stream";
     fileEntry->callback = 0;
     fileEntry->callbackData = 0;
+    fileEntry->pin = 0;
 
     // Open the file.
     fileEntry->fd = open(pathname, O_RDONLY);
@@ -93,25 +204,7 @@ marla_FileEntry* marla_FileEntry_new(marla_Server* server, const char* pathname,
     }
 
     // Retrieve the data from the file.
-    fileEntry->length = sb.st_size;
-    if(fileEntry->length > 0) {
-        fileEntry->data = malloc(sb.st_size + 1);
-        fileEntry->data[sb.st_size] = 0;
-        size_t remaining = sb.st_size;
-        size_t index = 0;
-        while(remaining > 0) {
-            int nread = read(fileEntry->fd, fileEntry->data + index, remaining);
-            if(nread <= 0) {
-                perror("read");
-                abort();
-            }
-            remaining -= nread;
-            index += nread;
-        }
-    }
-    else {
-        fileEntry->data = 0;
-    }
+    readData(fileEntry, &sb);
 
     // Close the file.
     close(fileEntry->fd);
@@ -193,10 +286,7 @@ void marla_FileEntry_reload(marla_FileEntry* fileEntry)
 {
     struct stat sb;
 
-    if(fileEntry->data) {
-        free(fileEntry->data);
-        fileEntry->data = 0;
-    }
+    releaseData(fileEntry);
 
     // Re-open the file.
     fileEntry->fd = open(fileEntry->pathname, O_RDONLY);
@@ -215,25 +305,7 @@ void marla_FileEntry_reload(marla_FileEntry* fileEntry)
     fileEntry->modtime = sb.st_mtim;
 
     // Retrieve the data from the file.
-    fileEntry->length = sb.st_size;
-    if(fileEntry->length > 0) {
-        fileEntry->data = malloc(sb.st_size + 1);
-        fileEntry->data[sb.st_size] = 0;
-        size_t remaining = sb.st_size;
-        size_t index = 0;
-        while(remaining > 0) {
-            int nread = read(fileEntry->fd, fileEntry->data + index, remaining);
-            if(nread <= 0) {
-                perror("read");
-                abort();
-            }
-            remaining -= nread;
-            index += nread;
-        }
-    }
-    else {
-        fileEntry->data = 0;
-    }
+    readData(fileEntry, &sb);
 
     // Close the file.
     close(fileEntry->fd);
@@ -246,10 +318,7 @@ void marla_FileEntry_reload(marla_FileEntry* fileEntry)
 
 void marla_FileEntry_free(marla_FileEntry* fileEntry)
 {
-    if(fileEntry->data) {
-        free(fileEntry->data);
-        fileEntry->data = 0;
-    }
+    releaseData(fileEntry);
 
     if(fileEntry->wd != -1) {
         // End the file's watch.
@@ -353,8 +422,17 @@ marla_WriteResult marla_writeFileHandlerResponse(marla_Request* req, marla_Write
         resp->handleStage = marla_FileResponderStage_BODY;
     }
 
+    if(resp->handleStage == marla_FileResponderStage_BODY && server->zeroCopyThreshold > 0 && resp->entry->length - resp->pos >= server->zeroCopyThreshold) {
+        if(writeZeroCopy(resp, req->cxn) == 0) {
+            resp->handleStage = marla_FileResponderStage_FLUSHING;
+        }
+    }
+
     while(resp->handleStage == marla_FileResponderStage_BODY) {
+        // The entry may be reloaded by another thread.
+        pthread_mutex_lock(&server->fileCache_mutex);
         int nwritten = marla_Connection_write(req->cxn, resp->entry->data + resp->pos, resp->entry->length - resp->pos);
+        pthread_mutex_unlock(&server->fileCache_mutex);
         if(nwritten <= 0) {
             return marla_WriteResult_DOWNSTREAM_CHOKED;
         }
@@ -364,23 +442,10 @@ marla_WriteResult marla_writeFileHandlerResponse(marla_Request* req, marla_Write
         }
     }
 
-    while(resp->handleStage == marla_FileResponderStage_FLUSHING) {
-        marla_logMessagef(server, "Flushing %d bytes of input data.", marla_Ring_size(req->cxn->output));
-        while(!marla_Ring_isEmpty(req->cxn->output)) {
-            int nflushed;
-            marla_WriteResult wr = marla_Connection_flush(req->cxn, &nflushed);
-            switch(wr) {
-            case marla_WriteResult_CLOSED:
-                return marla_WriteResult_CLOSED;
-            case marla_WriteResult_UPSTREAM_CHOKED:
-                continue;
-            case marla_WriteResult_DOWNSTREAM_CHOKED:
-                marla_logMessage(server, "Choked while flushing client response");
-                return marla_WriteResult_DOWNSTREAM_CHOKED;
-            default:
-                marla_die(server, "Unhandled flush result");
-            }
-        }
+    if(resp->handleStage == marla_FileResponderStage_FLUSHING) {
+        // Leave the response to be flushed with any that follow it.
+        marla_logMessagef(server, "Deferring flush of %d bytes of response data.", marla_Ring_size(req->cxn->output));
+        marla_Connection_markDirty(req->cxn);
         ++resp->handleStage;
     }
 
@@ -0,0 +1,137 @@
+#include "marla.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// A file store is one shared, anonymous mapping made before the server forks
+// its worker processes. It holds the contents of cached files, so each
+// worker's marla_FileEntry points into the same memory instead of keeping its
+// own copy. Contents are appended and never overwritten, so workers read
+// them without locking; a file that changes is appended again, and the space
+// of its old contents is not reused. Loading is serialized by a robust,
+// process-shared mutex, so a worker that dies while loading cannot block the
+// others.
+
+struct marla_FileStoreEntry {
+dev_t dev;
+ino_t ino;
+struct timespec modtime;
+size_t length;
+size_t offset;
+};
+
+struct marla_FileStore {
+pthread_mutex_t mutex;
+size_t size;
+size_t used;
+size_t numEntries;
+struct marla_FileStoreEntry entries[marla_FILESTORE_ENTRIES];
+unsigned char data[];
+};
+
+marla_FileStore* marla_FileStore_new(size_t size)
+{
+    size_t total = sizeof(marla_FileStore) + size;
+    marla_FileStore* store = mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(store == MAP_FAILED) {
+        return 0;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&store->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    store->size = size;
+    store->used = 0;
+    store->numEntries = 0;
+    return store;
+}
+
+void marla_FileStore_free(marla_FileStore* store)
+{
+    munmap(store, sizeof(marla_FileStore) + store->size);
+}
+
+static void lock(marla_FileStore* store)
+{
+    if(pthread_mutex_lock(&store->mutex) == EOWNERDEAD) {
+        // The holder died; any load it left unfinished was never committed.
+        pthread_mutex_consistent(&store->mutex);
+    }
+}
+
+static struct marla_FileStoreEntry* findEntry(marla_FileStore* store, const struct stat* sb)
+{
+    size_t slot = ((size_t)sb->st_ino * 31 + (size_t)sb->st_dev) % marla_FILESTORE_ENTRIES;
+    for(size_t i = 0; i < marla_FILESTORE_ENTRIES; ++i) {
+        struct marla_FileStoreEntry* entry = store->entries + ((slot + i) % marla_FILESTORE_ENTRIES);
+        if(entry->length == 0 || (entry->dev == sb->st_dev && entry->ino == sb->st_ino)) {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+// Returns the contents of the file open at fd, which has the given status,
+// reading it into the store if its current version is not there yet. The
+// contents are followed by a NUL. Returns 0 if the file is empty or the store
+// has no room, in which case the caller should load the file itself.
+unsigned char* marla_FileStore_load(marla_FileStore* store, int fd, const struct stat* sb)
+{
+    if(sb->st_size <= 0) {
+        return 0;
+    }
+    size_t length = sb->st_size;
+    unsigned char* data = 0;
+    lock(store);
+    struct marla_FileStoreEntry* entry = findEntry(store, sb);
+    if(!entry) {
+        pthread_mutex_unlock(&store->mutex);
+        return 0;
+    }
+    if(entry->length == length && entry->modtime.tv_sec == sb->st_mtim.tv_sec && entry->modtime.tv_nsec == sb->st_mtim.tv_nsec) {
+        data = store->data + entry->offset;
+        pthread_mutex_unlock(&store->mutex);
+        return data;
+    }
+
+    // Keep each file's contents aligned for the copies made from them.
+    size_t needed = (length + 1 + 15) & ~(size_t)15;
+    if(store->size - store->used < needed || (entry->length == 0 && store->numEntries >= marla_FILESTORE_ENTRIES - 1)) {
+        pthread_mutex_unlock(&store->mutex);
+        return 0;
+    }
+    data = store->data + store->used;
+    for(size_t index = 0; index < length;) {
+        ssize_t nread = pread(fd, data + index, length - index, index);
+        if(nread <= 0) {
+            if(nread < 0 && errno == EINTR) {
+                continue;
+            }
+            pthread_mutex_unlock(&store->mutex);
+            return 0;
+        }
+        index += nread;
+    }
+    data[length] = 0;
+
+    if(entry->length == 0) {
+        ++store->numEntries;
+    }
+    entry->dev = sb->st_dev;
+    entry->ino = sb->st_ino;
+    entry->modtime = sb->st_mtim;
+    entry->offset = store->used;
+    entry->length = length;
+    store->used += needed;
+    pthread_mutex_unlock(&store->mutex);
+    return data;
+}
+
+size_t marla_FileStore_used(marla_FileStore* store)
+{
+    return store->used;
+}
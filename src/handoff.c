@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include "marla.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+static int fill_address(struct sockaddr_un* addr, const char* path)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof addr->sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Listens on the given Unix socket path for a new process to take over this
+// one's listeners. Any socket left at the path by an earlier process is
+// replaced.
+int marla_Handoff_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    if(fill_address(&addr, path) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        return -1;
+    }
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Accepts the process taking over. The returned socket blocks, but gives up
+// after marla_HANDOFF_TIMEOUT_MS so a stuck peer cannot hang the server.
+int marla_Handoff_accept(int fd)
+{
+    int peer = accept4(fd, 0, 0, SOCK_CLOEXEC);
+    if(peer == -1) {
+        return -1;
+    }
+    struct timeval tv;
+    tv.tv_sec = marla_HANDOFF_TIMEOUT_MS / 1000;
+    tv.tv_usec = (marla_HANDOFF_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    return peer;
+}
+
+int marla_Handoff_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    if(fill_address(&addr, path) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char* buf, size_t len)
+{
+    while(len > 0) {
+        ssize_t nwritten = write(fd, buf, len);
+        if(nwritten <= 0) {
+            if(nwritten < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nwritten;
+        len -= nwritten;
+    }
+    return 0;
+}
+
+// Sends each descriptor with a byte describing its kind, in batches of up
+// to marla_HANDOFF_BATCH. An empty batch marks the end.
+int marla_Handoff_sendFds(int fd, const int* fds, const char* kinds, int count)
+{
+    for(int sent = 0;;) {
+        int n = count - sent;
+        if(n > marla_HANDOFF_BATCH) {
+            n = marla_HANDOFF_BATCH;
+        }
+        char control[CMSG_SPACE(sizeof(int) * marla_HANDOFF_BATCH)];
+        memset(control, 0, sizeof control);
+        char terminator = 0;
+        struct iovec iov;
+        iov.iov_base = n > 0 ? (void*)(kinds + sent) : &terminator;
+        iov.iov_len = n > 0 ? n : 1;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if(n > 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+            memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * n);
+        }
+        if(sendmsg(fd, &msg, MSG_NOSIGNAL) != iov.iov_len) {
+            return -1;
+        }
+        if(n == 0) {
+            return 0;
+        }
+        sent += n;
+    }
+}
+
+// Receives descriptors sent by marla_Handoff_sendFds, up to max of them.
+// Returns the number received, or -1 on error. Descriptors beyond max are
+// closed.
+int marla_Handoff_recvFds(int fd, int* fds, char* kinds, int max)
+{
+    int received = 0;
+    for(;;) {
+        char control[CMSG_SPACE(sizeof(int) * marla_HANDOFF_BATCH)];
+        char batchKinds[marla_HANDOFF_BATCH];
+        struct iovec iov;
+        iov.iov_base = batchKinds;
+        iov.iov_len = sizeof batchKinds;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        ssize_t nread = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if(nread <= 0) {
+            return -1;
+        }
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+            if(msg.msg_flags & MSG_CTRUNC) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            // The end of the descriptors.
+            return received;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* batch = (int*)CMSG_DATA(cmsg);
+        if(msg.msg_flags & MSG_CTRUNC) {
+            // Some of the batch was lost, so none of it can be trusted.
+            for(int i = 0; i < n; ++i) {
+                close(batch[i]);
+            }
+            errno = EMSGSIZE;
+            return -1;
+        }
+        for(int i = 0; i < n; ++i) {
+            if(received < max && i < nread) {
+                fds[received] = batch[i];
+                kinds[received] = batchKinds[i];
+                ++received;
+            }
+            else {
+                close(batch[i]);
+            }
+        }
+    }
+}
+
+struct FileList {
+char* data;
+size_t len;
+size_t cap;
+int failed;
+};
+
+static int appendFileEntry(void* rec, const void* key, apr_ssize_t klen, const void* value)
+{
+    struct FileList* list = rec;
+    const marla_FileEntry* fe = value;
+    size_t needed = strlen(fe->pathname) + strlen(fe->watchpath) + 3;
+    while(list->len + needed >= list->cap) {
+        char* data = realloc(list->data, list->cap << 1);
+        if(!data) {
+            list->failed = 1;
+            return 0;
+        }
+        list->data = data;
+        list->cap <<= 1;
+    }
+    list->len += sprintf(list->data + list->len, "%s\t%s\n", fe->pathname, fe->watchpath);
+    return 1;
+}
+
+// Sends the path of each cached file, so the new process can load them
+// before it takes over the listeners.
+int marla_Handoff_sendFileList(marla_Server* server, int fd)
+{
+    struct FileList list;
+    list.cap = 4096;
+    list.len = 0;
+    list.failed = 0;
+    list.data = malloc(list.cap);
+    if(!list.data) {
+        return -1;
+    }
+    pthread_mutex_lock(&server->fileCache_mutex);
+    apr_hash_do(appendFileEntry, &list, server->fileCache);
+    pthread_mutex_unlock(&server->fileCache_mutex);
+    if(list.failed) {
+        free(list.data);
+        errno = ENOMEM;
+        return -1;
+    }
+    list.data[list.len++] = '\n';
+    int rv = write_all(fd, list.data, list.len);
+    free(list.data);
+    return rv;
+}
+
+// Reads the list sent by marla_Handoff_sendFileList, up to its empty line.
+// The whole list is read before any file is loaded, so the old process is
+// not left waiting to write while files are read from disk. Returns the
+// list, to be freed by the caller, or 0 on error.
+static char* readFileList(int fd)
+{
+    size_t cap = 4096;
+    size_t len = 0;
+    char* list = malloc(cap);
+    if(!list) {
+        return 0;
+    }
+    for(;;) {
+        if(len == cap - 1) {
+            char* grown = realloc(list, cap << 1);
+            if(!grown) {
+                free(list);
+                return 0;
+            }
+            list = grown;
+            cap <<= 1;
+        }
+        ssize_t nread = read(fd, list + len, cap - 1 - len);
+        if(nread <= 0) {
+            if(nread < 0 && errno == EINTR) {
+                continue;
+            }
+            free(list);
+            return 0;
+        }
+        len += nread;
+        // The old process sends nothing more until this one is ready.
+        if(list[len - 1] == '\n' && (len == 1 || list[len - 2] == '\n')) {
+            list[len] = 0;
+            return list;
+        }
+    }
+}
+
+// Loads each file named by marla_Handoff_sendFileList into the server's
+// file cache. Returns the number of files loaded, or -1 on error.
+int marla_Handoff_warmFileCache(marla_Server* server, int fd)
+{
+    char* list = readFileList(fd);
+    if(!list) {
+        return -1;
+    }
+    int loaded = 0;
+    for(char* line = list; *line != '\n';) {
+        char* end = strchr(line, '\n');
+        *end = 0;
+        char* watchpath = strchr(line, '\t');
+        if(watchpath) {
+            *watchpath++ = 0;
+            // Skip files removed since the old process cached them.
+            if(access(line, R_OK) == 0 && access(watchpath, F_OK) == 0) {
+                marla_Server_getFile(server, line, watchpath);
+                ++loaded;
+            }
+        }
+        line = end + 1;
+    }
+    free(list);
+    return loaded;
+}
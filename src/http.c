@@ -1,4 +1,12 @@
 #include "marla.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 const char* marla_getDefaultStatusLine(int statusCode)
 {
@@ -114,3 +122,327 @@ const char* marla_getDefaultStatusLine(int statusCode)
     }
     return statusLine;
 }
+
+// Sets a bit in nameStops for each byte that cannot be part of a field name,
+// and in valueStops for each byte that cannot be part of a field value. The
+// colon, CR, and LF stop names; values stop only at controls other than tab,
+// so at CR and LF but not at the colon.
+static void classifyBlock(const unsigned char* data, size_t len, uint64_t* nameStops, uint64_t* valueStops)
+{
+    uint64_t names = 0;
+    uint64_t values = 0;
+    size_t i = 0;
+    if(len == 64) {
+        // Bytes from 0x80 compare as negative, so they count as controls.
+#ifdef __AVX2__
+        for(; i < 64; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(data + i));
+            __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+            __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+            __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), x));
+            __m256i tab = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'));
+            __m256i name = _mm256_or_si256(_mm256_or_si256(alpha, digit), _mm256_or_si256(tab, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-'))));
+            __m256i ctl = _mm256_or_si256(_mm256_andnot_si256(tab, _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), x)), _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7f)));
+            names |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(name) << i;
+            values |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ctl) << i;
+        }
+#elif defined(__SSE2__)
+        for(; i < 64; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+            __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+            __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+            __m128i tab = _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'));
+            __m128i name = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_or_si128(tab, _mm_cmpeq_epi8(x, _mm_set1_epi8('-'))));
+            __m128i ctl = _mm_or_si128(_mm_andnot_si128(tab, _mm_cmplt_epi8(x, _mm_set1_epi8(0x20))), _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+            names |= (uint64_t)(~_mm_movemask_epi8(name) & 0xffff) << i;
+            values |= (uint64_t)_mm_movemask_epi8(ctl) << i;
+        }
+#endif
+    }
+    for(; i < len; ++i) {
+        unsigned char c = data[i];
+        unsigned char lower = c | 0x20;
+        if(!((c >= '0' && c <= '9') || (lower >= 'a' && lower <= 'z') || c == '-' || c == '\t')) {
+            names |= (uint64_t)1 << i;
+        }
+        if((c < 0x20 && c != '\t') || c >= 0x7f) {
+            values |= (uint64_t)1 << i;
+        }
+    }
+    *nameStops = names;
+    *valueStops = values;
+}
+
+// Scans a block of header lines in one pass, validating each field's name and
+// value and finding its colon and line ending, until the empty line ending
+// the block, an invalid line, or the end of the data. A line without a colon
+// has its colon at its end, and a field without a value has its value at its
+// end. Lines may end in CRLF or LF, and must end within maxLine bytes.
+//
+// The scan's next offset is where the following scan should start: after the
+// empty line once the block is done, or at the first line not yet complete or
+// found to be invalid.
+void marla_scanHeaders(marla_HeaderScan* scan, const unsigned char* data, size_t len, size_t maxLine)
+{
+    scan->numLines = 0;
+    scan->errorAt = 0;
+    size_t lineStart = 0;
+    size_t colon = 0;
+    int inValue = 0;
+    size_t pos = 0;
+    for(size_t block = 0; block < len; block += 64) {
+        uint64_t nameStops;
+        uint64_t valueStops;
+        classifyBlock(data + block, len - block < 64 ? len - block : 64, &nameStops, &valueStops);
+        while(pos < block + 64) {
+            uint64_t stops = inValue ? valueStops : nameStops;
+            if(pos > block) {
+                stops &= ~(uint64_t)0 << (pos - block);
+            }
+            if(!stops) {
+                break;
+            }
+            size_t at = block + __builtin_ctzll(stops);
+            unsigned char c = data[at];
+            if(at - lineStart >= maxLine) {
+                scan->status = marla_HEADERS_TOO_LONG;
+                scan->errorAt = at;
+                scan->next = lineStart;
+                return;
+            }
+            if(!inValue && c == ':' && at > lineStart) {
+                colon = at;
+                inValue = 1;
+                pos = at + 1;
+                continue;
+            }
+            if(c != '\r' && c != '\n') {
+                scan->status = inValue ? marla_HEADERS_BAD_VALUE : marla_HEADERS_BAD_NAME;
+                scan->errorAt = at;
+                scan->next = lineStart;
+                return;
+            }
+
+            size_t next = at + 1;
+            if(c == '\r') {
+                if(next >= len) {
+                    break;
+                }
+                if(data[next] != '\n') {
+                    scan->status = marla_HEADERS_BAD_EOL;
+                    scan->errorAt = at;
+                    scan->next = lineStart;
+                    return;
+                }
+                if(next - lineStart >= maxLine) {
+                    scan->status = marla_HEADERS_TOO_LONG;
+                    scan->errorAt = next;
+                    scan->next = lineStart;
+                    return;
+                }
+                ++next;
+            }
+            if(at == lineStart) {
+                scan->status = marla_HEADERS_DONE;
+                scan->next = next;
+                return;
+            }
+
+            marla_HeaderLine* line = scan->lines + scan->numLines++;
+            line->start = lineStart;
+            line->colon = inValue ? colon : at;
+            line->value = line->colon;
+            if(inValue) {
+                for(++line->value; line->value < at && data[line->value] == ' '; ++line->value);
+            }
+            line->end = at;
+            line->next = next;
+            lineStart = next;
+            pos = next;
+            inValue = 0;
+            if(scan->numLines == marla_HEADER_SCAN_LINES) {
+                scan->status = marla_HEADERS_FULL;
+                scan->next = next;
+                return;
+            }
+        }
+    }
+    if(len - lineStart >= maxLine) {
+        scan->status = marla_HEADERS_TOO_LONG;
+        scan->errorAt = lineStart + maxLine;
+    }
+    else {
+        scan->status = marla_HEADERS_PARTIAL;
+    }
+    scan->next = lineStart;
+}
+
+// Known methods and field names are found by a switch on their length and
+// their first and last bytes, so each lookup ends in one comparison. Two
+// names that shared a key would fail to compile.
+#define marla_TOKEN_KEY(len, first, last) (((len) << 16) | ((first) << 8) | (last))
+
+static const char* const methodNames[marla_METHOD_MAX] = {
+    [marla_METHOD_UNKNOWN] = "",
+    [marla_METHOD_GET] = "GET",
+    [marla_METHOD_HEAD] = "HEAD",
+    [marla_METHOD_POST] = "POST",
+    [marla_METHOD_PUT] = "PUT",
+    [marla_METHOD_DELETE] = "DELETE",
+    [marla_METHOD_CONNECT] = "CONNECT",
+    [marla_METHOD_OPTIONS] = "OPTIONS",
+    [marla_METHOD_TRACE] = "TRACE"
+};
+
+const char* marla_nameMethod(enum marla_Method method)
+{
+    if(method <= marla_METHOD_UNKNOWN || method >= marla_METHOD_MAX) {
+        return "";
+    }
+    return methodNames[method];
+}
+
+// Returns the method with the given name, which is case-sensitive, or
+// marla_METHOD_UNKNOWN.
+enum marla_Method marla_lookupMethod(const char* method, size_t len)
+{
+    if(len == 0) {
+        return marla_METHOD_UNKNOWN;
+    }
+    enum marla_Method found;
+    switch(marla_TOKEN_KEY(len, (unsigned char)method[0], (unsigned char)method[len - 1])) {
+    case marla_TOKEN_KEY(3, 'G', 'T'): found = marla_METHOD_GET; break;
+    case marla_TOKEN_KEY(4, 'H', 'D'): found = marla_METHOD_HEAD; break;
+    case marla_TOKEN_KEY(4, 'P', 'T'): found = marla_METHOD_POST; break;
+    case marla_TOKEN_KEY(3, 'P', 'T'): found = marla_METHOD_PUT; break;
+    case marla_TOKEN_KEY(6, 'D', 'E'): found = marla_METHOD_DELETE; break;
+    case marla_TOKEN_KEY(7, 'C', 'T'): found = marla_METHOD_CONNECT; break;
+    case marla_TOKEN_KEY(7, 'O', 'S'): found = marla_METHOD_OPTIONS; break;
+    case marla_TOKEN_KEY(5, 'T', 'E'): found = marla_METHOD_TRACE; break;
+    default:
+        return marla_METHOD_UNKNOWN;
+    }
+    return memcmp(method, methodNames[found], len) ? marla_METHOD_UNKNOWN : found;
+}
+
+static const char* const fieldNames[marla_FIELD_MAX] = {
+    [marla_FIELD_UNKNOWN] = "",
+    [marla_FIELD_ACCEPT] = "Accept",
+    [marla_FIELD_ACCEPT_CHARSET] = "Accept-Charset",
+    [marla_FIELD_ACCEPT_ENCODING] = "Accept-Encoding",
+    [marla_FIELD_ACCEPT_LANGUAGE] = "Accept-Language",
+    [marla_FIELD_AUTHORIZATION] = "Authorization",
+    [marla_FIELD_CACHE_CONTROL] = "Cache-Control",
+    [marla_FIELD_CONNECTION] = "Connection",
+    [marla_FIELD_CONTENT_ENCODING] = "Content-Encoding",
+    [marla_FIELD_CONTENT_LENGTH] = "Content-Length",
+    [marla_FIELD_CONTENT_TYPE] = "Content-Type",
+    [marla_FIELD_COOKIE] = "Cookie",
+    [marla_FIELD_DATE] = "Date",
+    [marla_FIELD_ETAG] = "ETag",
+    [marla_FIELD_EXPECT] = "Expect",
+    [marla_FIELD_HOST] = "Host",
+    [marla_FIELD_IF_MATCH] = "If-Match",
+    [marla_FIELD_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [marla_FIELD_IF_NONE_MATCH] = "If-None-Match",
+    [marla_FIELD_IF_RANGE] = "If-Range",
+    [marla_FIELD_IF_UNMODIFIED_SINCE] = "If-Unmodified-Since",
+    [marla_FIELD_LAST_MODIFIED] = "Last-Modified",
+    [marla_FIELD_LOCATION] = "Location",
+    [marla_FIELD_ORIGIN] = "Origin",
+    [marla_FIELD_RANGE] = "Range",
+    [marla_FIELD_REFERER] = "Referer",
+    [marla_FIELD_SEC_WEBSOCKET_KEY] = "Sec-WebSocket-Key",
+    [marla_FIELD_SEC_WEBSOCKET_VERSION] = "Sec-WebSocket-Version",
+    [marla_FIELD_SET_COOKIE] = "Set-Cookie",
+    [marla_FIELD_TE] = "TE",
+    [marla_FIELD_TRAILER] = "Trailer",
+    [marla_FIELD_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [marla_FIELD_UPGRADE] = "Upgrade",
+    [marla_FIELD_USER_AGENT] = "User-Agent"
+};
+
+const char* marla_nameField(enum marla_Field field)
+{
+    if(field <= marla_FIELD_UNKNOWN || field >= marla_FIELD_MAX) {
+        return "";
+    }
+    return fieldNames[field];
+}
+
+// Compares a field name against a known one, ignoring the case of letters,
+// a word at a time. Known names hold only letters and hyphens, so their
+// letters are the bytes with 0x40 set, and only those bytes may differ in
+// their 0x20 bit. Any other byte must match exactly, so CR never matches a
+// hyphen.
+static int matchesField(const char* name, const char* known, size_t len)
+{
+    const uint64_t letters = 0x4040404040404040ULL;
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t a;
+        uint64_t b;
+        memcpy(&a, name + i, 8);
+        memcpy(&b, known + i, 8);
+        if((a ^ b) & ~((b & letters) >> 1)) {
+            return 0;
+        }
+    }
+    for(; i < len; ++i) {
+        unsigned char a = name[i];
+        unsigned char b = known[i];
+        if((a ^ b) & ~((b & 0x40) >> 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns the field with the given name, ignoring case, or
+// marla_FIELD_UNKNOWN.
+enum marla_Field marla_lookupField(const char* name, size_t len)
+{
+    if(len == 0) {
+        return marla_FIELD_UNKNOWN;
+    }
+    enum marla_Field found;
+    switch(marla_TOKEN_KEY(len, (unsigned char)(name[0] | 0x20), (unsigned char)(name[len - 1] | 0x20))) {
+    case marla_TOKEN_KEY(6, 'a', 't'): found = marla_FIELD_ACCEPT; break;
+    case marla_TOKEN_KEY(14, 'a', 't'): found = marla_FIELD_ACCEPT_CHARSET; break;
+    case marla_TOKEN_KEY(15, 'a', 'g'): found = marla_FIELD_ACCEPT_ENCODING; break;
+    case marla_TOKEN_KEY(15, 'a', 'e'): found = marla_FIELD_ACCEPT_LANGUAGE; break;
+    case marla_TOKEN_KEY(13, 'a', 'n'): found = marla_FIELD_AUTHORIZATION; break;
+    case marla_TOKEN_KEY(13, 'c', 'l'): found = marla_FIELD_CACHE_CONTROL; break;
+    case marla_TOKEN_KEY(10, 'c', 'n'): found = marla_FIELD_CONNECTION; break;
+    case marla_TOKEN_KEY(16, 'c', 'g'): found = marla_FIELD_CONTENT_ENCODING; break;
+    case marla_TOKEN_KEY(14, 'c', 'h'): found = marla_FIELD_CONTENT_LENGTH; break;
+    case marla_TOKEN_KEY(12, 'c', 'e'): found = marla_FIELD_CONTENT_TYPE; break;
+    case marla_TOKEN_KEY(6, 'c', 'e'): found = marla_FIELD_COOKIE; break;
+    case marla_TOKEN_KEY(4, 'd', 'e'): found = marla_FIELD_DATE; break;
+    case marla_TOKEN_KEY(4, 'e', 'g'): found = marla_FIELD_ETAG; break;
+    case marla_TOKEN_KEY(6, 'e', 't'): found = marla_FIELD_EXPECT; break;
+    case marla_TOKEN_KEY(4, 'h', 't'): found = marla_FIELD_HOST; break;
+    case marla_TOKEN_KEY(8, 'i', 'h'): found = marla_FIELD_IF_MATCH; break;
+    case marla_TOKEN_KEY(17, 'i', 'e'): found = marla_FIELD_IF_MODIFIED_SINCE; break;
+    case marla_TOKEN_KEY(13, 'i', 'h'): found = marla_FIELD_IF_NONE_MATCH; break;
+    case marla_TOKEN_KEY(8, 'i', 'e'): found = marla_FIELD_IF_RANGE; break;
+    case marla_TOKEN_KEY(19, 'i', 'e'): found = marla_FIELD_IF_UNMODIFIED_SINCE; break;
+    case marla_TOKEN_KEY(13, 'l', 'd'): found = marla_FIELD_LAST_MODIFIED; break;
+    case marla_TOKEN_KEY(8, 'l', 'n'): found = marla_FIELD_LOCATION; break;
+    case marla_TOKEN_KEY(6, 'o', 'n'): found = marla_FIELD_ORIGIN; break;
+    case marla_TOKEN_KEY(5, 'r', 'e'): found = marla_FIELD_RANGE; break;
+    case marla_TOKEN_KEY(7, 'r', 'r'): found = marla_FIELD_REFERER; break;
+    case marla_TOKEN_KEY(17, 's', 'y'): found = marla_FIELD_SEC_WEBSOCKET_KEY; break;
+    case marla_TOKEN_KEY(21, 's', 'n'): found = marla_FIELD_SEC_WEBSOCKET_VERSION; break;
+    case marla_TOKEN_KEY(10, 's', 'e'): found = marla_FIELD_SET_COOKIE; break;
+    case marla_TOKEN_KEY(2, 't', 'e'): found = marla_FIELD_TE; break;
+    case marla_TOKEN_KEY(7, 't', 'r'): found = marla_FIELD_TRAILER; break;
+    case marla_TOKEN_KEY(17, 't', 'g'): found = marla_FIELD_TRANSFER_ENCODING; break;
+    case marla_TOKEN_KEY(7, 'u', 'e'): found = marla_FIELD_UPGRADE; break;
+    case marla_TOKEN_KEY(10, 'u', 't'): found = marla_FIELD_USER_AGENT; break;
+    default:
+        return marla_FIELD_UNKNOWN;
+    }
+    return matchesField(name, fieldNames[found], len) ? found : marla_FIELD_UNKNOWN;
+}
@@ -1,188 +1,172 @@
 #include "marla.h"
-#include <time.h>
-#include <errno.h>
 
-static void idle_tick(marla_Server* server)
+// Services a connection from its timer, as the idle thread once did for
+// every connection each second. Returns 1 if the connection was destroyed.
+static int idle_connection(marla_Server* server, marla_Connection* cxn)
 {
-    for(marla_Connection* cxn = server->first_connection; cxn;) {
-        if(server->server_status == marla_SERVER_DESTROYING) {
-            break;
+    if(cxn->stage == marla_CLIENT_ACCEPTED) {
+        if(marla_clientAccept(cxn) != 0) {
+            return 0;
         }
+    }
 
-        struct timespec currentProcessTime;
-        clock_gettime(CLOCK_MONOTONIC, &currentProcessTime);
-
-        if(currentProcessTime.tv_sec - cxn->lastProcessTime.tv_sec < 0) {
-            // Skip recently processed connections
-            cxn = cxn->next_connection;
-            continue;
-        }
-        cxn->lastProcessTime.tv_sec = currentProcessTime.tv_sec;
-        cxn->lastProcessTime.tv_nsec = currentProcessTime.tv_nsec;
-        //fprintf(stderr, "Idling %s connection %d\n", cxn->is_backend ? "backend" : "client", cxn->id);
-
-        if(cxn->stage == marla_CLIENT_ACCEPTED) {
-            if(marla_clientAccept(cxn) != 0) {
-                cxn = cxn->next_connection;
+    if(cxn->stage == marla_CLIENT_SECURED) {
+        // Process connections
+        for(int loop = 1; loop && cxn->stage != marla_CLIENT_COMPLETE;) {
+            marla_WriteResult wr = marla_clientRead(cxn);
+            size_t refilled = 0;
+            switch(wr) {
+            case marla_WriteResult_CONTINUE:
                 continue;
-            }
-        }
-
-        if(cxn->stage == marla_CLIENT_SECURED) {
-            // Process connections
-            for(int loop = 1; loop && cxn->stage != marla_CLIENT_COMPLETE;) {
-                marla_WriteResult wr = marla_clientRead(cxn);
-                size_t refilled = 0;
-                switch(wr) {
-                case marla_WriteResult_CONTINUE:
-                    continue;
-                case marla_WriteResult_UPSTREAM_CHOKED:
-                    marla_Connection_refill(cxn, &refilled);
-                    if(refilled <= 0) {
+            case marla_WriteResult_UPSTREAM_CHOKED:
+                marla_Connection_refill(cxn, &refilled);
+                if(refilled <= 0) {
+                    loop = 0;
+                }
+                continue;
+            case marla_WriteResult_DOWNSTREAM_CHOKED:
+                if(cxn->stage != marla_CLIENT_COMPLETE && marla_Connection_hasOutput(cxn)) {
+                    int nflushed;
+                    marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
+                    switch(wr) {
+                    case marla_WriteResult_UPSTREAM_CHOKED:
+                        continue;
+                    case marla_WriteResult_DOWNSTREAM_CHOKED:
+                        //fprintf(stderr, "Responder choked.\n");
                         loop = 0;
-                    }
-                    continue;
-                case marla_WriteResult_DOWNSTREAM_CHOKED:
-                    if(cxn->stage != marla_CLIENT_COMPLETE && marla_Ring_size(cxn->output) > 0) {
-                        int nflushed;
-                        marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
-                        switch(wr) {
-                        case marla_WriteResult_UPSTREAM_CHOKED:
-                            continue;
-                        case marla_WriteResult_DOWNSTREAM_CHOKED:
-                            //fprintf(stderr, "Responder choked.\n");
-                            loop = 0;
-                            continue;
-                        case marla_WriteResult_CLOSED:
-                            cxn->stage = marla_CLIENT_COMPLETE;
-                            loop = 0;
-                            continue;
-                        default:
-                            marla_die(cxn->server, "Unhandled flush result");
-                        }
-                    }
-                    else {
+                        continue;
+                    case marla_WriteResult_CLOSED:
+                        cxn->stage = marla_CLIENT_COMPLETE;
                         loop = 0;
+                        continue;
+                    default:
+                        marla_die(cxn->server, "Unhandled flush result");
                     }
-                    continue;
-                default:
-                    //fprintf(stderr, "Connection %d's read returned %s\n", cxn->id, marla_nameWriteResult(wr));
+                }
+                else {
                     loop = 0;
-                    continue;
                 }
+                continue;
+            default:
+                //fprintf(stderr, "Connection %d's read returned %s\n", cxn->id, marla_nameWriteResult(wr));
+                loop = 0;
+                continue;
             }
-            for(int loop = 1; loop && cxn->stage != marla_CLIENT_COMPLETE;) {
-                marla_WriteResult wr = marla_clientWrite(cxn);
-                size_t refilled = 0;
-                switch(wr) {
-                case marla_WriteResult_CONTINUE:
-                    continue;
-                case marla_WriteResult_UPSTREAM_CHOKED:
-                    marla_Connection_refill(cxn, &refilled);
-                    if(refilled <= 0) {
+        }
+        for(int loop = 1; loop && cxn->stage != marla_CLIENT_COMPLETE;) {
+            marla_WriteResult wr = marla_clientWrite(cxn);
+            size_t refilled = 0;
+            switch(wr) {
+            case marla_WriteResult_CONTINUE:
+                continue;
+            case marla_WriteResult_UPSTREAM_CHOKED:
+                marla_Connection_refill(cxn, &refilled);
+                if(refilled <= 0) {
+                    loop = 0;
+                }
+                continue;
+            case marla_WriteResult_DOWNSTREAM_CHOKED:
+                if(cxn->stage != marla_CLIENT_COMPLETE && marla_Connection_hasOutput(cxn)) {
+                    int nflushed;
+                    marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
+                    switch(wr) {
+                    case marla_WriteResult_DOWNSTREAM_CHOKED:
+                        //fprintf(stderr, "Responder choked.\n");
                         loop = 0;
-                    }
-                    continue;
-                case marla_WriteResult_DOWNSTREAM_CHOKED:
-                    if(cxn->stage != marla_CLIENT_COMPLETE && marla_Ring_size(cxn->output) > 0) {
-                        int nflushed;
-                        marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
-                        switch(wr) {
-                        case marla_WriteResult_DOWNSTREAM_CHOKED:
-                            //fprintf(stderr, "Responder choked.\n");
-                            loop = 0;
-                            continue;
-                        case marla_WriteResult_UPSTREAM_CHOKED:
-                            continue;
-                        case marla_WriteResult_CLOSED:
-                            cxn->stage = marla_CLIENT_COMPLETE;
-                            loop = 0;
-                            continue;
-                        default:
-                            marla_die(cxn->server, "Unexpected flush result");
-                        }
-                    }
-                    else {
+                        continue;
+                    case marla_WriteResult_UPSTREAM_CHOKED:
+                        continue;
+                    case marla_WriteResult_CLOSED:
+                        cxn->stage = marla_CLIENT_COMPLETE;
                         loop = 0;
+                        continue;
+                    default:
+                        marla_die(cxn->server, "Unexpected flush result");
                     }
-                    continue;
-                default:
-                    //fprintf(stderr, "Connection %d's write returned %s\n", cxn->id, marla_nameWriteResult(wr));
+                }
+                else {
                     loop = 0;
-                    continue;
                 }
+                continue;
+            default:
+                //fprintf(stderr, "Connection %d's write returned %s\n", cxn->id, marla_nameWriteResult(wr));
+                loop = 0;
+                continue;
             }
         }
+    }
 
-        if(cxn->stage == marla_CLIENT_COMPLETE && !cxn->shouldDestroy) {
-            // Client needs shutdown.
-            if(!cxn->shutdownSource || 1 == cxn->shutdownSource(cxn)) {
-                cxn->shouldDestroy = 1;
-            }
-        }
+    if(cxn->stage == marla_CLIENT_SECURED || cxn->stage == marla_BACKEND_READY) {
+        // Return unused buffer space from connections that have gone idle.
+        marla_Connection_shrink(cxn);
+    }
 
-        if(cxn->shouldDestroy) {
-            marla_Connection* next = cxn->next_connection;
-            marla_logMessage(server, "Destroying connection.");
-            if(cxn->is_backend) {
-                marla_Backend_recover(cxn);
-            }
-            marla_Connection_destroy(cxn);
-            if(next) {
-                cxn = next;
-            }
-            else {
-                cxn = server->first_connection;
-            }
+    if(cxn->stage == marla_CLIENT_COMPLETE && !cxn->shouldDestroy) {
+        // Client needs shutdown.
+        if(!cxn->shutdownSource || 1 == cxn->shutdownSource(cxn)) {
+            cxn->shouldDestroy = 1;
         }
-        else {
-            cxn = cxn->next_connection;
+    }
+
+    if(cxn->shouldDestroy) {
+        marla_logMessage(server, "Destroying connection.");
+        if(cxn->is_backend) {
+            marla_Backend_recover(cxn);
         }
+        marla_Connection_destroy(cxn);
+        return 1;
     }
+    return 0;
 }
 
-void* idle_operator(void* data)
+// Runs when a connection's timer expires. Connections that have not sent
+// their request's headers in time, or that have sat idle past the
+// keep-alive timeout, are closed. Connections with requests in process are
+// serviced each marla_IDLE_INTERVAL_MS; idle ones sleep until their
+// keep-alive timeout.
+void marla_Connection_idle(marla_Timer* timer, void* data)
 {
-    struct marla_Server* server = (struct marla_Server*)data;
+    marla_Connection* cxn = data;
+    marla_Server* server = cxn->server;
+    if(server->server_status == marla_SERVER_DESTROYING) {
+        return;
+    }
+    marla_TimerWheel* timers = marla_Connection_timers(cxn);
+    long now = timers->now;
+    long idle = (now - cxn->lastActivity) * marla_TIMER_TICK_MS;
 
-    for(;;) {
-        struct timespec req;
-        req.tv_sec = 1;
-        req.tv_nsec = 0;
-        switch(pthread_mutex_timedlock(&server->server_mutex, &req)) {
-        case 0:
-            //fprintf(stderr, "Running idler tick\n");
-            server->idleTimeouts = 0;
-            idle_tick(server);
-            if(0 != pthread_mutex_unlock(&server->server_mutex)) {
-                perror("unlock");
-                abort();
+    if(!cxn->is_backend && cxn->stage != marla_CLIENT_COMPLETE) {
+        marla_Request* req = cxn->latest_request;
+        if(cxn->stage == marla_CLIENT_ACCEPTED || (req && req->readStage < marla_CLIENT_REQUEST_AWAITING_CONTINUE_WRITE)) {
+            if(cxn->headerStart < 0) {
+                cxn->headerStart = now;
+            }
+            else if((now - cxn->headerStart) * marla_TIMER_TICK_MS >= server->headerTimeout) {
+                marla_logMessagef(server, "Connection %d timed out reading request headers.", cxn->id);
+                cxn->stage = marla_CLIENT_COMPLETE;
+                cxn->shouldDestroy = 1;
             }
-            break;
-        case ETIMEDOUT:
-            ++server->idleTimeouts;
-            //fprintf(stderr, "Timeout %d for idler\n", server->idleTimeouts);
-            //if(server->idleTimeouts > 30) {
-                //marla_die(server, "Server timed out.");
-            //}
-            break;
-        default:
-            server->idleTimeouts = 0;
-            server->server_status = marla_SERVER_DESTROYING;
-            break;
         }
-        if(server->server_status == marla_SERVER_DESTROYING) {
-            break;
+        else {
+            cxn->headerStart = -1;
         }
-        struct timespec rem;
-        for(int rv = nanosleep(&req, &rem); rv == -1; rv = nanosleep(&rem, &rem)) {
-            if(errno == EINTR) {
-                continue;
-            }
-            perror("nanosleep");
-            abort();
+        if(cxn->requests_in_process == 0 && idle >= server->keepAliveTimeout) {
+            marla_logMessagef(server, "Connection %d timed out while idle.", cxn->id);
+            cxn->stage = marla_CLIENT_COMPLETE;
         }
     }
 
-    return 0;
+    if(idle_connection(server, cxn)) {
+        return;
+    }
+
+    long next = marla_IDLE_INTERVAL_MS;
+    if(!cxn->is_backend && cxn->stage == marla_CLIENT_SECURED && cxn->requests_in_process == 0) {
+        // Nothing to service until the peer sends something.
+        next = server->keepAliveTimeout - idle;
+        if(next < marla_IDLE_INTERVAL_MS) {
+            next = marla_IDLE_INTERVAL_MS;
+        }
+    }
+    marla_TimerWheel_schedule(timers, timer, next);
 }
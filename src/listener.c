@@ -0,0 +1,263 @@
+#include "marla.h"
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// A listener is described by a spec: a port, a host:port, an [IPv6]:port, or
+// unix:/path, followed by any of these comma-separated options:
+//
+//   defer=seconds      TCP_DEFER_ACCEPT, so a connection is not accepted
+//                      until it has sent data.
+//   fastopen=queue     TCP Fast Open, so a request can arrive with the SYN.
+//   backlog=count      The listen backlog. Defaults to SOMAXCONN.
+
+// Parses the given spec. Returns 0 if it is invalid.
+marla_Listener* marla_Listener_new(const char* spec)
+{
+    marla_Listener* listener = calloc(1, sizeof *listener);
+    if(!listener) {
+        return 0;
+    }
+    listener->fd = -1;
+    listener->backlog = SOMAXCONN;
+
+    char buf[512];
+    if(strlen(spec) >= sizeof buf) {
+        free(listener);
+        return 0;
+    }
+    strcpy(buf, spec);
+    char* options = strchr(buf, ',');
+    if(options) {
+        *options++ = 0;
+    }
+    if(!buf[0] || strlen(buf) >= sizeof listener->address) {
+        free(listener);
+        return 0;
+    }
+    strcpy(listener->address, buf);
+
+    if(!strncmp(buf, "unix:", 5)) {
+        listener->is_unix = 1;
+        if(!buf[5] || strlen(buf + 5) >= sizeof listener->path) {
+            free(listener);
+            return 0;
+        }
+        strcpy(listener->path, buf + 5);
+    }
+    else {
+        char* port = buf;
+        char* sep = strrchr(buf, ':');
+        if(buf[0] == '[') {
+            // An IPv6 address, as in [::1]:8080.
+            char* end = strchr(buf, ']');
+            if(!end || end[1] != ':') {
+                free(listener);
+                return 0;
+            }
+            *end = 0;
+            strcpy(listener->host, buf + 1);
+            listener->is_ipv6 = 1;
+            port = end + 2;
+        }
+        else if(sep) {
+            *sep = 0;
+            strcpy(listener->host, buf);
+            port = sep + 1;
+        }
+        if(!*port || strlen(port) >= sizeof listener->port) {
+            free(listener);
+            return 0;
+        }
+        strcpy(listener->port, port);
+    }
+
+    for(char* option = options; option && *option;) {
+        char* next = strchr(option, ',');
+        if(next) {
+            *next++ = 0;
+        }
+        char* value = strchr(option, '=');
+        long n = value ? atol(value + 1) : -1;
+        if(!value || n < 0) {
+            free(listener);
+            return 0;
+        }
+        *value = 0;
+        if(!strcmp(option, "defer") && !listener->is_unix) {
+            listener->deferAccept = n;
+        }
+        else if(!strcmp(option, "fastopen") && !listener->is_unix) {
+            listener->fastOpen = n;
+        }
+        else if(!strcmp(option, "backlog") && n > 0) {
+            listener->backlog = n;
+        }
+        else {
+            free(listener);
+            return 0;
+        }
+        option = next;
+    }
+    return listener;
+}
+
+// Frees the listener, closing its socket. A Unix socket's path is removed
+// unless the socket was handed off.
+void marla_Listener_free(marla_Listener* listener)
+{
+    if(listener->fd >= 0) {
+        close(listener->fd);
+        if(listener->is_unix) {
+            unlink(listener->path);
+        }
+    }
+    free(listener);
+}
+
+// Sets the listener's options on the given socket and listens on it. Used for
+// new sockets and for sockets taken over from another process.
+int marla_Listener_configure(const marla_Listener* listener, int fd)
+{
+    if(!listener->is_unix) {
+        if(listener->deferAccept > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &listener->deferAccept, sizeof listener->deferAccept) != 0) {
+            return -1;
+        }
+        if(listener->fastOpen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &listener->fastOpen, sizeof listener->fastOpen) != 0) {
+            return -1;
+        }
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    return listen(fd, listener->backlog);
+}
+
+static int bindUnix(const marla_Listener* listener)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, listener->path);
+
+    // Replace a socket left behind by a process that did not exit cleanly.
+    struct stat sb;
+    if(lstat(listener->path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+        unlink(listener->path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+        fprintf(stderr, "Could not bind to %s: %s (errno=%d)\n", listener->path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int resolve(const marla_Listener* listener, struct addrinfo** result)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = listener->is_ipv6 ? AF_INET6 : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int s = getaddrinfo(listener->host[0] ? listener->host : 0, listener->port, &hints, result);
+    if(s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        return -1;
+    }
+    return 0;
+}
+
+// Creates a socket listening on the first of the listener's addresses that
+// can be bound. An [IPv6] listener accepts only IPv6 connections, so an IPv4
+// listener can share its port. With reuseport, several sockets may listen on
+// the same port. Returns -1 on error.
+int marla_Listener_bind(const marla_Listener* listener, int reuseport)
+{
+    int fd = -1;
+    if(listener->is_unix) {
+        fd = bindUnix(listener);
+    }
+    else {
+        struct addrinfo* result;
+        if(resolve(listener, &result) != 0) {
+            return -1;
+        }
+        struct addrinfo* rp;
+        for(rp = result; rp; rp = rp->ai_next) {
+            fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+            if(fd == -1) {
+                continue;
+            }
+
+            int enable = 1;
+            if(reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable) != 0) {
+                fprintf(stderr, "Could not set SO_REUSEPORT: %s (errno=%d)\n", strerror(errno), errno);
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            if(listener->is_ipv6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof enable) != 0) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            if(bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+                break;
+            }
+            fprintf(stderr, "Could not bind: %s (errno=%d)\n", strerror(errno), errno);
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        if(!rp) {
+            fprintf(stderr, "Could not bind on any sockets for %s.\n", listener->address);
+            return -1;
+        }
+    }
+    if(fd >= 0 && marla_Listener_configure(listener, fd) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s (errno=%d)\n", listener->address, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns whether the given socket is bound to one of the listener's
+// addresses, so a socket taken over from another process can be matched to
+// the listener it belongs to.
+int marla_Listener_matches(const marla_Listener* listener, int fd)
+{
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof bound;
+    if(getsockname(fd, (struct sockaddr*)&bound, &boundLen) != 0) {
+        return 0;
+    }
+    if(listener->is_unix) {
+        struct sockaddr_un* local = (struct sockaddr_un*)&bound;
+        return bound.ss_family == AF_UNIX && !strcmp(local->sun_path, listener->path);
+    }
+    struct addrinfo* result;
+    if(resolve(listener, &result) != 0) {
+        return 0;
+    }
+    int matches = 0;
+    for(struct addrinfo* rp = result; rp && !matches; rp = rp->ai_next) {
+        matches = rp->ai_addrlen == boundLen && !memcmp(rp->ai_addr, &bound, boundLen);
+    }
+    freeaddrinfo(result);
+    return matches;
+}
@@ -46,7 +46,9 @@ void marla_logAction(marla_Server* server, const char* scope, const char* catego
         //write(2, buf, nwritten);
         return;
     }
+    pthread_mutex_lock(&server->log_mutex);
     int true_written = marla_Ring_write(server->log, buf, nwritten);
+    pthread_mutex_unlock(&server->log_mutex);
     if(true_written != nwritten) {
         fprintf(stderr, "Logging overflow\n");
         abort();
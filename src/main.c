@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "marla.h"
 #include <stdio.h>
 #include <signal.h>
@@ -17,69 +18,46 @@
 #include <dlfcn.h>
 #include <apr_dso.h>
 #include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
 #include <apr_file_info.h>
 
 #define MAXEVENTS 64
+#define MAXWAIT 1000
+#define MAXHANDOFF 1024
 
 static int use_curses = 1;
 static int use_ssl = 1;
+static int num_threads = 1;
+static int num_processes = 1;
+static int num_task_threads = 0;
+static pid_t* worker_pids = 0;
+static size_t file_store_size = marla_FILESTORE_SIZE;
+static int use_affinity = 0;
+static int use_incoming_cpu = 0;
+static cpu_set_t allowed_cpus;
+static int use_uring = 0;
+static int accept_pending = 0;
+static int listeners_pending = 0;
+static marla_Listener* main_listener = 0;
+static marla_Uring uring;
+static const char* handoff_path = 0;
+static const char* takeover_path = 0;
+static int handoff_idle = 0;
+static int handoff_fd = -1;
+static int handoff_peer = -1;
+static int handoff_pending = 0;
+static volatile int draining = 0;
+static long drain_timeout = marla_DRAIN_TIMEOUT_MS;
+static int takeover_fds[MAXHANDOFF];
+static char takeover_kinds[MAXHANDOFF];
+static int num_takeover_fds = 0;
+static SSL_CTX* ctx = 0;
 static char ssl_certificate_path[1024];
 static char ssl_key_path[1024];
 
-static int create_and_bind(const char *given_port)
-{
-    struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int s, sfd;
-
-    memset(&hints, 0, sizeof (struct addrinfo));
-    hints.ai_family = AF_UNSPEC;     /* Return IPv4 and IPv6 choices */
-    hints.ai_socktype = SOCK_STREAM; /* We want a TCP socket */
-    hints.ai_flags = AI_PASSIVE;     /* All interfaces */
-
-    char portbuf[512];
-    strcpy(portbuf, given_port);
-    const char* hostname = 0;
-    const char* port = portbuf;
-    char* sep = index(portbuf, ':');
-    if(sep) {
-        *sep = 0;
-        hostname = portbuf;
-        port = sep + 1;
-    }
-
-    s = getaddrinfo (hostname, port, &hints, &result);
-    if(s != 0) {
-        fprintf (stderr, "getaddrinfo: %s\n", gai_strerror (s));
-        return -1;
-    }
-
-    for(rp = result; rp != NULL; rp = rp->ai_next) {
-        sfd = socket (rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if(sfd == -1) {
-            continue;
-        }
-
-        s = bind(sfd, rp->ai_addr, rp->ai_addrlen);
-        if(s == 0) {
-            /* We managed to bind successfully! */
-            break;
-        }
-        else {
-            fprintf(stderr, "Could not bind: %s (errno=%d)\n", strerror(errno), errno);
-        }
-
-        close(sfd);
-    }
-
-    if(rp == NULL) {
-        fprintf(stderr, "Could not bind on any sockets.");
-        return -1;
-    }
-    freeaddrinfo (result);
-    return sfd;
-}
-
 static void init_openssl()
 {
     SSL_load_error_strings();	
@@ -133,7 +111,6 @@ void on_sigusr1()
 
 static int exit_value = EXIT_SUCCESS;
 extern void* terminal_operator(void* data);
-extern void* idle_operator(void* data);
 
 struct marla_Server server;
 
@@ -155,6 +132,21 @@ void marla_processConnection(marla_Connection* cxn)
 static void process_connection(struct epoll_event ep)
 {
     //marla_logMessagef(&server, "%d", ep.events);
+    if((ep.events & EPOLLERR) && ((marla_Connection*)ep.data.ptr)->first_zeroCopy) {
+        marla_Connection* cxn = (marla_Connection*)ep.data.ptr;
+        if(marla_Connection_completeZeroCopy(cxn) > 0) {
+            // The error was the kernel's notice of completed sends.
+            ep.events &= ~EPOLLERR;
+            if(!(ep.events & (EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLRDHUP))) {
+                if(!marla_Connection_hasOutput(cxn) && cxn->stage != marla_CLIENT_COMPLETE) {
+                    return;
+                }
+                // Sends or the shutdown may have been waiting for these
+                // completions.
+                ep.events = EPOLLOUT;
+            }
+        }
+    }
     if((ep.events & EPOLLERR) || (ep.events & EPOLLHUP) || (ep.events & EPOLLRDHUP) || (!(ep.events & EPOLLIN) && !(ep.events & EPOLLOUT))) {
         marla_Connection* cxn = (marla_Connection*)ep.data.ptr;
         // An error has occured on this fd, or the socket is not ready for reading (why were we notified then?)
@@ -193,6 +185,19 @@ static void process_connection(struct epoll_event ep)
     }
     marla_Connection* cxn = (marla_Connection*)ep.data.ptr;
     fprintf(stderr, "Received epoll for %s connection %d\n", cxn->is_backend ? "backend" : "client", cxn->id);
+    marla_Connection_touch(cxn);
+    marla_Connection_unmarkReady(cxn);
+
+    // Note the buffers' positions, to tell afterwards whether this pass made progress.
+    marla_Ring* input = cxn->input;
+    marla_Ring* output = cxn->output;
+    unsigned int inputRead = input->read_index;
+    unsigned int outputRead = output->read_index;
+    unsigned int outputWrite = output->write_index;
+
+    // Bytes moved through the source during this pass.
+    size_t spent = 0;
+    int exhausted = 0;
     {
         char buf[marla_BUFSIZE];
         memset(buf, 0, sizeof buf);
@@ -241,16 +246,28 @@ static void process_connection(struct epoll_event ep)
                     continue;
                 case marla_WriteResult_UPSTREAM_CHOKED:
                     marla_Connection_refill(cxn, &refilled);
+                    spent += refilled;
                     if(refilled <= 0) {
                         loop = 0;
                     }
+                    else if(server.processBudget > 0 && spent >= server.processBudget) {
+                        exhausted = 1;
+                        loop = 0;
+                    }
                     continue;
                 case marla_WriteResult_DOWNSTREAM_CHOKED:
-                    if(cxn->stage != marla_CLIENT_COMPLETE && marla_Ring_size(cxn->output) > 0) {
+                    if(cxn->stage != marla_CLIENT_COMPLETE && marla_Connection_hasOutput(cxn)) {
                         int nflushed;
                         marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
+                        if(nflushed > 0) {
+                            spent += nflushed;
+                        }
                         switch(wr) {
                         case marla_WriteResult_UPSTREAM_CHOKED:
+                            if(server.processBudget > 0 && spent >= server.processBudget) {
+                                exhausted = 1;
+                                loop = 0;
+                            }
                             continue;
                         case marla_WriteResult_DOWNSTREAM_CHOKED:
                             //fprintf(stderr, "Responder choked.\n");
@@ -286,16 +303,28 @@ static void process_connection(struct epoll_event ep)
                     continue;
                 case marla_WriteResult_UPSTREAM_CHOKED:
                     marla_Connection_refill(cxn, &refilled);
+                    spent += refilled;
                     if(refilled <= 0) {
                         loop = 0;
                     }
+                    else if(server.processBudget > 0 && spent >= server.processBudget) {
+                        exhausted = 1;
+                        loop = 0;
+                    }
                     continue;
                 case marla_WriteResult_DOWNSTREAM_CHOKED:
-                    while(loop && cxn->stage != marla_CLIENT_COMPLETE && marla_Ring_size(cxn->output) > 0) {
+                    while(loop && cxn->stage != marla_CLIENT_COMPLETE && marla_Connection_hasOutput(cxn)) {
                         int nflushed;
                         marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
+                        if(nflushed > 0) {
+                            spent += nflushed;
+                        }
                         switch(wr) {
                         case marla_WriteResult_UPSTREAM_CHOKED:
+                            if(server.processBudget > 0 && spent >= server.processBudget) {
+                                exhausted = 1;
+                                loop = 0;
+                            }
                             continue;
                         case marla_WriteResult_DOWNSTREAM_CHOKED:
                             //fprintf(stderr, "Responder choked.\n");
@@ -323,7 +352,7 @@ static void process_connection(struct epoll_event ep)
             marla_logMessage(&server, "Connection will be destroyed.");
         }
 
-        while(cxn->stage != marla_CLIENT_COMPLETE && !cxn->shouldDestroy && marla_Ring_size(cxn->output) > 0) {
+        while(cxn->stage != marla_CLIENT_COMPLETE && !cxn->shouldDestroy && marla_Connection_hasOutput(cxn)) {
             int nflushed;
             marla_WriteResult wr = marla_Connection_flush(cxn, &nflushed);
             switch(wr) {
@@ -359,6 +388,18 @@ static void process_connection(struct epoll_event ep)
         marla_logLeave(&server, "Destroying connection.");
     }
     else {
+        int progressed = input != cxn->input || output != cxn->output ||
+            inputRead != input->read_index ||
+            outputRead != output->read_index ||
+            outputWrite != output->write_index;
+        if(exhausted) {
+            // Let other connections run before this one continues.
+            marla_Connection_exhaustBudget(cxn);
+        }
+        else if(progressed && marla_Connection_hasPendingWork(cxn)) {
+            // Come back to this connection before waiting on the socket again.
+            marla_Connection_markReady(cxn);
+        }
         char buf[marla_BUFSIZE];
         memset(buf, 0, sizeof buf);
         cxn->describeSource(cxn, buf, sizeof buf);
@@ -366,184 +407,1386 @@ static void process_connection(struct epoll_event ep)
     }
 }
 
-int main(int argc, const char**argv)
+// Processes the connections that were left with buffered work, and flushes
+// those that were written to. Connections marked ready during this pass wait
+// for the next one, so sockets are polled in between.
+static void process_ready(marla_Connection** first, int* numReady)
+{
+    for(int count = *numReady; count > 0 && *first; --count) {
+        marla_Connection* cxn = *first;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.data.ptr = cxn;
+        event.events = cxn->readyEvents;
+        marla_Connection_unmarkReady(cxn);
+        process_connection(event);
+    }
+}
+
+// Returns whether a busy-polling event loop should poll again without
+// blocking. The loop keeps spinning until server.busyPoll microseconds have
+// passed since it last saw an event.
+static int keep_spinning(struct timespec* lastEvent, int numEvents)
+{
+    if(server.busyPoll <= 0) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(numEvents > 0) {
+        *lastEvent = now;
+        return 1;
+    }
+    long elapsed = (now.tv_sec - lastEvent->tv_sec) * 1000000L + (now.tv_nsec - lastEvent->tv_nsec) / 1000;
+    return elapsed < server.busyPoll;
+}
+
+// Returns how long an event loop may wait before its next timer is due.
+// Loops wake at least every MAXWAIT milliseconds to notice timers added by
+// other threads and the server being destroyed.
+static int loop_timeout(marla_TimerWheel* timers)
+{
+    int timeout = marla_TimerWheel_nextTimeout(timers);
+    if(timeout < 0 || timeout > MAXWAIT) {
+        return MAXWAIT;
+    }
+    return timeout;
+}
+
+static void add_connection(int infd, int efd, struct sockaddr* addr, socklen_t addrLen, int secure)
 {
-    atexit(handle_exit);
     int s;
-    struct epoll_event *events = 0;
+    marla_Connection* cxn = marla_Connection_new(&server);
+    if(!cxn) {
+        perror("Unable to create connection");
+        close(infd);
+        return;
+    }
+    if(addrLen > 0) {
+        memcpy(&cxn->peerAddress, addr, addrLen);
+        cxn->peerAddressLen = addrLen;
+    }
+    if(secure) {
+        s = marla_SSL_init(cxn, ctx, infd);
+        if(s <= 0) {
+            perror("Unable to initialize SSL connection");
+            marla_Connection_destroy(cxn);
+            close(infd);
+            return;
+        }
+    }
+    else if(use_uring) {
+        // Reads and writes are completed by the ring, not epoll.
+        marla_uring_init(cxn, &uring, infd);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.data.ptr = cxn;
+        event.events = EPOLLIN | EPOLLOUT;
+        process_connection(event);
+        return;
+    }
+    else {
+        marla_cleartext_init(cxn, infd);
+    }
+    if(server.busyPoll > 0 && marla_Connection_setBusyPoll(cxn, server.busyPoll) != 0) {
+        // Workers accept on their own threads, so only the first to fail warns.
+        static atomic_int warned = 0;
+        if(!atomic_exchange(&warned, 1)) {
+            marla_logMessagef(&server, "Could not enable busy polling on accepted sockets: %s", strerror(errno));
+        }
+    }
 
-    const size_t MIN_ARGS = 4;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.ptr = cxn;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    s = epoll_ctl(efd, EPOLL_CTL_ADD, infd, &event);
+    if(s == -1) {
+        perror ("epoll_ctl");
+        marla_Connection_destroy(cxn);
+        close(infd);
+        return;
+    }
 
-    apr_initialize();
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    process_connection(event);
+}
 
-    marla_Server_init(&server);
+// Accepts up to the server's accept budget of new connections. Returns 1 if
+// the budget was used up, in which case connections may still be waiting.
+static int accept_connections(int sfd, int efd)
+{
+    for(int accepted = 0; server.acceptBudget <= 0 || accepted < server.acceptBudget; ++accepted) {
+        struct sockaddr_storage in_addr;
+        socklen_t in_len = sizeof in_addr;
+        int infd = accept4(sfd, (struct sockaddr*)&in_addr, &in_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(infd == -1) {
+            if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Error accepting connection");
+            return 0;
+        }
 
-    if(0 != pthread_mutex_lock(&server.server_mutex)) {
-        fprintf(stderr, "Failed to acquire server mutex");
-        exit(EXIT_FAILURE);
+        marla_logMessagecf(&server, "Server socket connections", "Accepted connection on descriptor %d", infd);
+        add_connection(infd, efd, (struct sockaddr*)&in_addr, in_len, use_ssl);
     }
+    return 1;
+}
 
-    marla_logEnterc(&server, "Server initializations", "Initializing server");
+// Accepts from each -listen listener with connections waiting. Returns 1 if
+// any used up its accept budget.
+static int accept_listeners()
+{
+    int pending = 0;
+    for(marla_Listener* listener = server.first_listener; listener; listener = listener->next_listener) {
+        if(listener->acceptPending && listener->fd >= 0) {
+            listener->acceptPending = accept_connections(listener->fd, server.efd);
+            pending = pending || listener->acceptPending;
+        }
+    }
+    return pending;
+}
 
-    // Validate command-line.
-    if(argc < MIN_ARGS) {
-        fprintf(stderr, "Usage: %s [port] [backend-port] [logging-port] modulepath?modulefunc modulepath?modulefunc\n", argv[0]);
-        exit(EXIT_FAILURE);
+static marla_Listener* find_listener(int fd)
+{
+    for(marla_Listener* listener = server.first_listener; listener; listener = listener->next_listener) {
+        if(listener->fd == fd) {
+            return listener;
+        }
     }
+    return 0;
+}
 
-    // Do not die from SIGPIPE.
-    signal(SIGUSR1, on_sigusr1);
-    signal(SIGINT, on_sigint);
-    signal(SIGPIPE, SIG_IGN);
+static void close_listener(marla_Listener* listener)
+{
+    epoll_ctl(server.efd, EPOLL_CTL_DEL, listener->fd, 0);
+    close(listener->fd);
+    listener->fd = -1;
+    listener->acceptPending = 0;
+}
 
-    server.server_status = marla_SERVER_STARTED;
+static void open_handoff()
+{
+    handoff_fd = marla_Handoff_listen(handoff_path);
+    if(handoff_fd == -1) {
+        fprintf(stderr, "Could not listen for handoff on %s: %s\n", handoff_path, strerror(errno));
+        return;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.fd = handoff_fd;
+    event.events = EPOLLIN | EPOLLET;
+    if(epoll_ctl(server.efd, EPOLL_CTL_ADD, handoff_fd, &event) == -1) {
+        perror("Adding handoff socket to epoll queue");
+        close(handoff_fd);
+        handoff_fd = -1;
+        return;
+    }
+    marla_logMessagef(&server, "Listening for handoff on %s", handoff_path);
+}
 
-    // Create epoll queue.
-    server.efd = epoll_create1(0);
-    if(server.efd == -1) {
-        perror("Creating main epoll queue for server");
-        marla_logLeave(&server, "Failed to create epoll queue.");
-        exit(EXIT_FAILURE);
+static void close_handoff_peer()
+{
+    epoll_ctl(server.efd, EPOLL_CTL_DEL, handoff_peer, 0);
+    close(handoff_peer);
+    handoff_peer = -1;
+}
+
+// Accepts a new process that is taking over, and sends it the cached files
+// to load while this process keeps serving. The new process reads the whole
+// list before loading any file, so the write only waits on the copy.
+static void accept_handoff()
+{
+    int peer = marla_Handoff_accept(handoff_fd);
+    if(peer == -1) {
+        return;
+    }
+    epoll_ctl(server.efd, EPOLL_CTL_DEL, handoff_fd, 0);
+    close(handoff_fd);
+    handoff_fd = -1;
+    handoff_peer = peer;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.fd = handoff_peer;
+    event.events = EPOLLIN;
+    if(marla_Handoff_sendFileList(&server, handoff_peer) != 0 || epoll_ctl(server.efd, EPOLL_CTL_ADD, handoff_peer, &event) == -1) {
+        marla_logMessagef(&server, "Handoff failed: %s", strerror(errno));
+        close(handoff_peer);
+        handoff_peer = -1;
+        open_handoff();
+        return;
     }
+    marla_logMessage(&server, "New process is taking over.");
+}
 
-    // Create the file cache's inotify instance.
-    server.fileCacheifd = inotify_init1(O_NONBLOCK);
-    {
-        // Add the inotifiy instance to epoll.
-        struct epoll_event ev;
-        ev.data.fd = server.fileCacheifd;
-        ev.events = EPOLLIN | EPOLLET;
-        if(0 != epoll_ctl(server.efd, EPOLL_CTL_ADD, server.fileCacheifd, &ev)) {
-            perror("epoll_ctl");
-            marla_logLeave(&server, "Failed to create inotify queue for file cache.");
-            exit(EXIT_FAILURE);
+// Returns whether a connection has nothing in progress, so it can be closed
+// or handed off without losing a request.
+static int is_idle(marla_Connection* cxn)
+{
+    return !cxn->is_backend && cxn->requests_in_process == 0 && marla_Ring_isEmpty(cxn->input) && !marla_Connection_hasOutput(cxn) && !cxn->first_zeroCopy;
+}
+
+// Closes client connections that have sat idle for a moment, so one that
+// was just accepted gets the chance to send its request. Returns the number
+// of client connections left.
+static int drain_connections(marla_Connection* cxn, marla_TimerWheel* timers)
+{
+    int remaining = 0;
+    while(cxn) {
+        marla_Connection* next = cxn->next_connection;
+        if(is_idle(cxn) && (timers->now - cxn->lastActivity) * marla_TIMER_TICK_MS >= marla_IDLE_INTERVAL_MS) {
+            marla_Connection_destroy(cxn);
+        }
+        else if(!cxn->is_backend) {
+            ++remaining;
         }
+        cxn = next;
     }
+    return remaining;
+}
 
-    // Create the logging socket
-    server.logfd = create_and_connect("localhost", argv[3]);
-    if(server.logfd != -1) {
-        strcpy(server.logaddress, argv[3]);
-        marla_logMessagef(&server, "Server is logging on port %s", server.logaddress);
-        s = make_socket_non_blocking(server.logfd);
-        if(s == -1) {
-            exit_value = EXIT_FAILURE;
-            marla_logLeave(&server, "Failed to make logging server non-blocking.");
-            goto destroy;
+static int workers_drained()
+{
+    int remaining = 0;
+    for(int i = 0; i < server.numWorkers; ++i) {
+        marla_Worker* worker = server.workers + i;
+        marla_Worker_enter(worker);
+        for(marla_Connection* cxn = worker->first_connection; cxn; cxn = cxn->next_connection) {
+            if(!cxn->is_backend) {
+                ++remaining;
+            }
         }
+        marla_Worker_leave(worker);
+    }
+    return remaining == 0;
+}
 
-        struct epoll_event event;
-        memset(&event, 0, sizeof(struct epoll_event));
-        event.data.fd = server.logfd;
-        event.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
-        s = epoll_ctl(server.efd, EPOLL_CTL_ADD, server.logfd, &event);
-        if(s == -1) {
-            perror("Adding logging file descriptor to epoll queue");
-            exit_value = EXIT_FAILURE;
-            marla_logLeave(&server, "Failed to add logging server to epoll queue.");
-            goto destroy;
-        }
+static void drain_timed_out(marla_Timer* timer, void* data)
+{
+    marla_logMessage(&server, "Connections did not drain in time. Destroying server.");
+    server.server_status = marla_SERVER_DESTROYING;
+}
+
+// Sends the listeners, and this thread's idle cleartext connections if
+// -handoffidle was given, to the process taking over. This process then
+// stops accepting and exits once its connections have drained.
+static void hand_off()
+{
+    handoff_pending = 0;
+    char ready;
+    if(read(handoff_peer, &ready, 1) != 1 || ready != 'R') {
+        marla_logMessage(&server, "New process gave up taking over.");
+        close_handoff_peer();
+        open_handoff();
+        return;
     }
 
-    // Create the server socket
-    server.sfd = create_and_bind(argv[1]);
-    if(server.sfd == -1) {
-        perror("Creating main server socket for server");
-        marla_logLeave(&server, "Failed to create server socket.");
-        exit(EXIT_FAILURE);
+    int fds[MAXHANDOFF];
+    char kinds[MAXHANDOFF];
+    int n = 0;
+    if(server.sfd > 0) {
+        fds[n] = server.sfd;
+        kinds[n++] = 'L';
     }
-    strcpy(server.serverport, argv[1]);
-    marla_logMessagef(&server, "Server is using port %s", server.serverport);
-    s = make_socket_non_blocking(server.sfd);
-    if(s == -1) {
-        exit_value = EXIT_FAILURE;
-        marla_logLeave(&server, "Failed to make server socket non-blocking.");
-        goto destroy;
+    for(int i = 0; i < server.numWorkers; ++i) {
+        marla_Worker* worker = server.workers + i;
+        marla_Worker_enter(worker);
+        if(worker->sfd >= 0 && n < MAXHANDOFF) {
+            fds[n] = worker->sfd;
+            kinds[n++] = 'L';
+        }
+        marla_Worker_leave(worker);
     }
-    s = listen(server.sfd, SOMAXCONN);
-    if(s == -1) {
-        perror ("listen");
-        exit_value = EXIT_FAILURE;
-        marla_logLeave(&server, "Failed to listen to server socket.");
-        goto destroy;
+    for(marla_Listener* listener = server.first_listener; listener && n < MAXHANDOFF; listener = listener->next_listener) {
+        if(listener->fd >= 0) {
+            fds[n] = listener->fd;
+            kinds[n++] = 'A';
+        }
     }
-    else {
-        struct epoll_event event;
-        memset(&event, 0, sizeof(struct epoll_event));
-        event.data.fd = server.sfd;
-        event.events = EPOLLIN | EPOLLET;
-        s = epoll_ctl (server.efd, EPOLL_CTL_ADD, server.sfd, &event);
-        if(s == -1) {
-            perror("Adding server file descriptor to epoll queue");
-            exit_value = EXIT_FAILURE;
-            marla_logLeave(&server, "Failed to add server socket to epoll queue.");
-            goto destroy;
+    int numListeners = n;
+
+    // Connections owned by workers may have events waiting in their threads,
+    // so only this thread's connections are handed off.
+    for(marla_Connection* cxn = server.first_connection; handoff_idle && cxn && n < MAXHANDOFF;) {
+        marla_Connection* next = cxn->next_connection;
+        if(is_idle(cxn) && cxn->stage != marla_CLIENT_COMPLETE) {
+            int fd = marla_cleartext_release(cxn);
+            if(fd >= 0) {
+                epoll_ctl(server.efd, EPOLL_CTL_DEL, fd, 0);
+                marla_Connection_destroy(cxn);
+                fds[n] = fd;
+                kinds[n++] = 'C';
+            }
         }
+        cxn = next;
     }
 
-    // Create the backend socket
-    strcpy(server.backendport, argv[2]);
-
-    strcpy(ssl_key_path, "key.pem");
-    strcpy(ssl_certificate_path, "certificate.pem");
+    int rv = marla_Handoff_sendFds(handoff_peer, fds, kinds, n);
+    close_handoff_peer();
+    for(int i = numListeners; i < n; ++i) {
+        close(fds[i]);
+    }
+    if(rv != 0) {
+        marla_logMessagef(&server, "Failed to hand off listeners: %s", strerror(errno));
+        open_handoff();
+        return;
+    }
 
-    uid_t uid = geteuid();
-    if(uid != 0) {
-        char dbPathBuf[PATH_MAX];
-        char* homeDir = getenv("HOME");
-        strcpy(dbPathBuf, homeDir);
-        ssize_t len = strlen(dbPathBuf);
-        char c = dbPathBuf[len - 1];
-        if(c != '\\') {
-            // HOME is not terminated with a /.
-            strcat(dbPathBuf, "/var/parsegraph/users.sqlite");
+    // Stop accepting; the listeners now belong to the new process.
+    if(server.sfd > 0) {
+        if(use_uring) {
+            marla_Uring_cancelAccept(&uring);
         }
         else {
-            // HOME is terminated with a /.
-            strcat(dbPathBuf, "var/parsegraph/users.sqlite");
+            epoll_ctl(server.efd, EPOLL_CTL_DEL, server.sfd, 0);
         }
-        strcpy(server.db_path, dbPathBuf);
+        close(server.sfd);
+        server.sfd = -1;
+        accept_pending = 0;
     }
-    else {
-        strcpy(server.db_path, "/var/parsegraph/users.sqlite");
+    for(marla_Listener* listener = server.first_listener; listener; listener = listener->next_listener) {
+        if(listener->fd >= 0) {
+            close_listener(listener);
+        }
     }
-    strcpy(server.documentRoot, getenv("PWD"));
-    strcpy(server.dataRoot, getenv("PWD"));
+    listeners_pending = 0;
+    draining = 1;
+    marla_Server_addTimer(&server, drain_timeout, drain_timed_out, 0);
+    marla_logMessagef(&server, "Handed off %d listeners and %d connections. Draining.", numListeners, n - numListeners);
+}
 
-    if(argc > MIN_ARGS) {
-        for(int n = MIN_ARGS; n < argc; ++n) {
-            const char* arg = argv[n];
-            if(!strcmp(arg, "-nocurses")) {
-                use_curses = 0;
-                continue;
-            }
-            if(!strcmp(arg, "-nossl")) {
-                use_ssl = 0;
-                continue;
-            }
-            if(!strcmp(arg, "-ssl")) {
-                use_ssl = 1;
-                continue;
-            }
-            if(!strcmp(arg, "-curses")) {
-                use_curses = 1;
-                continue;
-            }
-            if(n < argc - 1) {
-                if(!strcmp(arg, "-key")) {
-                    strncpy(ssl_key_path, argv[n+1], sizeof ssl_key_path);
-                    ++n;
-                    continue;
-                }
-                if(!strcmp(arg, "-cert")) {
-                    strncpy(ssl_certificate_path, argv[n+1], sizeof ssl_certificate_path);
-                    ++n;
-                    continue;
-                }
-                if(!strcmp(arg, "-db")) {
-                    strncpy(server.db_path, argv[n+1], sizeof server.db_path);
-                    ++n;
-                    continue;
+// Ends the pass of the main thread's event loop.
+static void finish_pass()
+{
+    if(handoff_pending) {
+        hand_off();
+    }
+    if(draining && drain_connections(server.first_connection, &server.timers) == 0 && workers_drained()) {
+        marla_logMessage(&server, "Connections drained. Destroying server.");
+        server.server_status = marla_SERVER_DESTROYING;
+    }
+}
+
+// Takes over the listeners of the process listening for handoff on the
+// given path, after loading the files it has cached.
+static int take_over()
+{
+    int fd = marla_Handoff_connect(takeover_path);
+    if(fd == -1) {
+        fprintf(stderr, "Could not connect to %s to take over: %s\n", takeover_path, strerror(errno));
+        return -1;
+    }
+    int loaded = marla_Handoff_warmFileCache(&server, fd);
+    if(loaded < 0 || write(fd, "R", 1) != 1) {
+        fprintf(stderr, "Failed to take over from %s: %s\n", takeover_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    num_takeover_fds = marla_Handoff_recvFds(fd, takeover_fds, takeover_kinds, MAXHANDOFF);
+    close(fd);
+    if(num_takeover_fds < 0) {
+        fprintf(stderr, "Failed to receive listeners from %s: %s\n", takeover_path, strerror(errno));
+        return -1;
+    }
+    marla_logMessagef(&server, "Loaded %d cached files, and took over %d descriptors.", loaded, num_takeover_fds);
+    return 0;
+}
+
+// Removes and returns the next taken-over descriptor of the given kind, or
+// -1 if there are none left.
+static int next_takeover_fd(char kind)
+{
+    for(int i = 0; i < num_takeover_fds; ++i) {
+        if(takeover_kinds[i] == kind) {
+            int fd = takeover_fds[i];
+            takeover_kinds[i] = 0;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Returns the listener handed over for the given listener, or -1.
+static int take_listener(marla_Listener* listener)
+{
+    for(int i = 0; i < num_takeover_fds; ++i) {
+        if(takeover_kinds[i] == 'A' && marla_Listener_matches(listener, takeover_fds[i])) {
+            takeover_kinds[i] = 0;
+            return takeover_fds[i];
+        }
+    }
+    return -1;
+}
+
+// Opens the -listen listeners, which are served by the main thread's event
+// loop alongside the server socket.
+static int open_listeners()
+{
+    for(marla_Listener* listener = server.first_listener; listener; listener = listener->next_listener) {
+        listener->fd = take_listener(listener);
+        if(listener->fd >= 0 && marla_Listener_configure(listener, listener->fd) != 0) {
+            close(listener->fd);
+            listener->fd = -1;
+        }
+        if(listener->fd == -1) {
+            listener->fd = marla_Listener_bind(listener, 0);
+        }
+        if(listener->fd == -1) {
+            return -1;
+        }
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.data.fd = listener->fd;
+        event.events = EPOLLIN | EPOLLET;
+        if(epoll_ctl(server.efd, EPOLL_CTL_ADD, listener->fd, &event) == -1) {
+            perror("Adding listener to epoll queue");
+            return -1;
+        }
+        marla_logMessagef(&server, "Server is also listening on %s", listener->address);
+    }
+    return 0;
+}
+
+// Serves the connections that were handed over.
+static void adopt_connections()
+{
+    int next = 0;
+    for(int fd; (fd = next_takeover_fd('C')) >= 0;) {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof addr;
+        if(getpeername(fd, (struct sockaddr*)&addr, &addrLen) != 0) {
+            addrLen = 0;
+        }
+        if(server.numWorkers > 0) {
+            marla_Worker* worker = server.workers + (next++ % server.numWorkers);
+            marla_Worker_enter(worker);
+            add_connection(fd, worker->efd, (struct sockaddr*)&addr, addrLen, 0);
+            marla_Worker_leave(worker);
+        }
+        else {
+            add_connection(fd, server.efd, (struct sockaddr*)&addr, addrLen, 0);
+        }
+    }
+    for(int fd; (fd = next_takeover_fd('L')) >= 0;) {
+        // More listeners than this process has threads.
+        close(fd);
+    }
+    for(int fd; (fd = next_takeover_fd('A')) >= 0;) {
+        // Listeners this process was not given.
+        close(fd);
+    }
+}
+
+// Processes events from the server's epoll queue. Returns nonzero if the
+// server should be destroyed.
+static int process_events(struct epoll_event* events, int n)
+{
+    for(int i = 0; i < n; i++) {
+        // Process one epoll event.
+        if(handoff_fd >= 0 && events[i].data.fd == handoff_fd) {
+            accept_handoff();
+            continue;
+        }
+        if(handoff_peer >= 0 && events[i].data.fd == handoff_peer) {
+            // Hand off once this pass's connections have been processed.
+            handoff_pending = 1;
+            continue;
+        }
+        if(events[i].data.fd == server.completions.fd) {
+            marla_TaskCompletions_finish(&server.completions);
+            continue;
+        }
+        if(events[i].data.fd == server.fileCacheifd) {
+            // epoll event is from the file cache inotify descriptor.
+            char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+            struct inotify_event* ev = 0;
+            char* filepath = 0;
+            pthread_mutex_lock(&server.fileCache_mutex);
+            for(int loop = 1; loop;) {
+                // Attempt to read the next event.
+                ev = (struct inotify_event*)buf;
+                ssize_t nread = read(server.fileCacheifd, buf, sizeof buf);
+                if(nread < 0) {
+                    // Done reading events.
+                    loop = 0;
+                    continue;
+                }
+
+                if(ev->len > 0) {
+                    // Read the filepath.
+                    filepath = buf + sizeof(struct inotify_event);
+                    fprintf(stderr, "INOTIFY %ld on %s!!!!\n", nread, filepath);
+                }
+                else {
+                    filepath = 0;
+                    fprintf(stderr, "INOTIFY %ld!!!!\n", nread);
+                }
+
+                // Process one event.
+                const char* pathname = apr_hash_get(server.wdToPathname, &ev->wd, sizeof(ev->wd));
+                if(!pathname) {
+                    fprintf(stderr, "Failed to find pathanem for given watch descriptor %d\n", ev->wd);
+                    abort();
+                }
+
+                char* pathbuf = NULL;
+                if(filepath) {
+                    apr_filepath_merge(&pathbuf, pathname, filepath, APR_FILEPATH_TRUENAME | APR_FILEPATH_NOTABOVEROOT, server.pool);
+                }
+                else {
+                    pathbuf = (char*)pathname;
+                }
+
+                marla_FileEntry* fe = apr_hash_get(server.fileCache, pathbuf, APR_HASH_KEY_STRING);
+                if(!fe) {
+                    fprintf(stderr, "Nothing found for %s\n", pathbuf);
+                    continue;
+                }
+                if(ev->mask & IN_IGNORED) {
+                    apr_hash_set(server.wdToPathname, &fe->wd, sizeof(fe->wd), 0);
+                    fe->wd = inotify_add_watch(
+                        server.fileCacheifd, fe->watchpath, IN_DELETE_SELF | IN_MOVE_SELF | IN_MODIFY
+                    );
+                    apr_hash_set(server.wdToPathname, &fe->wd, sizeof(fe->wd), fe);
+                    fprintf(stderr, "Re-adding watch %d\n", fe->wd);
+                }
+
+                if(access(fe->pathname, R_OK) != 0) {
+                    // File was deleted.
+                    continue;
+                }
+
+                // Reload the file.
+                marla_FileEntry_reload(fe);
+            }
+            pthread_mutex_unlock(&server.fileCache_mutex);
+
+            // Done reading events.
+            continue;
+        }
+        if(events[i].data.fd == server.logfd) {
+            // epoll event is from the logging port.
+            if((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) || (!(events[i].events & EPOLLIN) && !(events[i].events & EPOLLOUT))) {
+                if(events[i].events & EPOLLRDHUP) {
+                    continue;
+                }
+                //fprintf(stderr, "epoll error on logfd: %d\n", events[i].events);
+                continue;
+            }
+            if(events[i].events & EPOLLOUT) {
+                server.wantsLogWrite = 0;
+                marla_Server_flushLog(&server);
+            }
+            continue;
+        }
+        marla_Listener* listener = find_listener(events[i].data.fd);
+        if(listener) {
+            if((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
+                marla_logMessagef(&server, "Listener on %s died.", listener->address);
+                close_listener(listener);
+                continue;
+            }
+            listener->acceptPending = 1;
+            listeners_pending = 1;
+            continue;
+        }
+        if(server.sfd == events[i].data.fd) {
+            // Event is from server socket.
+            if((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) || (!(events[i].events & EPOLLIN) && !(events[i].events & EPOLLOUT))) {
+                server.server_status = marla_SERVER_DESTROYING;
+                marla_logMessage(&server, "Server socket died. Destroying server.");
+                return -1;
+            }
+
+            // Accept once this pass's connections have been processed.
+            accept_pending = 1;
+            continue;
+        }
+        else {
+            process_connection(events[i]);
+        }
+    }
+    return 0;
+}
+
+// Runs the event loop on the io_uring instead of epoll_wait. The server's
+// epoll queue is polled through the ring, so SSL and backend connections,
+// the log, and the file cache are still serviced.
+static int run_uring(struct epoll_event* events)
+{
+    if(marla_Uring_poll(&uring, server.efd) != 0 || marla_Uring_accept(&uring, server.sfd) != 0) {
+        marla_logMessage(&server, "Failed to queue initial io_uring operations.");
+        return -1;
+    }
+    while(server.server_status != marla_SERVER_DESTROYING) {
+        server.server_status = marla_SERVER_WAITING_FOR_INPUT;
+        if(marla_Uring_submit(&uring) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            return -1;
+        }
+        int timeout = listeners_pending || server.numReady > 0 ? 0 : loop_timeout(&server.timers);
+        if(0 != pthread_mutex_unlock(&server.server_mutex)) {
+            fprintf(stderr, "Failed to release server mutex\n");
+            abort();
+        }
+        int rv = marla_Uring_wait(&uring, timeout);
+        int waitErrno = errno;
+        if(0 != pthread_mutex_lock(&server.server_mutex)) {
+            fprintf(stderr, "Failed to acquire server mutex\n");
+            abort();
+        }
+        if(rv < 0 && waitErrno != EINTR && waitErrno != ETIME && waitErrno != EBUSY) {
+            errno = waitErrno;
+            perror("io_uring_enter");
+            return -1;
+        }
+        if(server.server_status == marla_SERVER_DESTROYING) {
+            marla_logMessagec(&server, "Server processing", "Server is being destroyed.");
+            return 0;
+        }
+        server.server_status = marla_SERVER_PROCESSING;
+
+        struct io_uring_cqe* cqe;
+        while((cqe = marla_Uring_peekCqe(&uring))) {
+            struct io_uring_cqe done = *cqe;
+            marla_Uring_seenCqe(&uring);
+            switch(marla_Uring_op(&done)) {
+            case marla_URING_ACCEPT:
+                if(done.res >= 0) {
+                    marla_logMessagecf(&server, "Server socket connections", "Accepted connection on descriptor %d", done.res);
+                    // The ring's accept does not return the peer's address.
+                    struct sockaddr_storage addr;
+                    socklen_t addrLen = sizeof addr;
+                    if(getpeername(done.res, (struct sockaddr*)&addr, &addrLen) != 0) {
+                        addrLen = 0;
+                    }
+                    add_connection(done.res, server.efd, (struct sockaddr*)&addr, addrLen, use_ssl);
+                }
+                else if(done.res == -EINVAL && uring.multishotAccept) {
+                    // Multishot accept is not supported by this kernel.
+                    uring.multishotAccept = 0;
+                }
+                else if(done.res != -EAGAIN && done.res != -EINTR && done.res != -ECONNABORTED && done.res != -ECANCELED) {
+                    marla_logMessagef(&server, "Error accepting connection: %s", strerror(-done.res));
+                }
+                if(!(done.flags & IORING_CQE_F_MORE) && server.sfd >= 0) {
+                    marla_Uring_accept(&uring, server.sfd);
+                }
+                break;
+            case marla_URING_POLL:
+                for(int n = MAXEVENTS; n == MAXEVENTS;) {
+                    n = epoll_wait(server.efd, events, MAXEVENTS, 0);
+                    if(n > 0 && process_events(events, n) != 0) {
+                        return -1;
+                    }
+                }
+                if(!(done.flags & IORING_CQE_F_MORE)) {
+                    marla_Uring_poll(&uring, server.efd);
+                }
+                break;
+            case marla_URING_RECV:
+            case marla_URING_SEND:
+            {
+                int ev = 0;
+                marla_Connection* cxn = marla_Uring_complete(&uring, &done, &ev);
+                if(cxn) {
+                    struct epoll_event event;
+                    memset(&event, 0, sizeof(struct epoll_event));
+                    event.data.ptr = cxn;
+                    event.events = ev;
+                    process_connection(event);
+                }
+                break;
+            }
+            case marla_URING_TIMEOUT:
+                break;
+            }
+        }
+        if(listeners_pending) {
+            listeners_pending = accept_listeners();
+        }
+        process_ready(&server.first_ready, &server.numReady);
+        marla_TimerWheel_advance(&server.timers);
+        finish_pass();
+    }
+    return 0;
+}
+
+// Returns the CPU for the worker with the given index, taken in turn from
+// the CPUs the server was allowed to run on.
+static int worker_cpu(int index)
+{
+    int count = CPU_COUNT(&allowed_cpus);
+    if(count == 0) {
+        return -1;
+    }
+    index %= count;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &allowed_cpus) && index-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+// Pins the calling thread to the given CPU, and allocates the pool's first
+// connections and rings from it so their memory is local to its NUMA node.
+static int pin_to_cpu(int cpu, marla_Pool* pool)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+        return -1;
+    }
+    marla_Pool_warm(pool, server.bufferPolicy[marla_BUFFER_CLIENT].initialSize);
+    return 0;
+}
+
+static void* worker_operator(void* data)
+{
+    marla_Worker* worker = data;
+
+    // Leave SIGINT to the main thread.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);
+
+    if(worker->cpu >= 0) {
+        marla_Worker_enter(worker);
+        if(pin_to_cpu(worker->cpu, &worker->objectPool) != 0) {
+            marla_logMessagef(&server, "Could not pin worker %d to CPU %d.", worker->index, worker->cpu);
+            worker->cpu = -1;
+        }
+        marla_Worker_leave(worker);
+    }
+
+    struct epoll_event* events = calloc(MAXEVENTS, sizeof(struct epoll_event));
+    int acceptPending = 0;
+    int timeout = MAXWAIT;
+    int spinning = 0;
+    struct timespec lastEvent = {0, 0};
+    while(server.server_status != marla_SERVER_DESTROYING) {
+        int n = epoll_wait(worker->efd, events, MAXEVENTS, acceptPending || spinning || worker->numReady > 0 ? 0 : timeout);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            server.server_status = marla_SERVER_DESTROYING;
+            break;
+        }
+        spinning = keep_spinning(&lastEvent, n);
+
+        marla_Worker_enter(worker);
+        worker->lastCpu = sched_getcpu();
+        for(int i = 0; i < n; i++) {
+            if(worker->completions.fd == events[i].data.fd) {
+                marla_TaskCompletions_finish(&worker->completions);
+            }
+            else if(worker->sfd == events[i].data.fd) {
+                if((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) || (!(events[i].events & EPOLLIN) && !(events[i].events & EPOLLOUT))) {
+                    server.server_status = marla_SERVER_DESTROYING;
+                    marla_logMessagef(&server, "Server socket for worker %d died. Destroying server.", worker->index);
+                    break;
+                }
+                acceptPending = 1;
+            }
+            else {
+                process_connection(events[i]);
+            }
+        }
+        if(acceptPending) {
+            acceptPending = accept_connections(worker->sfd, worker->efd);
+        }
+        if(draining) {
+            if(worker->sfd >= 0) {
+                // The listener was handed off; stop accepting from it.
+                epoll_ctl(worker->efd, EPOLL_CTL_DEL, worker->sfd, 0);
+                close(worker->sfd);
+                worker->sfd = -1;
+                acceptPending = 0;
+            }
+            drain_connections(worker->first_connection, &worker->timers);
+        }
+        process_ready(&worker->first_ready, &worker->numReady);
+        marla_TimerWheel_advance(&worker->timers);
+        timeout = loop_timeout(&worker->timers);
+        marla_Worker_leave(worker);
+    }
+    free(events);
+    return 0;
+}
+
+// Wakes the event loop of the given epoll queue when tasks it submitted are
+// complete.
+static int watch_completions(int efd, marla_TaskCompletions* completions)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.fd = completions->fd;
+    event.events = EPOLLIN | EPOLLET;
+    return epoll_ctl(efd, EPOLL_CTL_ADD, completions->fd, &event);
+}
+
+static int start_worker(marla_Worker* worker)
+{
+    worker->efd = epoll_create1(0);
+    if(worker->efd == -1) {
+        perror("Creating epoll queue for worker");
+        return -1;
+    }
+
+    worker->sfd = next_takeover_fd('L');
+    if(worker->sfd >= 0 && marla_Listener_configure(main_listener, worker->sfd) != 0) {
+        perror("listen");
+        return -1;
+    }
+    if(worker->sfd == -1) {
+        worker->sfd = marla_Listener_bind(main_listener, 1);
+    }
+    if(worker->sfd == -1) {
+        return -1;
+    }
+    if(use_affinity) {
+        worker->cpu = worker_cpu(worker->index);
+        // Prefer this worker's listener for connections whose packets are
+        // processed on its CPU.
+        if(use_incoming_cpu && worker->cpu >= 0 && setsockopt(worker->sfd, SOL_SOCKET, SO_INCOMING_CPU, &worker->cpu, sizeof worker->cpu) != 0) {
+            marla_logMessagef(&server, "Could not set SO_INCOMING_CPU for worker %d: %s", worker->index, strerror(errno));
+        }
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.fd = worker->sfd;
+    event.events = EPOLLIN | EPOLLET;
+    if(epoll_ctl(worker->efd, EPOLL_CTL_ADD, worker->sfd, &event) == -1) {
+        perror("Adding worker's server socket to epoll queue");
+        return -1;
+    }
+    if(watch_completions(worker->efd, &worker->completions) == -1) {
+        perror("Adding worker's task completions to epoll queue");
+        return -1;
+    }
+
+    if(0 != pthread_create(&worker->thread, 0, worker_operator, worker)) {
+        fprintf(stderr, "Failed to create thread for worker %d\n", worker->index);
+        return -1;
+    }
+    return 0;
+}
+
+static int removeWatch(void* rec, const void* key, apr_ssize_t klen, const void* value)
+{
+    const marla_FileEntry* fe = value;
+    apr_hash_set(server.wdToPathname, &fe->wd, sizeof(fe->wd), 0);
+    return 1;
+}
+
+static int addWatch(void* rec, const void* key, apr_ssize_t klen, const void* value)
+{
+    marla_FileEntry* fe = (marla_FileEntry*)value;
+    fe->wd = inotify_add_watch(server.fileCacheifd, fe->watchpath, IN_MODIFY);
+    if(fe->wd != -1) {
+        apr_hash_set(server.wdToPathname, &fe->wd, sizeof(fe->wd), fe->watchpath);
+    }
+    return 1;
+}
+
+// Gives a new worker process its own epoll queue, file cache watches, task
+// completions, and logging socket, since those inherited from the parent are
+// shared with it.
+static int become_worker_process(int index)
+{
+    close(server.efd);
+    server.efd = epoll_create1(0);
+    if(server.efd == -1) {
+        perror("Creating epoll queue for worker process");
+        return -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.fd = server.sfd;
+    // Wake only one worker process for each new connection.
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    if(epoll_ctl(server.efd, EPOLL_CTL_ADD, server.sfd, &event) == -1) {
+        perror("Adding server socket to worker process's epoll queue");
+        return -1;
+    }
+    for(marla_Listener* listener = server.first_listener; listener; listener = listener->next_listener) {
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.data.fd = listener->fd;
+        event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        if(epoll_ctl(server.efd, EPOLL_CTL_ADD, listener->fd, &event) == -1) {
+            perror("Adding listener to worker process's epoll queue");
+            return -1;
+        }
+    }
+
+    close(server.fileCacheifd);
+    server.fileCacheifd = inotify_init1(O_NONBLOCK);
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.data.fd = server.fileCacheifd;
+    event.events = EPOLLIN | EPOLLET;
+    if(epoll_ctl(server.efd, EPOLL_CTL_ADD, server.fileCacheifd, &event) == -1) {
+        perror("Adding inotify queue to worker process's epoll queue");
+        return -1;
+    }
+
+    close(server.completions.fd);
+    server.completions.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(server.completions.fd == -1 || watch_completions(server.efd, &server.completions) == -1) {
+        perror("Adding task completions to worker process's epoll queue");
+        return -1;
+    }
+    pthread_mutex_lock(&server.fileCache_mutex);
+    apr_hash_do(removeWatch, 0, server.fileCache);
+    apr_hash_do(addWatch, 0, server.fileCache);
+    pthread_mutex_unlock(&server.fileCache_mutex);
+
+    if(server.logfd != -1) {
+        close(server.logfd);
+        server.logfd = create_and_connect("localhost", server.logaddress);
+    }
+    if(server.logfd != -1) {
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.data.fd = server.logfd;
+        event.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        if(make_socket_non_blocking(server.logfd) == -1 || epoll_ctl(server.efd, EPOLL_CTL_ADD, server.logfd, &event) == -1) {
+            close(server.logfd);
+            server.logfd = -1;
+        }
+    }
+
+    if(use_affinity) {
+        int cpu = worker_cpu(index);
+        if(cpu < 0 || pin_to_cpu(cpu, &server.objectPool) != 0) {
+            marla_logMessagef(&server, "Could not pin worker process %d to CPU %d.", index, cpu);
+        }
+    }
+
+    marla_logMessagef(&server, "Worker process %d started with pid %d.", index, getpid());
+    return 0;
+}
+
+static void on_sigchld()
+{
+    // Do nothing, but don't ignore it, so that it interrupts sigsuspend
+}
+
+// Forks a worker process. Returns its pid to the parent, and 0 to the worker
+// once it is ready to run the event loop.
+static pid_t fork_worker_process(int index, const sigset_t* mask)
+{
+    pid_t pid = fork();
+    if(pid != 0) {
+        return pid;
+    }
+    signal(SIGCHLD, SIG_DFL);
+    pthread_sigmask(SIG_SETMASK, mask, 0);
+    prctl(PR_SET_PDEATHSIG, SIGINT);
+    if(become_worker_process(index) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+// Forks the worker processes, and restarts any that exit until the server is
+// destroyed. Returns 0 in each worker process, 1 in the parent once its
+// workers have exited, or -1 if they could not be started.
+static int run_worker_processes()
+{
+    signal(SIGCHLD, on_sigchld);
+    sigset_t mask;
+    sigset_t waitmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &waitmask);
+
+    int rv = 1;
+    worker_pids = calloc(num_processes, sizeof(pid_t));
+    for(int i = 0; i < num_processes; ++i) {
+        worker_pids[i] = fork_worker_process(i, &waitmask);
+        if(worker_pids[i] == 0) {
+            free(worker_pids);
+            worker_pids = 0;
+            return 0;
+        }
+        if(worker_pids[i] == -1) {
+            perror("fork");
+            rv = -1;
+            server.server_status = marla_SERVER_DESTROYING;
+            break;
+        }
+    }
+    marla_logMessagef(&server, "Server is using port %s with %d worker processes", server.serverport, num_processes);
+
+    while(server.server_status != marla_SERVER_DESTROYING) {
+        sigsuspend(&waitmask);
+        for(;;) {
+            int status;
+            pid_t pid = waitpid(-1, &status, WNOHANG);
+            if(pid <= 0) {
+                break;
+            }
+            for(int i = 0; i < num_processes; ++i) {
+                if(worker_pids[i] != pid) {
+                    continue;
+                }
+                worker_pids[i] = -1;
+                if(server.server_status == marla_SERVER_DESTROYING) {
+                    break;
+                }
+                marla_logMessagef(&server, "Worker process %d exited with status %d. Restarting it.", i, status);
+                worker_pids[i] = fork_worker_process(i, &waitmask);
+                if(worker_pids[i] == 0) {
+                    free(worker_pids);
+                    worker_pids = 0;
+                    return 0;
+                }
+                break;
+            }
+        }
+    }
+
+    for(int i = 0; i < num_processes; ++i) {
+        if(worker_pids[i] > 0) {
+            kill(worker_pids[i], SIGINT);
+        }
+    }
+    for(int i = 0; i < num_processes; ++i) {
+        if(worker_pids[i] > 0) {
+            waitpid(worker_pids[i], 0, 0);
+        }
+    }
+    free(worker_pids);
+    worker_pids = 0;
+    pthread_sigmask(SIG_SETMASK, &waitmask, 0);
+    return rv;
+}
+
+// Parses a buffer size option, given as the largest size or as the
+// initial and largest sizes separated by a colon. Ring buffers must be
+// powers of two, so other sizes are rejected.
+static int parse_buffer_sizes(const char* arg, size_t* initialSize, size_t* maxSize)
+{
+    char* end;
+    size_t size = strtoul(arg, &end, 10);
+    if(*end == ':') {
+        *initialSize = size;
+        size = strtoul(end + 1, &end, 10);
+    }
+    *maxSize = size;
+    if(end == arg || *end != 0) {
+        return -1;
+    }
+    if(*initialSize == 0 || (*initialSize & (*initialSize - 1)) != 0 || (*maxSize & (*maxSize - 1)) != 0 || *maxSize < *initialSize) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, const char**argv)
+{
+    atexit(handle_exit);
+    int s;
+    struct epoll_event *events = 0;
+
+    const size_t MIN_ARGS = 4;
+
+    apr_initialize();
+
+    marla_Server_init(&server);
+
+    if(0 != pthread_mutex_lock(&server.server_mutex)) {
+        fprintf(stderr, "Failed to acquire server mutex");
+        exit(EXIT_FAILURE);
+    }
+
+    marla_logEnterc(&server, "Server initializations", "Initializing server");
+
+    // Validate command-line.
+    if(argc < MIN_ARGS) {
+        fprintf(stderr, "Usage: %s [port] [backend-port] [logging-port] modulepath?modulefunc modulepath?modulefunc\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Do not die from SIGPIPE.
+    signal(SIGUSR1, on_sigusr1);
+    signal(SIGINT, on_sigint);
+    signal(SIGPIPE, SIG_IGN);
+
+    server.server_status = marla_SERVER_STARTED;
+
+    // Create epoll queue.
+    server.efd = epoll_create1(0);
+    if(server.efd == -1) {
+        perror("Creating main epoll queue for server");
+        marla_logLeave(&server, "Failed to create epoll queue.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the file cache's inotify instance.
+    server.fileCacheifd = inotify_init1(O_NONBLOCK);
+    {
+        // Add the inotifiy instance to epoll.
+        struct epoll_event ev;
+        ev.data.fd = server.fileCacheifd;
+        ev.events = EPOLLIN | EPOLLET;
+        if(0 != epoll_ctl(server.efd, EPOLL_CTL_ADD, server.fileCacheifd, &ev)) {
+            perror("epoll_ctl");
+            marla_logLeave(&server, "Failed to create inotify queue for file cache.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(watch_completions(server.efd, &server.completions) != 0) {
+        perror("epoll_ctl");
+        marla_logLeave(&server, "Failed to watch task completions.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the logging socket
+    server.logfd = create_and_connect("localhost", argv[3]);
+    if(server.logfd != -1) {
+        strcpy(server.logaddress, argv[3]);
+        marla_logMessagef(&server, "Server is logging on port %s", server.logaddress);
+        s = make_socket_non_blocking(server.logfd);
+        if(s == -1) {
+            exit_value = EXIT_FAILURE;
+            marla_logLeave(&server, "Failed to make logging server non-blocking.");
+            goto destroy;
+        }
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.data.fd = server.logfd;
+        event.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        s = epoll_ctl(server.efd, EPOLL_CTL_ADD, server.logfd, &event);
+        if(s == -1) {
+            perror("Adding logging file descriptor to epoll queue");
+            exit_value = EXIT_FAILURE;
+            marla_logLeave(&server, "Failed to add logging server to epoll queue.");
+            goto destroy;
+        }
+    }
+
+    main_listener = marla_Listener_new(argv[1]);
+    if(!main_listener) {
+        fprintf(stderr, "Invalid port \"%s\".\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(server.serverport, sizeof server.serverport, "%s", main_listener->address);
+
+    // Create the backend socket
+    strcpy(server.backendport, argv[2]);
+
+    strcpy(ssl_key_path, "key.pem");
+    strcpy(ssl_certificate_path, "certificate.pem");
+
+    uid_t uid = geteuid();
+    if(uid != 0) {
+        char dbPathBuf[PATH_MAX];
+        char* homeDir = getenv("HOME");
+        strcpy(dbPathBuf, homeDir);
+        ssize_t len = strlen(dbPathBuf);
+        char c = dbPathBuf[len - 1];
+        if(c != '\\') {
+            // HOME is not terminated with a /.
+            strcat(dbPathBuf, "/var/parsegraph/users.sqlite");
+        }
+        else {
+            // HOME is terminated with a /.
+            strcat(dbPathBuf, "var/parsegraph/users.sqlite");
+        }
+        strcpy(server.db_path, dbPathBuf);
+    }
+    else {
+        strcpy(server.db_path, "/var/parsegraph/users.sqlite");
+    }
+    strcpy(server.documentRoot, getenv("PWD"));
+    strcpy(server.dataRoot, getenv("PWD"));
+
+    if(argc > MIN_ARGS) {
+        for(int n = MIN_ARGS; n < argc; ++n) {
+            const char* arg = argv[n];
+            if(!strcmp(arg, "-nocurses")) {
+                use_curses = 0;
+                continue;
+            }
+            if(!strcmp(arg, "-nossl")) {
+                use_ssl = 0;
+                continue;
+            }
+            if(!strcmp(arg, "-ssl")) {
+                use_ssl = 1;
+                continue;
+            }
+            if(!strcmp(arg, "-curses")) {
+                use_curses = 1;
+                continue;
+            }
+            if(!strcmp(arg, "-hugepages")) {
+                server.objectPool.use_hugepages = 1;
+                continue;
+            }
+            if(!strcmp(arg, "-mirrored")) {
+                server.use_mirrored_rings = 1;
+                continue;
+            }
+            if(!strcmp(arg, "-nocork")) {
+                server.use_cork = 0;
+                continue;
+            }
+            if(!strcmp(arg, "-affinity")) {
+                use_affinity = 1;
+                continue;
+            }
+            if(!strcmp(arg, "-incomingcpu")) {
+                use_incoming_cpu = 1;
+                continue;
+            }
+            if(!strcmp(arg, "-handoffidle")) {
+                handoff_idle = 1;
+                continue;
+            }
+            if(!strcmp(arg, "-uring")) {
+                use_uring = 1;
+                continue;
+            }
+            if(n < argc - 1) {
+                if(!strcmp(arg, "-threads")) {
+                    num_threads = atoi(argv[n+1]);
+                    if(num_threads < 1) {
+                        fprintf(stderr, "-threads must be given a positive number of threads.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-listen")) {
+                    marla_Listener* listener = marla_Listener_new(argv[n+1]);
+                    if(!listener) {
+                        fprintf(stderr, "Invalid listener \"%s\".\n", argv[n+1]);
+                        exit(EXIT_FAILURE);
+                    }
+                    if(server.last_listener) {
+                        server.last_listener->next_listener = listener;
+                    }
+                    else {
+                        server.first_listener = listener;
+                    }
+                    server.last_listener = listener;
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-taskthreads")) {
+                    num_task_threads = atoi(argv[n+1]);
+                    if(num_task_threads < 0) {
+                        fprintf(stderr, "-taskthreads must be given zero or a positive number of threads.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-workers")) {
+                    num_processes = atoi(argv[n+1]);
+                    if(num_processes < 1) {
+                        fprintf(stderr, "-workers must be given a positive number of processes.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-filestore")) {
+                    long size = atol(argv[n+1]);
+                    if(size < 0) {
+                        fprintf(stderr, "-filestore must be given zero or a positive number of bytes.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    file_store_size = size;
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-acceptbudget")) {
+                    server.acceptBudget = atoi(argv[n+1]);
+                    if(server.acceptBudget < 0) {
+                        fprintf(stderr, "-acceptbudget must be given zero or a positive number of connections.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-processbudget")) {
+                    long budget = atol(argv[n+1]);
+                    if(budget < 0) {
+                        fprintf(stderr, "-processbudget must be given zero or a positive number of bytes.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    server.processBudget = budget;
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-zerocopy")) {
+                    long threshold = atol(argv[n+1]);
+                    if(threshold < 0) {
+                        fprintf(stderr, "-zerocopy must be given zero or a positive number of bytes.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    server.zeroCopyThreshold = threshold;
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-busypoll")) {
+                    server.busyPoll = atoi(argv[n+1]);
+                    if(server.busyPoll < 0) {
+                        fprintf(stderr, "-busypoll must be given zero or a positive number of microseconds.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-handoff")) {
+                    handoff_path = argv[n+1];
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-takeover")) {
+                    takeover_path = argv[n+1];
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-draintimeout")) {
+                    drain_timeout = atol(argv[n+1]);
+                    if(drain_timeout < 0) {
+                        fprintf(stderr, "-draintimeout must be given zero or a positive number of milliseconds.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-key")) {
+                    strncpy(ssl_key_path, argv[n+1], sizeof ssl_key_path);
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-cert")) {
+                    strncpy(ssl_certificate_path, argv[n+1], sizeof ssl_certificate_path);
+                    ++n;
+                    continue;
+                }
+                if(!strcmp(arg, "-db")) {
+                    strncpy(server.db_path, argv[n+1], sizeof server.db_path);
+                    ++n;
+                    continue;
                 }
                 if(!strcmp(arg, "-doc")) {
                     strncpy(server.documentRoot, argv[n+1], sizeof server.documentRoot);
@@ -555,6 +1798,27 @@ int main(int argc, const char**argv)
                     ++n;
                     continue;
                 }
+                enum marla_BufferKind bufferKind = marla_BUFFER_KIND_MAX;
+                if(!strcmp(arg, "-clientbuf")) {
+                    bufferKind = marla_BUFFER_CLIENT;
+                }
+                else if(!strcmp(arg, "-backendbuf")) {
+                    bufferKind = marla_BUFFER_BACKEND;
+                }
+                else if(!strcmp(arg, "-websocketbuf")) {
+                    bufferKind = marla_BUFFER_WEBSOCKET;
+                }
+                if(bufferKind != marla_BUFFER_KIND_MAX) {
+                    size_t initialSize = server.bufferPolicy[bufferKind].initialSize;
+                    size_t maxSize;
+                    if(parse_buffer_sizes(argv[n+1], &initialSize, &maxSize) != 0) {
+                        fprintf(stderr, "%s must be given a power of two number of bytes, optionally preceded by a smaller power of two and a colon.\n", arg);
+                        exit(EXIT_FAILURE);
+                    }
+                    marla_Server_setBufferPolicy(&server, bufferKind, initialSize, maxSize);
+                    ++n;
+                    continue;
+                }
             }
             char* loc = index(arg, '?');
             if(loc == 0) {
@@ -599,8 +1863,86 @@ int main(int argc, const char**argv)
         }
     }
 
+    if(num_processes > 1) {
+        if(num_threads > 1 || use_uring || handoff_path || takeover_path) {
+            fprintf(stderr, "-workers cannot be combined with -threads, -uring, -handoff, or -takeover.\n");
+            exit(EXIT_FAILURE);
+        }
+        // Only the worker processes serve; the curses interface would show nothing.
+        use_curses = 0;
+        if(file_store_size > 0) {
+            server.fileStore = marla_FileStore_new(file_store_size);
+            if(!server.fileStore) {
+                marla_logMessagef(&server, "Could not create shared file store: %s", strerror(errno));
+            }
+        }
+    }
+    if(use_affinity && sched_getaffinity(0, sizeof allowed_cpus, &allowed_cpus) != 0) {
+        marla_logMessagef(&server, "Could not read CPU affinity (%s); workers will not be pinned.", strerror(errno));
+        use_affinity = 0;
+    }
+
+    if(use_uring && num_threads > 1) {
+        fprintf(stderr, "-uring cannot be used with more than one thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(use_uring && marla_Uring_init(&uring, marla_URING_ENTRIES) != 0) {
+        marla_logMessagef(&server, "io_uring is not available (%s); using epoll.", strerror(errno));
+        use_uring = 0;
+    }
+
+    if(takeover_path && take_over() != 0) {
+        marla_logLeave(&server, "Failed to take over.");
+        exit(EXIT_FAILURE);
+    }
+
+    if(num_threads <= 1) {
+        // Create the server socket, unless one was taken over.
+        server.sfd = next_takeover_fd('L');
+        if(server.sfd >= 0) {
+            s = marla_Listener_configure(main_listener, server.sfd);
+        }
+        else {
+            server.sfd = marla_Listener_bind(main_listener, 0);
+            s = 0;
+        }
+        if(server.sfd == -1) {
+            perror("Creating main server socket for server");
+            marla_logLeave(&server, "Failed to create server socket.");
+            exit(EXIT_FAILURE);
+        }
+        marla_logMessagef(&server, "Server is using port %s", server.serverport);
+        if(s == -1) {
+            perror ("listen");
+            exit_value = EXIT_FAILURE;
+            marla_logLeave(&server, "Failed to listen to server socket.");
+            goto destroy;
+        }
+        else if(use_uring) {
+            marla_logMessage(&server, "Using io_uring.");
+        }
+        else {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(struct epoll_event));
+            event.data.fd = server.sfd;
+            event.events = EPOLLIN | EPOLLET;
+            s = epoll_ctl (server.efd, EPOLL_CTL_ADD, server.sfd, &event);
+            if(s == -1) {
+                perror("Adding server file descriptor to epoll queue");
+                exit_value = EXIT_FAILURE;
+                marla_logLeave(&server, "Failed to add server socket to epoll queue.");
+                goto destroy;
+            }
+        }
+    }
+
+    if(open_listeners() != 0) {
+        exit_value = EXIT_FAILURE;
+        marla_logLeave(&server, "Failed to open listeners.");
+        goto destroy;
+    }
+
     // Create the SSL context
-    SSL_CTX *ctx = 0;
     if(use_ssl) {
         marla_logMessage(&server, "Using SSL.");
         init_openssl();
@@ -627,32 +1969,84 @@ int main(int argc, const char**argv)
     }
     marla_logLeave(&server, "Entering event loop.");
 
-    if(0 != pthread_create(&server.idle_thread, 0, idle_operator, &server)) {
-        fprintf(stderr, "Failed to create idle thread");
-        marla_logLeave(&server, "Failed to create idle thread");
-        exit(EXIT_FAILURE);
+    if(num_processes > 1) {
+        int rv = run_worker_processes();
+        if(rv != 0) {
+            if(rv < 0) {
+                exit_value = EXIT_FAILURE;
+            }
+            goto destroy;
+        }
+    }
+
+    if(num_task_threads > 0) {
+        // Started after any worker processes are forked, so each process
+        // has its own task threads.
+        server.taskPool = marla_TaskPool_new(num_task_threads);
+        if(!server.taskPool) {
+            exit_value = EXIT_FAILURE;
+            marla_logLeave(&server, "Failed to create task pool.");
+            goto destroy;
+        }
+        marla_logMessagef(&server, "Server is running handler tasks on %d threads", num_task_threads);
+    }
+
+    if(num_threads > 1) {
+        // Each worker accepts and processes its own connections; this
+        // thread is left to the log and file cache.
+        server.workers = calloc(num_threads, sizeof(marla_Worker));
+        for(int i = 0; i < num_threads; ++i) {
+            marla_Worker_init(server.workers + i, &server, i);
+            ++server.numWorkers;
+            if(start_worker(server.workers + i) != 0) {
+                --server.numWorkers;
+                marla_Worker_free(server.workers + i);
+                server.server_status = marla_SERVER_DESTROYING;
+                exit_value = EXIT_FAILURE;
+                marla_logLeave(&server, "Failed to start worker.");
+                goto destroy;
+            }
+        }
+        marla_logMessagef(&server, "Server is using port %s with %d worker threads", server.serverport, server.numWorkers);
+    }
+
+    adopt_connections();
+    if(handoff_path) {
+        open_handoff();
+    }
+
+    if(use_uring) {
+        if(run_uring(events) != 0) {
+            exit_value = EXIT_FAILURE;
+        }
+        goto destroy;
     }
 
+    int spinning = 0;
+    struct timespec lastEvent = {0, 0};
     for(;;) {
-        int n, i;
+        int n;
 
         if(server.server_status == marla_SERVER_DESTROYING) {
             break;
         }
         server.server_status = marla_SERVER_WAITING_FOR_INPUT;
+        // Don't block while accepted or ready connections are still waiting.
+        int timeout = accept_pending || listeners_pending || spinning || server.numReady > 0 ? 0 : loop_timeout(&server.timers);
         if(0 != pthread_mutex_unlock(&server.server_mutex)) {
             fprintf(stderr, "Failed to release server mutex\n");
             exit_value = EXIT_FAILURE;
             goto destroy_without_unlock;
         }
-wait:   n = epoll_wait(server.efd, events, MAXEVENTS, -1);
-        if(n <= 0) {
-            if(server.server_status != marla_SERVER_DESTROYING && (n == 0 || errno == EINTR)) {
+wait:   n = epoll_wait(server.efd, events, MAXEVENTS, timeout);
+        if(n < 0) {
+            if(server.server_status != marla_SERVER_DESTROYING && errno == EINTR) {
                 goto wait;
             }
             server.server_status = marla_SERVER_DESTROYING;
             goto destroy;
         }
+        spinning = keep_spinning(&lastEvent, n);
 
         // Acquire the server's lock for processing.
         if(0 != pthread_mutex_lock(&server.server_mutex)) {
@@ -668,170 +2062,18 @@ wait:   n = epoll_wait(server.efd, events, MAXEVENTS, -1);
         }
         server.server_status = marla_SERVER_PROCESSING;
 
-        for(i = 0; i < n; i++) {
-            // Process one epoll event.
-            if(events[i].data.fd == server.fileCacheifd) {
-                // epoll event is from the file cache inotify descriptor.
-                char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
-                struct inotify_event* ev = 0;
-                char* filepath = 0;
-                for(int loop = 1; loop;) {
-                    // Attempt to read the next event.
-                    ev = (struct inotify_event*)buf;
-                    ssize_t nread = read(server.fileCacheifd, buf, sizeof buf);
-                    if(nread < 0) {
-                        // Done reading events.
-                        loop = 0;
-                        continue;
-                    }
-
-                    if(ev->len > 0) {
-                        // Read the filepath.
-                        filepath = buf + sizeof(struct inotify_event);
-                        fprintf(stderr, "INOTIFY %ld on %s!!!!\n", nread, filepath);
-                    }
-                    else {
-                        filepath = 0;
-                        fprintf(stderr, "INOTIFY %ld!!!!\n", nread);
-                    }
-
-                    // Process one event.
-                    const char* pathname = apr_hash_get(server.wdToPathname, &ev->wd, sizeof(ev->wd));
-                    if(!pathname) {
-                        fprintf(stderr, "Failed to find pathanem for given watch descriptor %d\n", ev->wd);
-                        abort();
-                    }
-
-                    char* pathbuf = NULL;
-                    if(filepath) {
-                        apr_filepath_merge(&pathbuf, pathname, filepath, APR_FILEPATH_TRUENAME | APR_FILEPATH_NOTABOVEROOT, server.pool);
-                    }
-                    else {
-                        pathbuf = (char*)pathname;
-                    }
-
-                    marla_FileEntry* fe = apr_hash_get(server.fileCache, pathbuf, APR_HASH_KEY_STRING);
-                    if(!fe) {
-                        fprintf(stderr, "Nothing found for %s\n", pathbuf);
-                        continue;
-                    }
-                    if(ev->mask & IN_IGNORED) {
-                        apr_hash_set(server.wdToPathname, &fe->wd, sizeof(fe->wd), 0);
-                        fe->wd = inotify_add_watch(
-                            server.fileCacheifd, fe->watchpath, IN_DELETE_SELF | IN_MOVE_SELF | IN_MODIFY
-                        );
-                        apr_hash_set(server.wdToPathname, &fe->wd, sizeof(fe->wd), fe);
-                        fprintf(stderr, "Re-adding watch %d\n", fe->wd);
-                    }
-
-                    if(access(fe->pathname, R_OK) != 0) {
-                        // File was deleted.
-                        continue;
-                    }
-
-                    // Reload the file.
-                    marla_FileEntry_reload(fe);
-                }
-
-                // Done reading events.
-                continue;
-            }
-            if(events[i].data.fd == server.logfd) {
-                // epoll event is from the logging port.
-                if((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) || (!(events[i].events & EPOLLIN) && !(events[i].events & EPOLLOUT))) {
-                    if(events[i].events & EPOLLRDHUP) {
-                        continue;
-                    }
-                    //fprintf(stderr, "epoll error on logfd: %d\n", events[i].events);
-                    continue;
-                }
-                if(events[i].events & EPOLLOUT) {
-                    server.wantsLogWrite = 0;
-                    marla_Server_flushLog(&server);
-                }
-                continue;
-            }
-            else if (server.sfd == events[i].data.fd) {
-                // Event is from server socket.
-                if((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) || (!(events[i].events & EPOLLIN) && !(events[i].events & EPOLLOUT))) {
-                    server.server_status = marla_SERVER_DESTROYING;
-                    marla_logMessage(&server, "Server socket died. Destroying server.");
-                    goto destroy;
-                }
-
-                // Accept socket connections.
-                for(;;) {
-                    struct sockaddr in_addr;
-                    socklen_t in_len;
-                    int infd;
-                    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-
-                    in_len = sizeof in_addr;
-                    infd = accept(server.sfd, &in_addr, &in_len);
-                    if(infd == -1) {
-                        if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-                            break;
-                        }
-                        else {
-                            perror("Error accepting connection");
-                            break;
-                        }
-                    }
-
-                    s = getnameinfo(&in_addr, in_len, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
-                    if(s == 0) {
-                        marla_logMessagecf(&server, "Server socket connections", "Accepted connection on descriptor %d "
-                        "(host=%s, port=%s)\n", infd, hbuf, sbuf);
-                    }
-
-                    /* Make the incoming socket non-blocking and add it to the
-                    list of fds to monitor. */
-                    s = make_socket_non_blocking (infd);
-                    if(s != 0) {
-                        close(infd);
-                        continue;
-                    }
-
-                    marla_Connection* cxn = marla_Connection_new(&server);
-                    if(!cxn) {
-                        perror("Unable to create connection");
-                        close(infd);
-                        continue;
-                    }
-                    if(use_ssl) {
-                        s = marla_SSL_init(cxn, ctx, infd);
-                        if(s <= 0) {
-                            perror("Unable to initialize SSL connection");
-                            marla_Connection_destroy(cxn);
-                            close(infd);
-                            continue;
-                        }
-                    }
-                    else {
-                        marla_cleartext_init(cxn, infd);
-                    }
-
-                    struct epoll_event event;
-                    memset(&event, 0, sizeof(struct epoll_event));
-                    event.data.ptr = cxn;
-                    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
-                    s = epoll_ctl(server.efd, EPOLL_CTL_ADD, infd, &event);
-                    if(s == -1) {
-                        perror ("epoll_ctl");
-                        marla_Connection_destroy(cxn);
-                        close(infd);
-                        continue;
-                    }
-
-                    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
-                    process_connection(event);
-                }
-                continue;
-            }
-            else {
-                process_connection(events[i]);
-            }
+        if(process_events(events, n) != 0) {
+            goto destroy;
+        }
+        if(accept_pending && server.sfd >= 0) {
+            accept_pending = accept_connections(server.sfd, server.efd);
         }
+        if(listeners_pending) {
+            listeners_pending = accept_listeners();
+        }
+        process_ready(&server.first_ready, &server.numReady);
+        marla_TimerWheel_advance(&server.timers);
+        finish_pass();
     }
 
 destroy:
@@ -840,6 +2082,11 @@ destroy:
         exit_value = EXIT_FAILURE;
     }
 destroy_without_unlock:
+    server.server_status = marla_SERVER_DESTROYING;
+    for(int i = 0; i < server.numWorkers; ++i) {
+        void* retval;
+        pthread_join(server.workers[i].thread, &retval);
+    }
     if(events) {
         free(events);
     }
@@ -850,6 +2097,10 @@ destroy_without_unlock:
     if(server.sfd > 0) {
         close(server.sfd);
     }
+    if(handoff_fd >= 0) {
+        close(handoff_fd);
+        unlink(handoff_path);
+    }
     if(server.logfd > 0) {
         close(server.logfd);
     }
@@ -858,11 +2109,13 @@ destroy_without_unlock:
         pthread_join(server.terminal_thread, &retval);
         server.has_terminal = 0;
     }
-    {
-        void* retval;
-        pthread_join(server.idle_thread, &retval);
-    }
     marla_Server_free(&server);
+    if(main_listener) {
+        marla_Listener_free(main_listener);
+    }
+    if(use_uring) {
+        marla_Uring_free(&uring);
+    }
     apr_terminate();
     return 0;
 }
@@ -2,28 +2,44 @@
 #define marla_INCLUDED
 
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
 #include <openssl/ssl.h>
 #include <apr_pools.h>
 #include <apr_hash.h>
 #include <limits.h>
+#include <stdatomic.h>
 
 #define marla_BUFSIZE 1024
 #define marla_LOGBUFSIZE 524288
+#define marla_ACCEPT_BUDGET 64
+#define marla_PROCESS_BUDGET 65536
 
 // ring.c
-typedef struct {
+typedef struct marla_Ring {
 char* buf;
 unsigned int read_index;
 unsigned int write_index;
 size_t capacity;
+int mirrored;
+int pooled;
+struct marla_Ring* next_free;
 } marla_Ring;
 
 marla_Ring* marla_Ring_new(size_t capacity);
+marla_Ring* marla_Ring_newMirrored(size_t capacity);
 void marla_Ring_free(marla_Ring* ring);
 size_t marla_Ring_size(marla_Ring* ring);
 size_t marla_Ring_capacity(marla_Ring* ring);
 int marla_Ring_readc(marla_Ring* ring, unsigned char* c);
 int marla_Ring_read(marla_Ring* ring, unsigned char* sink, size_t size);
+int marla_Ring_peek(marla_Ring* ring, unsigned char* sink, size_t size);
+size_t marla_Ring_skip(marla_Ring* ring, size_t size);
+int marla_Ring_find(marla_Ring* ring, const char* set, size_t maxLen);
+int marla_Ring_readIov(marla_Ring* ring, struct iovec* iov);
+int marla_Ring_writeIov(marla_Ring* ring, struct iovec* iov);
+size_t marla_Ring_iovLen(struct iovec* iov, int iovcnt);
 void marla_Ring_putbackRead(marla_Ring* ring, size_t count);
 void marla_Ring_putbackWrite(marla_Ring* ring, size_t count);
 void marla_Ring_slot(marla_Ring* ring, void** slot, size_t* slotLen);
@@ -38,6 +54,62 @@ int marla_Ring_isEmpty(marla_Ring* ring);
 void marla_Ring_clear(marla_Ring* ring);
 void marla_Ring_dump(marla_Ring* ring, const char* name);
 
+// spsc.c
+#define marla_CACHELINE 64
+typedef struct marla_SpscRing {
+char* buf;
+size_t capacity;
+_Alignas(marla_CACHELINE) atomic_uint read_index;
+_Alignas(marla_CACHELINE) atomic_uint write_index;
+} marla_SpscRing;
+
+marla_SpscRing* marla_SpscRing_new(size_t capacity);
+void marla_SpscRing_free(marla_SpscRing* ring);
+size_t marla_SpscRing_size(marla_SpscRing* ring);
+size_t marla_SpscRing_capacity(marla_SpscRing* ring);
+size_t marla_SpscRing_read(marla_SpscRing* ring, void* sink, size_t size);
+size_t marla_SpscRing_write(marla_SpscRing* ring, const void* source, size_t size);
+void marla_SpscRing_readSlot(marla_SpscRing* ring, void** slot, size_t* slotLen);
+void marla_SpscRing_commitRead(marla_SpscRing* ring, size_t count);
+void marla_SpscRing_writeSlot(marla_SpscRing* ring, void** slot, size_t* slotLen);
+void marla_SpscRing_commitWrite(marla_SpscRing* ring, size_t count);
+
+// timer.c
+#define marla_TIMER_SLOTS 256
+#define marla_TIMER_TICK_MS 100
+
+struct marla_TimerWheel;
+typedef struct marla_Timer {
+struct marla_TimerWheel* wheel;
+long deadline;
+int slot;
+int owned;
+void(*callback)(struct marla_Timer*, void*);
+void* data;
+struct marla_Timer* prev;
+struct marla_Timer* next;
+} marla_Timer;
+
+typedef struct marla_TimerWheel {
+struct timespec start;
+long now;
+long nextDeadline;
+size_t count;
+marla_Timer* expired;
+marla_Timer* slots[marla_TIMER_SLOTS];
+long slotDeadlines[marla_TIMER_SLOTS];
+} marla_TimerWheel;
+
+void marla_Timer_init(marla_Timer* timer, void(*callback)(marla_Timer*, void*), void* data);
+int marla_Timer_isActive(marla_Timer* timer);
+void marla_TimerWheel_init(marla_TimerWheel* wheel);
+void marla_TimerWheel_free(marla_TimerWheel* wheel);
+long marla_TimerWheel_tick(marla_TimerWheel* wheel);
+void marla_TimerWheel_schedule(marla_TimerWheel* wheel, marla_Timer* timer, long ms);
+void marla_TimerWheel_cancel(marla_Timer* timer);
+int marla_TimerWheel_advance(marla_TimerWheel* wheel);
+int marla_TimerWheel_nextTimeout(marla_TimerWheel* wheel);
+
 // client.c
 enum marla_RequestReadStage {
 marla_CLIENT_REQUEST_READ_FRESH,
@@ -97,6 +169,62 @@ const char* marla_nameRequestWriteStage(enum marla_RequestWriteStage stage);
 #define marla_MESSAGE_LENGTH_UNKNOWN -2
 #define marla_MESSAGE_USES_CLOSE -3
 
+// http.c
+enum marla_Method {
+marla_METHOD_UNKNOWN,
+marla_METHOD_GET,
+marla_METHOD_HEAD,
+marla_METHOD_POST,
+marla_METHOD_PUT,
+marla_METHOD_DELETE,
+marla_METHOD_CONNECT,
+marla_METHOD_OPTIONS,
+marla_METHOD_TRACE,
+marla_METHOD_MAX
+};
+enum marla_Method marla_lookupMethod(const char* method, size_t len);
+const char* marla_nameMethod(enum marla_Method method);
+
+enum marla_Field {
+marla_FIELD_UNKNOWN,
+marla_FIELD_ACCEPT,
+marla_FIELD_ACCEPT_CHARSET,
+marla_FIELD_ACCEPT_ENCODING,
+marla_FIELD_ACCEPT_LANGUAGE,
+marla_FIELD_AUTHORIZATION,
+marla_FIELD_CACHE_CONTROL,
+marla_FIELD_CONNECTION,
+marla_FIELD_CONTENT_ENCODING,
+marla_FIELD_CONTENT_LENGTH,
+marla_FIELD_CONTENT_TYPE,
+marla_FIELD_COOKIE,
+marla_FIELD_DATE,
+marla_FIELD_ETAG,
+marla_FIELD_EXPECT,
+marla_FIELD_HOST,
+marla_FIELD_IF_MATCH,
+marla_FIELD_IF_MODIFIED_SINCE,
+marla_FIELD_IF_NONE_MATCH,
+marla_FIELD_IF_RANGE,
+marla_FIELD_IF_UNMODIFIED_SINCE,
+marla_FIELD_LAST_MODIFIED,
+marla_FIELD_LOCATION,
+marla_FIELD_ORIGIN,
+marla_FIELD_RANGE,
+marla_FIELD_REFERER,
+marla_FIELD_SEC_WEBSOCKET_KEY,
+marla_FIELD_SEC_WEBSOCKET_VERSION,
+marla_FIELD_SET_COOKIE,
+marla_FIELD_TE,
+marla_FIELD_TRAILER,
+marla_FIELD_TRANSFER_ENCODING,
+marla_FIELD_UPGRADE,
+marla_FIELD_USER_AGENT,
+marla_FIELD_MAX
+};
+enum marla_Field marla_lookupField(const char* name, size_t len);
+const char* marla_nameField(enum marla_Field field);
+
 // chunks
 
 enum marla_ChunkResponseStage {
@@ -223,10 +351,12 @@ apr_pool_t* pool;
 struct marla_Request* next_request;
 int id;
 int statusCode;
-int refs;
+atomic_int refs;
 char statusLine[MAX_FIELD_VALUE_LENGTH + 1];
 struct marla_Connection* cxn;
 char method[MAX_METHOD_LENGTH + 1];
+enum marla_Method methodId;
+enum marla_Field headerField;
 char host[MAX_FIELD_VALUE_LENGTH + 1];
 char uri[MAX_URI_LENGTH + 1];
 char error[marla_BUFSIZE];
@@ -277,6 +407,7 @@ uint64_t websocketFrameLen;
 char websocketOutMask[4];
 char websocketMask[4];
 int websocket_version;
+struct marla_Task* first_task;
 };
 typedef struct marla_Request marla_Request;
 
@@ -286,6 +417,7 @@ struct marla_Server;
 marla_Request* marla_Request_new(struct marla_Connection* cxn);
 void marla_Request_ref(marla_Request*);
 void marla_Request_unref(marla_Request*);
+struct marla_Task* marla_Request_runTask(marla_Request* req, void(*run)(struct marla_Task*), void(*done)(struct marla_Task*), void* data);
 void marla_killRequest(struct marla_Request* req, int statusCode, const char* reason, ...);
 void marla_dumpRequest(marla_Request* req);
 
@@ -299,6 +431,35 @@ marla_CLIENT_COMPLETE /* Done with connection */
 };
 
 const char* marla_nameConnectionStage(enum marla_ConnectionStage);
+enum marla_BufferKind {
+marla_BUFFER_CLIENT,
+marla_BUFFER_BACKEND,
+marla_BUFFER_WEBSOCKET,
+marla_BUFFER_KIND_MAX
+};
+
+const char* marla_nameBufferKind(enum marla_BufferKind kind);
+
+struct marla_BufferPolicy {
+size_t initialSize;
+size_t maxSize;
+int growAfter;
+};
+
+// A buffer sent with MSG_ZEROCOPY instead of being copied into the output
+// ring. It stays pinned until the kernel has completed every send of it.
+struct marla_ZeroCopy {
+const unsigned char* data;
+size_t length;
+size_t sent;
+size_t precedingBytes;
+unsigned int lastSend;
+void(*release)(void*);
+void* releaseData;
+struct marla_ZeroCopy* next;
+};
+typedef struct marla_ZeroCopy marla_ZeroCopy;
+
 struct marla_Connection {
 
 // Flags
@@ -311,12 +472,20 @@ int in_write;
 int is_backend;
 marla_Connection* backendPeer;
 
-struct timespec lastProcessTime;
+marla_Timer timer;
+long lastActivity;
+long headerStart;
 
 int id;
 struct marla_Server* server;
+struct marla_Worker* worker;
+struct sockaddr_storage peerAddress;
+socklen_t peerAddressLen;
 struct marla_Connection* prev_connection;
 struct marla_Connection* next_connection;
+struct marla_Connection* prev_ready;
+struct marla_Connection* next_ready;
+int readyEvents;
 
 // Requests
 marla_Request* current_request;
@@ -326,17 +495,32 @@ size_t requests_in_process;
 // Buffers
 marla_Ring* input;
 marla_Ring* output;
+int inputChokes;
+int outputChokes;
 
 // Source
 void* source;
 int(*readSource)(struct marla_Connection*, void*, size_t);
 int(*writeSource)(struct marla_Connection*, void*, size_t);
+int(*readvSource)(struct marla_Connection*, struct iovec*, int);
+int(*writevSource)(struct marla_Connection*, struct iovec*, int);
 void(*acceptSource)(struct marla_Connection*);
 int(*shutdownSource)(struct marla_Connection*);
 void(*destroySource)(struct marla_Connection*);
 int(*describeSource)(struct marla_Connection*, char*, size_t);
+int(*socketSource)(struct marla_Connection*);
+int(*sendZeroCopySource)(struct marla_Connection*, const void*, size_t);
+int corked;
 struct epoll_event poll;
 size_t flushed;
+
+// Zero-copy sends
+int zeroCopy;
+marla_ZeroCopy* first_zeroCopy;
+marla_ZeroCopy* last_zeroCopy;
+marla_ZeroCopy* unsent_zeroCopy;
+unsigned int zeroCopySends;
+unsigned int zeroCopyCompleted;
 };
 
 typedef struct marla_Connection marla_Connection;
@@ -348,6 +532,32 @@ int marla_Connection_refill(marla_Connection* cxn, size_t* total);
 void marla_Connection_destroy(marla_Connection* cxn);
 int marla_Connection_flush(marla_Connection* cxn, int* outnflushed);
 int marla_Connection_write(marla_Connection* cxn, const void* source, size_t requested);
+enum marla_BufferKind marla_Connection_bufferKind(marla_Connection* cxn);
+int marla_Connection_resizeRing(marla_Connection* cxn, marla_Ring** ringp, size_t capacity);
+int marla_Connection_growInput(marla_Connection* cxn);
+int marla_Connection_growOutput(marla_Connection* cxn);
+void marla_Connection_shrink(marla_Connection* cxn);
+int marla_Connection_describePeer(marla_Connection* cxn, char* sink, size_t len);
+marla_TimerWheel* marla_Connection_timers(marla_Connection* cxn);
+void marla_Connection_markReady(marla_Connection* cxn);
+void marla_Connection_markDirty(marla_Connection* cxn);
+void marla_Connection_unmarkReady(marla_Connection* cxn);
+int marla_Connection_hasPendingWork(marla_Connection* cxn);
+void marla_Connection_exhaustBudget(marla_Connection* cxn);
+void marla_Connection_touch(marla_Connection* cxn);
+void marla_Connection_cork(marla_Connection* cxn);
+void marla_Connection_uncork(marla_Connection* cxn);
+int marla_Connection_setNoDelay(marla_Connection* cxn);
+int marla_Connection_setBusyPoll(marla_Connection* cxn, int usec);
+int marla_Connection_hasOutput(marla_Connection* cxn);
+int marla_Connection_writeZeroCopy(marla_Connection* cxn, const void* data, size_t length, void(*release)(void*), void* releaseData);
+int marla_Connection_completeZeroCopy(marla_Connection* cxn);
+
+// idler.c
+#define marla_IDLE_INTERVAL_MS 1000
+#define marla_KEEPALIVE_TIMEOUT_MS 60000
+#define marla_HEADER_TIMEOUT_MS 30000
+void marla_Connection_idle(marla_Timer* timer, void* data);
 
 typedef struct {
 int fd;
@@ -359,6 +569,79 @@ typedef struct {
 int fd;
 } marla_ClearTextSource;
 int marla_cleartext_init(marla_Connection* cxn, int fd);
+int marla_cleartext_release(marla_Connection* cxn);
+
+// uring.o
+#define marla_URING_ENTRIES 256
+#define marla_URING_BUFSIZE 16384
+#define marla_URING_BUFFERS 256
+#define marla_URING_READ_TIMEOUT 60
+
+enum marla_UringOp {
+marla_URING_ACCEPT,
+marla_URING_POLL,
+marla_URING_RECV,
+marla_URING_SEND,
+marla_URING_TIMEOUT
+};
+
+struct marla_Uring {
+int fd;
+unsigned int entries;
+void* ringMap;
+size_t ringMapLen;
+struct io_uring_sqe* sqes;
+size_t sqesLen;
+unsigned int* sqHead;
+unsigned int* sqTail;
+unsigned int sqMask;
+unsigned int* sqArray;
+unsigned int sqeTail;
+unsigned int* cqHead;
+unsigned int* cqTail;
+unsigned int cqMask;
+struct io_uring_cqe* cqes;
+unsigned char* buffers;
+int* freeBuffers;
+int numFreeBuffers;
+int registeredBuffers;
+int multishotAccept;
+struct __kernel_timespec readTimeout;
+};
+typedef struct marla_Uring marla_Uring;
+
+int marla_Uring_init(marla_Uring* uring, unsigned int entries);
+void marla_Uring_free(marla_Uring* uring);
+struct io_uring_sqe* marla_Uring_getSqe(marla_Uring* uring);
+int marla_Uring_submit(marla_Uring* uring);
+int marla_Uring_wait(marla_Uring* uring, int timeout);
+struct io_uring_cqe* marla_Uring_peekCqe(marla_Uring* uring);
+void marla_Uring_seenCqe(marla_Uring* uring);
+enum marla_UringOp marla_Uring_op(struct io_uring_cqe* cqe);
+int marla_Uring_accept(marla_Uring* uring, int sfd);
+int marla_Uring_cancelAccept(marla_Uring* uring);
+int marla_Uring_poll(marla_Uring* uring, int fd);
+marla_Connection* marla_Uring_complete(marla_Uring* uring, struct io_uring_cqe* cqe, int* events);
+
+typedef struct {
+int fd;
+marla_Uring* uring;
+marla_Connection* cxn;
+int pending;
+int recvBuffer;
+unsigned char* recvData;
+int recvPending;
+int recvLen;
+int recvOffset;
+int recvClosed;
+int sendBuffer;
+unsigned char* sendData;
+int sendPending;
+int sendLen;
+int sendOffset;
+int sendClosed;
+} marla_UringSource;
+int marla_uring_init(marla_Connection* cxn, marla_Uring* uring, int fd);
 int marla_readDuplex(marla_Connection* cxn, void* sink, size_t len);
 int marla_writeDuplex(marla_Connection* cxn, void* source, size_t len);
 void marla_putbackDuplexRead(marla_Connection* cxn, int count);
@@ -388,6 +671,7 @@ extern void(*default_request_handler)(struct marla_Request*, enum marla_ClientEv
 void marla_closeWebSocketRequest(marla_Request* req, uint16_t closeCode, const char* reason, size_t reasonLen);
 int marla_writeWebSocket(struct marla_Request* req, unsigned char* data, int dataLen);
 int marla_readWebSocket(struct marla_Request* req, unsigned char* data, int dataLen);
+int marla_WebSocketRemaining(struct marla_Request* req);
 void marla_putbackWebSocketRead(struct marla_Request* req, int dataLen);
 void marla_putbackWebSocketWrite(struct marla_Request* req, int dataLen);
 int marla_writeWebSocketHeader(struct marla_Request* req, unsigned char opcode, uint64_t frameLen);
@@ -444,40 +728,212 @@ marla_SERVER_DESTROYING = 5,
 const char* marla_nameServerStatus(enum marla_ServerStatus);
 
 struct marla_FileEntry;
+// pool.c
+#define marla_POOL_SLABSIZE (2*1024*1024)
+#define marla_POOL_CONNECTIONS_PER_SLAB 64
+#define marla_POOL_RING_CLASSES 32
+
+struct marla_PoolSlab {
+void* data;
+size_t len;
+int mapped;
+void* headers;
+struct marla_PoolSlab* next_slab;
+};
+
+struct marla_Pool {
+struct marla_Connection* free_connections;
+marla_Ring* free_rings[marla_POOL_RING_CLASSES];
+struct marla_PoolSlab* slabs;
+int use_hugepages;
+size_t connectionHits;
+size_t connectionMisses;
+size_t ringHits;
+size_t ringMisses;
+size_t slabBytes;
+};
+
+typedef struct marla_Pool marla_Pool;
+
+void marla_Pool_init(marla_Pool* pool);
+void marla_Pool_destroy(marla_Pool* pool);
+struct marla_Connection* marla_Pool_takeConnection(marla_Pool* pool);
+void marla_Pool_releaseConnection(marla_Pool* pool, struct marla_Connection* cxn);
+marla_Ring* marla_Pool_takeRing(marla_Pool* pool, size_t capacity);
+void marla_Pool_releaseRing(marla_Pool* pool, marla_Ring* ring);
+void marla_Pool_warm(marla_Pool* pool, size_t ringCapacity);
+
+// taskpool.c
+struct marla_Task;
+typedef struct marla_Task marla_Task;
+
+struct marla_TaskCompletions {
+pthread_mutex_t mutex;
+int fd;
+marla_Task* first_task;
+marla_Task* last_task;
+};
+typedef struct marla_TaskCompletions marla_TaskCompletions;
+
+struct marla_Task {
+void(*run)(marla_Task*);
+void(*done)(marla_Task*);
+void(*complete)(marla_Task*);
+void* data;
+marla_Request* req;
+marla_TaskCompletions* completions;
+marla_Task* next;
+marla_Task* prev;
+marla_Task* nextInRequest;
+};
+
+struct marla_TaskQueue {
+_Alignas(marla_CACHELINE) pthread_mutex_t mutex;
+marla_Task* head;
+marla_Task* tail;
+struct marla_TaskPool* pool;
+int index;
+pthread_t thread;
+};
+
+struct marla_TaskPool {
+int numThreads;
+struct marla_TaskQueue* queues;
+atomic_uint nextQueue;
+atomic_long pending;
+atomic_long stolen;
+pthread_mutex_t sleepMutex;
+pthread_cond_t wake;
+int stopping;
+};
+typedef struct marla_TaskPool marla_TaskPool;
+
+marla_TaskPool* marla_TaskPool_new(int numThreads);
+void marla_TaskPool_free(marla_TaskPool* pool);
+void marla_TaskPool_submit(marla_TaskPool* pool, marla_Task* task);
+marla_Task* marla_Task_new(void(*run)(marla_Task*), void(*done)(marla_Task*), void* data);
+void marla_Task_detach(marla_Task* task);
+int marla_TaskCompletions_init(marla_TaskCompletions* completions);
+void marla_TaskCompletions_free(marla_TaskCompletions* completions);
+int marla_TaskCompletions_finish(marla_TaskCompletions* completions);
+
+// worker.o
+struct marla_Worker {
+struct marla_Server* server;
+int index;
+pthread_t thread;
+pthread_mutex_t mutex;
+int efd;
+int sfd;
+struct marla_Connection* first_connection;
+struct marla_Connection* last_connection;
+struct marla_Connection* first_ready;
+struct marla_Connection* last_ready;
+int numReady;
+long budgetExhausted;
+long numRequests;
+int cpu;
+int lastCpu;
+marla_Pool objectPool;
+marla_TimerWheel timers;
+marla_TaskCompletions completions;
+};
+
+typedef struct marla_Worker marla_Worker;
+void marla_Worker_init(marla_Worker* worker, struct marla_Server* server, int index);
+void marla_Worker_free(marla_Worker* worker);
+void marla_Worker_enter(marla_Worker* worker);
+void marla_Worker_leave(marla_Worker* worker);
+marla_Worker* marla_Worker_current();
+
+// filestore.c
+#define marla_FILESTORE_ENTRIES 4096
+#define marla_FILESTORE_SIZE (64 * 1024 * 1024)
+struct stat;
+typedef struct marla_FileStore marla_FileStore;
+marla_FileStore* marla_FileStore_new(size_t size);
+void marla_FileStore_free(marla_FileStore* store);
+unsigned char* marla_FileStore_load(marla_FileStore* store, int fd, const struct stat* sb);
+size_t marla_FileStore_used(marla_FileStore* store);
+
+// listener.c
+struct marla_Listener {
+char address[256];
+char host[256];
+char port[64];
+char path[108];
+int is_unix;
+int is_ipv6;
+int backlog;
+int deferAccept;
+int fastOpen;
+int fd;
+int acceptPending;
+struct marla_Listener* next_listener;
+};
+typedef struct marla_Listener marla_Listener;
+marla_Listener* marla_Listener_new(const char* spec);
+void marla_Listener_free(marla_Listener* listener);
+int marla_Listener_bind(const marla_Listener* listener, int reuseport);
+int marla_Listener_configure(const marla_Listener* listener, int fd);
+int marla_Listener_matches(const marla_Listener* listener, int fd);
+
 struct marla_Server {
 apr_pool_t* pool;
 apr_hash_t* wdToPathname;
 apr_hash_t* fileCache;
+marla_FileStore* fileStore;
+marla_TaskPool* taskPool;
+marla_TaskCompletions completions;
 
 void(*fileUpdated)(struct marla_FileEntry*);
 void* fileUpdatedData;
 
-int idleTimeouts;
+marla_TimerWheel timers;
+long keepAliveTimeout;
+long headerTimeout;
 
 struct marla_Connection* first_connection;
 struct marla_Connection* last_connection;
+struct marla_Connection* first_ready;
+struct marla_Connection* last_ready;
+int numReady;
+marla_Pool objectPool;
+int numWorkers;
+marla_Worker* workers;
+struct marla_BufferPolicy bufferPolicy[marla_BUFFER_KIND_MAX];
 
 int using_ssl;
+int use_mirrored_rings;
+int use_cork;
+int busyPoll;
+size_t zeroCopyThreshold;
+int acceptBudget;
+size_t processBudget;
+long budgetExhausted;
 int wantsLogWrite;
 int logfd;
 marla_Ring* log;
 char logaddress[1024];
-char serverport[64];
+char serverport[256];
 char backendport[64];
 const char* backendPort;
 char db_path[PATH_MAX];
 char documentRoot[PATH_MAX];
 char dataRoot[PATH_MAX];
 pthread_mutex_t server_mutex;
+pthread_mutex_t log_mutex;
+pthread_mutex_t fileCache_mutex;
 volatile enum marla_ServerStatus server_status;
 volatile int efd;
 volatile int sfd;
 volatile int fileCacheifd;
 pthread_t terminal_thread;
-pthread_t idle_thread;
 volatile int has_terminal;
 struct marla_ServerModule* first_module;
 struct marla_ServerModule* last_module;
+marla_Listener* first_listener;
+marla_Listener* last_listener;
 struct marla_HookList hooks[marla_ServerHook_MAX];
 void(*undertaker)(marla_Request*, int);
 void* undertakerData;
@@ -495,9 +951,14 @@ struct marla_ServerModule* prevModule;
 void marla_Server_init(struct marla_Server* server);
 void marla_Server_flushLog(struct marla_Server* server);
 void marla_Server_free(struct marla_Server* server);
+void marla_Server_setBufferPolicy(struct marla_Server* server, enum marla_BufferKind kind, size_t initialSize, size_t maxSize);
 void marla_Server_invokeHook(struct marla_Server* server, enum marla_ServerHook serverHook, struct marla_Request* req);
 int marla_Server_removeHook(struct marla_Server* server, enum marla_ServerHook serverHook, void(*hookFunc)(struct marla_Request* req, void*), void* hookData);
 void marla_Server_addHook(struct marla_Server* server, enum marla_ServerHook serverHook, void(*hookFunc)(struct marla_Request* req, void*), void* hookData);
+marla_TimerWheel* marla_Server_timers(struct marla_Server* server);
+marla_TaskCompletions* marla_Server_completions(struct marla_Server* server);
+marla_Timer* marla_Server_addTimer(struct marla_Server* server, long ms, void(*callback)(marla_Timer*, void*), void* data);
+void marla_Server_cancelTimer(struct marla_Server* server, marla_Timer* timer);
 const char* marla_nameClientEvent(enum marla_ClientEvent ev);
 
 void marla_Server_log(struct marla_Server* server, const char* output, size_t len);
@@ -520,12 +981,46 @@ void marla_die(marla_Server* server, const char* fmt, ...);
 // http.o
 const char* marla_getDefaultStatusLine(int statusCode);
 
+#define marla_HEADER_SCAN_LINES 32
+#define marla_MAX_FIELD_LINE_LENGTH (MAX_FIELD_NAME_LENGTH + 2 + MAX_FIELD_VALUE_LENGTH + 2)
+
+enum marla_HeaderScanStatus {
+marla_HEADERS_PARTIAL,
+marla_HEADERS_FULL,
+marla_HEADERS_DONE,
+marla_HEADERS_BAD_NAME,
+marla_HEADERS_BAD_VALUE,
+marla_HEADERS_BAD_EOL,
+marla_HEADERS_TOO_LONG
+};
+
+// A header line, as offsets into the scanned data.
+typedef struct marla_HeaderLine {
+size_t start;
+size_t colon;
+size_t value;
+size_t end;
+size_t next;
+} marla_HeaderLine;
+
+typedef struct marla_HeaderScan {
+marla_HeaderLine lines[marla_HEADER_SCAN_LINES];
+int numLines;
+enum marla_HeaderScanStatus status;
+size_t next;
+size_t errorAt;
+} marla_HeaderScan;
+
+void marla_scanHeaders(marla_HeaderScan* scan, const unsigned char* data, size_t len, size_t maxLine);
+
 struct marla_FileEntry {
 const char* type;
 char* pathname;
 char* watchpath;
 unsigned char* data;
 size_t length;
+int shared;
+struct marla_FilePin* pin;
 int fd;
 int wd;
 struct timespec modtime;
@@ -540,6 +1035,18 @@ typedef struct marla_FileEntry marla_FileEntry;
 // Server file entries.
 marla_FileEntry* marla_Server_getFile(marla_Server* server, const char* pathname, const char* watchpath);
 
+// handoff.c
+#define marla_HANDOFF_BATCH 64
+#define marla_HANDOFF_TIMEOUT_MS 5000
+#define marla_DRAIN_TIMEOUT_MS 30000
+int marla_Handoff_listen(const char* path);
+int marla_Handoff_accept(int fd);
+int marla_Handoff_connect(const char* path);
+int marla_Handoff_sendFds(int fd, const int* fds, const char* kinds, int count);
+int marla_Handoff_recvFds(int fd, int* fds, char* kinds, int max);
+int marla_Handoff_sendFileList(marla_Server* server, int fd);
+int marla_Handoff_warmFileCache(marla_Server* server, int fd);
+
 // File entries.
 marla_FileEntry* marla_FileEntry_new(marla_Server* server, const char* pathname, const char* watchpath);
 void marla_FileEntry_reload(marla_FileEntry* fileEntry);
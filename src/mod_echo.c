@@ -0,0 +1,134 @@
+#include "marla.h"
+#include <string.h>
+
+// A module that answers every request with a short page, and echoes each
+// WebSocket message back to its sender. It lets bench-latency.sh measure the
+// server without an application module.
+
+#define ECHO_MAX_MESSAGE 125
+
+struct echo_Message {
+unsigned char data[ECHO_MAX_MESSAGE];
+int len;
+int type;
+unsigned char frame[2 + ECHO_MAX_MESSAGE];
+int frameLen;
+int frameWritten;
+};
+
+// Writes what is left of the echoed frame. Returns whether anything was
+// written.
+static int writeEcho(marla_Request* req, struct echo_Message* msg)
+{
+    if(msg->frameWritten == msg->frameLen) {
+        return 0;
+    }
+    int nwritten = marla_Connection_write(req->cxn, msg->frame + msg->frameWritten, msg->frameLen - msg->frameWritten);
+    if(nwritten <= 0) {
+        return 0;
+    }
+    msg->frameWritten += nwritten;
+    return 1;
+}
+
+static void echoHandler(marla_Request* req, marla_ClientEvent ev, void* in, int len)
+{
+    struct echo_Message* msg = req->handlerData;
+    marla_WriteEvent* we;
+    char buf[256];
+    switch(ev) {
+    case marla_EVENT_ACCEPTING_REQUEST:
+        *(int*)in = 1;
+        break;
+    case marla_EVENT_REQUEST_BODY:
+        we = in;
+        if(we->length == 0) {
+            req->readStage = marla_CLIENT_REQUEST_DONE_READING;
+        }
+        break;
+    case marla_EVENT_MUST_WRITE:
+        len = snprintf(buf, sizeof buf, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 3\r\n%s\r\nok\n", req->close_after_done ? "Connection: close\r\n" : "");
+        if(marla_Connection_write(req->cxn, buf, len) < len) {
+            marla_killRequest(req, 500, "Echo response did not fit.");
+            break;
+        }
+        req->writeStage = marla_CLIENT_REQUEST_AFTER_RESPONSE;
+        break;
+    case marla_EVENT_WEBSOCKET_MUST_READ:
+        if(!msg) {
+            msg = malloc(sizeof *msg);
+            if(!msg) {
+                marla_killRequest(req, 500, "Failed to allocate echo message.");
+                break;
+            }
+            msg->len = 0;
+            msg->type = 0;
+            msg->frameLen = 0;
+            msg->frameWritten = 0;
+            req->handlerData = msg;
+        }
+        if(len > 0) {
+            if(msg->len + len > ECHO_MAX_MESSAGE) {
+                marla_closeWebSocketRequest(req, 1009, "Message too big", 15);
+                break;
+            }
+            memcpy(msg->data + msg->len, in, len);
+            msg->len += len;
+            break;
+        }
+
+        if(marla_WebSocketRemaining(req) > 0) {
+            // The rest of the frame has yet to arrive.
+            break;
+        }
+
+        // The frame is done. Continuations keep the type of the first frame.
+        if(req->websocket_type != 0) {
+            msg->type = req->websocket_type;
+        }
+        if(!req->websocket_fin) {
+            break;
+        }
+        if(msg->frameWritten < msg->frameLen) {
+            // Only one echo is kept, and the client has not read the last.
+            marla_closeWebSocketRequest(req, 1008, "Echo not read", 13);
+            break;
+        }
+        msg->frame[0] = 0x80 | msg->type;
+        msg->frame[1] = msg->len;
+        memcpy(msg->frame + 2, msg->data, msg->len);
+        msg->frameLen = 2 + msg->len;
+        msg->frameWritten = 0;
+        msg->len = 0;
+        writeEcho(req, msg);
+        break;
+    case marla_EVENT_WEBSOCKET_MUST_WRITE:
+        if(msg && writeEcho(req, msg)) {
+            *(int*)in = 0;
+        }
+        break;
+    case marla_EVENT_DESTROYING:
+        free(msg);
+        req->handlerData = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+static void echoRouter(marla_Request* req, void* hookData)
+{
+    req->handler = echoHandler;
+}
+
+void mod_echo_init(marla_Server* server, enum marla_ServerModuleEvent e)
+{
+    switch(e) {
+    case marla_EVENT_SERVER_MODULE_START:
+        marla_Server_addHook(server, marla_ServerHook_ROUTE, echoRouter, 0);
+        break;
+    case marla_EVENT_SERVER_MODULE_STOP:
+        marla_Server_removeHook(server, marla_ServerHook_ROUTE, echoRouter, 0);
+        break;
+    }
+}
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include "marla.h"
+#include <string.h>
+#include <sys/mman.h>
+
+void marla_Pool_init(marla_Pool* pool)
+{
+    pool->free_connections = 0;
+    for(int i = 0; i < marla_POOL_RING_CLASSES; ++i) {
+        pool->free_rings[i] = 0;
+    }
+    pool->slabs = 0;
+    pool->use_hugepages = 0;
+    pool->connectionHits = 0;
+    pool->connectionMisses = 0;
+    pool->ringHits = 0;
+    pool->ringMisses = 0;
+    pool->slabBytes = 0;
+}
+
+void marla_Pool_destroy(marla_Pool* pool)
+{
+    struct marla_PoolSlab* slab = pool->slabs;
+    while(slab) {
+        struct marla_PoolSlab* nextSlab = slab->next_slab;
+        if(slab->mapped) {
+            munmap(slab->data, slab->len);
+        }
+        else {
+            free(slab->data);
+        }
+        free(slab->headers);
+        free(slab);
+        slab = nextSlab;
+    }
+    marla_Pool_init(pool);
+}
+
+static struct marla_PoolSlab* addSlab(marla_Pool* pool)
+{
+    struct marla_PoolSlab* slab = malloc(sizeof *slab);
+    if(!slab) {
+        fprintf(stderr, "Failed to allocate pool slab.\n");
+        abort();
+    }
+    slab->data = 0;
+    slab->len = 0;
+    slab->mapped = 0;
+    slab->headers = 0;
+    slab->next_slab = pool->slabs;
+    pool->slabs = slab;
+    return slab;
+}
+
+static int sizeClass(size_t capacity)
+{
+    int rv = 0;
+    while(((size_t)1 << rv) < capacity) {
+        ++rv;
+    }
+    if(((size_t)1 << rv) != capacity || rv >= marla_POOL_RING_CLASSES) {
+        fprintf(stderr, "Pooled rings must have a power-of-two capacity, but %ld was given.\n", capacity);
+        abort();
+    }
+    return rv;
+}
+
+static void* mapSlab(marla_Pool* pool, size_t len)
+{
+    void* data = MAP_FAILED;
+    if(pool->use_hugepages) {
+        data = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(data == MAP_FAILED) {
+            // Fall back to regular pages if no huge pages are reserved.
+            pool->use_hugepages = 0;
+        }
+    }
+    if(data == MAP_FAILED) {
+        data = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if(data == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
+    return data;
+}
+
+marla_Ring* marla_Pool_takeRing(marla_Pool* pool, size_t capacity)
+{
+    int sc = sizeClass(capacity);
+    marla_Ring* ring = pool->free_rings[sc];
+    if(ring) {
+        ++pool->ringHits;
+    }
+    else {
+        // Carve a new slab into rings of this size.
+        ++pool->ringMisses;
+        struct marla_PoolSlab* slab = addSlab(pool);
+        slab->len = capacity > marla_POOL_SLABSIZE ? capacity : marla_POOL_SLABSIZE;
+        slab->data = mapSlab(pool, slab->len);
+        slab->mapped = 1;
+        size_t count = slab->len / capacity;
+        marla_Ring* rings = malloc(count * sizeof(marla_Ring));
+        if(!rings) {
+            fprintf(stderr, "Failed to allocate pooled rings.\n");
+            abort();
+        }
+        slab->headers = rings;
+        pool->slabBytes += slab->len;
+        for(size_t i = 0; i < count; ++i) {
+            rings[i].buf = (char*)slab->data + i * capacity;
+            rings[i].capacity = capacity;
+            rings[i].mirrored = 0;
+            rings[i].pooled = 1;
+            rings[i].next_free = i + 1 < count ? rings + i + 1 : 0;
+        }
+        ring = rings;
+    }
+    pool->free_rings[sc] = ring->next_free;
+    ring->next_free = 0;
+    ring->read_index = 0;
+    ring->write_index = 0;
+    return ring;
+}
+
+// Allocates a slab of connections and a slab of rings of the given capacity,
+// and touches their memory from the calling thread. Under the kernel's
+// default first-touch policy, their pages are placed on the NUMA node of the
+// CPU the thread runs on.
+void marla_Pool_warm(marla_Pool* pool, size_t ringCapacity)
+{
+    if(!pool->free_connections) {
+        marla_Connection* cxn = marla_Pool_takeConnection(pool);
+        if(cxn) {
+            marla_Pool_releaseConnection(pool, cxn);
+        }
+    }
+    size_t misses = pool->ringMisses;
+    marla_Ring* ring = marla_Pool_takeRing(pool, ringCapacity);
+    if(pool->ringMisses != misses) {
+        memset(pool->slabs->data, 0, pool->slabs->len);
+    }
+    marla_Pool_releaseRing(pool, ring);
+}
+
+void marla_Pool_releaseRing(marla_Pool* pool, marla_Ring* ring)
+{
+    if(!ring->pooled) {
+        marla_Ring_free(ring);
+        return;
+    }
+    int sc = sizeClass(ring->capacity);
+    ring->next_free = pool->free_rings[sc];
+    pool->free_rings[sc] = ring;
+}
+
+marla_Connection* marla_Pool_takeConnection(marla_Pool* pool)
+{
+    marla_Connection* cxn = pool->free_connections;
+    if(cxn) {
+        ++pool->connectionHits;
+    }
+    else {
+        ++pool->connectionMisses;
+        struct marla_PoolSlab* slab = addSlab(pool);
+        slab->len = marla_POOL_CONNECTIONS_PER_SLAB * sizeof(marla_Connection);
+        slab->data = malloc(slab->len);
+        if(!slab->data) {
+            return 0;
+        }
+        pool->slabBytes += slab->len;
+        marla_Connection* cxns = slab->data;
+        for(int i = 0; i < marla_POOL_CONNECTIONS_PER_SLAB; ++i) {
+            cxns[i].next_connection = i + 1 < marla_POOL_CONNECTIONS_PER_SLAB ? cxns + i + 1 : 0;
+        }
+        cxn = cxns;
+    }
+    pool->free_connections = cxn->next_connection;
+    cxn->next_connection = 0;
+    return cxn;
+}
+
+void marla_Pool_releaseConnection(marla_Pool* pool, marla_Connection* cxn)
+{
+    cxn->next_connection = pool->free_connections;
+    pool->free_connections = cxn;
+}
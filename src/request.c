@@ -10,7 +10,7 @@
 #include <openssl/err.h>
 #include <openssl/rand.h>
 
-int marla_Request_numKilled = 0;
+atomic_int marla_Request_numKilled = 0;
 
 void marla_killRequest(struct marla_Request* req, int statusCode, const char* reason, ...)
 {
@@ -29,7 +29,7 @@ void marla_killRequest(struct marla_Request* req, int statusCode, const char* re
     }
     //fprintf(stderr, "Killing request: %s\n", req->error);
     va_end(ap);
-    ++marla_Request_numKilled;
+    atomic_fetch_add(&marla_Request_numKilled, 1);
 }
 
 void marla_dumpRequest(marla_Request* req)
@@ -121,7 +121,7 @@ const char* marla_nameRequestWriteStage(enum marla_RequestWriteStage stage)
     return "?";
 }
 
-int marla_Request_NEXT_ID = 1;
+atomic_int marla_Request_NEXT_ID = 1;
 
 marla_Request* marla_Request_new(marla_Connection* cxn)
 {
@@ -130,9 +130,12 @@ marla_Request* marla_Request_new(marla_Connection* cxn)
     req->statusCode = 0;
     memset(req->statusLine, 0, sizeof req->statusLine);
 
-    req->refs = 1;
+    atomic_init(&req->refs, 1);
 
-    req->id = marla_Request_NEXT_ID++;
+    req->id = atomic_fetch_add(&marla_Request_NEXT_ID, 1);
+    if(cxn->worker && !cxn->is_backend) {
+        ++cxn->worker->numRequests;
+    }
 
     req->handler = 0;
     req->handlerData = 0;
@@ -153,6 +156,8 @@ marla_Request* marla_Request_new(marla_Connection* cxn)
     memset(req->host, 0, sizeof(req->host));
     memset(req->uri, 0, sizeof(req->uri));
     memset(req->method, 0, sizeof(req->method));
+    req->methodId = marla_METHOD_UNKNOWN;
+    req->headerField = marla_FIELD_UNKNOWN;
     memset(req->contentType, 0, sizeof(req->contentType));
     memset(req->redirectLocation, 0, sizeof req->redirectLocation);
     memset(req->acceptHeader, 0, sizeof req->acceptHeader);
@@ -195,22 +200,58 @@ marla_Request* marla_Request_new(marla_Connection* cxn)
     req->close_after_done = 0;
 
     req->next_request = 0;
+    req->first_task = 0;
 
     return req;
 }
 
 void marla_Request_ref(marla_Request* req)
 {
-    ++req->refs;
+    atomic_fetch_add_explicit(&req->refs, 1, memory_order_relaxed);
+}
+
+static void completeRequestTask(marla_Task* task)
+{
+    marla_Request* req = task->req;
+    marla_Task_detach(task);
+    task->req = req;
+    if(task->done) {
+        task->done(task);
+    }
+    if(req) {
+        marla_Connection_markReady(req->cxn);
+    }
+}
+
+// Runs the given function on the server's task pool, then calls done on this
+// thread's event loop and marks the request's connection ready, so a handler
+// that returned marla_WriteResult_UPSTREAM_CHOKED from its
+// marla_EVENT_MUST_WRITE event is called again. The task's req is 0 when done
+// is called if the request was destroyed in the meantime. The run function
+// must not touch the request. The loop's lock must be held.
+marla_Task* marla_Request_runTask(marla_Request* req, void(*run)(marla_Task*), void(*done)(marla_Task*), void* data)
+{
+    marla_Server* server = req->cxn->server;
+    marla_Task* task = marla_Task_new(run, done, data);
+    if(!task) {
+        return 0;
+    }
+    task->complete = completeRequestTask;
+    task->req = req;
+    task->nextInRequest = req->first_task;
+    req->first_task = task;
+    task->completions = marla_Server_completions(server);
+    marla_TaskPool_submit(server->taskPool, task);
+    return task;
 }
 
 void marla_Request_unref(marla_Request* req)
 {
-    --req->refs;
-    if(req->refs > 0) {
+    int refs = atomic_fetch_sub_explicit(&req->refs, 1, memory_order_acq_rel) - 1;
+    if(refs > 0) {
         return;
     }
-    if(req->refs < 0) {
+    if(refs < 0) {
         fprintf(stderr, "Already destroyed\n");
         abort();
     }
@@ -219,6 +260,10 @@ void marla_Request_unref(marla_Request* req)
     if(req->handler) {
         req->handler(req, marla_EVENT_DESTROYING, 0, 0);
     }
+    while(req->first_task) {
+        // Tasks still running finish without their request.
+        marla_Task_detach(req->first_task);
+    }
     if(req->error[0] != 0) {
         marla_logMessagef(req->cxn->server, "Destroying request %d with error %s", req->id, req->error);
     }
@@ -1,6 +1,14 @@
+#define _GNU_SOURCE
 #include "marla.h"
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 static int ensure_po2(size_t given)
 {
@@ -22,6 +30,60 @@ marla_Ring* marla_Ring_new(size_t capacity)
     rv->buf = calloc(capacity, 1);
     rv->read_index = 0;
     rv->write_index = 0;
+    rv->mirrored = 0;
+    rv->pooled = 0;
+    rv->next_free = 0;
+    return rv;
+}
+
+marla_Ring* marla_Ring_newMirrored(size_t capacity)
+{
+    if(!ensure_po2(capacity)) {
+        fprintf(stderr, "Rings must not be created with non power-of-two sizes, but %ld was given.\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+
+    // Each half of the mapping must be page-aligned.
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    if(capacity < pagesize) {
+        capacity = pagesize;
+    }
+
+    int fd = memfd_create("marla_Ring", MFD_CLOEXEC);
+    if(fd == -1) {
+        perror("memfd_create");
+        return marla_Ring_new(capacity);
+    }
+    if(ftruncate(fd, capacity) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return marla_Ring_new(capacity);
+    }
+
+    // Reserve the address space for both halves, then map the same file into each.
+    char* buf = mmap(0, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return marla_Ring_new(capacity);
+    }
+    if(mmap(buf, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(buf + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap");
+        munmap(buf, 2 * capacity);
+        close(fd);
+        return marla_Ring_new(capacity);
+    }
+    close(fd);
+
+    marla_Ring* rv = malloc(sizeof(marla_Ring));
+    rv->capacity = capacity;
+    rv->buf = buf;
+    rv->read_index = 0;
+    rv->write_index = 0;
+    rv->mirrored = 1;
+    rv->pooled = 0;
+    rv->next_free = 0;
     return rv;
 }
 
@@ -49,16 +111,147 @@ int marla_Ring_isEmpty(marla_Ring* ring)
     return marla_Ring_size(ring) == 0;
 }
 
-int marla_Ring_read(marla_Ring* ring, unsigned char* sink, size_t size)
+int marla_Ring_peek(marla_Ring* ring, unsigned char* sink, size_t size)
+{
+    size_t avail = marla_Ring_size(ring);
+    if(size > avail) {
+        size = avail;
+    }
+    if(size == 0) {
+        return 0;
+    }
+    size_t rindex = ring->read_index & (ring->capacity - 1);
+    size_t leading = ring->capacity - rindex;
+    if(ring->mirrored || leading >= size) {
+        memcpy(sink, ring->buf + rindex, size);
+    }
+    else {
+        // Read wraps around the end of the buffer.
+        memcpy(sink, ring->buf + rindex, leading);
+        memcpy(sink + leading, ring->buf, size - leading);
+    }
+    return size;
+}
+
+size_t marla_Ring_skip(marla_Ring* ring, size_t size)
+{
+    size_t avail = marla_Ring_size(ring);
+    if(size > avail) {
+        size = avail;
+    }
+    ring->read_index += size;
+    return size;
+}
+
+static size_t findInSegment(const unsigned char* data, size_t len, const char* set, size_t setLen)
 {
-    int nread = 0;
-    for(unsigned i = 0; i < size; ++i) {
-        if(marla_Ring_size(ring) == 0) {
-            break;
+    size_t i = 0;
+#ifdef __AVX2__
+    for(; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i hits = _mm256_setzero_si256();
+        for(size_t s = 0; s < setLen; ++s) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(set[s])));
+        }
+        unsigned int mask = _mm256_movemask_epi8(hits);
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    for(; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i hits = _mm_setzero_si128();
+        for(size_t s = 0; s < setLen; ++s) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(set[s])));
+        }
+        unsigned int mask = _mm_movemask_epi8(hits);
+        if(mask) {
+            return i + __builtin_ctz(mask);
         }
-        sink[i] = ring->buf[(ring->read_index++) & (ring->capacity-1)];
-        ++nread;
     }
+#endif
+    for(; i < len; ++i) {
+        if(memchr(set, data[i], setLen)) {
+            return i;
+        }
+    }
+    return len;
+}
+
+int marla_Ring_find(marla_Ring* ring, const char* set, size_t maxLen)
+{
+    size_t size = marla_Ring_size(ring);
+    if(maxLen > size) {
+        maxLen = size;
+    }
+    size_t setLen = strlen(set);
+    size_t rindex = ring->read_index & (ring->capacity - 1);
+    size_t leading = ring->capacity - rindex;
+    if(ring->mirrored || leading > maxLen) {
+        leading = maxLen;
+    }
+
+    size_t found = findInSegment((unsigned char*)ring->buf + rindex, leading, set, setLen);
+    if(found < leading) {
+        return found;
+    }
+    if(leading < maxLen) {
+        found = findInSegment((unsigned char*)ring->buf, maxLen - leading, set, setLen);
+        if(found < maxLen - leading) {
+            return leading + found;
+        }
+    }
+    return -1;
+}
+
+static int fillIov(marla_Ring* ring, struct iovec* iov, size_t index, size_t len)
+{
+    if(len == 0) {
+        return 0;
+    }
+    size_t leading = ring->capacity - index;
+    iov[0].iov_base = ring->buf + index;
+    if(ring->mirrored || leading >= len) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+    iov[0].iov_len = leading;
+    iov[1].iov_base = ring->buf;
+    iov[1].iov_len = len - leading;
+    return 2;
+}
+
+int marla_Ring_readIov(marla_Ring* ring, struct iovec* iov)
+{
+    size_t size = marla_Ring_size(ring);
+    int iovcnt = fillIov(ring, iov, ring->read_index & (ring->capacity - 1), size);
+    ring->read_index += size;
+    return iovcnt;
+}
+
+int marla_Ring_writeIov(marla_Ring* ring, struct iovec* iov)
+{
+    size_t avail = ring->capacity - marla_Ring_size(ring);
+    int iovcnt = fillIov(ring, iov, ring->write_index & (ring->capacity - 1), avail);
+    ring->write_index += avail;
+    return iovcnt;
+}
+
+size_t marla_Ring_iovLen(struct iovec* iov, int iovcnt)
+{
+    size_t len = 0;
+    for(int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+int marla_Ring_read(marla_Ring* ring, unsigned char* sink, size_t size)
+{
+    int nread = marla_Ring_peek(ring, sink, size);
+    ring->read_index += nread;
     return nread;
 }
 
@@ -73,15 +266,25 @@ int marla_Ring_readc(marla_Ring* ring, unsigned char* c)
 
 size_t marla_Ring_write(marla_Ring* ring, const void* source, size_t size)
 {
-    size_t nwritten = 0;
-    for(unsigned i = 0; i < size; ++i) {
-        if(marla_Ring_size(ring) == marla_Ring_capacity(ring)) {
-            return nwritten;
-        }
-        ++nwritten;
-        marla_Ring_writec(ring, ((unsigned char*)source)[i]);
+    size_t avail = marla_Ring_capacity(ring) - marla_Ring_size(ring);
+    if(size > avail) {
+        size = avail;
+    }
+    if(size == 0) {
+        return 0;
+    }
+    size_t windex = ring->write_index & (ring->capacity - 1);
+    size_t leading = ring->capacity - windex;
+    if(ring->mirrored || leading >= size) {
+        memcpy(ring->buf + windex, source, size);
+    }
+    else {
+        // Write wraps around the end of the buffer.
+        memcpy(ring->buf + windex, source, leading);
+        memcpy(ring->buf, (const unsigned char*)source + leading, size - leading);
     }
-    return nwritten;
+    ring->write_index += size;
+    return size;
 }
 
 int marla_Ring_writeStr(marla_Ring* ring, const char* source)
@@ -108,6 +311,13 @@ void marla_Ring_writeSlot(marla_Ring* ring, void** slot, size_t* slotLen)
     size_t index = ring->write_index & capmask;
     *slot = ring->buf + index;
 
+    if(ring->mirrored) {
+        // The mirror makes all free space contiguous.
+        *slotLen = marla_Ring_capacity(ring) - marla_Ring_size(ring);
+        ring->write_index += *slotLen;
+        return;
+    }
+
     int rindex = ring->read_index & capmask;
     if(index > rindex) {
         //printf("windex(%ld) > rindex(%d)\n", index, rindex);
@@ -141,7 +351,11 @@ void marla_Ring_readSlot(marla_Ring* ring, void** slot, size_t* slotLen)
     size_t rindex = ring->read_index & capmask;
     *slot = ring->buf + rindex;
 
-    if(windex > rindex) {
+    if(ring->mirrored) {
+        // The mirror makes all readable bytes contiguous.
+        *slotLen = marla_Ring_size(ring);
+    }
+    else if(windex > rindex) {
         // Write index > read index
         *slotLen = marla_Ring_size(ring);
     }
@@ -170,6 +384,10 @@ void marla_Ring_simplify(marla_Ring* ring)
         ring->write_index = 0;
         return;
     }
+    if(ring->mirrored) {
+        // Mirrored rings are never fragmented.
+        return;
+    }
 
     int capmask = ring->capacity - 1;
     size_t rindex = ring->read_index & capmask;
@@ -229,15 +447,23 @@ void marla_Ring_dump(marla_Ring* ring, const char* name)
 {
     int len = marla_Ring_size(ring);
     unsigned char* tmp = malloc(len + 1);
-    marla_Ring_read(ring, tmp, len);
+    marla_Ring_peek(ring, tmp, len);
     tmp[len] = 0;
     printf("%s(%d): %s\n", name, len, tmp);
     free(tmp);
-    marla_Ring_putbackRead(ring, len);
 }
 
 void marla_Ring_free(marla_Ring* ring)
 {
-    free(ring->buf);
+    if(ring->pooled) {
+        fprintf(stderr, "Pooled rings must be released to their pool, not freed.\n");
+        abort();
+    }
+    if(ring->mirrored) {
+        munmap(ring->buf, 2 * ring->capacity);
+    }
+    else {
+        free(ring->buf);
+    }
     free(ring);
 }
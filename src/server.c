@@ -41,19 +41,38 @@ void marla_Server_init(struct marla_Server* server)
     // Create the file cache.
     server->fileCache = apr_hash_make(server->pool);
     server->wdToPathname = apr_hash_make(server->pool);
+    server->fileStore = 0;
+    server->taskPool = 0;
+    if(0 != marla_TaskCompletions_init(&server->completions)) {
+        fprintf(stderr, "Failed to create task completions.\n");
+        abort();
+    }
 
     server->server_status = marla_SERVER_STOPPED;
     pthread_mutex_init(&server->server_mutex, 0);
+    pthread_mutex_init(&server->log_mutex, 0);
+    pthread_mutex_init(&server->fileCache_mutex, 0);
     server->has_terminal = 0;
-    server->idleTimeouts = 0;
+    marla_TimerWheel_init(&server->timers);
+    server->keepAliveTimeout = marla_KEEPALIVE_TIMEOUT_MS;
+    server->headerTimeout = marla_HEADER_TIMEOUT_MS;
     server->logfd = -1;
     server->wantsLogWrite = 0;
     server->using_ssl = 0;
+    server->use_mirrored_rings = 0;
+    server->use_cork = 1;
+    server->busyPoll = 0;
+    server->zeroCopyThreshold = 0;
+    server->acceptBudget = marla_ACCEPT_BUDGET;
+    server->processBudget = marla_PROCESS_BUDGET;
+    server->budgetExhausted = 0;
     server->efd = 0;
     server->sfd = 0;
     server->fileCacheifd = 0;
     server->first_module = 0;
     server->last_module = 0;
+    server->first_listener = 0;
+    server->last_listener = 0;
     server->log = marla_Ring_new(marla_LOGBUFSIZE);
     server->undertaker = 0;
     server->undertakerData = 0;
@@ -65,6 +84,15 @@ void marla_Server_init(struct marla_Server* server)
 
     server->first_connection = 0;
     server->last_connection = 0;
+    server->first_ready = 0;
+    server->last_ready = 0;
+    server->numReady = 0;
+    marla_Pool_init(&server->objectPool);
+    server->numWorkers = 0;
+    server->workers = 0;
+    marla_Server_setBufferPolicy(server, marla_BUFFER_CLIENT, marla_BUFSIZE, 64 * marla_BUFSIZE);
+    marla_Server_setBufferPolicy(server, marla_BUFFER_BACKEND, marla_BUFSIZE, 64 * marla_BUFSIZE);
+    marla_Server_setBufferPolicy(server, marla_BUFFER_WEBSOCKET, marla_BUFSIZE, 16 * marla_BUFSIZE);
 
     for(int i = 0; i < marla_ServerHook_MAX; ++i) {
         struct marla_HookList* hookList = server->hooks + i;
@@ -75,7 +103,9 @@ void marla_Server_init(struct marla_Server* server)
 
 void marla_Server_flushLog(struct marla_Server* server)
 {
+    pthread_mutex_lock(&server->log_mutex);
     if(server->wantsLogWrite || server->logfd == 0) {
+        pthread_mutex_unlock(&server->log_mutex);
         return;
     }
     void* readSlot;
@@ -83,17 +113,18 @@ void marla_Server_flushLog(struct marla_Server* server)
     marla_Ring_readSlot(server->log, &readSlot, &slotLen);
     if(slotLen == 0) {
         // Nothing to write.
+        pthread_mutex_unlock(&server->log_mutex);
         return;
     }
     int true_written = write(server->logfd, readSlot, slotLen);
     if(true_written <= 0) {
         server->wantsLogWrite = 1;
         marla_Ring_putbackRead(server->log, slotLen);
-        return;
     }
-    if(true_written < slotLen) {
+    else if(true_written < slotLen) {
         marla_Ring_putbackRead(server->log, slotLen - true_written);
     }
+    pthread_mutex_unlock(&server->log_mutex);
 }
 
 int clearFileCache(void *rec, const void *key, apr_ssize_t klen, const void *value)
@@ -103,11 +134,82 @@ int clearFileCache(void *rec, const void *key, apr_ssize_t klen, const void *val
     return 1;
 }
 
+void marla_Server_setBufferPolicy(struct marla_Server* server, enum marla_BufferKind kind, size_t initialSize, size_t maxSize)
+{
+    if(kind < 0 || kind >= marla_BUFFER_KIND_MAX) {
+        fprintf(stderr, "Invalid buffer kind %d.\n", kind);
+        abort();
+    }
+    for(size_t size = 1; size != initialSize; size <<= 1) {
+        if(size > initialSize) {
+            fprintf(stderr, "Buffer sizes must be powers of two, but %ld was given.\n", initialSize);
+            abort();
+        }
+    }
+    if(maxSize < initialSize) {
+        maxSize = initialSize;
+    }
+    struct marla_BufferPolicy* policy = server->bufferPolicy + kind;
+    policy->initialSize = initialSize;
+    policy->maxSize = maxSize;
+    policy->growAfter = 2;
+}
+
+// Returns the timer wheel of the event loop run by this thread.
+marla_TimerWheel* marla_Server_timers(struct marla_Server* server)
+{
+    marla_Worker* worker = marla_Worker_current();
+    return worker ? &worker->timers : &server->timers;
+}
+
+// Returns the task completions of the event loop run by this thread.
+marla_TaskCompletions* marla_Server_completions(struct marla_Server* server)
+{
+    marla_Worker* worker = marla_Worker_current();
+    return worker ? &worker->completions : &server->completions;
+}
+
+// Runs the callback once on this thread's event loop after the given number
+// of milliseconds. The returned timer is freed once it has run or been
+// cancelled. The loop's lock must be held.
+marla_Timer* marla_Server_addTimer(struct marla_Server* server, long ms, void(*callback)(marla_Timer*, void*), void* data)
+{
+    marla_Timer* timer = malloc(sizeof *timer);
+    if(!timer) {
+        return 0;
+    }
+    marla_Timer_init(timer, callback, data);
+    timer->owned = 1;
+    marla_TimerWheel_schedule(marla_Server_timers(server), timer, ms);
+    return timer;
+}
+
+void marla_Server_cancelTimer(struct marla_Server* server, marla_Timer* timer)
+{
+    marla_TimerWheel_cancel(timer);
+    if(timer->owned == 1) {
+        free(timer);
+    }
+}
+
 void marla_Server_free(struct marla_Server* server)
 {
+    // Let running tasks finish before the loops they complete on are freed.
+    marla_TaskPool_free(server->taskPool);
+    server->taskPool = 0;
+
+    for(int i = 0; i < server->numWorkers; ++i) {
+        marla_Worker_free(server->workers + i);
+    }
+    free(server->workers);
+    server->workers = 0;
+    server->numWorkers = 0;
+
     while(server->first_connection) {
         marla_Connection_destroy(server->first_connection);
     }
+    marla_TaskCompletions_free(&server->completions);
+    marla_Pool_destroy(&server->objectPool);
 
     for(enum marla_ServerHook serverHook = 0; serverHook < marla_ServerHook_MAX; ++serverHook) {
         struct marla_HookList* hookList = server->hooks + serverHook;
@@ -127,6 +229,14 @@ void marla_Server_free(struct marla_Server* server)
         free(serverModule);
         serverModule = nextModule;
     }
+    marla_TimerWheel_free(&server->timers);
+
+    while(server->first_listener) {
+        marla_Listener* next = server->first_listener->next_listener;
+        marla_Listener_free(server->first_listener);
+        server->first_listener = next;
+    }
+    server->last_listener = 0;
 
     // Destroy existing marla_FileEntry objects.
     apr_hash_do(clearFileCache, server, server->fileCache);
@@ -134,5 +244,10 @@ void marla_Server_free(struct marla_Server* server)
     // Destroy the server's pool. Hashes are now invalid past this point.
     apr_pool_destroy(server->pool);
 
+    if(server->fileStore) {
+        marla_FileStore_free(server->fileStore);
+        server->fileStore = 0;
+    }
+
     marla_Ring_free(server->log);
 }
@@ -0,0 +1,146 @@
+#include "marla.h"
+#include <string.h>
+
+// A ring that one producer thread can write while one consumer thread reads
+// it, without a lock. The producer owns write_index, and the consumer owns
+// read_index; each publishes its index with release ordering, and reads the
+// other's with acquire ordering, so bytes are visible before the index that
+// covers them.
+
+static int ensure_po2(size_t given)
+{
+    size_t candidate = 1;
+    while(candidate < given) {
+        candidate <<= 1;
+    }
+    return candidate == given;
+}
+
+marla_SpscRing* marla_SpscRing_new(size_t capacity)
+{
+    if(!ensure_po2(capacity)) {
+        fprintf(stderr, "Rings must not be created with non power-of-two sizes, but %ld was given.\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    marla_SpscRing* rv = aligned_alloc(marla_CACHELINE, sizeof(marla_SpscRing));
+    if(!rv) {
+        return 0;
+    }
+    rv->capacity = capacity;
+    rv->buf = calloc(capacity, 1);
+    if(!rv->buf) {
+        free(rv);
+        return 0;
+    }
+    atomic_init(&rv->read_index, 0);
+    atomic_init(&rv->write_index, 0);
+    return rv;
+}
+
+void marla_SpscRing_free(marla_SpscRing* ring)
+{
+    free(ring->buf);
+    free(ring);
+}
+
+size_t marla_SpscRing_size(marla_SpscRing* ring)
+{
+    unsigned int windex = atomic_load_explicit(&ring->write_index, memory_order_acquire);
+    unsigned int rindex = atomic_load_explicit(&ring->read_index, memory_order_acquire);
+    return windex - rindex;
+}
+
+size_t marla_SpscRing_capacity(marla_SpscRing* ring)
+{
+    return ring->capacity;
+}
+
+void marla_SpscRing_readSlot(marla_SpscRing* ring, void** slot, size_t* slotLen)
+{
+    if(!slotLen) {
+        fprintf(stderr, "slotLen must be given.\n");
+        abort();
+    }
+    if(!slot) {
+        fprintf(stderr, "slot must be given.\n");
+        abort();
+    }
+    unsigned int rindex = atomic_load_explicit(&ring->read_index, memory_order_relaxed);
+    unsigned int windex = atomic_load_explicit(&ring->write_index, memory_order_acquire);
+    size_t offset = rindex & (ring->capacity - 1);
+    size_t size = windex - rindex;
+    size_t leading = ring->capacity - offset;
+    *slot = ring->buf + offset;
+    *slotLen = size < leading ? size : leading;
+}
+
+void marla_SpscRing_commitRead(marla_SpscRing* ring, size_t count)
+{
+    unsigned int rindex = atomic_load_explicit(&ring->read_index, memory_order_relaxed);
+    atomic_store_explicit(&ring->read_index, rindex + count, memory_order_release);
+}
+
+void marla_SpscRing_writeSlot(marla_SpscRing* ring, void** slot, size_t* slotLen)
+{
+    if(!slotLen) {
+        fprintf(stderr, "slotLen must be given.\n");
+        abort();
+    }
+    if(!slot) {
+        fprintf(stderr, "slot must be given.\n");
+        abort();
+    }
+    unsigned int windex = atomic_load_explicit(&ring->write_index, memory_order_relaxed);
+    unsigned int rindex = atomic_load_explicit(&ring->read_index, memory_order_acquire);
+    size_t offset = windex & (ring->capacity - 1);
+    size_t avail = ring->capacity - (windex - rindex);
+    size_t leading = ring->capacity - offset;
+    *slot = ring->buf + offset;
+    *slotLen = avail < leading ? avail : leading;
+}
+
+void marla_SpscRing_commitWrite(marla_SpscRing* ring, size_t count)
+{
+    unsigned int windex = atomic_load_explicit(&ring->write_index, memory_order_relaxed);
+    atomic_store_explicit(&ring->write_index, windex + count, memory_order_release);
+}
+
+size_t marla_SpscRing_read(marla_SpscRing* ring, void* sink, size_t size)
+{
+    size_t nread = 0;
+    while(nread < size) {
+        void* slot;
+        size_t slotLen;
+        marla_SpscRing_readSlot(ring, &slot, &slotLen);
+        if(slotLen == 0) {
+            break;
+        }
+        if(slotLen > size - nread) {
+            slotLen = size - nread;
+        }
+        memcpy((char*)sink + nread, slot, slotLen);
+        marla_SpscRing_commitRead(ring, slotLen);
+        nread += slotLen;
+    }
+    return nread;
+}
+
+size_t marla_SpscRing_write(marla_SpscRing* ring, const void* source, size_t size)
+{
+    size_t nwritten = 0;
+    while(nwritten < size) {
+        void* slot;
+        size_t slotLen;
+        marla_SpscRing_writeSlot(ring, &slot, &slotLen);
+        if(slotLen == 0) {
+            break;
+        }
+        if(slotLen > size - nwritten) {
+            slotLen = size - nwritten;
+        }
+        memcpy(slot, (const char*)source + nwritten, slotLen);
+        marla_SpscRing_commitWrite(ring, slotLen);
+        nwritten += slotLen;
+    }
+    return nwritten;
+}
@@ -125,16 +125,25 @@ static void destroySSLSource(marla_Connection* cxn)
     free(cxn->source);
 }
 
+static int socketSSLSource(marla_Connection* cxn)
+{
+    marla_SSLSource* cxnSource = cxn->source;
+    return cxnSource->fd;
+}
+
 int marla_SSL_init(marla_Connection* cxn, SSL_CTX* ctx, int fd)
 {
     marla_SSLSource* source = malloc(sizeof *source);
     cxn->source = source;
     cxn->readSource = readSSLSource;
     cxn->writeSource = writeSSLSource;
+    cxn->readvSource = 0;
+    cxn->writevSource = 0;
     cxn->acceptSource = acceptSSLSource;
     cxn->shutdownSource = shutdownSSLSource;
     cxn->destroySource = destroySSLSource;
     cxn->describeSource = describeSSLSource;
+    cxn->socketSource = socketSSLSource;
     source->ctx = ctx;
     source->fd = fd;
     source->ssl = SSL_new(ctx);
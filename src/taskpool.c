@@ -0,0 +1,333 @@
+#include "marla.h"
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// A task pool runs slow work, like rendering an expensive page, off of the
+// event loops. Each pool thread has its own queue of tasks; submissions are
+// spread across the queues, each thread runs its own tasks oldest first, and
+// a thread with nothing left steals the newest task from another's queue, so
+// one long task only holds up the tasks queued behind it until a thread
+// comes free to take them.
+//
+// A finished task is posted to the completions of the event loop that
+// submitted it, whose eventfd wakes that loop to run the task's done
+// callback with the loop's lock held.
+
+marla_Task* marla_Task_new(void(*run)(marla_Task*), void(*done)(marla_Task*), void* data)
+{
+    marla_Task* task = malloc(sizeof *task);
+    if(!task) {
+        return 0;
+    }
+    task->run = run;
+    task->done = done;
+    task->complete = done;
+    task->data = data;
+    task->req = 0;
+    task->completions = 0;
+    task->next = 0;
+    task->prev = 0;
+    task->nextInRequest = 0;
+    return task;
+}
+
+// Removes the task from the request it was run for, if any.
+void marla_Task_detach(marla_Task* task)
+{
+    marla_Request* req = task->req;
+    if(!req) {
+        return;
+    }
+    task->req = 0;
+    if(req->first_task == task) {
+        req->first_task = task->nextInRequest;
+        return;
+    }
+    for(marla_Task* prev = req->first_task; prev; prev = prev->nextInRequest) {
+        if(prev->nextInRequest == task) {
+            prev->nextInRequest = task->nextInRequest;
+            return;
+        }
+    }
+}
+
+int marla_TaskCompletions_init(marla_TaskCompletions* completions)
+{
+    completions->first_task = 0;
+    completions->last_task = 0;
+    completions->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(completions->fd < 0) {
+        return -1;
+    }
+    if(0 != pthread_mutex_init(&completions->mutex, 0)) {
+        close(completions->fd);
+        completions->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Finishes any tasks still waiting to be completed. Their pools must already
+// be freed.
+void marla_TaskCompletions_free(marla_TaskCompletions* completions)
+{
+    if(completions->fd < 0) {
+        return;
+    }
+    marla_TaskCompletions_finish(completions);
+    close(completions->fd);
+    completions->fd = -1;
+    pthread_mutex_destroy(&completions->mutex);
+}
+
+static void postCompletion(marla_Task* task)
+{
+    marla_TaskCompletions* completions = task->completions;
+    pthread_mutex_lock(&completions->mutex);
+    int wasEmpty = !completions->first_task;
+    task->next = 0;
+    if(completions->last_task) {
+        completions->last_task->next = task;
+    }
+    else {
+        completions->first_task = task;
+    }
+    completions->last_task = task;
+    pthread_mutex_unlock(&completions->mutex);
+
+    if(wasEmpty) {
+        uint64_t one = 1;
+        while(write(completions->fd, &one, sizeof one) < 0 && errno == EINTR);
+    }
+}
+
+// Runs the done callback of each finished task, in the order they finished,
+// and frees them. Returns the number of tasks completed.
+int marla_TaskCompletions_finish(marla_TaskCompletions* completions)
+{
+    uint64_t count;
+    while(read(completions->fd, &count, sizeof count) < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&completions->mutex);
+    marla_Task* task = completions->first_task;
+    completions->first_task = 0;
+    completions->last_task = 0;
+    pthread_mutex_unlock(&completions->mutex);
+
+    int numCompleted = 0;
+    while(task) {
+        marla_Task* next = task->next;
+        if(task->complete) {
+            task->complete(task);
+        }
+        free(task);
+        task = next;
+        ++numCompleted;
+    }
+    return numCompleted;
+}
+
+static _Thread_local struct marla_TaskQueue* current_queue = 0;
+
+// Takes the oldest task from the thread's own queue, or else steals the
+// newest task from the next queue that has one.
+static marla_Task* takeTask(marla_TaskPool* pool, struct marla_TaskQueue* own)
+{
+    pthread_mutex_lock(&own->mutex);
+    marla_Task* task = own->head;
+    if(task) {
+        own->head = task->next;
+        if(own->head) {
+            own->head->prev = 0;
+        }
+        else {
+            own->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&own->mutex);
+    if(task) {
+        return task;
+    }
+
+    for(int i = 1; i < pool->numThreads; ++i) {
+        struct marla_TaskQueue* victim = pool->queues + ((own->index + i) % pool->numThreads);
+        pthread_mutex_lock(&victim->mutex);
+        task = victim->tail;
+        if(task) {
+            victim->tail = task->prev;
+            if(victim->tail) {
+                victim->tail->next = 0;
+            }
+            else {
+                victim->head = 0;
+            }
+        }
+        pthread_mutex_unlock(&victim->mutex);
+        if(task) {
+            atomic_fetch_add_explicit(&pool->stolen, 1, memory_order_relaxed);
+            return task;
+        }
+    }
+    return 0;
+}
+
+static void* runTasks(void* data)
+{
+    struct marla_TaskQueue* queue = data;
+    marla_TaskPool* pool = queue->pool;
+    current_queue = queue;
+    for(;;) {
+        marla_Task* task = takeTask(pool, queue);
+        if(task) {
+            atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_relaxed);
+            task->next = 0;
+            task->prev = 0;
+            task->run(task);
+            postCompletion(task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->sleepMutex);
+        while(!pool->stopping && atomic_load(&pool->pending) == 0) {
+            pthread_cond_wait(&pool->wake, &pool->sleepMutex);
+        }
+        int stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->sleepMutex);
+        if(stopping) {
+            return 0;
+        }
+    }
+}
+
+marla_TaskPool* marla_TaskPool_new(int numThreads)
+{
+    if(numThreads < 1) {
+        return 0;
+    }
+    marla_TaskPool* pool = malloc(sizeof *pool);
+    if(!pool) {
+        return 0;
+    }
+    pool->numThreads = numThreads;
+    pool->queues = aligned_alloc(marla_CACHELINE, sizeof(struct marla_TaskQueue) * numThreads);
+    if(!pool->queues) {
+        free(pool);
+        return 0;
+    }
+    atomic_init(&pool->nextQueue, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->stolen, 0);
+    pthread_mutex_init(&pool->sleepMutex, 0);
+    pthread_cond_init(&pool->wake, 0);
+    pool->stopping = 0;
+
+    // Leave signals to the thread that started the pool.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for(int i = 0; i < numThreads; ++i) {
+        struct marla_TaskQueue* queue = pool->queues + i;
+        pthread_mutex_init(&queue->mutex, 0);
+        queue->head = 0;
+        queue->tail = 0;
+        queue->pool = pool;
+        queue->index = i;
+    }
+    for(int i = 0; i < numThreads; ++i) {
+        struct marla_TaskQueue* queue = pool->queues + i;
+        if(0 != pthread_create(&queue->thread, 0, runTasks, queue)) {
+            fprintf(stderr, "Failed to create task thread %d.\n", i);
+            abort();
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    return pool;
+}
+
+// Stops the pool's threads once their current tasks are done. Tasks that
+// never started are freed without being run or completed, so the event loops
+// must already be stopped.
+void marla_TaskPool_free(marla_TaskPool* pool)
+{
+    if(!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->sleepMutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->sleepMutex);
+
+    // Empty the queues so running threads find nothing more to take.
+    for(int i = 0; i < pool->numThreads; ++i) {
+        struct marla_TaskQueue* queue = pool->queues + i;
+        pthread_mutex_lock(&queue->mutex);
+        marla_Task* task = queue->head;
+        queue->head = 0;
+        queue->tail = 0;
+        pthread_mutex_unlock(&queue->mutex);
+        while(task) {
+            marla_Task* next = task->next;
+            marla_Task_detach(task);
+            free(task);
+            task = next;
+        }
+    }
+    for(int i = 0; i < pool->numThreads; ++i) {
+        pthread_join(pool->queues[i].thread, 0);
+        pthread_mutex_destroy(&pool->queues[i].mutex);
+    }
+    pthread_mutex_destroy(&pool->sleepMutex);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->queues);
+    free(pool);
+}
+
+// Runs the task's run callback on one of the pool's threads, then its done
+// callback once the task's completions are finished. The task's completions
+// must be set. Without a pool, the task is run immediately and still
+// completed later, so callers see the same order either way.
+void marla_TaskPool_submit(marla_TaskPool* pool, marla_Task* task)
+{
+    task->next = 0;
+    task->prev = 0;
+    if(!pool) {
+        task->run(task);
+        postCompletion(task);
+        return;
+    }
+
+    struct marla_TaskQueue* queue;
+    if(current_queue && current_queue->pool == pool) {
+        // Tasks submitted by a task run next on the same thread.
+        queue = current_queue;
+        pthread_mutex_lock(&queue->mutex);
+        task->next = queue->head;
+        if(queue->head) {
+            queue->head->prev = task;
+        }
+        else {
+            queue->tail = task;
+        }
+        queue->head = task;
+    }
+    else {
+        queue = pool->queues + (atomic_fetch_add_explicit(&pool->nextQueue, 1, memory_order_relaxed) % pool->numThreads);
+        pthread_mutex_lock(&queue->mutex);
+        task->prev = queue->tail;
+        if(queue->tail) {
+            queue->tail->next = task;
+        }
+        else {
+            queue->head = task;
+        }
+        queue->tail = task;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    atomic_fetch_add_explicit(&pool->pending, 1, memory_order_relaxed);
+    pthread_mutex_lock(&pool->sleepMutex);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->sleepMutex);
+}
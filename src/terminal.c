@@ -15,8 +15,8 @@
 #include <ncurses.h>
 #include <locale.h>
 
-extern int marla_Request_NEXT_ID;
-extern int marla_Request_numKilled;
+extern atomic_int marla_Request_NEXT_ID;
+extern atomic_int marla_Request_numKilled;
 
 static char status_line[255];
 
@@ -35,18 +35,49 @@ static enum TerminalPageMode firstPage = TerminalPageMode_Statistics;
 static enum TerminalPageMode lastPage = TerminalPageMode_Connections;
 static enum TerminalPageMode defaultPage = TerminalPageMode_Statistics;
 
+static long* lastRequests = 0;
+static long* requestRates = 0;
+static struct timespec lastSample;
+
+// Updates the rate of requests served by each worker, at most once a second.
+static void sample_request_rates(marla_Server* server)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(!lastRequests) {
+        lastRequests = calloc(server->numWorkers, sizeof(long));
+        requestRates = calloc(server->numWorkers, sizeof(long));
+        lastSample = now;
+    }
+    double elapsed = (now.tv_sec - lastSample.tv_sec) + (now.tv_nsec - lastSample.tv_nsec) / 1e9;
+    if(elapsed < 1) {
+        return;
+    }
+    for(int i = 0; i < server->numWorkers; ++i) {
+        marla_Worker* worker = server->workers + i;
+        marla_Worker_enter(worker);
+        long numRequests = worker->numRequests;
+        marla_Worker_leave(worker);
+        requestRates[i] = (numRequests - lastRequests[i]) / elapsed;
+        lastRequests[i] = numRequests;
+    }
+    lastSample = now;
+}
+
 static void display_connection(marla_Server* server, marla_Connection* cxn, int* y, int WINY)
 {
     char buf[1024];
     int len;
     char sourceStr[64];
+    char peerStr[64];
     if(*y >= WINY - 1) {
         return;
     }
     cxn->describeSource(cxn, sourceStr, sizeof(sourceStr));
+    marla_Connection_describePeer(cxn, peerStr, sizeof(peerStr));
     move(++(*y), 0);
     if(cxn->requests_in_process > 0) {
-        len = snprintf(buf, sizeof buf, "%s | %4ld request | input %4ld ri %4ld wi %4ld cap | output %4ld ri %4ld wi %4ld cap | %s | %s | %s",
+        len = snprintf(buf, sizeof buf, "%s | %4ld request | input %4ld ri %4ld wi %4ld cap | output %4ld ri %4ld wi %4ld cap | %s %s | %s | %s",
             marla_nameConnectionStage(cxn->stage),
             cxn->requests_in_process,
             cxn->input->write_index & (cxn->input->capacity-1),
@@ -56,6 +87,7 @@ static void display_connection(marla_Server* server, marla_Connection* cxn, int*
             cxn->output->read_index & (cxn->output->capacity-1),
             cxn->output->capacity,
             sourceStr,
+            peerStr,
             (cxn->current_request ? marla_nameRequestWriteStage(cxn->current_request->writeStage) : ""),
             cxn->is_backend ?
                 (cxn->current_request ? marla_nameRequestReadStage(cxn->current_request->readStage) : "") :
@@ -63,7 +95,7 @@ static void display_connection(marla_Server* server, marla_Connection* cxn, int*
         );
     }
     else {
-        len = snprintf(buf, sizeof buf, "%s | %4ld request | input %4ld ri %4ld wi %4ld cap | output %4ld ri %4ld wi %4ld cap | %s",
+        len = snprintf(buf, sizeof buf, "%s | %4ld request | input %4ld ri %4ld wi %4ld cap | output %4ld ri %4ld wi %4ld cap | %s %s",
             marla_nameConnectionStage(cxn->stage),
             cxn->requests_in_process,
             cxn->input->write_index & (cxn->input->capacity-1),
@@ -72,7 +104,8 @@ static void display_connection(marla_Server* server, marla_Connection* cxn, int*
             cxn->output->write_index & (cxn->output->capacity-1),
             cxn->output->read_index & (cxn->output->capacity-1),
             cxn->output->capacity,
-            sourceStr
+            sourceStr,
+            peerStr
         );
     }
     addnstr(buf, len);
@@ -87,6 +120,14 @@ static void display_connections(marla_Server* server, int y)
         display_connection(server, cxn, &y, WINY);
         cxn = cxn->next_connection;
     }
+    for(int i = 0; i < server->numWorkers; ++i) {
+        marla_Worker* worker = server->workers + i;
+        marla_Worker_enter(worker);
+        for(cxn = worker->first_connection; cxn; cxn = cxn->next_connection) {
+            display_connection(server, cxn, &y, WINY);
+        }
+        marla_Worker_leave(worker);
+    }
 }
 
 void* terminal_operator(void* data)
@@ -190,6 +231,10 @@ void* terminal_operator(void* data)
                 addch(' ');
             }
 
+            if(server->numWorkers > 0) {
+                sample_request_rates(server);
+            }
+
             if(mode == TerminalPageMode_Statistics) {
                 move(++y, 0);
                 len = snprintf(buf, sizeof buf, "%d request%s served", (marla_Request_NEXT_ID-1), marla_Request_NEXT_ID == 2 ? "" : "s");
@@ -211,6 +256,35 @@ void* terminal_operator(void* data)
                 move(++y, 0);
                 len = snprintf(buf, sizeof buf, "marla_BUFSIZE: %d bytes", marla_BUFSIZE);
                 addnstr(buf, len);
+                if(server->numWorkers > 0) {
+                    move(++y, 0);
+                    len = snprintf(buf, sizeof buf, "%d worker threads", server->numWorkers);
+                    addnstr(buf, len);
+                }
+                for(int i = 0; i < server->numWorkers; ++i) {
+                    marla_Worker* worker = server->workers + i;
+                    marla_Worker_enter(worker);
+                    move(++y, 0);
+                    len = snprintf(buf, sizeof buf, "  Worker %d on CPU %d%s: %ld requests, %ld/s", i, worker->lastCpu, worker->cpu >= 0 ? " (pinned)" : "", worker->numRequests, requestRates[i]);
+                    marla_Worker_leave(worker);
+                    addnstr(buf, len);
+                }
+                long budgetExhausted = server->budgetExhausted;
+                for(int i = 0; i < server->numWorkers; ++i) {
+                    marla_Worker* worker = server->workers + i;
+                    marla_Worker_enter(worker);
+                    budgetExhausted += worker->budgetExhausted;
+                    marla_Worker_leave(worker);
+                }
+                move(++y, 0);
+                len = snprintf(buf, sizeof buf, "Processing budget of %zu bytes exhausted %ld time%s", server->processBudget, budgetExhausted, budgetExhausted == 1 ? "" : "s");
+                addnstr(buf, len);
+                move(++y, 0);
+                len = snprintf(buf, sizeof buf, "Connection pool: %ld hits, %ld misses", server->objectPool.connectionHits, server->objectPool.connectionMisses);
+                addnstr(buf, len);
+                move(++y, 0);
+                len = snprintf(buf, sizeof buf, "Ring pool: %ld hits, %ld misses, %ld slab bytes%s", server->objectPool.ringHits, server->objectPool.ringMisses, server->objectPool.slabBytes, server->objectPool.use_hugepages ? " (huge pages)" : "");
+                addnstr(buf, len);
                 move(++y, 0);
                 len = snprintf(buf, sizeof buf, "marla_LOGBUFSIZE: %d bytes", marla_LOGBUFSIZE);
                 addnstr(buf, len);
@@ -2,5 +2,13 @@
 ./test_ring || exit 1
 ./test_small_ring || exit 1
 ./test_ring_putback || exit 1
+./test_ring_slot || exit 1
+./test_ring_mirrored || exit 1
+./test_spsc_ring || exit 1
+./test_timer || exit 1
+./test_filestore || exit 1
+./test_taskpool || exit 1
+./test_listener || exit 1
+./test_headers || exit 1
 ./test_ring_po2 16 || exit 1
 ./test_ring_po2 15 2>/dev/null || exit 0
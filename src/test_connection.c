@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <dlfcn.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
 static int expectReadStage(marla_Request* req, enum marla_RequestReadStage readStage)
 {
@@ -1232,6 +1234,370 @@ int test_large_download()
     return 0;
 }
 
+int test_buffer_growth(struct marla_Server* server)
+{
+    marla_Server_setBufferPolicy(server, marla_BUFFER_CLIENT, marla_BUFSIZE, 4 * marla_BUFSIZE);
+    marla_Connection* cxn = marla_Connection_new(server);
+    marla_Duplex_init(cxn, 8 * marla_BUFSIZE, 8 * marla_BUFSIZE);
+    size_t slabBytes = server->objectPool.slabBytes;
+
+    // Fill the output buffer until it stops growing.
+    char buf[marla_BUFSIZE];
+    memset(buf, 'A', sizeof buf);
+    int chokes = 0;
+    while(chokes < 10) {
+        if(marla_Connection_write(cxn, buf, sizeof buf) <= 0) {
+            ++chokes;
+        }
+    }
+    if(marla_Ring_capacity(cxn->output) != 4 * marla_BUFSIZE) {
+        printf("Output buffer must grow to its maximum size, but was %ld bytes.\n", marla_Ring_capacity(cxn->output));
+        return 1;
+    }
+    if(marla_Ring_size(cxn->output) != 4 * marla_BUFSIZE) {
+        printf("Output buffer must keep its data when grown.\n");
+        return 1;
+    }
+
+    // Refill the input buffer from a source that has more than it can hold.
+    for(int i = 0; i < 8; ++i) {
+        marla_writeDuplex(cxn, buf, sizeof buf);
+    }
+    for(int i = 0; i < 10; ++i) {
+        marla_Connection_refill(cxn, 0);
+    }
+    if(marla_Ring_capacity(cxn->input) != 4 * marla_BUFSIZE) {
+        printf("Input buffer must grow to its maximum size, but was %ld bytes.\n", marla_Ring_capacity(cxn->input));
+        return 1;
+    }
+
+    // Idle connections return to their initial size.
+    marla_Connection_shrink(cxn);
+    if(marla_Ring_capacity(cxn->output) != 4 * marla_BUFSIZE) {
+        printf("Output buffer must not shrink while it holds data.\n");
+        return 1;
+    }
+    marla_Ring_clear(cxn->input);
+    marla_Ring_clear(cxn->output);
+    marla_Connection_shrink(cxn);
+    if(marla_Ring_capacity(cxn->input) != marla_BUFSIZE || marla_Ring_capacity(cxn->output) != marla_BUFSIZE) {
+        printf("Idle buffers must shrink to their initial size.\n");
+        return 1;
+    }
+    if(server->objectPool.slabBytes != slabBytes) {
+        printf("Grown buffers must not be kept by the pool.\n");
+        return 1;
+    }
+    for(size_t capacity = 2 * marla_BUFSIZE; capacity <= 4 * marla_BUFSIZE; capacity <<= 1) {
+        int sc = 0;
+        while(((size_t)1 << sc) < capacity) {
+            ++sc;
+        }
+        if(server->objectPool.free_rings[sc]) {
+            printf("Grown buffers must not be kept on the pool's freelists.\n");
+            return 1;
+        }
+    }
+
+    marla_Connection_destroy(cxn);
+    marla_Server_setBufferPolicy(server, marla_BUFFER_CLIENT, marla_BUFSIZE, 64 * marla_BUFSIZE);
+
+    // Backend connections start at their own initial size.
+    marla_Server_setBufferPolicy(server, marla_BUFFER_BACKEND, 4 * marla_BUFSIZE, 64 * marla_BUFSIZE);
+    cxn = marla_Connection_new(server);
+    marla_Backend_init(cxn, -1);
+    if(marla_Ring_capacity(cxn->input) != 4 * marla_BUFSIZE || marla_Ring_capacity(cxn->output) != 4 * marla_BUFSIZE) {
+        printf("Backend buffers must start at the backend's initial size.\n");
+        return 1;
+    }
+    marla_Connection_destroy(cxn);
+    marla_Server_setBufferPolicy(server, marla_BUFFER_BACKEND, marla_BUFSIZE, 64 * marla_BUFSIZE);
+    return 0;
+}
+
+static int test_describe_peer(struct marla_Server* server)
+{
+    marla_Connection* cxn = marla_Connection_new(server);
+    char buf[64];
+    if(marla_Connection_describePeer(cxn, buf, sizeof buf) != -1 || buf[0] != 0) {
+        printf("A connection without a peer address must describe its peer as empty.\n");
+        marla_Connection_destroy(cxn);
+        return 1;
+    }
+
+    struct sockaddr_in* sin = (struct sockaddr_in*)&cxn->peerAddress;
+    memset(sin, 0, sizeof *sin);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(8080);
+    inet_pton(AF_INET, "127.0.0.1", &sin->sin_addr);
+    cxn->peerAddressLen = sizeof *sin;
+    if(marla_Connection_describePeer(cxn, buf, sizeof buf) != 0 || strcmp(buf, "127.0.0.1:8080")) {
+        printf("IPv4 peer must be described as host:port, but got %s.\n", buf);
+        marla_Connection_destroy(cxn);
+        return 1;
+    }
+
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&cxn->peerAddress;
+    memset(sin6, 0, sizeof *sin6);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(443);
+    inet_pton(AF_INET6, "::1", &sin6->sin6_addr);
+    cxn->peerAddressLen = sizeof *sin6;
+    if(marla_Connection_describePeer(cxn, buf, sizeof buf) != 0 || strcmp(buf, "[::1]:443")) {
+        printf("IPv6 peer must be described as [host]:port, but got %s.\n", buf);
+        marla_Connection_destroy(cxn);
+        return 1;
+    }
+    marla_Connection_destroy(cxn);
+    return 0;
+}
+
+static int test_ready_list(struct marla_Server* server)
+{
+    marla_Connection* a = marla_Connection_new(server);
+    marla_Connection* b = marla_Connection_new(server);
+    marla_Connection* c = marla_Connection_new(server);
+    marla_Connection_markReady(a);
+    marla_Connection_markReady(b);
+    marla_Connection_markReady(c);
+    marla_Connection_markReady(b);
+    if(server->numReady != 3 || server->first_ready != a || server->last_ready != c) {
+        printf("Ready list must hold each connection once, in order.\n");
+        return 1;
+    }
+    marla_Connection_unmarkReady(b);
+    if(server->numReady != 2 || a->next_ready != c || c->prev_ready != a || b->readyEvents) {
+        printf("Unmarking must unlink the connection.\n");
+        return 1;
+    }
+    marla_Connection_destroy(a);
+    if(server->numReady != 1 || server->first_ready != c || server->last_ready != c) {
+        printf("Destroying a ready connection must remove it from the ready list.\n");
+        return 1;
+    }
+    marla_Connection_destroy(c);
+    marla_Connection_destroy(b);
+    if(server->numReady != 0 || server->first_ready || server->last_ready) {
+        printf("Ready list must be empty.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_exhaust_budget(struct marla_Server* server)
+{
+    marla_Connection* cxn = marla_Connection_new(server);
+    long budgetExhausted = server->budgetExhausted;
+    marla_Connection_exhaustBudget(cxn);
+    marla_Connection_exhaustBudget(cxn);
+    if(server->budgetExhausted != budgetExhausted + 2) {
+        printf("Exhausted budgets must be counted.\n");
+        return 1;
+    }
+    if(!cxn->readyEvents || server->numReady != 1) {
+        printf("A connection that exhausted its budget must be ready once.\n");
+        return 1;
+    }
+    marla_Connection_destroy(cxn);
+    return 0;
+}
+
+static int writeSinkSource(struct marla_Connection* cxn, void* source, size_t len)
+{
+    return marla_Ring_write(cxn->source, source, len);
+}
+
+static int sendZeroCopySinkSource(struct marla_Connection* cxn, const void* source, size_t len)
+{
+    return marla_Ring_write(cxn->source, source, len);
+}
+
+static void releaseZeroCopy(void* data)
+{
+    ++*(int*)data;
+}
+
+static int test_zero_copy_order(struct marla_Server* server)
+{
+    marla_Connection* cxn = marla_Connection_new(server);
+    cxn->source = marla_Ring_new(marla_BUFSIZE);
+    cxn->writeSource = writeSinkSource;
+    cxn->destroySource = destroySource;
+    cxn->sendZeroCopySource = sendZeroCopySinkSource;
+    // There is no socket to set SO_ZEROCOPY on.
+    cxn->zeroCopy = 1;
+
+    size_t threshold = server->zeroCopyThreshold;
+    server->zeroCopyThreshold = 4;
+    int released = 0;
+    marla_Connection_write(cxn, "head ", 5);
+    int small = marla_Connection_writeZeroCopy(cxn, "abc", 3, releaseZeroCopy, &released);
+    int queued = marla_Connection_writeZeroCopy(cxn, "zero-copied ", 12, releaseZeroCopy, &released);
+    marla_Connection_write(cxn, "tail", 4);
+    server->zeroCopyThreshold = threshold;
+    if(small == 0 || queued != 0) {
+        printf("Only buffers above the threshold may be queued.\n");
+        return 1;
+    }
+
+    while(marla_Connection_flush(cxn, 0) != marla_WriteResult_UPSTREAM_CHOKED);
+    char sent[64];
+    memset(sent, 0, sizeof sent);
+    marla_Ring_read(cxn->source, (unsigned char*)sent, sizeof sent - 1);
+    if(strcmp(sent, "head zero-copied tail")) {
+        printf("Queued buffers must be sent in order with other output, but got \"%s\".\n", sent);
+        return 1;
+    }
+    if(released != 0 || marla_Connection_hasOutput(cxn)) {
+        printf("Sent buffers must stay pinned until their sends complete.\n");
+        return 1;
+    }
+    marla_Connection_destroy(cxn);
+    if(released != 1) {
+        printf("Queued buffers must be released when the connection is destroyed.\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Sends without MSG_ZEROCOPY, so sends complete only when the test says so.
+static int sendPlainSource(struct marla_Connection* cxn, const void* source, size_t len)
+{
+    return send(cxn->socketSource(cxn), source, len, MSG_NOSIGNAL);
+}
+
+static int test_zero_copy_shutdown(struct marla_Server* server)
+{
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    marla_Connection* cxn = marla_Connection_new(server);
+    marla_cleartext_init(cxn, pair[0]);
+    cxn->sendZeroCopySource = sendPlainSource;
+    cxn->zeroCopy = 1;
+
+    size_t threshold = server->zeroCopyThreshold;
+    server->zeroCopyThreshold = 4;
+    int released = 0;
+    int queued = marla_Connection_writeZeroCopy(cxn, "zero-copied", 11, releaseZeroCopy, &released);
+    server->zeroCopyThreshold = threshold;
+    if(queued != 0) {
+        printf("The buffer must be queued.\n");
+        return 1;
+    }
+    if(cxn->shutdownSource(cxn) != -1 || released != 0) {
+        printf("A connection must not shut down while its zero-copy sends are incomplete.\n");
+        return 1;
+    }
+
+    // Complete the send, as the kernel's notice would.
+    cxn->zeroCopyCompleted = cxn->zeroCopySends;
+    if(cxn->shutdownSource(cxn) != 1 || released != 1) {
+        printf("A connection must shut down once its zero-copy sends are complete.\n");
+        return 1;
+    }
+    char sent[16];
+    memset(sent, 0, sizeof sent);
+    if(read(pair[1], sent, sizeof sent - 1) != 11 || strcmp(sent, "zero-copied")) {
+        printf("The queued buffer must be sent before the shutdown.\n");
+        return 1;
+    }
+    marla_Connection_destroy(cxn);
+    close(pair[1]);
+    return 0;
+}
+
+#define WORKER_TEST_CONNECTIONS 1000
+
+struct worker_test {
+marla_Worker worker;
+int ids[WORKER_TEST_CONNECTIONS];
+int failed;
+};
+
+static void* run_worker_test(void* data)
+{
+    struct worker_test* test = data;
+    marla_Worker_enter(&test->worker);
+    for(int i = 0; i < WORKER_TEST_CONNECTIONS; ++i) {
+        marla_Connection* cxn = marla_Connection_new(test->worker.server);
+        if(cxn->worker != &test->worker || test->worker.last_connection != cxn) {
+            test->failed = 1;
+        }
+        test->ids[i] = cxn->id;
+
+        marla_Request* req = marla_Request_new(cxn);
+        marla_Request_ref(req);
+        marla_Request_unref(req);
+        marla_Request_unref(req);
+
+        if(i % 2) {
+            marla_Connection_destroy(cxn);
+        }
+    }
+    marla_Worker_leave(&test->worker);
+    return 0;
+}
+
+int test_worker_connections(struct marla_Server* server)
+{
+    struct marla_Connection* first_connection = server->first_connection;
+    struct worker_test tests[2];
+    pthread_t threads[2];
+    for(int i = 0; i < 2; ++i) {
+        marla_Worker_init(&tests[i].worker, server, i);
+        tests[i].failed = 0;
+        if(0 != pthread_create(threads + i, 0, run_worker_test, tests + i)) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for(int i = 0; i < 2; ++i) {
+        pthread_join(threads[i], 0);
+    }
+
+    int rv = 0;
+    for(int i = 0; i < 2; ++i) {
+        if(tests[i].failed) {
+            printf("Connections must belong to the worker that created them.\n");
+            rv = 1;
+        }
+        int count = 0;
+        for(marla_Connection* cxn = tests[i].worker.first_connection; cxn; cxn = cxn->next_connection) {
+            ++count;
+        }
+        if(count != WORKER_TEST_CONNECTIONS / 2) {
+            printf("Worker %d must keep its own connections, but had %d.\n", i, count);
+            rv = 1;
+        }
+        if(tests[i].worker.objectPool.connectionHits == 0) {
+            printf("Worker %d must reuse connections from its own pool.\n", i);
+            rv = 1;
+        }
+    }
+    for(int i = 0; i < WORKER_TEST_CONNECTIONS; ++i) {
+        for(int j = 0; j < WORKER_TEST_CONNECTIONS; ++j) {
+            if(tests[0].ids[i] == tests[1].ids[j]) {
+                printf("Connection IDs must be unique across workers.\n");
+                rv = 1;
+                i = WORKER_TEST_CONNECTIONS;
+                break;
+            }
+        }
+    }
+    if(server->first_connection != first_connection) {
+        printf("Worker connections must not be added to the server's list.\n");
+        rv = 1;
+    }
+
+    for(int i = 0; i < 2; ++i) {
+        marla_Worker_free(&tests[i].worker);
+    }
+    return rv;
+}
+
 int test_sigpipe_client_after_header_response()
 {
     marla_Server server;
@@ -1734,6 +2100,69 @@ int main(int argc, char* argv[])
         ++failed;
     }
 
+    printf("test_buffer_growth:");
+    if(0 == test_buffer_growth(&server)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_describe_peer:");
+    if(0 == test_describe_peer(&server)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_ready_list:");
+    if(0 == test_ready_list(&server)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_exhaust_budget:");
+    if(0 == test_exhaust_budget(&server)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_zero_copy_order:");
+    if(0 == test_zero_copy_order(&server)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_zero_copy_shutdown:");
+    if(0 == test_zero_copy_shutdown(&server)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_worker_connections:");
+    if(0 == test_worker_connections(&server)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
     printf("test_sigpipe_client_after_header_response:");
     if(0 == test_sigpipe_client_after_header_response()) {
         printf("PASSED\n");
@@ -0,0 +1,144 @@
+#include "marla.h"
+#include <string.h>
+#include <time.h>
+
+#define CHURN_ITERATIONS 100000
+
+static void handler(marla_Request* req, marla_ClientEvent ev, void* in, int len)
+{
+    marla_WriteEvent* we;
+    switch(ev) {
+    case marla_EVENT_ACCEPTING_REQUEST:
+        *(int*)in = 1;
+        break;
+    case marla_EVENT_REQUEST_BODY:
+        we = in;
+        if(we->length == 0) {
+            req->readStage = marla_CLIENT_REQUEST_DONE_READING;
+        }
+        break;
+    case marla_EVENT_MUST_WRITE:
+        req->writeStage = marla_CLIENT_REQUEST_AFTER_RESPONSE;
+        break;
+    default:
+        return;
+    }
+}
+
+static void router(marla_Request* req, void* hd)
+{
+    req->handler = handler;
+}
+
+static double elapsed(struct timespec* start, struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// The allocations marla_Connection_new and marla_Connection_destroy made
+// before connections were pooled, kept here as the baseline for comparison.
+static double churn_heap()
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < CHURN_ITERATIONS; ++i) {
+        marla_Connection* cxn = malloc(sizeof(*cxn));
+        cxn->input = marla_Ring_new(marla_BUFSIZE);
+        cxn->output = marla_Ring_new(marla_BUFSIZE);
+        cxn->input->buf[0] = 1;
+        cxn->output->buf[0] = 1;
+        marla_Ring_free(cxn->input);
+        marla_Ring_free(cxn->output);
+        free(cxn);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(&start, &end);
+}
+
+static double churn_pool(marla_Server* server)
+{
+    marla_Pool* pool = &server->objectPool;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < CHURN_ITERATIONS; ++i) {
+        marla_Connection* cxn = marla_Pool_takeConnection(pool);
+        cxn->input = marla_Pool_takeRing(pool, marla_BUFSIZE);
+        cxn->output = marla_Pool_takeRing(pool, marla_BUFSIZE);
+        cxn->input->buf[0] = 1;
+        cxn->output->buf[0] = 1;
+        marla_Pool_releaseRing(pool, cxn->input);
+        marla_Pool_releaseRing(pool, cxn->output);
+        marla_Pool_releaseConnection(pool, cxn);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(&start, &end);
+}
+
+static int churn_requests(marla_Server* server, double* secs)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < CHURN_ITERATIONS; ++i) {
+        marla_Connection* cxn = marla_Connection_new(server);
+        marla_Duplex_init(cxn, marla_BUFSIZE, marla_BUFSIZE);
+
+        char buf[1024];
+        int len = snprintf(buf, sizeof buf, "GET / HTTP/1.1\r\nHost: localhost:%s\r\n\r\n", server->serverport);
+        marla_writeDuplex(cxn, buf, len);
+
+        marla_clientRead(cxn);
+
+        if(cxn->requests_in_process > 0) {
+            marla_dumpRequest(cxn->current_request);
+            return 1;
+        }
+
+        marla_Connection_destroy(cxn);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *secs = elapsed(&start, &end);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    printf("test_connection_churn.\n");
+    apr_initialize();
+    if(argc < 2) {
+        fprintf(stderr, "Too few arguments given; provide serverport.");
+        return 1;
+    }
+
+    marla_Server server;
+    marla_Server_init(&server);
+    marla_Server_addHook(&server, marla_ServerHook_ROUTE, router, 0);
+    strcpy(server.serverport, argv[1]);
+    if(argc > 2 && !strcmp(argv[2], "-hugepages")) {
+        server.objectPool.use_hugepages = 1;
+    }
+
+    // Keep the per-connection destruction messages out of the timings.
+    if(!freopen("/dev/null", "w", stderr)) {
+        perror("freopen");
+        return 1;
+    }
+
+    double heapSecs = churn_heap();
+    double poolSecs = churn_pool(&server);
+    double requestSecs;
+    if(churn_requests(&server, &requestSecs)) {
+        printf("Request churn failed.\n");
+        return 1;
+    }
+
+    printf("%d connections\n", CHURN_ITERATIONS);
+    printf("heap allocation:  %8.1f ns/connection\n", heapSecs * 1e9 / CHURN_ITERATIONS);
+    printf("pool allocation:  %8.1f ns/connection (%.2fx)\n", poolSecs * 1e9 / CHURN_ITERATIONS, heapSecs / poolSecs);
+    printf("request churn:    %8.1f ns/connection\n", requestSecs * 1e9 / CHURN_ITERATIONS);
+    printf("connection pool:  %ld hits, %ld misses\n", server.objectPool.connectionHits, server.objectPool.connectionMisses);
+    printf("ring pool:        %ld hits, %ld misses, %ld slab bytes%s\n", server.objectPool.ringHits, server.objectPool.ringMisses, server.objectPool.slabBytes, server.objectPool.use_hugepages ? " (huge pages)" : "");
+
+    marla_Server_free(&server);
+    apr_terminate();
+    return 0;
+}
@@ -178,6 +178,9 @@ int test2()
     marla_clientRead(client);
     marla_clientWrite(client);
 
+    // Responses are flushed once the event loop is done with the connection.
+    marla_Connection_flush(client, 0);
+
     memset(source_str, 0, sizeof(source_str));
     nwritten = marla_readDuplex(client, source_str, sizeof(source_str));
     if(nwritten == 0) {
@@ -0,0 +1,138 @@
+#include "marla.h"
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+static char path[] = "/tmp/marla_filestoreXXXXXX";
+
+static unsigned char* load(marla_FileStore* store)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    fstat(fd, &sb);
+    unsigned char* data = marla_FileStore_load(store, fd, &sb);
+    close(fd);
+    return data;
+}
+
+// Replaces the file's contents, giving it a new modification time.
+static void put(const char* content)
+{
+    static long version = 0;
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    write(fd, content, strlen(content));
+    struct timespec times[2];
+    times[0].tv_sec = ++version;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    futimens(fd, times);
+    close(fd);
+}
+
+static int test_reuse(marla_FileStore* store)
+{
+    unsigned char* data = load(store);
+    if(!data || strcmp((char*)data, "first")) {
+        fprintf(stderr, "The file's contents must be loaded.\n");
+        return 1;
+    }
+    if(load(store) != data) {
+        fprintf(stderr, "An unchanged file must not be loaded again.\n");
+        return 1;
+    }
+    size_t used = marla_FileStore_used(store);
+
+    put("second");
+    unsigned char* changed = load(store);
+    if(!changed || changed == data || strcmp((char*)changed, "second")) {
+        fprintf(stderr, "A changed file must be loaded again.\n");
+        return 1;
+    }
+    if(strcmp((char*)data, "first")) {
+        fprintf(stderr, "Old contents must not be overwritten.\n");
+        return 1;
+    }
+    if(marla_FileStore_used(store) <= used) {
+        fprintf(stderr, "Changed contents must be appended.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_shared(marla_FileStore* store)
+{
+    put("third");
+    pid_t pid = fork();
+    if(pid == 0) {
+        _exit(load(store) ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    size_t used = marla_FileStore_used(store);
+    unsigned char* data = load(store);
+    if(status != 0 || !data || strcmp((char*)data, "third") || marla_FileStore_used(store) != used) {
+        fprintf(stderr, "Contents loaded by another process must be shared.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_full()
+{
+    marla_FileStore* small = marla_FileStore_new(4);
+    unsigned char* data = load(small);
+    marla_FileStore_free(small);
+    if(data) {
+        fprintf(stderr, "A full store must leave the file to be loaded by the caller.\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    int fd = mkstemp(path);
+    if(fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    put("first");
+
+    int failed = 0;
+    marla_FileStore* store = marla_FileStore_new(4096);
+
+    printf("test_reuse:");
+    if(0 == test_reuse(store)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_shared:");
+    if(0 == test_shared(store)) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_full:");
+    if(0 == test_full()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    marla_FileStore_free(store);
+    unlink(path);
+    return failed;
+}
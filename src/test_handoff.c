@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include "marla.h"
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define NUM_FILES 500
+
+static int test_fds()
+{
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    int pipes[2 * marla_HANDOFF_BATCH + 1][2];
+    int fds[2 * marla_HANDOFF_BATCH + 1];
+    char kinds[2 * marla_HANDOFF_BATCH + 1];
+    int count = sizeof fds / sizeof *fds;
+    for(int i = 0; i < count; ++i) {
+        if(pipe(pipes[i]) != 0) {
+            perror("pipe");
+            return 1;
+        }
+        fds[i] = pipes[i][1];
+        kinds[i] = i % 2 ? 'L' : 'C';
+    }
+    if(marla_Handoff_sendFds(pair[0], fds, kinds, count) != 0) {
+        fprintf(stderr, "Descriptors must be sent in batches.\n");
+        return 1;
+    }
+
+    int received[2 * marla_HANDOFF_BATCH + 1];
+    char receivedKinds[2 * marla_HANDOFF_BATCH + 1];
+    int max = count - 3;
+    if(marla_Handoff_recvFds(pair[1], received, receivedKinds, max) != max) {
+        fprintf(stderr, "Descriptors must be received up to the maximum.\n");
+        return 1;
+    }
+    for(int i = 0; i < max; ++i) {
+        char c = 0;
+        if(receivedKinds[i] != kinds[i] || write(received[i], "x", 1) != 1 || read(pipes[i][0], &c, 1) != 1 || c != 'x') {
+            fprintf(stderr, "Descriptor %d must refer to the one sent.\n", i);
+            return 1;
+        }
+        close(received[i]);
+    }
+    for(int i = 0; i < count; ++i) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return 0;
+}
+
+static int test_truncated()
+{
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    // Send more descriptors in one message than a batch may hold.
+    int fds[marla_HANDOFF_BATCH + 8];
+    char kinds[marla_HANDOFF_BATCH + 8];
+    int count = sizeof fds / sizeof *fds;
+    for(int i = 0; i < count; ++i) {
+        fds[i] = pair[0];
+        kinds[i] = 'L';
+    }
+    char control[CMSG_SPACE(sizeof fds)];
+    memset(control, 0, sizeof control);
+    struct iovec iov;
+    iov.iov_base = kinds;
+    iov.iov_len = count;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+    if(sendmsg(pair[0], &msg, 0) != count) {
+        perror("sendmsg");
+        return 1;
+    }
+
+    int received[marla_HANDOFF_BATCH + 8];
+    char receivedKinds[marla_HANDOFF_BATCH + 8];
+    if(marla_Handoff_recvFds(pair[1], received, receivedKinds, count) != -1) {
+        fprintf(stderr, "A truncated batch of descriptors must be rejected.\n");
+        return 1;
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return 0;
+}
+
+struct Sender {
+marla_Server* server;
+int fd;
+int rv;
+};
+
+static void* sendFileList(void* data)
+{
+    struct Sender* sender = data;
+    sender->rv = marla_Handoff_sendFileList(sender->server, sender->fd);
+    return 0;
+}
+
+// Sends a list of cached files many times larger than the socket's buffer.
+static int test_file_list()
+{
+    char dir[] = "/tmp/marla_handoffXXXXXX";
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char paths[NUM_FILES][PATH_MAX];
+    marla_Server old;
+    marla_Server_init(&old);
+    old.fileCacheifd = inotify_init1(IN_CLOEXEC);
+    for(int i = 0; i < NUM_FILES; ++i) {
+        snprintf(paths[i], sizeof paths[i], "%s/%0160d.html", dir, i);
+        FILE* fp = fopen(paths[i], "w");
+        if(!fp) {
+            perror("fopen");
+            return 1;
+        }
+        fprintf(fp, "%d", i);
+        fclose(fp);
+        marla_Server_getFile(&old, paths[i], dir);
+    }
+
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    int bufSize = 4096;
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof bufSize);
+    setsockopt(pair[1], SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof bufSize);
+
+    struct Sender sender;
+    sender.server = &old;
+    sender.fd = pair[0];
+    sender.rv = -1;
+    pthread_t thread;
+    pthread_create(&thread, 0, sendFileList, &sender);
+
+    marla_Server new;
+    marla_Server_init(&new);
+    new.fileCacheifd = inotify_init1(IN_CLOEXEC);
+    int loaded = marla_Handoff_warmFileCache(&new, pair[1]);
+    pthread_join(thread, 0);
+    if(sender.rv != 0 || loaded != NUM_FILES) {
+        fprintf(stderr, "The whole file list must be sent, but %d of %d files were loaded.\n", loaded, NUM_FILES);
+        return 1;
+    }
+    for(int i = 0; i < NUM_FILES; ++i) {
+        marla_FileEntry* fe = apr_hash_get(new.fileCache, paths[i], APR_HASH_KEY_STRING);
+        if(!fe || fe->length != snprintf(0, 0, "%d", i)) {
+            fprintf(stderr, "%s must be loaded.\n", paths[i]);
+            return 1;
+        }
+    }
+
+    close(pair[0]);
+    close(pair[1]);
+    close(old.fileCacheifd);
+    close(new.fileCacheifd);
+    marla_Server_free(&old);
+    marla_Server_free(&new);
+    for(int i = 0; i < NUM_FILES; ++i) {
+        unlink(paths[i]);
+    }
+    rmdir(dir);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    apr_initialize();
+
+    int failed = 0;
+
+    printf("test_fds:");
+    if(0 == test_fds()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_truncated:");
+    if(0 == test_truncated()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_file_list:");
+    if(0 == test_file_list()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    apr_terminate();
+    return failed;
+}
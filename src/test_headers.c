@@ -0,0 +1,244 @@
+#include "marla.h"
+#include <string.h>
+#include <ctype.h>
+
+static const char* browserHeaders =
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language:en-US,en;q=0.5\n"
+    "X-Empty:   \r\n"
+    "NoSeparator\r\n"
+    "\r\n"
+    "GET / HTTP/1.1\r\n";
+
+static marla_HeaderScan scan;
+
+static void scanString(const char* data, size_t maxLine)
+{
+    marla_scanHeaders(&scan, (const unsigned char*)data, strlen(data), maxLine);
+}
+
+static int test_block()
+{
+    scanString(browserHeaders, marla_MAX_FIELD_LINE_LENGTH);
+    if(scan.status != marla_HEADERS_DONE || scan.numLines != 6) {
+        fprintf(stderr, "A header block must be scanned to its empty line.\n");
+        return 1;
+    }
+    if(scan.next != strstr(browserHeaders, "GET") - browserHeaders) {
+        fprintf(stderr, "A scan must end after the empty line.\n");
+        return 1;
+    }
+    const char* names[] = {"Host", "User-Agent", "Accept", "Accept-Language", "X-Empty", "NoSeparator"};
+    const char* values[] = {"localhost:8080", "Mozilla/5.0", "text/html", "en-US", "", ""};
+    for(int i = 0; i < scan.numLines; ++i) {
+        marla_HeaderLine* line = scan.lines + i;
+        if(line->colon - line->start != strlen(names[i]) || strncmp(browserHeaders + line->start, names[i], strlen(names[i]))) {
+            fprintf(stderr, "Line %d's name must be found.\n", i);
+            return 1;
+        }
+        if(line->end - line->value < strlen(values[i]) || strncmp(browserHeaders + line->value, values[i], strlen(values[i]))) {
+            fprintf(stderr, "Line %d's value must be found.\n", i);
+            return 1;
+        }
+        if(browserHeaders[line->end] != '\r' && browserHeaders[line->end] != '\n') {
+            fprintf(stderr, "Line %d's end must be found.\n", i);
+            return 1;
+        }
+        if(i > 0 && line->start != scan.lines[i - 1].next) {
+            fprintf(stderr, "Line %d must follow the line before it.\n", i);
+            return 1;
+        }
+    }
+    if(scan.lines[4].value != scan.lines[4].end || scan.lines[5].colon != scan.lines[5].end) {
+        fprintf(stderr, "Empty values and missing separators must be found.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_incomplete()
+{
+    scanString("Host: localhost\r\nAccept: */*\r", marla_MAX_FIELD_LINE_LENGTH);
+    if(scan.status != marla_HEADERS_PARTIAL || scan.numLines != 1 || scan.next != 17) {
+        fprintf(stderr, "An incomplete line must not be scanned.\n");
+        return 1;
+    }
+
+    char many[2048] = "";
+    for(int i = 0; i < marla_HEADER_SCAN_LINES + 4; ++i) {
+        strcat(many, "X-Header: value\r\n");
+    }
+    strcat(many, "\r\n");
+    scanString(many, marla_MAX_FIELD_LINE_LENGTH);
+    if(scan.status != marla_HEADERS_FULL || scan.numLines != marla_HEADER_SCAN_LINES || scan.next != 17 * marla_HEADER_SCAN_LINES) {
+        fprintf(stderr, "A scan must stop once its lines are full.\n");
+        return 1;
+    }
+    scanString(many + scan.next, marla_MAX_FIELD_LINE_LENGTH);
+    if(scan.status != marla_HEADERS_DONE || scan.numLines != 4) {
+        fprintf(stderr, "A scan must resume where the last one stopped.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_invalid()
+{
+    struct {
+        const char* data;
+        enum marla_HeaderScanStatus status;
+        size_t errorAt;
+    } cases[] = {
+        {"Host: a\r\nBad Name: b\r\n\r\n", marla_HEADERS_BAD_NAME, 12},
+        {"Host: a\r\n: b\r\n\r\n", marla_HEADERS_BAD_NAME, 9},
+        {"Host: a\x01\r\n\r\n", marla_HEADERS_BAD_VALUE, 7},
+        {"Host: \x80\r\n\r\n", marla_HEADERS_BAD_VALUE, 6},
+        {"Host: a\rb\r\n\r\n", marla_HEADERS_BAD_EOL, 7},
+        {"Host: aaaaaaaaaaaa", marla_HEADERS_TOO_LONG, 12},
+        {"Host: aaaaa\r\n", marla_HEADERS_TOO_LONG, 12}
+    };
+    for(int i = 0; i < sizeof cases / sizeof *cases; ++i) {
+        scanString(cases[i].data, 12);
+        if(scan.status != cases[i].status || scan.errorAt != cases[i].errorAt) {
+            fprintf(stderr, "Case %d must be rejected at %ld, but got status %d at %ld.\n", i, cases[i].errorAt, scan.status, scan.errorAt);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Places every byte at positions scanned both in whole blocks and in the
+// block that ends the data, checking each against the classes it must be in.
+static int test_classes()
+{
+    char line[160];
+    for(int c = 1; c < 256; ++c) {
+        int nameByte = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '\t';
+        int valueByte = (c >= 0x20 && c < 0x7f) || c == '\t';
+        for(int pos = 1; pos < 150; pos += 37) {
+            memset(line, 'a', sizeof line);
+            line[90] = ':';
+            strcpy(line + 150, "\r\n\r\n");
+            if(c == '\r' || c == '\n' || (c == ':' && pos < 90)) {
+                continue;
+            }
+            line[pos] = c;
+            scanString(line, marla_MAX_FIELD_LINE_LENGTH);
+            int valid = pos < 90 ? nameByte : valueByte;
+            if(valid ? scan.status != marla_HEADERS_DONE : scan.errorAt != pos) {
+                fprintf(stderr, "Byte 0x%02x at %d must be %s.\n", c, pos, valid ? "accepted" : "rejected");
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int test_lookup()
+{
+    char name[64];
+    for(enum marla_Field field = marla_FIELD_UNKNOWN + 1; field < marla_FIELD_MAX; ++field) {
+        const char* known = marla_nameField(field);
+        size_t len = strlen(known);
+        for(int i = 0; i <= len; ++i) {
+            name[i] = tolower(known[i]);
+        }
+        if(marla_lookupField(known, len) != field || marla_lookupField(name, len) != field) {
+            fprintf(stderr, "%s must be found regardless of case.\n", known);
+            return 1;
+        }
+        // Change a byte the lookup does not switch on.
+        if(len > 2) {
+            name[len / 2] = name[len / 2] == 'x' ? 'y' : 'x';
+            if(marla_lookupField(name, len) != marla_FIELD_UNKNOWN) {
+                fprintf(stderr, "%s must not be found.\n", name);
+                return 1;
+            }
+        }
+        // CR and hyphen differ only in their 0x20 bit.
+        char* hyphen = strchr(known, '-');
+        if(hyphen) {
+            memcpy(name, known, len + 1);
+            name[hyphen - known] = '\r';
+            if(marla_lookupField(name, len) != marla_FIELD_UNKNOWN) {
+                fprintf(stderr, "%s must not match a CR in place of its hyphen.\n", known);
+                return 1;
+            }
+        }
+    }
+    if(marla_lookupField("Content\rLength", 14) != marla_FIELD_UNKNOWN) {
+        fprintf(stderr, "Content\\rLength must not be found.\n");
+        return 1;
+    }
+    if(marla_lookupField("Hast", 4) != marla_FIELD_UNKNOWN || marla_lookupField("", 0) != marla_FIELD_UNKNOWN) {
+        fprintf(stderr, "Unknown fields must not be found.\n");
+        return 1;
+    }
+
+    for(enum marla_Method method = marla_METHOD_UNKNOWN + 1; method < marla_METHOD_MAX; ++method) {
+        const char* known = marla_nameMethod(method);
+        if(marla_lookupMethod(known, strlen(known)) != method) {
+            fprintf(stderr, "%s must be found.\n", known);
+            return 1;
+        }
+    }
+    if(marla_lookupMethod("get", 3) != marla_METHOD_UNKNOWN || marla_lookupMethod("PATCH", 5) != marla_METHOD_UNKNOWN) {
+        fprintf(stderr, "Methods must be found only by their exact names.\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    int failed = 0;
+
+    printf("test_block:");
+    if(0 == test_block()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_incomplete:");
+    if(0 == test_incomplete()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_invalid:");
+    if(0 == test_invalid()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_classes:");
+    if(0 == test_classes()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_lookup:");
+    if(0 == test_lookup()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    return failed;
+}
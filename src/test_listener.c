@@ -0,0 +1,110 @@
+#include "marla.h"
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+static int test_parse()
+{
+    marla_Listener* listener = marla_Listener_new("127.0.0.1:8080,defer=5,fastopen=256,backlog=64");
+    if(!listener || strcmp(listener->host, "127.0.0.1") || strcmp(listener->port, "8080") || strcmp(listener->address, "127.0.0.1:8080")) {
+        fprintf(stderr, "A listener's host and port must be parsed.\n");
+        return 1;
+    }
+    if(listener->deferAccept != 5 || listener->fastOpen != 256 || listener->backlog != 64) {
+        fprintf(stderr, "A listener's options must be parsed.\n");
+        return 1;
+    }
+    marla_Listener_free(listener);
+
+    listener = marla_Listener_new("[::1]:8081");
+    if(!listener || strcmp(listener->host, "::1") || strcmp(listener->port, "8081") || !listener->is_ipv6) {
+        fprintf(stderr, "A bracketed IPv6 host must be parsed.\n");
+        return 1;
+    }
+    marla_Listener_free(listener);
+
+    listener = marla_Listener_new("8082");
+    if(!listener || listener->host[0] || strcmp(listener->port, "8082") || listener->backlog != SOMAXCONN) {
+        fprintf(stderr, "A port alone must listen on all interfaces.\n");
+        return 1;
+    }
+    marla_Listener_free(listener);
+
+    const char* invalid[] = {"", "8080,defer", "8080,nagle=1", "[::1]8080", "unix:", "unix:/tmp/x,fastopen=1", "8080,backlog=0"};
+    for(int i = 0; i < sizeof invalid / sizeof *invalid; ++i) {
+        listener = marla_Listener_new(invalid[i]);
+        if(listener) {
+            fprintf(stderr, "\"%s\" must be rejected.\n", invalid[i]);
+            marla_Listener_free(listener);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_unix()
+{
+    char path[] = "/tmp/marla_listenerXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+    char spec[64];
+    snprintf(spec, sizeof spec, "unix:%s,backlog=8", path);
+    marla_Listener* listener = marla_Listener_new(spec);
+    if(!listener || !listener->is_unix || strcmp(listener->path, path)) {
+        fprintf(stderr, "A Unix socket's path must be parsed.\n");
+        return 1;
+    }
+
+    // A socket left behind must be replaced.
+    for(int i = 0; i < 2; ++i) {
+        if(listener->fd >= 0) {
+            close(listener->fd);
+        }
+        listener->fd = marla_Listener_bind(listener, 0);
+        if(listener->fd < 0) {
+            fprintf(stderr, "A Unix socket must be bound.\n");
+            return 1;
+        }
+    }
+    marla_Listener* other = marla_Listener_new("unix:/tmp/marla_listener_other");
+    if(!marla_Listener_matches(listener, listener->fd) || marla_Listener_matches(other, listener->fd)) {
+        fprintf(stderr, "A socket must only match its own listener.\n");
+        return 1;
+    }
+    marla_Listener_free(other);
+    marla_Listener_free(listener);
+
+    struct stat sb;
+    if(stat(path, &sb) == 0) {
+        fprintf(stderr, "A Unix socket's path must be removed when it is freed.\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    int failed = 0;
+
+    printf("test_parse:");
+    if(0 == test_parse()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_unix:");
+    if(0 == test_unix()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    return failed;
+}
@@ -2,10 +2,16 @@
 #include <string.h>
 #include <httpd.h>
 #include <unistd.h>
+#include <stdlib.h>
+
+// The tests are run over both plain and mirrored rings. Mirrored rings
+// round their capacity up to the page size, so tests use the capacity of
+// the ring they were given.
+static marla_Ring* (*newRing)(size_t capacity) = marla_Ring_new;
 
 int test_ring_read()
 {
-    marla_Ring* ring = marla_Ring_new(marla_BUFSIZE);
+    marla_Ring* ring = newRing(marla_BUFSIZE);
 
     const char* line = "Hello, world!";
     int linelen = strlen(line) + 1;
@@ -28,14 +34,14 @@ int test_ring_read()
 
 int test_ring_write()
 {
-    marla_Ring* ring = marla_Ring_new(marla_BUFSIZE);
+    marla_Ring* ring = newRing(marla_BUFSIZE);
 
     void* slotData;
     size_t slotLen;
     marla_Ring_writeSlot(ring, &slotData, &slotLen);
 
-    if(slotLen != marla_BUFSIZE) {
-        fprintf(stderr, "slotLen must be equal to the BUFSIZE for an empty ring.\n");
+    if(slotLen != marla_Ring_capacity(ring)) {
+        fprintf(stderr, "slotLen must be equal to the capacity for an empty ring.\n");
         return 1;
     }
     marla_Ring_writeSlot(ring, &slotData, &slotLen);
@@ -50,16 +56,16 @@ int test_ring_write()
 
 int test_ring_readSlot()
 {
-    marla_Ring* ring = marla_Ring_new(marla_BUFSIZE);
-    for(int i = 0; i < marla_BUFSIZE; ++i) {
+    marla_Ring* ring = newRing(marla_BUFSIZE);
+    for(int i = 0; i < marla_Ring_capacity(ring); ++i) {
         marla_Ring_write(ring, "A", 1);
     }
 
     void* slotData;
     size_t slotLen;
     marla_Ring_readSlot(ring, &slotData, &slotLen);
-    if(slotLen != marla_BUFSIZE) {
-        fprintf(stderr, "slotLen must be equal to the BUFSIZE for a full ring.\n");
+    if(slotLen != marla_Ring_capacity(ring)) {
+        fprintf(stderr, "slotLen must be equal to the capacity for a full ring.\n");
         return 1;
     }
     marla_Ring_readSlot(ring, &slotData, &slotLen);
@@ -74,8 +80,8 @@ int test_ring_readSlot()
 
 int test_ring_nearFullReads()
 {
-    const int CAP = 16;
-    marla_Ring* ring = marla_Ring_new(CAP);
+    marla_Ring* ring = newRing(16);
+    const int CAP = marla_Ring_capacity(ring);
     for(int i = 0; i < CAP-1; ++i) {
         marla_Ring_writec(ring, 1+i);
     }
@@ -92,7 +98,7 @@ int test_ring_nearFullReads()
     }
     for(int i = 0; i < CAP-1; ++i) {
         char c = ((char*)bytes)[i];
-        if(c != 1+i) {
+        if(c != (char)(1+i)) {
             fprintf(stderr, "Ring must return bytes in the order written. (%d != %d\n", c, 1+i);
             return 1;
         }
@@ -113,7 +119,7 @@ int test_ring_emptyWrite()
     char buf[CAP];
     const char* given = "abcd" "efgh" "ijkl" "mnop";
     memcpy(buf, given, 16);
-    marla_Ring* ring = marla_Ring_new(CAP);
+    marla_Ring* ring = newRing(CAP);
     marla_Ring_write(ring,buf, 16);
     marla_Ring_write(ring,buf, 0);
 
@@ -138,7 +144,12 @@ int test_ring_simplify()
     unsigned char buf[CAP];
     const char* given = "abcd" "efgh" "ijkl" "mnop";
     memcpy(buf, given, 16);
-    marla_Ring* ring = marla_Ring_new(CAP);
+    marla_Ring* ring = newRing(CAP);
+    if(ring->mirrored) {
+        // Mirrored rings keep their contents in place; see test_ring_mirrored.
+        marla_Ring_free(ring);
+        return 0;
+    }
     marla_Ring_write(ring,buf, 16);
     marla_Ring_read(ring,buf,4);
     marla_Ring_simplify(ring);
@@ -158,7 +169,8 @@ int test_ring_simplify()
 
 int test_ring_write_with_full_ring()
 {
-    marla_Ring* ring = marla_Ring_new(marla_BUFSIZE);
+    marla_Ring* ring = newRing(marla_BUFSIZE);
+    const int CAP = marla_Ring_capacity(ring);
 
     char buf[256];
     memset(buf, 16, sizeof buf);
@@ -170,11 +182,11 @@ int test_ring_write_with_full_ring()
     marla_Ring_writeSlot(ring, &slotData, &slotLen);
 
     if(slotLen == 0) {
-        fprintf(stderr, "slotLen must be equal to the BUFSIZE for an empty ring.\n");
+        fprintf(stderr, "slotLen must be equal to the capacity for an empty ring.\n");
         return 1;
     }
 
-    if(slotLen + sizeof buf != marla_BUFSIZE) {
+    if(slotLen + sizeof buf != CAP) {
         fprintf(stderr, "Unexpected slot size: %ld", slotLen);
         return 1;
     }
@@ -187,46 +199,206 @@ int test_ring_write_with_full_ring()
 
     marla_Ring_putbackWrite(ring, 50);
 
-    unsigned char bigbuf[marla_BUFSIZE];
-    marla_Ring_read(ring, bigbuf, sizeof bigbuf);
+    marla_Ring_skip(ring, CAP);
+
+    if(ring->mirrored) {
+        // The free space of a mirrored ring is one slot, even once it wraps.
+        marla_Ring_writeSlot(ring, &slotData, &slotLen);
+        if(slotLen != CAP) {
+            fprintf(stderr, "WriteSlot size %ld isn't expected %d\n", slotLen, CAP);
+            return 1;
+        }
+    }
+    else {
+        marla_Ring_writeSlot(ring, &slotData, &slotLen);
+        if(slotLen != 50) {
+            fprintf(stderr, "WriteSlot size %ld isn't expected %d %d\n", slotLen, ring->read_index, ring->write_index);
+            return 1;
+        }
+        if(ring->read_index != CAP-50) {
+            fprintf(stderr, "Read index isn't CAP-50, but is %d.\n", ring->read_index);
+            return 1;
+        }
+
+        marla_Ring_writeSlot(ring, &slotData, &slotLen);
+        if(slotLen != CAP - 50) {
+            fprintf(stderr, "WriteSlot size %ld isn't expected %d %d\n", slotLen, ring->read_index, ring->write_index);
+            return 1;
+        }
+        if(ring->read_index != CAP-50) {
+            fprintf(stderr, "Read index isn't CAP-50, but is %d.\n", ring->read_index);
+            return 1;
+        }
+    }
 
     marla_Ring_writeSlot(ring, &slotData, &slotLen);
-    if(slotLen != 50) {
-        fprintf(stderr, "WriteSlot size %ld isn't expected %d %d\n", slotLen, ring->read_index, ring->write_index);
+    if(slotLen != 0) {
+        fprintf(stderr, "Write Slotlen must be zero for full rings");
+        return 1;
+    }
+
+    void* zbuf;
+    size_t zlen;
+    marla_Ring_readSlot(ring, &zbuf, &zlen);
+    if(zlen != (ring->mirrored ? CAP : 50)) {
+        fprintf(stderr, "zlen isn't %d, but is %ld.\n", ring->mirrored ? CAP : 50, zlen);
         return 1;
     }
-    if(ring->read_index != marla_BUFSIZE-50) {
-        fprintf(stderr, "Read index isn't marla_BUFSIZE-50, but is %d.\n", ring->read_index);
+
+    marla_Ring_putbackRead(ring, CAP-10);
+    if(ring->read_index != (ring->mirrored ? CAP-40 : 10)) {
+        fprintf(stderr, "Read index isn't %d, but is %d.\n", ring->mirrored ? CAP-40 : 10, ring->read_index);
         return 1;
     }
 
-    marla_Ring_writeSlot(ring, &slotData, &slotLen);
-    if(slotLen != marla_BUFSIZE - 50) {
-        fprintf(stderr, "WriteSlot size %ld isn't expected %d %d\n", slotLen, ring->read_index, ring->write_index);
+    marla_Ring_free(ring);
+    return 0;
+}
+
+int test_ring_wrappedTransfers()
+{
+    marla_Ring* ring = newRing(16);
+    const int CAP = marla_Ring_capacity(ring);
+    char* given = malloc(CAP + 10);
+    for(int i = 0; i < CAP + 10; ++i) {
+        given[i] = 'a' + i % 26;
+    }
+
+    // Move the indices near the end of the buffer.
+    marla_Ring_write(ring, given, CAP - 4);
+    unsigned char* out = malloc(CAP + 1);
+    marla_Ring_read(ring, out, CAP - 4);
+
+    if(marla_Ring_write(ring, given, CAP + 10) != CAP) {
+        fprintf(stderr, "Ring must only write up to its capacity.\n");
         return 1;
     }
-    if(ring->read_index != marla_BUFSIZE-50) {
-        fprintf(stderr, "Read index isn't marla_BUFSIZE-50, but is %d.\n", ring->read_index);
+    memset(out, 0, CAP + 1);
+    if(marla_Ring_peek(ring, out, 10) != 10 || memcmp(out, given, 10)) {
+        fprintf(stderr, "Ring must peek wrapped data in order.\n");
+        return 1;
+    }
+    if(marla_Ring_size(ring) != CAP) {
+        fprintf(stderr, "Peeking must not consume data.\n");
+        return 1;
+    }
+    if(marla_Ring_skip(ring, 6) != 6) {
+        fprintf(stderr, "Ring must skip the requested amount.\n");
+        return 1;
+    }
+    memset(out, 0, CAP + 1);
+    if(marla_Ring_read(ring, out, CAP) != CAP - 6 || memcmp(out, given + 6, CAP - 6)) {
+        fprintf(stderr, "Ring must read wrapped data in order.\n");
+        return 1;
+    }
+    if(marla_Ring_skip(ring, 1) != 0) {
+        fprintf(stderr, "Ring must not skip past the write index.\n");
         return 1;
     }
 
-    marla_Ring_writeSlot(ring, &slotData, &slotLen);
-    if(slotLen != 0) {
-        fprintf(stderr, "Write Slotlen must be zero for full rings");
+    free(given);
+    free(out);
+    marla_Ring_free(ring);
+    return 0;
+}
+
+int test_ring_iov()
+{
+    marla_Ring* ring = newRing(16);
+    const int CAP = marla_Ring_capacity(ring);
+    const char* given = "abcdefghijklmnopqrstuvwxyz";
+    unsigned char* out = malloc(CAP);
+
+    // Move the indices near the end of the buffer.
+    for(int i = 0; i < CAP - 4; ++i) {
+        marla_Ring_writec(ring, 'z');
+    }
+    marla_Ring_skip(ring, CAP - 4);
+
+    // A mirrored ring's regions are contiguous, so it needs only one.
+    int regions = ring->mirrored ? 1 : 2;
+    struct iovec iov[2];
+    int iovcnt = marla_Ring_writeIov(ring, iov);
+    if(iovcnt != regions || marla_Ring_iovLen(iov, iovcnt) != CAP) {
+        fprintf(stderr, "writeIov must return all free space, but returned %d regions.\n", iovcnt);
+        return 1;
+    }
+    if(regions == 2) {
+        memcpy(iov[0].iov_base, given, iov[0].iov_len);
+        memcpy(iov[1].iov_base, given + iov[0].iov_len, 6);
+    }
+    else {
+        memcpy(iov[0].iov_base, given, 10);
+    }
+    marla_Ring_putbackWrite(ring, CAP - 10);
+    if(marla_Ring_size(ring) != 10) {
+        fprintf(stderr, "Ring size after writeIov is unexpected: %zu\n", marla_Ring_size(ring));
         return 1;
     }
 
-    void* zbuf;
-    size_t zlen;
-    marla_Ring_readSlot(ring, &zbuf, &zlen);
-    if(zlen != 50) {
-        fprintf(stderr, "zlen isn't %d, but is %ld.\n", marla_BUFSIZE, zlen);
+    iovcnt = marla_Ring_readIov(ring, iov);
+    if(iovcnt != regions || marla_Ring_iovLen(iov, iovcnt) != 10 || (regions == 2 && (iov[0].iov_len != 4 || iov[1].iov_len != 6))) {
+        fprintf(stderr, "readIov must return all readable regions.\n");
+        return 1;
+    }
+    if(memcmp(iov[0].iov_base, given, iov[0].iov_len) || (regions == 2 && memcmp(iov[1].iov_base, given + 4, 6))) {
+        fprintf(stderr, "readIov regions must hold the written data in order.\n");
         return 1;
     }
+    marla_Ring_putbackRead(ring, 6);
+    if(marla_Ring_read(ring, out, CAP) != 6 || memcmp(out, given + 4, 6)) {
+        fprintf(stderr, "Putback after readIov must restore unread data.\n");
+        return 1;
+    }
+    if(marla_Ring_readIov(ring, iov) != 0) {
+        fprintf(stderr, "readIov must return no regions for an empty ring.\n");
+        return 1;
+    }
+
+    free(out);
+    marla_Ring_free(ring);
+    return 0;
+}
 
-    marla_Ring_putbackRead(ring, marla_BUFSIZE-10);
-    if(ring->read_index != 10) {
-        fprintf(stderr, "Read index isn't %d, but is %d.\n", marla_BUFSIZE-40, ring->read_index);
+int test_ring_find()
+{
+    const int CAP = 256;
+    marla_Ring* ring = newRing(CAP);
+    char line[200];
+    memset(line, 'a', sizeof line);
+
+    // Move the indices so the contents wrap.
+    marla_Ring_write(ring, line, 150);
+    marla_Ring_skip(ring, 150);
+
+    line[170] = '\r';
+    line[171] = '\n';
+    marla_Ring_write(ring, line, sizeof line);
+
+    if(marla_Ring_find(ring, "\n", CAP) != 171) {
+        fprintf(stderr, "Ring must find a delimiter past the wrap point, but found %d.\n", marla_Ring_find(ring, "\n", CAP));
+        return 1;
+    }
+    if(marla_Ring_find(ring, "\r\n", CAP) != 170) {
+        fprintf(stderr, "Ring must find the first of several delimiters.\n");
+        return 1;
+    }
+    if(marla_Ring_find(ring, "\n", 171) != -1) {
+        fprintf(stderr, "Ring must not search past the given length.\n");
+        return 1;
+    }
+    if(marla_Ring_find(ring, " ", CAP) != -1) {
+        fprintf(stderr, "Ring must not find missing delimiters.\n");
+        return 1;
+    }
+    marla_Ring_skip(ring, 172);
+    if(marla_Ring_find(ring, "\n", CAP) != -1) {
+        fprintf(stderr, "Ring must not search past its contents.\n");
+        return 1;
+    }
+    marla_Ring_write(ring, " x", 2);
+    if(marla_Ring_find(ring, " ", CAP) != 28) {
+        fprintf(stderr, "Ring must find a delimiter at the end of its contents.\n");
         return 1;
     }
 
@@ -234,14 +406,26 @@ int test_ring_write_with_full_ring()
     return 0;
 }
 
-int main()
+static int test_ring_all()
 {
-    fprintf(stderr, "test_ring\n");
     return test_ring_read() ||
         test_ring_write() ||
         test_ring_write_with_full_ring() ||
         test_ring_readSlot() ||
         test_ring_nearFullReads() ||
         test_ring_emptyWrite() ||
-        test_ring_simplify();
+        test_ring_simplify() ||
+        test_ring_wrappedTransfers() ||
+        test_ring_iov() ||
+        test_ring_find();
+}
+
+int main()
+{
+    fprintf(stderr, "test_ring\n");
+    if(test_ring_all()) {
+        return 1;
+    }
+    newRing = marla_Ring_newMirrored;
+    return test_ring_all();
 }
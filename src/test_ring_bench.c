@@ -0,0 +1,97 @@
+#include "marla.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_RING_CAPACITY (128*1024)
+#define BENCH_TOTAL_BYTES (64*1024*1024)
+
+// The byte-at-a-time copy loops that marla_Ring_read and marla_Ring_write used
+// before they were rewritten, kept here as the baseline for comparison.
+static int bytewise_read(marla_Ring* ring, unsigned char* sink, size_t size)
+{
+    int nread = 0;
+    for(unsigned i = 0; i < size; ++i) {
+        if(marla_Ring_size(ring) == 0) {
+            break;
+        }
+        sink[i] = ring->buf[(ring->read_index++) & (ring->capacity-1)];
+        ++nread;
+    }
+    return nread;
+}
+
+static size_t bytewise_write(marla_Ring* ring, const void* source, size_t size)
+{
+    size_t nwritten = 0;
+    for(unsigned i = 0; i < size; ++i) {
+        if(marla_Ring_size(ring) == marla_Ring_capacity(ring)) {
+            return nwritten;
+        }
+        ++nwritten;
+        marla_Ring_writec(ring, ((unsigned char*)source)[i]);
+    }
+    return nwritten;
+}
+
+static double elapsed(struct timespec* start, struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double bench(const char* name, size_t transferSize, int bytewise)
+{
+    marla_Ring* ring = marla_Ring_new(BENCH_RING_CAPACITY);
+    unsigned char* source = malloc(transferSize);
+    unsigned char* sink = malloc(transferSize);
+    for(size_t i = 0; i < transferSize; ++i) {
+        source[i] = i;
+    }
+
+    // Offset the indices so that transfers regularly wrap around the buffer.
+    ring->read_index = BENCH_RING_CAPACITY - 7;
+    ring->write_index = ring->read_index;
+
+    size_t iterations = BENCH_TOTAL_BYTES / transferSize;
+    size_t total = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(size_t i = 0; i < iterations; ++i) {
+        if(bytewise) {
+            bytewise_write(ring, source, transferSize);
+            total += bytewise_read(ring, sink, transferSize);
+        }
+        else {
+            marla_Ring_write(ring, source, transferSize);
+            total += marla_Ring_read(ring, sink, transferSize);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(memcmp(source, sink, transferSize)) {
+        fprintf(stderr, "%s: data read does not match data written.\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    double secs = elapsed(&start, &end);
+    // Each byte is both written and read.
+    double rate = (2.0 * total) / secs / 1e9;
+    printf("%-10s %6ld bytes: %8.3f GB/s (%ld bytes in %.3fs)\n", name, transferSize, rate, total, secs);
+
+    free(source);
+    free(sink);
+    marla_Ring_free(ring);
+    return rate;
+}
+
+int main(int argc, char** argv)
+{
+    printf("test_ring_bench\n");
+    size_t sizes[] = { 16, 1024, 64*1024 };
+    for(int i = 0; i < sizeof(sizes)/sizeof(*sizes); ++i) {
+        double before = bench("bytewise", sizes[i], 1);
+        double after = bench("memcpy", sizes[i], 0);
+        printf("%-10s %6ld bytes: %8.2fx\n", "speedup", sizes[i], after / before);
+    }
+    return 0;
+}
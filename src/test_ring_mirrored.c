@@ -0,0 +1,169 @@
+#include "marla.h"
+#include <string.h>
+#include <unistd.h>
+
+static int fillRing(marla_Ring* ring, size_t count, unsigned char start)
+{
+    for(size_t i = 0; i < count; ++i) {
+        if(!marla_Ring_writec(ring, start + i)) {
+            fprintf(stderr, "Ring filled early after %ld bytes.\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int test_ring_mirrored_capacity()
+{
+    marla_Ring* ring = marla_Ring_newMirrored(16);
+    if(!ring->mirrored) {
+        fprintf(stderr, "Mirrored ring could not be created.\n");
+        return 1;
+    }
+    if(marla_Ring_capacity(ring) != sysconf(_SC_PAGESIZE)) {
+        fprintf(stderr, "Mirrored ring capacity(%ld) must be rounded to the page size.\n", marla_Ring_capacity(ring));
+        return 1;
+    }
+    marla_Ring_free(ring);
+    return 0;
+}
+
+int test_ring_mirrored_readSlot()
+{
+    marla_Ring* ring = marla_Ring_newMirrored(marla_BUFSIZE);
+    size_t cap = marla_Ring_capacity(ring);
+
+    // Move the read head near the end so the contents wrap.
+    if(fillRing(ring, cap - 10, 0)) {
+        return 1;
+    }
+    marla_Ring_skip(ring, cap - 10);
+    if(fillRing(ring, 30, 'a')) {
+        return 1;
+    }
+
+    void* slotData;
+    size_t slotLen;
+    marla_Ring_readSlot(ring, &slotData, &slotLen);
+    if(slotLen != 30) {
+        fprintf(stderr, "Read slot(%ld) must span the wrap point.\n", slotLen);
+        return 1;
+    }
+    for(int i = 0; i < 30; ++i) {
+        if(((unsigned char*)slotData)[i] != 'a' + i) {
+            fprintf(stderr, "Read slot byte %d is unexpected.\n", i);
+            return 1;
+        }
+    }
+    if(!marla_Ring_isEmpty(ring)) {
+        fprintf(stderr, "Ring must be empty after reading the slot.\n");
+        return 1;
+    }
+
+    marla_Ring_free(ring);
+    return 0;
+}
+
+int test_ring_mirrored_writeSlot()
+{
+    marla_Ring* ring = marla_Ring_newMirrored(marla_BUFSIZE);
+    size_t cap = marla_Ring_capacity(ring);
+
+    if(fillRing(ring, cap - 10, 0)) {
+        return 1;
+    }
+    marla_Ring_skip(ring, cap - 20);
+
+    void* slotData;
+    size_t slotLen;
+    marla_Ring_writeSlot(ring, &slotData, &slotLen);
+    if(slotLen != cap - 10) {
+        fprintf(stderr, "Write slot(%ld) must cover all free space(%ld).\n", slotLen, cap - 10);
+        return 1;
+    }
+    memset(slotData, 'z', slotLen);
+
+    // Bytes written past the end must appear at the front of the ring.
+    marla_Ring_skip(ring, 10);
+    unsigned char c;
+    for(size_t i = 0; i < cap - 10; ++i) {
+        if(!marla_Ring_readc(ring, &c) || c != 'z') {
+            fprintf(stderr, "Byte %ld written through the slot is unexpected.\n", i);
+            return 1;
+        }
+    }
+
+    marla_Ring_free(ring);
+    return 0;
+}
+
+int test_ring_mirrored_wrappedTransfers()
+{
+    marla_Ring* ring = marla_Ring_newMirrored(marla_BUFSIZE);
+    size_t cap = marla_Ring_capacity(ring);
+
+    unsigned char in[100];
+    unsigned char out[100];
+    for(int i = 0; i < sizeof in; ++i) {
+        in[i] = i;
+    }
+
+    // Each pass moves the indices across the wrap point.
+    for(size_t pass = 0; pass < 3 * cap / sizeof in; ++pass) {
+        if(marla_Ring_write(ring, in, sizeof in) != sizeof in) {
+            fprintf(stderr, "Write underflowed on pass %ld.\n", pass);
+            return 1;
+        }
+        if(marla_Ring_read(ring, out, sizeof out) != sizeof out) {
+            fprintf(stderr, "Read underflowed on pass %ld.\n", pass);
+            return 1;
+        }
+        if(memcmp(in, out, sizeof in)) {
+            fprintf(stderr, "Data differs on pass %ld.\n", pass);
+            return 1;
+        }
+    }
+
+    marla_Ring_free(ring);
+    return 0;
+}
+
+int test_ring_mirrored_simplify()
+{
+    marla_Ring* ring = marla_Ring_newMirrored(marla_BUFSIZE);
+    size_t cap = marla_Ring_capacity(ring);
+
+    if(fillRing(ring, cap - 10, 0)) {
+        return 1;
+    }
+    marla_Ring_skip(ring, cap - 20);
+    if(fillRing(ring, 20, 0)) {
+        return 1;
+    }
+    unsigned int read_index = ring->read_index;
+    marla_Ring_simplify(ring);
+    if(ring->read_index != read_index || marla_Ring_size(ring) != 30) {
+        fprintf(stderr, "Simplify must not move the contents of a mirrored ring.\n");
+        return 1;
+    }
+
+    marla_Ring_skip(ring, 30);
+    marla_Ring_simplify(ring);
+    if(ring->read_index != 0 || ring->write_index != 0) {
+        fprintf(stderr, "Simplify must reset the indices of an empty mirrored ring.\n");
+        return 1;
+    }
+
+    marla_Ring_free(ring);
+    return 0;
+}
+
+int main()
+{
+    fprintf(stderr, "test_ring_mirrored\n");
+    return test_ring_mirrored_capacity() ||
+        test_ring_mirrored_readSlot() ||
+        test_ring_mirrored_writeSlot() ||
+        test_ring_mirrored_wrappedTransfers() ||
+        test_ring_mirrored_simplify();
+}
@@ -2,10 +2,9 @@
 #include <string.h>
 #include <unistd.h>
 
-int main()
+static int test_ring_putback(marla_Ring* ring)
 {
-    int CAP = 1024;
-    marla_Ring* ring = marla_Ring_new(CAP);
+    int CAP = marla_Ring_capacity(ring);
 
     const char* line = "0123456789";
     int nwritten = marla_Ring_write(ring, line, 4);
@@ -18,7 +17,7 @@ int main()
     marla_Ring_writec(ring, 'P');
 
     unsigned char out[marla_BUFSIZE];
-    int nread = marla_Ring_read(ring, out, CAP);
+    int nread = marla_Ring_read(ring, out, sizeof out);
     if(nread != 4) {
         fprintf(stderr, "nread(%d) must be equal to 4, the expected number of written characters.", nread);
         return 2;
@@ -39,3 +38,12 @@ int main()
     marla_Ring_free(ring);
     return 0;
 }
+
+int main()
+{
+    int rv = test_ring_putback(marla_Ring_new(1024));
+    if(rv != 0) {
+        return rv;
+    }
+    return test_ring_putback(marla_Ring_newMirrored(1024));
+}
@@ -1,13 +1,11 @@
 #include "marla.h"
 #include <string.h>
 
-int main()
+static int test_ring_slot(marla_Ring* ring)
 {
-    int CAP = 8;
-    marla_Ring* ring = marla_Ring_create(CAP);
+    int CAP = marla_Ring_capacity(ring);
 
     const char* line = "0123456789";
-    int linelen = strlen(line) + 1;
     int nwritten = marla_Ring_write(ring, line, 4);
     if(nwritten != 4) {
         fprintf(stderr, "Write underflowed(%d).\n", nwritten);
@@ -18,27 +16,32 @@ int main()
     size_t len;
     marla_Ring_writeSlot(ring, &buf, &len);
 
-    if(len != 4) {
-        fprintf(stderr, "Write slot underflowed(%d).\n", nwritten);
+    if(len != CAP - 4) {
+        fprintf(stderr, "Write slot underflowed(%ld).\n", len);
         return 1;
     }
 
-    if(marla_Ring_size(ring) != 8) {
-        fprintf(stderr, "Ring size(%d) is unexpected.\n", marla_Ring_size(ring));
+    if(marla_Ring_size(ring) != CAP) {
+        fprintf(stderr, "Ring size(%ld) is unexpected.\n", marla_Ring_size(ring));
         return 1;
     }
 
     marla_Ring_readSlot(ring, &buf, &len);
-    if(len != 8) {
-        fprintf(stderr, "Read slot underflowed(%d).\n", nwritten);
+    if(len != CAP) {
+        fprintf(stderr, "Read slot underflowed(%ld).\n", len);
         return 1;
     }
 
     if(marla_Ring_size(ring) != 0) {
-        fprintf(stderr, "Ring size(%d) is unexpected.\n", marla_Ring_size(ring));
+        fprintf(stderr, "Ring size(%ld) is unexpected.\n", marla_Ring_size(ring));
         return 1;
     }
 
     marla_Ring_free(ring);
     return 0;
 }
+
+int main()
+{
+    return test_ring_slot(marla_Ring_new(8)) || test_ring_slot(marla_Ring_newMirrored(8));
+}
@@ -0,0 +1,74 @@
+#include "marla.h"
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define BENCH_RING_CAPACITY (64*1024)
+#define BENCH_TOTAL_BYTES (256*1024*1024L)
+
+struct bench_args {
+marla_SpscRing* ring;
+size_t transferSize;
+};
+
+static double elapsed(struct timespec* start, struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void* produce(void* data)
+{
+    struct bench_args* args = data;
+    unsigned char* source = malloc(args->transferSize);
+    memset(source, 'A', args->transferSize);
+    for(size_t sent = 0; sent < BENCH_TOTAL_BYTES;) {
+        size_t nwritten = marla_SpscRing_write(args->ring, source, args->transferSize);
+        if(nwritten == 0) {
+            // Let the consumer run if it shares this CPU.
+            sched_yield();
+        }
+        sent += nwritten;
+    }
+    free(source);
+    return 0;
+}
+
+static void bench(size_t transferSize)
+{
+    struct bench_args args;
+    args.ring = marla_SpscRing_new(BENCH_RING_CAPACITY);
+    args.transferSize = transferSize;
+    unsigned char* sink = malloc(transferSize);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t producer;
+    if(pthread_create(&producer, 0, produce, &args) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t received = 0; received < BENCH_TOTAL_BYTES;) {
+        size_t nread = marla_SpscRing_read(args.ring, sink, transferSize);
+        if(nread == 0) {
+            sched_yield();
+        }
+        received += nread;
+    }
+    pthread_join(producer, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = elapsed(&start, &end);
+    printf("%6ld-byte transfers: %6.2f GB/s\n", transferSize, BENCH_TOTAL_BYTES / secs / 1e9);
+    free(sink);
+    marla_SpscRing_free(args.ring);
+}
+
+int main()
+{
+    printf("test_spsc_bench: %ld bytes through a %d-byte ring between two threads.\n", BENCH_TOTAL_BYTES, BENCH_RING_CAPACITY);
+    bench(64);
+    bench(1024);
+    bench(16384);
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include "marla.h"
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define STRESS_CAPACITY 64
+#define STRESS_TOTAL (16*1024*1024)
+
+static void* produce(void* data)
+{
+    marla_SpscRing* ring = data;
+    unsigned char buf[37];
+    size_t sent = 0;
+    while(sent < STRESS_TOTAL) {
+        size_t len = sizeof buf;
+        if(len > STRESS_TOTAL - sent) {
+            len = STRESS_TOTAL - sent;
+        }
+        for(size_t i = 0; i < len; ++i) {
+            buf[i] = (sent + i) % 251;
+        }
+        size_t written = 0;
+        while(written < len) {
+            size_t nwritten = marla_SpscRing_write(ring, buf + written, len - written);
+            if(nwritten == 0) {
+                // Let the consumer run if it shares this CPU.
+                sched_yield();
+            }
+            written += nwritten;
+        }
+        sent += len;
+    }
+    return 0;
+}
+
+static int consume(marla_SpscRing* ring)
+{
+    size_t received = 0;
+    while(received < STRESS_TOTAL) {
+        void* slot;
+        size_t slotLen;
+        marla_SpscRing_readSlot(ring, &slot, &slotLen);
+        if(slotLen > marla_SpscRing_capacity(ring)) {
+            fprintf(stderr, "Read slot(%ld) exceeds capacity.\n", slotLen);
+            return 1;
+        }
+        for(size_t i = 0; i < slotLen; ++i) {
+            if(((unsigned char*)slot)[i] != (received + i) % 251) {
+                fprintf(stderr, "Byte %ld is unexpected: %d\n", received + i, ((unsigned char*)slot)[i]);
+                return 1;
+            }
+        }
+        marla_SpscRing_commitRead(ring, slotLen);
+        if(slotLen == 0) {
+            sched_yield();
+        }
+        received += slotLen;
+    }
+    return 0;
+}
+
+int test_spsc_ring_basic()
+{
+    marla_SpscRing* ring = marla_SpscRing_new(16);
+    const char* given = "abcdefghijklmnopqrstuvwxyz";
+    unsigned char out[32];
+
+    if(marla_SpscRing_write(ring, given, 26) != 16) {
+        fprintf(stderr, "Ring must only write up to its capacity.\n");
+        return 1;
+    }
+    if(marla_SpscRing_read(ring, out, 10) != 10 || memcmp(out, given, 10)) {
+        fprintf(stderr, "Ring must read data in order.\n");
+        return 1;
+    }
+    if(marla_SpscRing_write(ring, given + 16, 10) != 10) {
+        fprintf(stderr, "Ring must write across the wrap point.\n");
+        return 1;
+    }
+
+    void* slot;
+    size_t slotLen;
+    marla_SpscRing_readSlot(ring, &slot, &slotLen);
+    if(slotLen != 6) {
+        fprintf(stderr, "Read slot must end at the wrap point, but was %ld.\n", slotLen);
+        return 1;
+    }
+    if(marla_SpscRing_size(ring) != 16) {
+        fprintf(stderr, "Read slots must not consume data until committed.\n");
+        return 1;
+    }
+    if(marla_SpscRing_read(ring, out, sizeof out) != 16 || memcmp(out, given + 10, 16)) {
+        fprintf(stderr, "Ring must read wrapped data in order.\n");
+        return 1;
+    }
+
+    marla_SpscRing_free(ring);
+    return 0;
+}
+
+int test_spsc_ring_threads()
+{
+    marla_SpscRing* ring = marla_SpscRing_new(STRESS_CAPACITY);
+    pthread_t producer;
+    if(pthread_create(&producer, 0, produce, ring) != 0) {
+        perror("pthread_create");
+        return 1;
+    }
+    int rv = consume(ring);
+    pthread_join(producer, 0);
+    if(marla_SpscRing_size(ring) != 0) {
+        fprintf(stderr, "Ring must be empty after all data is consumed.\n");
+        rv = 1;
+    }
+    marla_SpscRing_free(ring);
+    return rv;
+}
+
+int main()
+{
+    fprintf(stderr, "test_spsc_ring\n");
+    return test_spsc_ring_basic() ||
+        test_spsc_ring_threads();
+}
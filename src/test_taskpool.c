@@ -0,0 +1,168 @@
+#include "marla.h"
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_TASKS 64
+
+static atomic_int ran;
+static int done[NUM_TASKS];
+static pthread_t loop;
+static int doneElsewhere;
+
+static void count(marla_Task* task)
+{
+    atomic_fetch_add(&ran, 1);
+}
+
+static void finish(marla_Task* task)
+{
+    ++done[(long)task->data];
+    if(!pthread_equal(pthread_self(), loop)) {
+        ++doneElsewhere;
+    }
+}
+
+// Waits for the completions' eventfd like an event loop, finishing tasks
+// until the given number are done.
+static int wait_for(marla_TaskCompletions* completions, int numTasks)
+{
+    int numDone = 0;
+    while(numDone < numTasks) {
+        struct pollfd pfd = {completions->fd, POLLIN, 0};
+        if(poll(&pfd, 1, 5000) != 1) {
+            return -1;
+        }
+        numDone += marla_TaskCompletions_finish(completions);
+    }
+    return 0;
+}
+
+static marla_Task* submit(marla_TaskPool* pool, marla_TaskCompletions* completions, void(*run)(marla_Task*), long index)
+{
+    marla_Task* task = marla_Task_new(run, finish, (void*)index);
+    task->completions = completions;
+    marla_TaskPool_submit(pool, task);
+    return task;
+}
+
+static int test_complete()
+{
+    marla_TaskCompletions completions;
+    marla_TaskCompletions_init(&completions);
+    marla_TaskPool* pool = marla_TaskPool_new(2);
+    atomic_store(&ran, 0);
+    memset(done, 0, sizeof done);
+    doneElsewhere = 0;
+    for(long i = 0; i < NUM_TASKS; ++i) {
+        submit(pool, &completions, count, i);
+    }
+    int failed = wait_for(&completions, NUM_TASKS);
+    marla_TaskPool_free(pool);
+    marla_TaskCompletions_free(&completions);
+    if(failed || atomic_load(&ran) != NUM_TASKS) {
+        fprintf(stderr, "Every task must be run.\n");
+        return 1;
+    }
+    for(int i = 0; i < NUM_TASKS; ++i) {
+        if(done[i] != 1) {
+            fprintf(stderr, "Every task must be completed once.\n");
+            return 1;
+        }
+    }
+    if(doneElsewhere) {
+        fprintf(stderr, "Tasks must be completed by the thread that finishes them.\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Holds its thread until every other task has run, so the tasks queued
+// behind it can only run if they are stolen.
+static void block(marla_Task* task)
+{
+    for(int i = 0; i < 5000 && atomic_load(&ran) < NUM_TASKS - 1; ++i) {
+        usleep(1000);
+    }
+}
+
+static int test_steal()
+{
+    marla_TaskCompletions completions;
+    marla_TaskCompletions_init(&completions);
+    marla_TaskPool* pool = marla_TaskPool_new(3);
+    atomic_store(&ran, 0);
+    memset(done, 0, sizeof done);
+    submit(pool, &completions, block, 0);
+    for(long i = 1; i < NUM_TASKS; ++i) {
+        submit(pool, &completions, count, i);
+    }
+    int failed = wait_for(&completions, NUM_TASKS);
+    long stolen = atomic_load(&pool->stolen);
+    marla_TaskPool_free(pool);
+    marla_TaskCompletions_free(&completions);
+    if(failed || atomic_load(&ran) != NUM_TASKS - 1) {
+        fprintf(stderr, "Tasks behind a long task must be run by other threads.\n");
+        return 1;
+    }
+    if(stolen == 0) {
+        fprintf(stderr, "Idle threads must steal queued tasks.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_inline()
+{
+    marla_TaskCompletions completions;
+    marla_TaskCompletions_init(&completions);
+    atomic_store(&ran, 0);
+    memset(done, 0, sizeof done);
+    submit(0, &completions, count, 0);
+    if(atomic_load(&ran) != 1 || done[0] != 0) {
+        fprintf(stderr, "Without a pool, a task must be run immediately but completed later.\n");
+        return 1;
+    }
+    int failed = wait_for(&completions, 1);
+    marla_TaskCompletions_free(&completions);
+    if(failed || done[0] != 1) {
+        fprintf(stderr, "Without a pool, a task must still be completed.\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    loop = pthread_self();
+    int failed = 0;
+
+    printf("test_complete:");
+    if(0 == test_complete()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_steal:");
+    if(0 == test_steal()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_inline:");
+    if(0 == test_inline()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    return failed;
+}
@@ -0,0 +1,210 @@
+#include "marla.h"
+#include <string.h>
+
+static int fired[8];
+
+static void countFire(marla_Timer* timer, void* data)
+{
+    ++fired[(long)data];
+}
+
+// Moves the wheel's clock forward by pretending it was created earlier.
+static void elapse(marla_TimerWheel* wheel, long ms)
+{
+    wheel->start.tv_sec -= ms / 1000;
+    wheel->start.tv_nsec -= (ms % 1000) * 1000000L;
+    if(wheel->start.tv_nsec < 0) {
+        wheel->start.tv_nsec += 1000000000L;
+        wheel->start.tv_sec -= 1;
+    }
+}
+
+static int test_order()
+{
+    marla_TimerWheel wheel;
+    marla_TimerWheel_init(&wheel);
+    memset(fired, 0, sizeof fired);
+    marla_Timer timers[3];
+    long delays[] = {100, 250, 1000};
+    for(long i = 0; i < 3; ++i) {
+        marla_Timer_init(timers + i, countFire, (void*)i);
+        marla_TimerWheel_schedule(&wheel, timers + i, delays[i]);
+    }
+    if(marla_TimerWheel_advance(&wheel) != 0) {
+        fprintf(stderr, "No timer may run before its deadline.\n");
+        return 1;
+    }
+    elapse(&wheel, 300);
+    if(marla_TimerWheel_advance(&wheel) != 2 || !fired[0] || !fired[1] || fired[2]) {
+        fprintf(stderr, "Only the expired timers must run.\n");
+        return 1;
+    }
+    int timeout = marla_TimerWheel_nextTimeout(&wheel);
+    if(timeout < 0 || timeout > 800) {
+        fprintf(stderr, "Next timeout (%d) must not be later than the last timer.\n", timeout);
+        return 1;
+    }
+    elapse(&wheel, 800);
+    if(marla_TimerWheel_advance(&wheel) != 1 || !fired[2]) {
+        fprintf(stderr, "The last timer must run once its deadline passes.\n");
+        return 1;
+    }
+    if(wheel.count != 0 || marla_TimerWheel_nextTimeout(&wheel) != -1) {
+        fprintf(stderr, "An empty wheel must have no timeout.\n");
+        return 1;
+    }
+    marla_TimerWheel_free(&wheel);
+    return 0;
+}
+
+static int test_cancel()
+{
+    marla_TimerWheel wheel;
+    marla_TimerWheel_init(&wheel);
+    memset(fired, 0, sizeof fired);
+    marla_Timer timer;
+    marla_Timer_init(&timer, countFire, 0);
+    marla_TimerWheel_schedule(&wheel, &timer, 100);
+    marla_TimerWheel_cancel(&timer);
+    if(marla_Timer_isActive(&timer) || wheel.count != 0) {
+        fprintf(stderr, "A cancelled timer must leave the wheel.\n");
+        return 1;
+    }
+    elapse(&wheel, 1000);
+    if(marla_TimerWheel_advance(&wheel) != 0 || fired[0]) {
+        fprintf(stderr, "A cancelled timer must not run.\n");
+        return 1;
+    }
+    marla_TimerWheel_free(&wheel);
+    return 0;
+}
+
+static int test_rotations()
+{
+    marla_TimerWheel wheel;
+    marla_TimerWheel_init(&wheel);
+    memset(fired, 0, sizeof fired);
+    marla_Timer timer;
+    marla_Timer_init(&timer, countFire, 0);
+    long rotation = marla_TIMER_SLOTS * marla_TIMER_TICK_MS;
+    marla_TimerWheel_schedule(&wheel, &timer, rotation + 5 * marla_TIMER_TICK_MS);
+    for(long t = 0; t < rotation; t += marla_TIMER_TICK_MS) {
+        elapse(&wheel, marla_TIMER_TICK_MS);
+        marla_TimerWheel_advance(&wheel);
+    }
+    if(fired[0]) {
+        fprintf(stderr, "A timer must wait for its deadline's rotation.\n");
+        return 1;
+    }
+    elapse(&wheel, 10 * marla_TIMER_TICK_MS);
+    if(marla_TimerWheel_advance(&wheel) != 1) {
+        fprintf(stderr, "A timer must run in its deadline's rotation.\n");
+        return 1;
+    }
+    marla_TimerWheel_free(&wheel);
+    return 0;
+}
+
+static int test_long_gap()
+{
+    marla_TimerWheel wheel;
+    marla_TimerWheel_init(&wheel);
+    memset(fired, 0, sizeof fired);
+    marla_Timer timers[2];
+    marla_Timer_init(timers, countFire, (void*)0);
+    marla_Timer_init(timers + 1, countFire, (void*)1);
+    marla_TimerWheel_schedule(&wheel, timers, 100);
+    marla_TimerWheel_schedule(&wheel, timers + 1, 5000);
+    elapse(&wheel, 10 * marla_TIMER_SLOTS * marla_TIMER_TICK_MS);
+    if(marla_TimerWheel_advance(&wheel) != 2) {
+        fprintf(stderr, "Every overdue timer must run after a long wait.\n");
+        return 1;
+    }
+    marla_TimerWheel_free(&wheel);
+    return 0;
+}
+
+static void rescheduleSelf(marla_Timer* timer, void* data)
+{
+    marla_TimerWheel* wheel = data;
+    if(++fired[0] == 1) {
+        marla_TimerWheel_schedule(wheel, timer, 100);
+    }
+}
+
+static int test_reschedule()
+{
+    marla_TimerWheel wheel;
+    marla_TimerWheel_init(&wheel);
+    memset(fired, 0, sizeof fired);
+    marla_Timer timer;
+    marla_Timer_init(&timer, rescheduleSelf, &wheel);
+    marla_TimerWheel_schedule(&wheel, &timer, 100);
+    elapse(&wheel, 200);
+    marla_TimerWheel_advance(&wheel);
+    if(fired[0] != 1 || !marla_Timer_isActive(&timer)) {
+        fprintf(stderr, "A timer must be able to reschedule itself.\n");
+        return 1;
+    }
+    elapse(&wheel, 200);
+    marla_TimerWheel_advance(&wheel);
+    if(fired[0] != 2 || marla_Timer_isActive(&timer)) {
+        fprintf(stderr, "A rescheduled timer must run again.\n");
+        return 1;
+    }
+    marla_TimerWheel_free(&wheel);
+    return 0;
+}
+
+int main()
+{
+    printf("Testing timer wheel ...\n");
+    int failed = 0;
+
+    printf("test_order:");
+    if(0 == test_order()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_cancel:");
+    if(0 == test_cancel()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_rotations:");
+    if(0 == test_rotations()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_long_gap:");
+    if(0 == test_long_gap()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    printf("test_reschedule:");
+    if(0 == test_reschedule()) {
+        printf("PASSED\n");
+    }
+    else {
+        printf("FAILED\n");
+        ++failed;
+    }
+
+    return failed;
+}
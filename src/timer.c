@@ -0,0 +1,215 @@
+#include "marla.h"
+#include <string.h>
+#include <time.h>
+
+// A hashed timer wheel. Each timer is kept in the slot for its deadline's
+// tick, so scheduling and cancelling are constant-time, and each tick only
+// visits the timers in one slot. A wheel belongs to one event loop and is
+// only used while that loop's lock is held.
+
+void marla_Timer_init(marla_Timer* timer, void(*callback)(marla_Timer*, void*), void* data)
+{
+    timer->wheel = 0;
+    timer->deadline = 0;
+    timer->slot = -1;
+    timer->owned = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->prev = 0;
+    timer->next = 0;
+}
+
+int marla_Timer_isActive(marla_Timer* timer)
+{
+    return timer->wheel != 0;
+}
+
+void marla_TimerWheel_init(marla_TimerWheel* wheel)
+{
+    clock_gettime(CLOCK_MONOTONIC, &wheel->start);
+    wheel->now = 0;
+    wheel->nextDeadline = LONG_MAX;
+    wheel->count = 0;
+    wheel->expired = 0;
+    memset(wheel->slots, 0, sizeof wheel->slots);
+    for(int i = 0; i < marla_TIMER_SLOTS; ++i) {
+        wheel->slotDeadlines[i] = LONG_MAX;
+    }
+}
+
+static marla_Timer** timerList(marla_TimerWheel* wheel, int slot)
+{
+    return slot < 0 ? &wheel->expired : wheel->slots + slot;
+}
+
+static void linkTimer(marla_TimerWheel* wheel, marla_Timer* timer, int slot)
+{
+    marla_Timer** list = timerList(wheel, slot);
+    timer->wheel = wheel;
+    timer->slot = slot;
+    timer->prev = 0;
+    timer->next = *list;
+    if(*list) {
+        (*list)->prev = timer;
+    }
+    *list = timer;
+    ++wheel->count;
+}
+
+static void unlinkTimer(marla_Timer* timer)
+{
+    marla_TimerWheel* wheel = timer->wheel;
+    if(timer->prev) {
+        timer->prev->next = timer->next;
+    }
+    else {
+        *timerList(wheel, timer->slot) = timer->next;
+    }
+    if(timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = 0;
+    timer->next = 0;
+    timer->wheel = 0;
+    timer->slot = -1;
+    --wheel->count;
+}
+
+void marla_TimerWheel_free(marla_TimerWheel* wheel)
+{
+    for(int i = -1; i < marla_TIMER_SLOTS; ++i) {
+        marla_Timer** list = timerList(wheel, i);
+        while(*list) {
+            marla_Timer* timer = *list;
+            unlinkTimer(timer);
+            if(timer->owned) {
+                free(timer);
+            }
+        }
+    }
+}
+
+// Returns the number of ticks since the wheel was created.
+long marla_TimerWheel_tick(marla_TimerWheel* wheel)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long ms = (ts.tv_sec - wheel->start.tv_sec) * 1000 + (ts.tv_nsec - wheel->start.tv_nsec) / 1000000;
+    return ms / marla_TIMER_TICK_MS;
+}
+
+// Schedules the timer to run once after the given number of milliseconds,
+// rounded up to the next tick. A scheduled timer is moved.
+void marla_TimerWheel_schedule(marla_TimerWheel* wheel, marla_Timer* timer, long ms)
+{
+    if(timer->wheel) {
+        unlinkTimer(timer);
+    }
+    long ticks = (ms + marla_TIMER_TICK_MS - 1) / marla_TIMER_TICK_MS;
+    if(ticks < 1) {
+        ticks = 1;
+    }
+    timer->deadline = marla_TimerWheel_tick(wheel) + ticks;
+    int slot = timer->deadline & (marla_TIMER_SLOTS - 1);
+    linkTimer(wheel, timer, slot);
+    if(timer->deadline < wheel->slotDeadlines[slot]) {
+        wheel->slotDeadlines[slot] = timer->deadline;
+    }
+    if(timer->deadline < wheel->nextDeadline) {
+        wheel->nextDeadline = timer->deadline;
+    }
+}
+
+void marla_TimerWheel_cancel(marla_Timer* timer)
+{
+    // Slot deadlines are left as lower bounds, and corrected by the next
+    // pass over their slot.
+    if(timer->wheel) {
+        unlinkTimer(timer);
+    }
+}
+
+// Runs every timer whose deadline has passed. Returns the number of timers
+// run.
+int marla_TimerWheel_advance(marla_TimerWheel* wheel)
+{
+    long current = marla_TimerWheel_tick(wheel);
+    if(current > wheel->now) {
+        // Visit each slot at most once, however long it has been.
+        long from = wheel->now + 1;
+        if(current - wheel->now > marla_TIMER_SLOTS) {
+            from = current - marla_TIMER_SLOTS + 1;
+        }
+        for(long tick = from; tick <= current; ++tick) {
+            int slot = tick & (marla_TIMER_SLOTS - 1);
+            long slotDeadline = LONG_MAX;
+            for(marla_Timer* timer = wheel->slots[slot]; timer;) {
+                marla_Timer* next = timer->next;
+                if(timer->deadline <= current) {
+                    unlinkTimer(timer);
+                    linkTimer(wheel, timer, -1);
+                }
+                else if(timer->deadline < slotDeadline) {
+                    slotDeadline = timer->deadline;
+                }
+                timer = next;
+            }
+            wheel->slotDeadlines[slot] = slotDeadline;
+        }
+        wheel->now = current;
+        wheel->nextDeadline = LONG_MAX;
+        for(int i = 0; i < marla_TIMER_SLOTS; ++i) {
+            if(wheel->slotDeadlines[i] < wheel->nextDeadline) {
+                wheel->nextDeadline = wheel->slotDeadlines[i];
+            }
+        }
+    }
+
+    int ran = 0;
+    while(wheel->expired) {
+        marla_Timer* timer = wheel->expired;
+        unlinkTimer(timer);
+        if(timer->owned) {
+            // Mark the timer as running, so cancelling it from its own
+            // callback does not free it.
+            timer->owned = 2;
+        }
+        timer->callback(timer, timer->data);
+        ++ran;
+        if(timer->owned) {
+            if(timer->wheel) {
+                timer->owned = 1;
+            }
+            else {
+                free(timer);
+            }
+        }
+    }
+    return ran;
+}
+
+// Returns the milliseconds until the next timer is due, or -1 if no timer
+// is scheduled. The result may be early, but is never late.
+int marla_TimerWheel_nextTimeout(marla_TimerWheel* wheel)
+{
+    if(wheel->count == 0) {
+        return -1;
+    }
+    if(wheel->expired) {
+        return 0;
+    }
+    if(wheel->nextDeadline == LONG_MAX) {
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long ms = (ts.tv_sec - wheel->start.tv_sec) * 1000 + (ts.tv_nsec - wheel->start.tv_nsec) / 1000000;
+    long wait = wheel->nextDeadline * marla_TIMER_TICK_MS - ms;
+    if(wait < 0) {
+        return 0;
+    }
+    if(wait > INT_MAX) {
+        return INT_MAX;
+    }
+    return wait;
+}
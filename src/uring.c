@@ -0,0 +1,533 @@
+#include "marla.h"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// An io_uring driven alternative to epoll and read/write. Cleartext
+// connections are read and written through staging buffers that are
+// registered with the kernel, so the connection's own rings may still be
+// resized or simplified while an operation is in flight. Each operation's
+// user_data is its source pointer, tagged with a marla_UringOp in the low
+// bits.
+
+#define URING_OP_MASK 7
+
+static __u64 tag(void* ptr, enum marla_UringOp op)
+{
+    return (__u64)(uintptr_t)ptr | op;
+}
+
+static void* untag(__u64 userData)
+{
+    return (void*)(uintptr_t)(userData & ~(__u64)URING_OP_MASK);
+}
+
+enum marla_UringOp marla_Uring_op(struct io_uring_cqe* cqe)
+{
+    return cqe->user_data & URING_OP_MASK;
+}
+
+static int uring_enter(marla_Uring* uring, unsigned int toSubmit, unsigned int minComplete, unsigned int flags, void* arg, size_t argLen)
+{
+    return syscall(__NR_io_uring_enter, uring->fd, toSubmit, minComplete, flags, arg, argLen);
+}
+
+int marla_Uring_init(marla_Uring* uring, unsigned int entries)
+{
+    memset(uring, 0, sizeof *uring);
+    uring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0) {
+        return -1;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    uring->fd = fd;
+    uring->entries = params.sq_entries;
+
+    // Map the submission and completion rings together.
+    size_t sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ringMapLen = sqLen > cqLen ? sqLen : cqLen;
+    uring->ringMap = mmap(0, uring->ringMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(uring->ringMap == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    uring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(0, uring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(uring->sqes == MAP_FAILED) {
+        munmap(uring->ringMap, uring->ringMapLen);
+        close(fd);
+        return -1;
+    }
+
+    char* ring = uring->ringMap;
+    uring->sqHead = (unsigned int*)(ring + params.sq_off.head);
+    uring->sqTail = (unsigned int*)(ring + params.sq_off.tail);
+    uring->sqMask = *(unsigned int*)(ring + params.sq_off.ring_mask);
+    uring->sqArray = (unsigned int*)(ring + params.sq_off.array);
+    uring->sqeTail = *uring->sqTail;
+    uring->cqHead = (unsigned int*)(ring + params.cq_off.head);
+    uring->cqTail = (unsigned int*)(ring + params.cq_off.tail);
+    uring->cqMask = *(unsigned int*)(ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    // Create the staging buffers, and register them if allowed.
+    uring->buffers = mmap(0, marla_URING_BUFFERS * marla_URING_BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(uring->buffers == MAP_FAILED) {
+        marla_Uring_free(uring);
+        return -1;
+    }
+    uring->freeBuffers = malloc(marla_URING_BUFFERS * sizeof(int));
+    for(int i = 0; i < marla_URING_BUFFERS; ++i) {
+        uring->freeBuffers[i] = marla_URING_BUFFERS - 1 - i;
+    }
+    uring->numFreeBuffers = marla_URING_BUFFERS;
+    struct iovec iov;
+    iov.iov_base = uring->buffers;
+    iov.iov_len = marla_URING_BUFFERS * marla_URING_BUFSIZE;
+    uring->registeredBuffers = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+    uring->multishotAccept = 1;
+    uring->readTimeout.tv_sec = marla_URING_READ_TIMEOUT;
+    uring->readTimeout.tv_nsec = 0;
+    return 0;
+}
+
+void marla_Uring_free(marla_Uring* uring)
+{
+    if(uring->buffers && uring->buffers != MAP_FAILED) {
+        munmap(uring->buffers, marla_URING_BUFFERS * marla_URING_BUFSIZE);
+    }
+    uring->buffers = 0;
+    free(uring->freeBuffers);
+    uring->freeBuffers = 0;
+    if(uring->sqes && uring->sqes != MAP_FAILED) {
+        munmap(uring->sqes, uring->sqesLen);
+    }
+    uring->sqes = 0;
+    if(uring->ringMap && uring->ringMap != MAP_FAILED) {
+        munmap(uring->ringMap, uring->ringMapLen);
+    }
+    uring->ringMap = 0;
+    if(uring->fd >= 0) {
+        close(uring->fd);
+    }
+    uring->fd = -1;
+}
+
+// Returns a cleared SQE, submitting queued SQEs first if the ring is full.
+// The SQE is not visible to the kernel until the next marla_Uring_submit.
+struct io_uring_sqe* marla_Uring_getSqe(marla_Uring* uring)
+{
+    unsigned int head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+    if(uring->sqeTail - head >= uring->entries) {
+        marla_Uring_submit(uring);
+        head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+        if(uring->sqeTail - head >= uring->entries) {
+            return 0;
+        }
+    }
+    unsigned int index = uring->sqeTail & uring->sqMask;
+    struct io_uring_sqe* sqe = uring->sqes + index;
+    memset(sqe, 0, sizeof *sqe);
+    uring->sqArray[index] = index;
+    ++uring->sqeTail;
+    return sqe;
+}
+
+// Submits all queued SQEs to the kernel.
+int marla_Uring_submit(marla_Uring* uring)
+{
+    __atomic_store_n(uring->sqTail, uring->sqeTail, __ATOMIC_RELEASE);
+    unsigned int toSubmit = uring->sqeTail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+    if(toSubmit == 0) {
+        return 0;
+    }
+    return uring_enter(uring, toSubmit, 0, 0, 0, 0);
+}
+
+// Blocks for up to the given number of milliseconds until a completion is
+// available. Nothing is submitted, so other threads may queue SQEs while
+// this thread waits.
+int marla_Uring_wait(marla_Uring* uring, int timeout)
+{
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (__u64)(uintptr_t)&ts;
+    return uring_enter(uring, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+struct io_uring_cqe* marla_Uring_peekCqe(marla_Uring* uring)
+{
+    unsigned int head = *uring->cqHead;
+    if(head == __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    return uring->cqes + (head & uring->cqMask);
+}
+
+void marla_Uring_seenCqe(marla_Uring* uring)
+{
+    __atomic_store_n(uring->cqHead, *uring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+int marla_Uring_accept(marla_Uring* uring, int sfd)
+{
+    struct io_uring_sqe* sqe = marla_Uring_getSqe(uring);
+    if(!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sfd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if(uring->multishotAccept) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = tag(0, marla_URING_ACCEPT);
+    return 0;
+}
+
+// Stops accepting connections, so the listener can be handed to another
+// process.
+int marla_Uring_cancelAccept(marla_Uring* uring)
+{
+    struct io_uring_sqe* sqe = marla_Uring_getSqe(uring);
+    if(!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag(0, marla_URING_ACCEPT);
+    sqe->user_data = tag(0, marla_URING_TIMEOUT);
+    return 0;
+}
+
+int marla_Uring_poll(marla_Uring* uring, int fd)
+{
+    struct io_uring_sqe* sqe = marla_Uring_getSqe(uring);
+    if(!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag(0, marla_URING_POLL);
+    return 0;
+}
+
+static unsigned char* takeBuffer(marla_Uring* uring, int* index)
+{
+    if(uring->numFreeBuffers == 0) {
+        *index = -1;
+        return malloc(marla_URING_BUFSIZE);
+    }
+    *index = uring->freeBuffers[--uring->numFreeBuffers];
+    return uring->buffers + *index * marla_URING_BUFSIZE;
+}
+
+static void releaseBuffer(marla_Uring* uring, unsigned char* data, int index)
+{
+    if(index < 0) {
+        free(data);
+        return;
+    }
+    uring->freeBuffers[uring->numFreeBuffers++] = index;
+}
+
+static void prepTransfer(marla_Uring* uring, struct io_uring_sqe* sqe, int fixedOp, int op, int fd, unsigned char* data, size_t len, int bufferIndex)
+{
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)data;
+    sqe->len = len;
+    if(bufferIndex >= 0 && uring->registeredBuffers) {
+        sqe->opcode = fixedOp;
+        sqe->buf_index = 0;
+    }
+    else {
+        sqe->opcode = op;
+    }
+}
+
+static int submitRecv(marla_UringSource* source)
+{
+    marla_Uring* uring = source->uring;
+
+    // The recv and its timeout must be queued together.
+    unsigned int head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+    if(uring->entries - (uring->sqeTail - head) < 2) {
+        marla_Uring_submit(uring);
+    }
+    struct io_uring_sqe* sqe = marla_Uring_getSqe(uring);
+    if(!sqe) {
+        return -1;
+    }
+    prepTransfer(uring, sqe, IORING_OP_READ_FIXED, IORING_OP_RECV, source->fd, source->recvData, marla_URING_BUFSIZE, source->recvBuffer);
+    sqe->user_data = tag(source, marla_URING_RECV);
+    sqe->flags = IOSQE_IO_LINK;
+
+    struct io_uring_sqe* timeout = marla_Uring_getSqe(uring);
+    if(!timeout) {
+        sqe->flags = 0;
+    }
+    else {
+        timeout->opcode = IORING_OP_LINK_TIMEOUT;
+        timeout->fd = -1;
+        timeout->addr = (__u64)(uintptr_t)&uring->readTimeout;
+        timeout->len = 1;
+        timeout->user_data = tag(0, marla_URING_TIMEOUT);
+    }
+    source->recvPending = 1;
+    ++source->pending;
+    return 0;
+}
+
+static int submitSend(marla_UringSource* source)
+{
+    marla_Uring* uring = source->uring;
+    struct io_uring_sqe* sqe = marla_Uring_getSqe(uring);
+    if(!sqe) {
+        return -1;
+    }
+    prepTransfer(uring, sqe, IORING_OP_WRITE_FIXED, IORING_OP_SEND, source->fd, source->sendData + source->sendOffset, source->sendLen - source->sendOffset, source->sendBuffer);
+    if(sqe->opcode == IORING_OP_SEND) {
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->user_data = tag(source, marla_URING_SEND);
+    source->sendPending = 1;
+    ++source->pending;
+    return 0;
+}
+
+static void freeSource(marla_UringSource* source)
+{
+    releaseBuffer(source->uring, source->recvData, source->recvBuffer);
+    releaseBuffer(source->uring, source->sendData, source->sendBuffer);
+    close(source->fd);
+    free(source);
+}
+
+// Applies a completed recv or send to its source. Returns the connection
+// that should now be processed, and sets events to the epoll events it
+// would have received.
+marla_Connection* marla_Uring_complete(marla_Uring* uring, struct io_uring_cqe* cqe, int* events)
+{
+    enum marla_UringOp op = marla_Uring_op(cqe);
+    if(op != marla_URING_RECV && op != marla_URING_SEND) {
+        return 0;
+    }
+    marla_UringSource* source = untag(cqe->user_data);
+    --source->pending;
+    if(op == marla_URING_RECV) {
+        source->recvPending = 0;
+    }
+    else {
+        source->sendPending = 0;
+    }
+
+    if(!source->cxn) {
+        // The connection was destroyed while this operation was in flight.
+        if(source->pending == 0) {
+            freeSource(source);
+        }
+        return 0;
+    }
+
+    marla_Connection* cxn = source->cxn;
+    if(op == marla_URING_RECV) {
+        if(cqe->res > 0) {
+            source->recvLen = cqe->res;
+            source->recvOffset = 0;
+            *events = EPOLLIN;
+            return cxn;
+        }
+        if(cqe->res == -ECANCELED && cxn->requests_in_process > 0) {
+            // Timed out, but a request is still being served.
+            submitRecv(source);
+            return 0;
+        }
+        if(cqe->res == -EAGAIN || cqe->res == -EINTR) {
+            submitRecv(source);
+            return 0;
+        }
+        // Closed by the peer, failed, or idle past the read timeout.
+        source->recvClosed = 1;
+        *events = cqe->res == 0 || cqe->res == -ECANCELED ? EPOLLIN | EPOLLRDHUP : EPOLLERR;
+        return cxn;
+    }
+
+    if(cqe->res == -EAGAIN || cqe->res == -EINTR) {
+        submitSend(source);
+        return 0;
+    }
+    if(cqe->res <= 0) {
+        source->sendClosed = 1;
+        *events = EPOLLOUT;
+        return cxn;
+    }
+    source->sendOffset += cqe->res;
+    if(source->sendOffset < source->sendLen) {
+        // Short write.
+        submitSend(source);
+        return 0;
+    }
+    source->sendOffset = 0;
+    source->sendLen = 0;
+    *events = EPOLLOUT;
+    return cxn;
+}
+
+static int describeSource(marla_Connection* cxn, char* sink, size_t len)
+{
+    marla_UringSource* cxnSource = cxn->source;
+    memset(sink, 0, len);
+    snprintf(sink, len, "FD %d (io_uring)", cxnSource->fd);
+    return 0;
+}
+
+static int socketSource(marla_Connection* cxn)
+{
+    marla_UringSource* cxnSource = cxn->source;
+    return cxnSource->fd;
+}
+
+static int readSource(marla_Connection* cxn, void* sink, size_t len)
+{
+    marla_UringSource* cxnSource = cxn->source;
+    if(cxnSource->recvOffset < cxnSource->recvLen) {
+        size_t avail = cxnSource->recvLen - cxnSource->recvOffset;
+        if(len > avail) {
+            len = avail;
+        }
+        memcpy(sink, cxnSource->recvData + cxnSource->recvOffset, len);
+        cxnSource->recvOffset += len;
+        if(cxnSource->recvOffset == cxnSource->recvLen) {
+            // Start the next read while this data is processed.
+            cxnSource->recvOffset = 0;
+            cxnSource->recvLen = 0;
+            submitRecv(cxnSource);
+        }
+        return len;
+    }
+    if(cxnSource->recvClosed) {
+        cxn->shouldDestroy = 1;
+        return -1;
+    }
+    if(!cxnSource->recvPending && submitRecv(cxnSource) != 0) {
+        cxn->shouldDestroy = 1;
+        return -1;
+    }
+    cxn->wantsRead = 1;
+    return -1;
+}
+
+static int writeSource(marla_Connection* cxn, void* source, size_t len)
+{
+    marla_UringSource* cxnSource = cxn->source;
+    if(cxnSource->sendClosed) {
+        cxn->shouldDestroy = 1;
+        return -1;
+    }
+    if(cxnSource->sendPending) {
+        cxn->wantsWrite = 1;
+        return -1;
+    }
+    if(len > marla_URING_BUFSIZE) {
+        len = marla_URING_BUFSIZE;
+    }
+    memcpy(cxnSource->sendData, source, len);
+    cxnSource->sendLen = len;
+    cxnSource->sendOffset = 0;
+    if(submitSend(cxnSource) != 0) {
+        cxn->shouldDestroy = 1;
+        return -1;
+    }
+    return len;
+}
+
+static void acceptSource(marla_Connection* cxn)
+{
+    // Accepted and secured.
+    cxn->stage = marla_CLIENT_SECURED;
+}
+
+static int shutdownSource(marla_Connection* cxn)
+{
+    marla_logMessage(cxn->server, "Shutting down io_uring source.");
+    marla_UringSource* cxnSource = cxn->source;
+
+    while(!marla_Ring_isEmpty(cxn->output)) {
+        int nflushed;
+        switch(marla_Connection_flush(cxn, &nflushed)) {
+        case marla_WriteResult_CLOSED:
+            marla_Ring_clear(cxn->output);
+            continue;
+        case marla_WriteResult_DOWNSTREAM_CHOKED:
+            return -1;
+        case marla_WriteResult_UPSTREAM_CHOKED:
+            continue;
+        }
+    }
+    if(cxnSource->sendPending) {
+        // Wait for the last send to complete.
+        return -1;
+    }
+    int rv = shutdown(cxnSource->fd, SHUT_RDWR);
+    marla_logMessagef(cxn->server, "shutdown() returned %d", rv);
+    return 1;
+}
+
+static void destroySource(marla_Connection* cxn)
+{
+    marla_logMessage(cxn->server, "Destroying io_uring source.");
+    marla_UringSource* cxnSource = cxn->source;
+    cxn->source = 0;
+    if(cxnSource->pending == 0) {
+        freeSource(cxnSource);
+        return;
+    }
+
+    // Fail the operations in flight; the source is freed when they complete.
+    cxnSource->cxn = 0;
+    shutdown(cxnSource->fd, SHUT_RDWR);
+}
+
+int marla_uring_init(marla_Connection* cxn, marla_Uring* uring, int fd)
+{
+    marla_UringSource* source = malloc(sizeof *source);
+    memset(source, 0, sizeof *source);
+    source->fd = fd;
+    source->uring = uring;
+    source->cxn = cxn;
+    source->recvData = takeBuffer(uring, &source->recvBuffer);
+    source->sendData = takeBuffer(uring, &source->sendBuffer);
+
+    cxn->source = source;
+    cxn->readSource = readSource;
+    cxn->writeSource = writeSource;
+    cxn->readvSource = 0;
+    cxn->writevSource = 0;
+    cxn->acceptSource = acceptSource;
+    cxn->shutdownSource = shutdownSource;
+    cxn->destroySource = destroySource;
+    cxn->describeSource = describeSource;
+    cxn->socketSource = socketSource;
+    return 0;
+}
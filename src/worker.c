@@ -0,0 +1,83 @@
+#include "marla.h"
+#include <unistd.h>
+
+// A worker owns an event loop: its own epoll instance, listening socket,
+// connection list, timer wheel, and object pool. Everything a worker owns is
+// only touched while its mutex is held, so the terminal thread can enter a
+// worker to inspect its connections.
+
+static _Thread_local marla_Worker* current_worker = 0;
+
+void marla_Worker_init(marla_Worker* worker, struct marla_Server* server, int index)
+{
+    worker->server = server;
+    worker->index = index;
+    worker->efd = -1;
+    worker->sfd = -1;
+    worker->first_connection = 0;
+    worker->last_connection = 0;
+    worker->first_ready = 0;
+    worker->last_ready = 0;
+    worker->numReady = 0;
+    worker->budgetExhausted = 0;
+    worker->numRequests = 0;
+    worker->cpu = -1;
+    worker->lastCpu = -1;
+    marla_Pool_init(&worker->objectPool);
+    marla_TimerWheel_init(&worker->timers);
+    if(0 != marla_TaskCompletions_init(&worker->completions)) {
+        fprintf(stderr, "Failed to create task completions for worker %d.\n", index);
+        abort();
+    }
+    worker->objectPool.use_hugepages = server->objectPool.use_hugepages;
+    if(0 != pthread_mutex_init(&worker->mutex, 0)) {
+        fprintf(stderr, "Failed to create mutex for worker %d.\n", index);
+        abort();
+    }
+}
+
+void marla_Worker_free(marla_Worker* worker)
+{
+    marla_Worker_enter(worker);
+    while(worker->first_connection) {
+        marla_Connection_destroy(worker->first_connection);
+    }
+    marla_TaskCompletions_free(&worker->completions);
+    marla_Worker_leave(worker);
+    marla_TimerWheel_free(&worker->timers);
+    marla_Pool_destroy(&worker->objectPool);
+    if(worker->sfd >= 0) {
+        close(worker->sfd);
+        worker->sfd = -1;
+    }
+    if(worker->efd >= 0) {
+        close(worker->efd);
+        worker->efd = -1;
+    }
+    pthread_mutex_destroy(&worker->mutex);
+}
+
+// Locks the worker, and makes it the owner of connections created by this
+// thread until marla_Worker_leave is called.
+void marla_Worker_enter(marla_Worker* worker)
+{
+    if(0 != pthread_mutex_lock(&worker->mutex)) {
+        fprintf(stderr, "Failed to acquire mutex for worker %d.\n", worker->index);
+        abort();
+    }
+    current_worker = worker;
+}
+
+void marla_Worker_leave(marla_Worker* worker)
+{
+    current_worker = 0;
+    if(0 != pthread_mutex_unlock(&worker->mutex)) {
+        fprintf(stderr, "Failed to release mutex for worker %d.\n", worker->index);
+        abort();
+    }
+}
+
+marla_Worker* marla_Worker_current()
+{
+    return current_worker;
+}